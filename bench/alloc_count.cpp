@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include "depipe.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 計算整個程式的 heap 配置次數 (陣列與 aligned 版本一併計入)
+static std::atomic<size_t> allocations{0};
+
+static void *counted(size_t size) {
+    ++allocations;
+
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+static void *counted(size_t size, std::align_val_t alignment) {
+    ++allocations;
+    size_t align = static_cast<size_t>(alignment);
+    // aligned_alloc 要求 size 是 alignment 的倍數
+    size = (std::max<size_t>(size, 1) + align - 1) / align * align;
+
+    if (void *p = std::aligned_alloc(align, size)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size) {
+    return counted(size);
+}
+
+void *operator new[](size_t size) {
+    return counted(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    return counted(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return counted(size, alignment);
+}
+
+// GCC 把 inline 之後的 free 與呼叫端的 new 表達式配對而誤報 (上面的 new 全部來自 malloc)
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+// 驗證 depipe 在 steady state 下每轉送一個 chunk 不做任何 heap 配置。
+// writer -> [a] depipe [b] -> reader，計算暖機後轉送 <chunks> 個 chunk 期間的配置次數。
+int main(int argc, const char *argv[]) {
+    io_context io;
+    size_t chunks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    constexpr size_t WARMUP = 1000;
+
+    try {
+        tcp::acceptor acceptor(io, tcp::endpoint(ip::address_v4::loopback(), 0));
+        auto connect_pair = [&acceptor](tcp::socket & client) {
+            client.connect(acceptor.local_endpoint());
+            return acceptor.accept();
+        };
+
+        tcp::socket writer(io);
+        tcp::socket a = connect_pair(writer);
+        tcp::socket b(io);
+        tcp::socket reader = connect_pair(b);
+
+        make_depipe(std::move(a), std::move(b))->start();
+        auto work = make_work_guard(io);
+        std::thread runner([&io]() {
+            io.run();
+        });
+
+        std::array<char, BUF_SIZE> chunk{};
+        auto pump = [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                write(writer, buffer(chunk));
+                read(reader, buffer(chunk));
+            }
+        };
+
+        pump(WARMUP);
+        size_t before = allocations.load();
+        pump(chunks);
+        size_t steady = allocations.load() - before;
+
+        std::cout << "chunks " << chunks << "\n"
+                  << "allocations " << steady << "\n"
+                  << "allocations_per_chunk " << double(steady) / chunks << std::endl;
+
+        writer.close();
+        reader.close();
+        work.reset();
+        io.stop();
+        runner.join();
+        return steady == 0 ? 0 : 1;
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,200 @@
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <pthread.h>
+#include <thread>
+#include <time.h>
+
+#include "coro_pipe.hpp"
+#include "depipe.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 計算整個程式的 heap 配置次數
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+    ++allocations;
+
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+// 只計算執行 io_context 的那條線程 (tunnel 與 echo)，不含產生連線的 client
+static double cpu_seconds(std::thread &thread) {
+    clockid_t clock;
+    timespec ts{};
+    pthread_getcpuclockid(thread.native_handle(), &clock);
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 與 expose.cpp 相同的 callback 連線鏈 (async_resolve_and_connect 見 dns_cache.hpp)
+class CallbackSession : public std::enable_shared_from_this<CallbackSession> {
+  public:
+    CallbackSession(tcp::socket _client, std::string _port)
+        : client(std::move(_client)), upstream(client.get_executor()), port(std::move(_port)) {}
+
+    void start() {
+        auto self(shared_from_this());
+        async_resolve_and_connect(upstream, "127.0.0.1", port,
+        [this, self](const boost::system::error_code & ec, const tcp::endpoint) {
+            if (ec) {
+                return;
+            }
+
+            make_depipe(std::move(client), std::move(upstream))->start();
+        });
+    }
+
+  private:
+    tcp::socket client;
+    tcp::socket upstream;
+    std::string port;
+};
+
+static task coroutine_session(tcp::socket client, const std::string &port) {
+    tcp::socket upstream(client.get_executor());
+    boost::system::error_code ec;
+    co_await co_connect(upstream, "127.0.0.1", port, ec);
+
+    if (ec) {
+        co_return;
+    }
+
+    co_depipe(std::move(client), std::move(upstream));
+}
+
+static task echo_session(tcp::socket peer) {
+    std::array<char, 64> data;
+
+    for (;;) {
+        auto [read_ec, n] = co_await async_io([&](auto handler) {
+            peer.async_read_some(buffer(data), std::move(handler));
+        });
+
+        if (read_ec) {
+            co_return;
+        }
+
+        auto [write_ec, written] = co_await async_io([&, n = n](auto handler) {
+            async_write(peer, buffer(data.data(), n), std::move(handler));
+        });
+
+        if (write_ec) {
+            co_return;
+        }
+    }
+}
+
+// 以單線程 io_context 模擬一個 shard：front 收到的連線先連到 upstream echo，再轉送
+// 由另一條線程依序建立 <count> 條連線，各做一次 64 bytes 的來回後關閉，
+// 比較兩種實作每條連線的 heap 配置次數與 CPU 時間。
+static void run(bool coroutine, size_t count) {
+    io_context io(1);
+    tcp::acceptor front(io, tcp::endpoint(ip::address_v4::loopback(), 0));
+    tcp::acceptor echo(io, tcp::endpoint(ip::address_v4::loopback(), 0));
+    std::string echo_port = std::to_string(echo.local_endpoint().port());
+
+    std::function<void()> accept_front = [&]() {
+        front.async_accept([&](boost::system::error_code ec, tcp::socket client) {
+            if (ec) {
+                return;
+            }
+
+            if (coroutine) {
+                coroutine_session(std::move(client), echo_port).detach();
+            } else {
+                std::make_shared<CallbackSession>(std::move(client), echo_port)->start();
+            }
+
+            accept_front();
+        });
+    };
+
+    // upstream echo 兩種實作共用，負擔相同 (以 frame_pool 配置，穩定後不進 heap)
+    std::function<void()> accept_echo = [&]() {
+        echo.async_accept([&](boost::system::error_code ec, tcp::socket peer) {
+            if (ec) {
+                return;
+            }
+
+            echo_session(std::move(peer)).detach();
+            accept_echo();
+        });
+    };
+
+    accept_front();
+    accept_echo();
+    auto work = make_work_guard(io);
+    std::thread runner([&io]() {
+        io.run();
+    });
+
+    auto endpoint = front.local_endpoint();
+    io_context client_io;
+    auto one = [&endpoint, &client_io]() {
+        tcp::socket socket(client_io);
+        socket.connect(endpoint);
+        std::array<char, 64> data{};
+        write(socket, buffer(data));
+        read(socket, buffer(data));
+    };
+
+    for (size_t i = 0; i < count / 10; ++i) {
+        one();
+    }
+
+    size_t before = allocations.load();
+    double cpu = cpu_seconds(runner);
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < count; ++i) {
+        one();
+    }
+
+    std::chrono::duration<double> elapsed_time = std::chrono::steady_clock::now() - start;
+    double elapsed = elapsed_time.count();
+    cpu = cpu_seconds(runner) - cpu;
+    size_t used = allocations.load() - before;
+
+    std::cout << (coroutine ? "coroutine" : "callback ") << " connections " << count
+              << " allocations_per_connection " << double(used) / count
+              << " cpu_us_per_connection " << cpu / count * 1e6
+              << " wall_us_per_connection " << elapsed / count * 1e6 << std::endl;
+
+    work.reset();
+    io.stop();
+    runner.join();
+}
+
+int main(int argc, const char *argv[]) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+
+    try {
+        run(false, count);
+        run(true, count);
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,928 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+using namespace boost::asio;
+using ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+/**
+ * 端到端負載產生器。
+ *
+ * 在 localhost 上啟動 proxy_server + expose，自己提供上游 echo 服務，
+ * 依情境 (scenario) 開 N 個並行 client 穿過整條鏈路，輸出一行 JSON：
+ *   - short：大量短連線，量測連線建立延遲 (connect -> 第一個 echo byte)
+ *   - rtt  ：長連線上的 64 bytes request/response 往返延遲；--request-writes=2 時 request 分成
+ *            兩次寫出 (連續的小寫入，比較 SOCKET_PROFILE 對 Nagle 與 delayed ACK 的影響)
+ *   - bulk ：少量長時間大量傳輸，量測單一 tunnel 與總吞吐量
+ *   - mixed：以上三者同時進行
+ *   - burst：每一輪同時開 --clients 條連線 (一起 connect，各自 echo 一次後關閉)，量測建立延遲，
+ *            並從 proxy 的 metrics 換算每條連線的 control frame 數與控制連線寫入次數
+ *   - upgrade：short 與 rtt 各半數 client，進行到一半時以 UPGRADE_SOCKET 啟動新的 proxy_server
+ *            接手 (見 upgrade.hpp)，回報新程式的接手時間 (upgrade_ms)、舊程式交出後多久結束
+ *            (old_exit_ms) 與 expose 重新註冊的次數；交接期間的 client 不應出錯
+ *            (不在 all 之中，不計算 CPU)
+ * 並由 /proc 讀取 proxy_server 與 expose 的 CPU 時間，換算每 GiB 轉送資料的 CPU 秒數；
+ * 從兩者的 metrics 換算 proxy <-> expose 之間實際傳輸的 bytes (wire_bytes)，比較各種壓縮方式。
+ * 可以讀取 raw_syscalls tracepoint 時 (Linux、root 且已 mount tracefs) 另外計算兩者所有線程的
+ * syscall 數 (syscalls、syscalls_per_mib)，比較 DEPIPE_ENGINE 的 copy (epoll)、splice 與 uring。
+ * SOCKET_PROFILE 不是 default 時，另外附上相對於輸出檔中同樣參數的 default 結果的實測變化 (vs_default)。
+ * bulk 傳送的內容由 --payload 決定：fill (單一字元)、text (類似 HTTP log 的文字) 或 random。
+ *
+ * Usage: loadgen <proxy_server> <expose> [--scenario=all|short|rtt|bulk|mixed|burst|upgrade]
+ *                [--clients=16] [--bulk-clients=4] [--duration=5] [--base-port=17000]
+ *                [--payload=fill|text|random] [--request-writes=1] [--env=KEY=VALUE ...]
+ *                [--output=results.jsonl]
+ */
+
+struct Options {
+    std::string proxy_server;
+    std::string expose;
+    std::string scenario = "all";
+    size_t clients = 16;
+    size_t bulk_clients = 4;
+    double duration = 5;
+    u_short base_port = 17000;
+    std::string payload = "fill";
+    size_t request_writes = 1;
+    std::vector<std::string> env;
+    std::string output;
+};
+
+// 以 mutex 保護的樣本集合；每個 client 線程先在本地累積，結束時再合併
+struct Samples {
+    void merge(const std::vector<double> &local) {
+        std::lock_guard<std::mutex> lock(mutex);
+        values.insert(values.end(), local.begin(), local.end());
+    }
+
+    std::string json() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::sort(values.begin(), values.end());
+        std::ostringstream out;
+        auto percentile = [this](double p) {
+            if (values.empty()) {
+                return 0.0;
+            }
+
+            return values[std::min(values.size() - 1, size_t(p * values.size()))];
+        };
+        out << "{\"count\":" << values.size() << ",\"p50\":" << percentile(0.50)
+            << ",\"p90\":" << percentile(0.90) << ",\"p99\":" << percentile(0.99)
+            << ",\"max\":" << (values.empty() ? 0.0 : values.back()) << "}";
+        return out.str();
+    }
+
+    std::mutex mutex;
+    std::vector<double> values;
+};
+
+struct Result {
+    Samples setup_us;
+    Samples rtt_us;
+    std::mutex mutex;
+    std::vector<double> bulk_mib_s;
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> connections{0};
+};
+
+double micros_since(clock_type::time_point start) {
+    return std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+}
+
+// ---- 上游 echo 服務 ----
+
+class EchoSession : public std::enable_shared_from_this<EchoSession> {
+  public:
+    explicit EchoSession(tcp::socket socket) : socket_(std::move(socket)), data_(64 * 1024) {}
+
+    void start() {
+        auto self(shared_from_this());
+        socket_.async_read_some(buffer(data_),
+        [this, self](boost::system::error_code ec, std::size_t length) {
+            if (ec) {
+                return;
+            }
+
+            async_write(socket_, buffer(data_, length),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (!ec) {
+                    start();
+                }
+            });
+        });
+    }
+
+  private:
+    tcp::socket socket_;
+    std::vector<char> data_;
+};
+
+void do_echo_accept(tcp::acceptor &acceptor) {
+    acceptor.async_accept([&acceptor](boost::system::error_code ec, tcp::socket socket) {
+        if (ec) {
+            return;
+        }
+
+        socket.set_option(tcp::no_delay(true));
+        std::make_shared<EchoSession>(std::move(socket))->start();
+        do_echo_accept(acceptor);
+    });
+}
+
+// ---- 子行程管理 ----
+
+pid_t spawn(const std::vector<std::string> &args, const std::vector<std::string> &env) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        for (auto &entry : env) {
+            putenv(const_cast<char *>(entry.c_str()));
+        }
+
+        // 子行程的例行輸出不影響結果
+        freopen("/dev/null", "w", stdout);
+        std::vector<char *> argv;
+
+        for (auto &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    return pid;
+}
+
+void terminate(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+// user + system CPU 秒數
+double cpu_seconds(pid_t pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string field;
+
+    for (int i = 1; i <= 13 && stat >> field; ++i) {
+    }
+
+    unsigned long long utime = 0, stime = 0;
+    stat >> utime >> stime;
+    return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * 以 perf_event_open 在指定 process 的每個線程上掛 raw_syscalls:sys_enter tracepoint，計算 syscall 數。
+ * 只涵蓋建立當時已存在的線程 (proxy_server 與 expose 的 io 線程在啟動時建立)。
+ */
+class SyscallCounter {
+  public:
+    explicit SyscallCounter(const std::vector<pid_t> &pids) {
+#ifdef __linux__
+        int id = tracepoint_id();
+
+        if (id < 0) {
+            return;
+        }
+
+        for (pid_t pid : pids) {
+            std::string path = "/proc/" + std::to_string(pid) + "/task";
+            DIR *dir = opendir(path.c_str());
+
+            if (!dir) {
+                continue;
+            }
+
+            while (dirent *entry = readdir(dir)) {
+                if (entry->d_name[0] == '.') {
+                    continue;
+                }
+
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_TRACEPOINT;
+                attr.config = id;
+                pid_t tid = pid_t(std::stoi(entry->d_name));
+                int fd = int(syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0));
+
+                if (fd >= 0) {
+                    fds.push_back(fd);
+                }
+            }
+
+            closedir(dir);
+        }
+
+#endif
+    }
+
+    ~SyscallCounter() {
+        for (int fd : fds) {
+            close(fd);
+        }
+    }
+
+    bool available() const {
+        return !fds.empty();
+    }
+
+    double total() const {
+        double sum = 0;
+
+        for (int fd : fds) {
+            uint64_t value = 0;
+
+            if (read(fd, &value, sizeof(value)) == sizeof(value)) {
+                sum += double(value);
+            }
+        }
+
+        return sum;
+    }
+
+  private:
+    static int tracepoint_id() {
+        for (const char *path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                                 "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+                                }) {
+            std::ifstream file(path);
+            int id = -1;
+
+            if (file >> id) {
+                return id;
+            }
+        }
+
+        return -1;
+    }
+
+    std::vector<int> fds;
+};
+
+// 鏈路停滯 (例如 proxy 卡住) 時等待資料的上限，之後該 client 記為錯誤，loadgen 不會永遠等待
+constexpr auto STALL_TIMEOUT = std::chrono::seconds(5);
+
+// 等到 socket 可讀；STALL_TIMEOUT 內沒有資料到達時回傳 false
+bool wait_readable(tcp::socket &socket) {
+    pollfd fd{socket.native_handle(), POLLIN, 0};
+    int timeout = int(std::chrono::duration_cast<std::chrono::milliseconds>(STALL_TIMEOUT).count());
+    int n;
+
+    while ((n = ::poll(&fd, 1, timeout)) < 0 && errno == EINTR) {
+    }
+
+    return n > 0;
+}
+
+// 讀滿 target；停滯或連線結束時拋出例外
+void read_full(tcp::socket &socket, mutable_buffer target) {
+    while (target.size() > 0) {
+        if (!wait_readable(socket)) {
+            throw boost::system::system_error(error::timed_out);
+        }
+
+        target += socket.read_some(target);
+    }
+}
+
+// 讀取 http://127.0.0.1:<port>/metrics，加總名稱為 name 的所有序列 (不分 label)
+double scrape(u_short port, const std::string &name) {
+    try {
+        io_context io_context;
+        tcp::socket socket(io_context);
+        socket.connect(tcp::endpoint(ip::address_v4::loopback(), port));
+        write(socket, buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+        std::string response;
+        std::array<char, 4096> chunk;
+        boost::system::error_code ec;
+
+        while (!ec && wait_readable(socket)) {
+            response.append(chunk.data(), socket.read_some(buffer(chunk), ec));
+        }
+
+        std::istringstream lines(response);
+        std::string line;
+        double total = 0;
+
+        while (std::getline(lines, line)) {
+            if (line.compare(0, name.size(), name) == 0 && line.size() > name.size()
+                    && (line[name.size()] == '{' || line[name.size()] == ' ')) {
+                total += std::stod(line.substr(line.rfind(' ') + 1));
+            }
+        }
+
+        return total;
+    } catch (...) {
+        return 0;
+    }
+}
+
+// 兩端各自送上 proxy <-> expose 這一段的未壓縮 bytes：proxy 從 client 讀到的與 expose 從 target 讀到的
+double leg_bytes(u_short proxy_metrics, u_short expose_metrics) {
+    return scrape(proxy_metrics, "tunnel_bytes_total{direction=\"upstream\"}") +
+           scrape(expose_metrics, "tunnel_bytes_total{direction=\"downstream\"}");
+}
+
+// 實際寫到這一段上的 bytes：經過壓縮的部分換成壓縮後的 bytes (兩者都在送出端計算，不受傳輸中的資料影響)
+double wire_bytes(u_short proxy_metrics, u_short expose_metrics) {
+    double total = leg_bytes(proxy_metrics, expose_metrics);
+
+    for (u_short port : {proxy_metrics, expose_metrics}) {
+        total += scrape(port, "tunnel_codec_wire_bytes_total")
+                 - scrape(port, "tunnel_codec_input_bytes_total");
+    }
+
+    return total;
+}
+
+// 從 loadgen 自己輸出的一行 JSON 取出 "<object>":{... "<key>":<number>，沒有時為 0
+double json_number(const std::string &line, const std::string &object, const std::string &key) {
+    size_t at = line.find("\"" + object + "\":{");
+
+    if (at != std::string::npos) {
+        at = line.find("\"" + key + "\":", at);
+    }
+
+    return at == std::string::npos ? 0 : std::strtod(line.c_str() + at + key.size() + 3, nullptr);
+}
+
+/**
+ * SOCKET_PROFILE 不是 default 時，在輸出檔中找最後一筆其餘參數都相同、SOCKET_PROFILE=default
+ * 的結果，回傳相對於它的實測變化 (百分比)：rtt 的 p50 / p99 與 bulk 的單一 tunnel 吞吐量。
+ * 沒有可比較的結果時回傳空字串。
+ */
+std::string profile_delta(const std::string &path, const std::string &line) {
+    const std::string field = "\"SOCKET_PROFILE\":\"";
+    std::string prefix = line.substr(0, line.find(",\"clients\":"));
+    size_t at = prefix.find(field);
+
+    if (at == std::string::npos || prefix.compare(at + field.size(), 8, "default\"") == 0) {
+        return "";
+    }
+
+    size_t end = prefix.find('"', at + field.size());
+    std::string wanted = prefix.substr(0, at + field.size()) + "default" + prefix.substr(end)
+                         + ",\"clients\":";
+    std::ifstream input(path);
+    std::string baseline;
+
+    for (std::string previous; std::getline(input, previous);) {
+        if (previous.compare(0, wanted.size(), wanted) == 0) {
+            baseline = previous;
+        }
+    }
+
+    if (baseline.empty()) {
+        return "";
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    auto change = [&](const char *name, const char *object, const char *key) {
+        double before = json_number(baseline, object, key);
+        double after = json_number(line, object, key);
+
+        if (before > 0 && after > 0) {
+            out << (out.tellp() > 0 ? "," : "{") << "\"" << name << "_pct\":"
+                << (after / before - 1) * 100;
+        }
+    };
+    change("rtt_p50", "rtt_us", "p50");
+    change("rtt_p99", "rtt_us", "p99");
+    change("bulk_per_tunnel", "bulk_mib_s", "per_tunnel");
+    return out.tellp() > 0 ? out.str() + "}" : "";
+}
+
+// bulk client 寫出的內容
+std::vector<char> make_payload(const std::string &kind, size_t size) {
+    std::vector<char> data;
+    data.reserve(size);
+    std::mt19937 generator(42);
+
+    if (kind == "random") {
+        while (data.size() < size) {
+            data.push_back(static_cast<char>(generator()));
+        }
+    } else if (kind == "text") {
+        const char *paths[] = {"/", "/index.html", "/api/v1/items", "/static/app.js", "/login"};
+        const char *statuses[] = {"200", "200", "200", "304", "404"};
+
+        while (data.size() < size) {
+            std::string line = "10.0.0." + std::to_string(generator() % 256) + " - - \"GET " +
+                               paths[generator() % 5] + "?id=" +
+                               std::to_string(generator() % 100000) +
+                               " HTTP/1.1\" " + statuses[generator() % 5] + " " +
+                               std::to_string(generator() % 20000) + "\n";
+            data.insert(data.end(), line.begin(), line.end());
+        }
+
+        data.resize(size);
+    } else {
+        data.assign(size, 'x');
+    }
+
+    return data;
+}
+
+// 等到整條鏈路可以 echo 為止
+bool wait_ready(const tcp::endpoint &endpoint) {
+    io_context io_context;
+
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        try {
+            tcp::socket socket(io_context);
+            socket.connect(endpoint);
+            char byte = 'x';
+            write(socket, buffer(&byte, 1));
+            read_full(socket, buffer(&byte, 1));
+            return true;
+        } catch (...) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+
+    return false;
+}
+
+// ---- 情境 ----
+
+void run_short(const tcp::endpoint &endpoint, clock_type::time_point deadline, Result &result) {
+    io_context io_context;
+    std::vector<double> local;
+    std::array<char, 64> request{};
+
+    while (clock_type::now() < deadline) {
+        try {
+            auto start = clock_type::now();
+            tcp::socket socket(io_context);
+            socket.connect(endpoint);
+            socket.set_option(tcp::no_delay(true));
+            write(socket, buffer(request));
+            read_full(socket, buffer(request));
+            local.push_back(micros_since(start));
+            result.bytes += 2 * request.size();
+        } catch (...) {
+            ++result.errors;
+        }
+    }
+
+    result.setup_us.merge(local);
+}
+
+// request 分成 writes 次寫出 (64 bytes 平均分配)
+void run_rtt(const tcp::endpoint &endpoint, clock_type::time_point deadline, size_t writes,
+             Result &result) {
+    io_context io_context;
+    std::vector<double> local;
+    std::array<char, 64> request{};
+    size_t piece = request.size() / writes;
+
+    try {
+        tcp::socket socket(io_context);
+        socket.connect(endpoint);
+        socket.set_option(tcp::no_delay(true));
+
+        while (clock_type::now() < deadline) {
+            auto start = clock_type::now();
+
+            for (size_t offset = 0; offset < request.size(); offset += piece) {
+                size_t length = std::min(piece, request.size() - offset);
+                write(socket, buffer(request.data() + offset, length));
+            }
+
+            read_full(socket, buffer(request));
+            local.push_back(micros_since(start));
+            result.bytes += 2 * request.size();
+        }
+    } catch (...) {
+        ++result.errors;
+    }
+
+    result.rtt_us.merge(local);
+}
+
+void run_bulk(const tcp::endpoint &endpoint, clock_type::time_point deadline,
+              const std::vector<char> &chunk, Result &result) {
+    io_context io_context;
+    uint64_t received = 0;
+    auto start = clock_type::now();
+
+    try {
+        tcp::socket socket(io_context);
+        socket.connect(endpoint);
+        std::atomic<bool> done{false};
+        // 寫入與讀取分開，讓 echo 回來的資料持續被消化
+        std::thread writer([&socket, &done, &chunk, deadline]() {
+            try {
+                while (clock_type::now() < deadline) {
+                    write(socket, buffer(chunk));
+                }
+
+                socket.shutdown(tcp::socket::shutdown_send);
+            } catch (...) {
+            }
+
+            done = true;
+        });
+        std::vector<char> sink(256 * 1024);
+        boost::system::error_code ec;
+
+        while (!ec) {
+            if (!wait_readable(socket)) {
+                // 停滯：關閉兩個方向，讓阻塞在寫入中的 writer 也返回
+                ++result.errors;
+                socket.shutdown(tcp::socket::shutdown_both, ec);
+                break;
+            }
+
+            received += socket.read_some(buffer(sink), ec);
+
+            if (done && clock_type::now() > deadline + std::chrono::seconds(2)) {
+                break;
+            }
+        }
+
+        writer.join();
+    } catch (...) {
+        ++result.errors;
+    }
+
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    result.bytes += 2 * received;
+    std::lock_guard<std::mutex> lock(result.mutex);
+    result.bulk_mib_s.push_back(received / 1048576.0 / seconds);
+}
+
+void run_burst(const tcp::endpoint &endpoint, clock_type::time_point deadline, size_t clients,
+               Result &result) {
+    io_context io_context;
+    std::vector<double> local;
+
+    struct connection {
+        explicit connection(boost::asio::io_context &io_context) : socket(io_context) {}
+
+        tcp::socket socket;
+        std::array<char, 64> request{};
+    };
+
+    while (clock_type::now() < deadline) {
+        std::vector<std::unique_ptr<connection>> round;
+        auto start = clock_type::now();
+
+        for (size_t i = 0; i < clients; ++i) {
+            round.push_back(std::make_unique<connection>(io_context));
+            auto &c = *round.back();
+            c.socket.async_connect(endpoint,
+            [&c, &result, &local, start](const boost::system::error_code & ec) {
+                if (ec) {
+                    ++result.errors;
+                    return;
+                }
+
+                async_write(c.socket, buffer(c.request),
+                [&c, &result, &local, start](const boost::system::error_code & ec, size_t) {
+                    if (ec) {
+                        ++result.errors;
+                        return;
+                    }
+
+                    async_read(c.socket, buffer(c.request),
+                    [&result, &local, start](const boost::system::error_code & ec, size_t n) {
+                        if (ec) {
+                            ++result.errors;
+                            return;
+                        }
+
+                        local.push_back(micros_since(start));
+                        result.bytes += 2 * n;
+                        ++result.connections;
+                    });
+                });
+            });
+        }
+
+        // 停滯時關閉這一輪剩下的連線，被取消的操作記為錯誤
+        io_context.run_for(STALL_TIMEOUT);
+
+        if (!io_context.stopped()) {
+            for (auto &c : round) {
+                boost::system::error_code ignored;
+                c->socket.close(ignored);
+            }
+
+            io_context.run();
+        }
+
+        io_context.restart();
+    }
+
+    result.setup_us.merge(local);
+}
+
+// respawn 以同樣的參數啟動新的 proxy_server (upgrade 情境)，proxy 隨之換成新程式
+std::string run_scenario(const Options &options, const std::string &scenario,
+                         const tcp::endpoint &endpoint, pid_t &proxy, pid_t expose,
+                         const std::function<pid_t()> &respawn) {
+    Result result;
+    u_short proxy_metrics = options.base_port + 3;
+    u_short expose_metrics = options.base_port + 4;
+    double tunnel_before = leg_bytes(proxy_metrics, expose_metrics);
+    double wire_before = wire_bytes(proxy_metrics, expose_metrics);
+    std::vector<char> chunk = make_payload(options.payload, 256 * 1024);
+    double cpu_before = cpu_seconds(proxy) + cpu_seconds(expose);
+    SyscallCounter syscalls({proxy, expose});
+    double syscalls_before = syscalls.total();
+    double frames_before = scrape(proxy_metrics, "control_frames_sent_total");
+    double writes_before = scrape(proxy_metrics, "control_writes_total");
+    double registrations_before = scrape(expose_metrics, "expose_registrations_total");
+    auto start = clock_type::now();
+    auto deadline = start + std::chrono::duration_cast<clock_type::duration>(
+                        std::chrono::duration<double>(options.duration));
+    std::vector<std::thread> threads;
+    bool mixed = scenario == "mixed";
+    bool upgrade = scenario == "upgrade";
+    size_t clients = mixed || upgrade ? std::max<size_t>(1, options.clients / 2) : options.clients;
+
+    if (scenario == "short" || mixed || upgrade) {
+        for (size_t i = 0; i < clients; ++i) {
+            threads.emplace_back(run_short, endpoint, deadline, std::ref(result));
+        }
+    }
+
+    if (scenario == "rtt" || mixed || upgrade) {
+        for (size_t i = 0; i < clients; ++i) {
+            threads.emplace_back(run_rtt, endpoint, deadline, options.request_writes,
+                                 std::ref(result));
+        }
+    }
+
+    if (scenario == "bulk" || mixed) {
+        for (size_t i = 0; i < options.bulk_clients; ++i) {
+            threads.emplace_back(run_bulk, endpoint, deadline, std::cref(chunk), std::ref(result));
+        }
+    }
+
+    if (scenario == "burst") {
+        threads.emplace_back(run_burst, endpoint, deadline, options.clients, std::ref(result));
+    }
+
+    size_t thread_count = threads.size();
+    double upgrade_ms = 0;
+    double old_exit_ms = 0;
+
+    if (upgrade) {
+        std::this_thread::sleep_until(start + (deadline - start) / 2);
+        pid_t old = proxy;
+        auto spawned = clock_type::now();
+        proxy = respawn();
+
+        // rtt client 的 tunnel 留在舊程式，舊程式在它們結束之後才退出
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        threads.clear();
+
+        while (waitpid(old, nullptr, WNOHANG) == 0
+                && clock_type::now() < deadline + std::chrono::seconds(5)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        old_exit_ms = micros_since(spawned) / 1000;
+        upgrade_ms = scrape(proxy_metrics, "proxy_upgrade_seconds_sum") * 1000;
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+    double cpu = upgrade ? 0 : cpu_seconds(proxy) + cpu_seconds(expose) - cpu_before;
+    double syscall_count = syscalls.total() - syscalls_before;
+    double gib = result.bytes / 1073741824.0;
+    double tunnel = leg_bytes(proxy_metrics, expose_metrics) - tunnel_before;
+    double wire = wire_bytes(proxy_metrics, expose_metrics) - wire_before;
+    double connections = double(result.connections);
+    double frames = scrape(proxy_metrics, "control_frames_sent_total") - frames_before;
+    double writes = scrape(proxy_metrics, "control_writes_total") - writes_before;
+    double per_tunnel = 0;
+    double aggregate = 0;
+
+    for (double v : result.bulk_mib_s) {
+        aggregate += v;
+    }
+
+    if (!result.bulk_mib_s.empty()) {
+        per_tunnel = aggregate / result.bulk_mib_s.size();
+    }
+
+    std::ostringstream out;
+    out << "{\"scenario\":\"" << scenario << "\",\"payload\":\"" << options.payload << "\"";
+
+    if (options.request_writes > 1) {
+        out << ",\"request_writes\":" << options.request_writes;
+    }
+
+    for (auto &entry : options.env) {
+        auto eq = entry.find('=');
+        out << ",\"" << entry.substr(0, eq) << "\":\"" << entry.substr(eq + 1) << "\"";
+    }
+
+    out << ",\"clients\":" << (scenario == "burst" ? options.clients : thread_count)
+        << ",\"duration_s\":" << elapsed
+        << ",\"errors\":" << result.errors << ",\"setup_us\":" << result.setup_us.json()
+        << ",\"rtt_us\":" << result.rtt_us.json()
+        << ",\"bulk_mib_s\":{\"per_tunnel\":" << per_tunnel << ",\"aggregate\":" << aggregate << "}"
+        << ",\"bytes\":" << result.bytes << ",\"tunnel_bytes\":" << tunnel
+        << ",\"wire_bytes\":" << wire << ",\"wire_ratio\":" << (tunnel > 0 ? wire / tunnel : 0)
+        << ",\"cpu_s\":" << cpu
+        << ",\"cpu_s_per_gib\":" << (gib > 0 ? cpu / gib : 0);
+
+    if (syscalls.available()) {
+        double mib = result.bytes / 1048576.0;
+        out << ",\"syscalls\":" << syscall_count << ",\"syscalls_per_mib\":"
+            << (mib > 0 ? syscall_count / mib : 0);
+
+        if (connections > 0) {
+            out << ",\"syscalls_per_connection\":" << syscall_count / connections;
+        }
+    }
+
+    if (connections > 0) {
+        out << ",\"connections\":" << connections
+            << ",\"control_frames_per_connection\":" << frames / connections
+            << ",\"control_writes_per_connection\":" << writes / connections;
+    }
+
+    if (upgrade) {
+        out << ",\"upgrade_ms\":" << upgrade_ms << ",\"old_exit_ms\":" << old_exit_ms
+            << ",\"reregistrations\":"
+            << scrape(expose_metrics, "expose_registrations_total") - registrations_before;
+    }
+
+    out << "}";
+    return out.str();
+}
+
+int main(int argc, const char *argv[]) {
+    Options options;
+
+    try {
+        if (argc < 3) {
+            throw std::invalid_argument("");
+        }
+
+        options.proxy_server = argv[1];
+        options.expose = argv[2];
+
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+
+            if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+                throw std::invalid_argument("");
+            }
+
+            std::string key = arg.substr(2, eq - 2);
+            std::string value = arg.substr(eq + 1);
+
+            if (key == "scenario") {
+                options.scenario = value;
+            } else if (key == "clients") {
+                options.clients = std::stoul(value);
+            } else if (key == "bulk-clients") {
+                options.bulk_clients = std::stoul(value);
+            } else if (key == "duration") {
+                options.duration = std::stod(value);
+            } else if (key == "base-port") {
+                options.base_port = std::stoi(value);
+            } else if (key == "payload") {
+                if (value != "fill" && value != "text" && value != "random") {
+                    throw std::invalid_argument("");
+                }
+
+                options.payload = value;
+            } else if (key == "request-writes") {
+                size_t writes = std::max<size_t>(std::stoul(value), 1);
+                options.request_writes = std::min<size_t>(writes, 64);
+            } else if (key == "env") {
+                options.env.push_back(value);
+            } else if (key == "output") {
+                options.output = value;
+            } else {
+                throw std::invalid_argument("");
+            }
+        }
+    } catch (...) {
+        std::cerr << "Usage: loadgen <proxy_server> <expose>\n"
+                  "               [--scenario=all|short|rtt|bulk|mixed|burst|upgrade]\n"
+                  "               [--clients=16] [--bulk-clients=4] [--duration=5]\n"
+                  "               [--base-port=17000] [--payload=fill|text|random]\n"
+                  "               [--request-writes=1] [--env=KEY=VALUE ...] [--output=file]\n";
+        return 1;
+    }
+
+    u_short control_port = options.base_port;
+    u_short public_port = options.base_port + 1;
+    u_short upstream_port = options.base_port + 2;
+
+    io_context upstream_io;
+    tcp::acceptor upstream(upstream_io, tcp::endpoint(ip::address_v4::loopback(), upstream_port));
+    do_echo_accept(upstream);
+    auto work = make_work_guard(upstream_io);
+    std::thread upstream_thread([&upstream_io]() {
+        upstream_io.run();
+    });
+
+    // 兩個程式的 metrics 分別在 base_port + 3 與 + 4，供計算 wire_bytes
+    std::vector<std::string> env = options.env;
+    env.push_back("METRICS_PORT=" + std::to_string(options.base_port + 3));
+
+    // upgrade：新的 proxy_server 經由這個路徑接手
+    if (options.scenario == "upgrade") {
+        env.push_back("UPGRADE_SOCKET=/tmp/loadgen-" + std::to_string(options.base_port) + ".sock");
+    }
+
+    std::vector<std::string> proxy_env = env;
+    auto respawn = [&options, &proxy_env, control_port]() {
+        return spawn({options.proxy_server, std::to_string(control_port)}, proxy_env);
+    };
+    pid_t proxy = respawn();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    env = options.env;
+    env.push_back("METRICS_PORT=" + std::to_string(options.base_port + 4));
+    env.push_back("PROXY_HOST=127.0.0.1:" + std::to_string(control_port));
+    std::string mapping = std::to_string(public_port) + ":" + std::to_string(upstream_port);
+    pid_t expose = spawn({options.expose, mapping}, env);
+
+    tcp::endpoint endpoint(ip::address_v4::loopback(), public_port);
+    int status = 0;
+
+    if (!wait_ready(endpoint)) {
+        std::cerr << "Tunnel did not come up on port " << public_port << "\n";
+        status = 1;
+    } else {
+        std::vector<std::string> scenarios = {"short", "rtt", "bulk", "mixed"};
+
+        if (options.scenario != "all") {
+            scenarios = {options.scenario};
+        }
+
+        std::ofstream output;
+
+        if (!options.output.empty()) {
+            output.open(options.output, std::ios::app);
+        }
+
+        for (auto &scenario : scenarios) {
+            std::string line = run_scenario(options, scenario, endpoint, proxy, expose, respawn);
+            std::string delta = options.output.empty() ? "" : profile_delta(options.output, line);
+
+            if (!delta.empty()) {
+                line.insert(line.size() - 1, ",\"vs_default\":" + delta);
+            }
+
+            std::cout << line << std::endl;
+
+            if (output) {
+                output << line << std::endl;
+            }
+        }
+    }
+
+    terminate(expose);
+    terminate(proxy);
+    upstream_io.stop();
+    upstream_thread.join();
+    return status;
+}
@@ -0,0 +1,126 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vhost.hpp"
+
+// 一個典型大小 (約 512 bytes) 的 TLS 1.3 ClientHello：server_name 排在幾個 extension 之後
+std::vector<char> client_hello(const std::string &host) {
+    std::vector<uint8_t> extensions;
+    auto put16 = [](std::vector<uint8_t> &out, size_t value) {
+        out.push_back(uint8_t(value >> 8));
+        out.push_back(uint8_t(value));
+    };
+    auto extension = [&](uint16_t type, const std::vector<uint8_t> &body) {
+        put16(extensions, type);
+        put16(extensions, body.size());
+        extensions.insert(extensions.end(), body.begin(), body.end());
+    };
+
+    extension(0x000a, std::vector<uint8_t>(10, 0x1d));  // supported_groups
+    extension(0x000d, std::vector<uint8_t>(24, 0x04));  // signature_algorithms
+    extension(0x0033, std::vector<uint8_t>(38, 0x20));  // key_share
+    extension(0x002b, std::vector<uint8_t>(7, 0x03));   // supported_versions
+    std::vector<uint8_t> name;
+    put16(name, host.size() + 3);
+    name.push_back(0);
+    put16(name, host.size());
+    name.insert(name.end(), host.begin(), host.end());
+    extension(0x0000, name);
+    extension(0x0015, std::vector<uint8_t>(512 - 200 - host.size(), 0)); // padding
+
+    std::vector<uint8_t> hello = {0x03, 0x03};
+    hello.insert(hello.end(), 32, 0x5a); // random
+    hello.push_back(32);                 // session id
+    hello.insert(hello.end(), 32, 0xa5);
+    put16(hello, 32);                    // cipher suites
+    hello.insert(hello.end(), 32, 0x13);
+    hello.push_back(1);                  // compression methods
+    hello.push_back(0);
+    put16(hello, extensions.size());
+    hello.insert(hello.end(), extensions.begin(), extensions.end());
+
+    std::vector<uint8_t> record = {0x16, 0x03, 0x01};
+    put16(record, hello.size() + 4);
+    record.push_back(0x01);
+    record.push_back(0);
+    put16(record, hello.size());
+    record.insert(record.end(), hello.begin(), hello.end());
+    return std::vector<char>(record.begin(), record.end());
+}
+
+std::vector<char> http_request(const std::string &host) {
+    std::string request = "GET /api/v1/items?page=2 HTTP/1.1\r\n"
+                          "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+                          "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+                          "Accept-Language: en-US,en;q=0.5\r\n"
+                          "Accept-Encoding: gzip, deflate, br\r\n"
+                          "Host: " + host + ":8080\r\n"
+                          "Connection: keep-alive\r\n\r\n";
+    return std::vector<char>(request.begin(), request.end());
+}
+
+// 一次完整的路由決策：解析、正規化、查表。split 為第一次 peek 到的長度 (模擬分段到達)
+template <typename Routes>
+bool decide(const std::vector<char> &data, size_t split, const Routes &routes) {
+    route_parser parser;
+    route_status status = parser.parse(data.data(), split);
+
+    if (status == route_status::NEED_MORE) {
+        status = parser.parse(data.data(), data.size());
+    }
+
+    char name[VHOST_MAX_NAME + 1];
+    return status == route_status::FOUND
+           && routes.find(normalize_host(parser.host(), name)) != routes.end();
+}
+
+// 每種請求解析 <iterations> 次，輸出每次路由決策的平均時間
+int main(int argc, const char *argv[]) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    std::map<std::string, int, std::less<>> routes;
+
+    for (int i = 0; i < 64; ++i) {
+        routes["service-" + std::to_string(i) + ".example.com"] = i;
+    }
+
+    struct scenario {
+        const char *name;
+        std::vector<char> data;
+        size_t split;
+    };
+
+    auto tls = client_hello("service-42.example.com");
+    auto http = http_request("Service-42.Example.com");
+    std::vector<scenario> scenarios = {
+        {"tls_sni", tls, tls.size()},
+        {"tls_sni_split", tls, tls.size() / 2},
+        {"http_host", http, http.size()},
+        {"http_host_split", http, http.size() / 2},
+    };
+
+    for (auto &s : scenarios) {
+        size_t matched = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < iterations; ++i) {
+            matched += decide(s.data, s.split, routes);
+        }
+
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        double ns = elapsed.count();
+
+        if (matched != iterations) {
+            std::cerr << s.name << ": routed " << matched << " of " << iterations << std::endl;
+            return 1;
+        }
+
+        std::cout << s.name << " (" << s.data.size() << " bytes): " << ns / iterations
+                  << " ns/decision" << std::endl;
+    }
+
+    return 0;
+}
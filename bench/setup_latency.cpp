@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 量測「連線建立到收到第一個 echo byte」的延遲 (time-to-first-byte)。
+// 搭配 echo_server + proxy_server + expose 使用，例如：
+//   TUNNEL_MODE=mux ./expose 8080:9000 & ./setup_latency 127.0.0.1 8080 1000
+int main(int argc, const char *argv[]) {
+    if (argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> <count>\n";
+        return 1;
+    }
+
+    try {
+        io_context io_context;
+        tcp::resolver resolver(io_context);
+        auto endpoints = resolver.resolve(argv[1], argv[2]);
+        int count = std::atoi(argv[3]);
+        std::vector<double> samples;
+        samples.reserve(count);
+
+        for (int i = 0; i < count; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            tcp::socket socket(io_context);
+            connect(socket, endpoints);
+            socket.set_option(tcp::no_delay(true));
+            char byte = 'x';
+            write(socket, buffer(&byte, 1));
+            read(socket, buffer(&byte, 1));
+            auto end = std::chrono::steady_clock::now();
+            samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        }
+
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];
+        };
+        std::cout << "connections " << samples.size() << "\n"
+                  << "p50_us " << percentile(0.50) << "\n"
+                  << "p90_us " << percentile(0.90) << "\n"
+                  << "p99_us " << percentile(0.99) << "\n"
+                  << "max_us " << samples.back() << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 量測單一 tunnel 的單向傳輸吞吐量。
+// 本工具同時扮演上游服務 (在 <target_port> 上 listen) 與 client (連到 <proxy_port>)，
+// 因此只需先啟動 proxy_server 與 expose <proxy_port>:<target_port>：
+//   ./throughput 127.0.0.1 8080 9000 1024
+int main(int argc, const char *argv[]) {
+    if (argc != 5) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <proxy_host> <proxy_port> <target_port> <megabytes>\n";
+        return 1;
+    }
+
+    try {
+        io_context io_context;
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), std::atoi(argv[3])));
+        tcp::resolver resolver(io_context);
+        size_t total = size_t(std::atoi(argv[4])) << 20;
+
+        tcp::socket client(io_context);
+        connect(client, resolver.resolve(argv[1], argv[2]));
+        tcp::socket upstream = acceptor.accept();
+
+        // client -> proxy -> expose -> upstream
+        auto start = std::chrono::steady_clock::now();
+        std::thread sender([&client, total]() {
+            std::vector<char> chunk(256 * 1024, 'x');
+            size_t sent = 0;
+
+            while (sent < total) {
+                sent += write(client, buffer(chunk, std::min(chunk.size(), total - sent)));
+            }
+        });
+
+        std::vector<char> sink(256 * 1024);
+        size_t received = 0;
+
+        while (received < total) {
+            received += upstream.read_some(buffer(sink));
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        sender.join();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << "bytes " << received << "\n"
+                  << "seconds " << seconds << "\n"
+                  << "mib_per_s " << (received / 1048576.0) / seconds << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
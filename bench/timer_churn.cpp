@@ -0,0 +1,78 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "timer_wheel.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+// 每個 timer 設定一次、重新設定一次 (例如 tunnel 有活動)、取消一次，輸出每次操作的平均時間
+template <typename Timer, typename Arm, typename Cancel>
+void churn(const char *name, std::vector<Timer> &timers, const std::vector<int> &delays, Arm arm,
+           Cancel cancel) {
+    auto start = clock_type::now();
+
+    for (size_t i = 0; i < timers.size(); ++i) {
+        arm(timers[i], std::chrono::seconds(delays[i]));
+    }
+
+    for (size_t i = 0; i < timers.size(); ++i) {
+        arm(timers[i], std::chrono::seconds(delays[timers.size() - 1 - i]));
+    }
+
+    for (auto &timer : timers) {
+        cancel(timer);
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+    std::cout << name << " (" << timers.size() << " timers): " << ns / (timers.size() * 3)
+              << " ns/op" << std::endl;
+}
+
+// 以 <count> 個 timer (逾時 1 ~ 300 秒) 比較 timer_wheel 與每個物件一個 steady_timer
+int main(int argc, const char *argv[]) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    std::mt19937 generator(1);
+    std::vector<int> delays(count);
+
+    for (auto &delay : delays) {
+        delay = 1 + generator() % 300;
+    }
+
+    io_context context;
+    std::vector<std::unique_ptr<steady_timer>> steady;
+
+    for (size_t i = 0; i < count; ++i) {
+        steady.push_back(std::make_unique<steady_timer>(context));
+    }
+
+    churn("steady_timer", steady, delays, [](auto & timer, auto delay) {
+        timer->expires_after(delay);
+        timer->async_wait([](const boost::system::error_code &) {});
+    }, [](auto & timer) {
+        timer->cancel();
+    });
+    context.run();
+    context.restart();
+
+    auto &wheel = use_service<timer_wheel>(context);
+    std::vector<std::unique_ptr<wheel_timer>> wheeled;
+
+    for (size_t i = 0; i < count; ++i) {
+        wheeled.push_back(std::make_unique<wheel_timer>([]() {}));
+    }
+
+    churn("wheel_timer", wheeled, delays, [&wheel](auto & timer, auto delay) {
+        timer->arm(wheel, delay);
+    }, [](auto & timer) {
+        timer->cancel();
+    });
+    context.run();
+    std::cout << "sizeof: steady_timer " << sizeof(steady_timer) << " bytes, wheel_timer "
+              << sizeof(wheel_timer) << " bytes" << std::endl;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "trace.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+// 每個追蹤點的平均時間；on 時先設定 TRACE_FILE (第一次呼叫才讀取環境變數)
+int main(int argc, const char *argv[]) {
+    bool on = argc > 1 && std::string(argv[1]) == "on";
+    size_t count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000000;
+
+    if (on) {
+        setenv("TRACE_FILE", "/dev/null", 1);
+    }
+
+    trace_event("warmup", 1);
+    auto start = clock_type::now();
+
+    for (size_t i = 0; i < count; ++i) {
+        trace_event("bench", i + 1);
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+    std::cout << "tracing " << (on ? "on" : "off") << ": " << ns / count << " ns/event"
+              << std::endl;
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "depipe.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 以 malloc_usable_size 計算整個程式目前佔用的 heap bytes (包含 allocator 的取整)
+static std::atomic<long long> live_bytes{0};
+
+void *operator new(size_t size) {
+    if (void *p = std::malloc(size ? size : 1)) {
+        live_bytes += malloc_usable_size(p);
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    if (p) {
+        live_bytes -= malloc_usable_size(p);
+        std::free(p);
+    }
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+/**
+ * 每條閒置 tunnel 在 user-space 佔用的記憶體：
+ * 先建立 <tunnels> 組 client -> [a] depipe [b] -> target 的 loopback 連線 (socket 本身不計)，
+ * 再分兩批啟動 depipe、每條來回轉送一小段資料後閒置，比較第二批前後的 heap 使用量。
+ * 指定 bulk_kib 時每條 tunnel 先以 64 KiB 為單位單向轉送這麼多資料 (讓 buffer 成長) 再閒置。
+ * 每條 tunnel 使用 4 個 fd，須先以 ulimit -n 調高上限。
+ *
+ * Usage: tunnel_memory [tunnels] [bulk_kib]
+ */
+int main(int argc, const char *argv[]) {
+    size_t tunnels = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+    size_t bulk_chunks = argc > 2 ? std::strtoul(argv[2], nullptr, 10) / 64 : 0;
+    io_context io;
+
+    try {
+        tcp::acceptor acceptor(io, tcp::endpoint(ip::address_v4::loopback(), 0));
+        acceptor.listen(4096);
+        auto connect_pair = [&acceptor](tcp::socket & client) {
+            client.connect(acceptor.local_endpoint());
+            return acceptor.accept();
+        };
+
+        struct ends {
+            tcp::socket client;
+            tcp::socket target;
+        };
+
+        std::vector<ends> outer;
+        std::vector<std::pair<tcp::socket, tcp::socket>> inner;
+        outer.reserve(tunnels);
+        inner.reserve(tunnels);
+
+        for (size_t i = 0; i < tunnels; ++i) {
+            tcp::socket client(io);
+            tcp::socket a = connect_pair(client);
+            tcp::socket b(io);
+            tcp::socket target = connect_pair(b);
+            outer.push_back({std::move(client), std::move(target)});
+            inner.emplace_back(std::move(a), std::move(b));
+        }
+
+        auto work = make_work_guard(io);
+        std::thread runner([&io]() {
+            io.run();
+        });
+
+        // 啟動 [begin, end) 的 tunnel，每條兩個方向各轉送一次，讓 buffer 與 handler 都實際用過
+        auto exercise = [&](size_t begin, size_t end) {
+            std::array<char, 64> message{};
+            std::vector<char> chunk(64 * 1024);
+
+            for (size_t i = begin; i < end; ++i) {
+                post(io, [&pair = inner[i]]() {
+                    make_depipe(std::move(pair.first), std::move(pair.second))->start();
+                });
+            }
+
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t n = 0; n < bulk_chunks; ++n) {
+                    write(outer[i].client, buffer(chunk));
+                    read(outer[i].target, buffer(chunk));
+                }
+
+                write(outer[i].client, buffer(message));
+                read(outer[i].target, buffer(message));
+                write(outer[i].target, buffer(message));
+                read(outer[i].client, buffer(message));
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            return live_bytes.load();
+        };
+
+        // 前一半讓每條線程的 frame_pool 快取達到上限 (與連線數無關的固定量)，
+        // 以後一半的增量計算每條 tunnel 的成本
+        long long half = exercise(0, tunnels / 2);
+        long long idle = exercise(tunnels / 2, tunnels) - half;
+        size_t measured = tunnels - tunnels / 2;
+        std::cout << "sizeof(depipe): " << sizeof(depipe) << " bytes" << std::endl;
+        std::cout << "heap per idle tunnel: " << double(idle) / measured << " bytes (" << tunnels
+                  << " tunnels)" << std::endl;
+
+        for (auto &end : outer) {
+            end.client.close();
+            end.target.close();
+        }
+
+        work.reset();
+        runner.join();
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
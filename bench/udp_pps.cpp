@@ -0,0 +1,204 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// 量測 UDP tunnel 每秒可轉送的 datagram 數 (TUNNEL_MODE=udp)。
+// 本工具同時扮演上游 echo 服務 (在 <target_port> 上) 與 client (<flows> 個 socket 連到 <proxy_port>)，
+// client 持續以 sendmmsg 送出 <size> bytes 的 datagram，統計 echo 回來的數量：
+//   TUNNEL_MODE=udp ./expose 9999:9000 &
+//   ./udp_pps 127.0.0.1 9999 9000 8 5 64
+// 送出速率超過 tunnel 能力時多出的 datagram 會被丟棄，received_pps 即 tunnel 的處理能力。
+namespace {
+
+constexpr int BATCH = 32;
+
+int udp_socket() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    return fd;
+}
+
+sockaddr_in resolve(const char *host, const char *port) {
+    addrinfo hints{}, *result = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        throw std::runtime_error("cannot resolve proxy host");
+    }
+
+    sockaddr_in address = *reinterpret_cast<sockaddr_in *>(result->ai_addr);
+    freeaddrinfo(result);
+    return address;
+}
+
+// 把收到的 datagram 原樣送回來源
+void echo(int fd, const std::atomic<bool> &stop) {
+    std::vector<char> data(BATCH * 2048);
+    mmsghdr headers[BATCH];
+    iovec vectors[BATCH];
+    sockaddr_in peers[BATCH];
+
+    while (!stop) {
+        pollfd ready{fd, POLLIN, 0};
+
+        if (poll(&ready, 1, 100) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < BATCH; ++i) {
+            vectors[i] = {&data[i * 2048], 2048};
+            headers[i].msg_hdr = {};
+            headers[i].msg_hdr.msg_name = &peers[i];
+            headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            headers[i].msg_hdr.msg_iov = &vectors[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(fd, headers, BATCH, MSG_DONTWAIT, nullptr);
+
+        for (int i = 0; i < n; ++i) {
+            vectors[i].iov_len = headers[i].msg_len;
+        }
+
+        if (n > 0) {
+            sendmmsg(fd, headers, n, 0);
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    if (argc < 4 || argc > 7) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <proxy_host> <proxy_port> <target_port>"
+                  << " [<flows>=8] [<seconds>=5] [<size>=64]\n";
+        return 1;
+    }
+
+    int flows = argc > 4 ? std::atoi(argv[4]) : 8;
+    double seconds = argc > 5 ? std::atof(argv[5]) : 5;
+    size_t size = argc > 6 ? std::strtoul(argv[6], nullptr, 10) : 64;
+
+    try {
+        int upstream = udp_socket();
+        sockaddr_in bound{};
+        bound.sin_family = AF_INET;
+        bound.sin_port = htons(std::atoi(argv[3]));
+
+        if (bind(upstream, reinterpret_cast<sockaddr *>(&bound), sizeof(bound)) != 0) {
+            throw std::runtime_error("cannot bind target port");
+        }
+
+        sockaddr_in proxy = resolve(argv[1], argv[2]);
+        std::vector<pollfd> clients;
+
+        for (int i = 0; i < flows; ++i) {
+            int fd = udp_socket();
+
+            if (connect(fd, reinterpret_cast<sockaddr *>(&proxy), sizeof(proxy)) != 0) {
+                throw std::runtime_error("cannot connect to proxy port");
+            }
+
+            clients.push_back({fd, POLLIN, 0});
+        }
+
+        std::atomic<bool> stop{false};
+        std::atomic<bool> sending{true};
+        std::atomic<uint64_t> sent{0};
+        uint64_t received = 0;
+        std::thread echo_thread(echo, upstream, std::cref(stop));
+
+        std::thread sender([&]() {
+            std::vector<char> payload(size, 'u');
+            mmsghdr headers[BATCH];
+            iovec vector{payload.data(), size};
+
+            for (auto &header : headers) {
+                header.msg_hdr = {};
+                header.msg_hdr.msg_iov = &vector;
+                header.msg_hdr.msg_iovlen = 1;
+            }
+
+            while (sending) {
+                for (auto &client : clients) {
+                    int n = sendmmsg(client.fd, headers, BATCH, MSG_DONTWAIT);
+
+                    if (n > 0) {
+                        sent += n;
+                    }
+                }
+            }
+        });
+
+        std::vector<char> sink(BATCH * 2048);
+        mmsghdr headers[BATCH];
+        iovec vectors[BATCH];
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::duration<double>(seconds);
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (poll(clients.data(), clients.size(), 100) <= 0) {
+                continue;
+            }
+
+            for (auto &client : clients) {
+                if (!(client.revents & POLLIN)) {
+                    continue;
+                }
+
+                for (int i = 0; i < BATCH; ++i) {
+                    vectors[i] = {&sink[i * 2048], 2048};
+                    headers[i].msg_hdr = {};
+                    headers[i].msg_hdr.msg_iov = &vectors[i];
+                    headers[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                int n = recvmmsg(client.fd, headers, BATCH, MSG_DONTWAIT, nullptr);
+
+                if (n > 0) {
+                    received += n;
+                }
+            }
+        }
+
+        std::chrono::duration<double> elapsed_time = std::chrono::steady_clock::now() - start;
+        double elapsed = elapsed_time.count();
+        sending = false;
+        sender.join();
+        stop = true;
+        echo_thread.join();
+
+        std::cout << "flows " << flows << "\n"
+                  << "datagram_bytes " << size << "\n"
+                  << "seconds " << elapsed << "\n"
+                  << "sent_pps " << sent / elapsed << "\n"
+                  << "received_pps " << received / elapsed << std::endl;
+
+        for (auto &client : clients) {
+            close(client.fd);
+        }
+
+        close(upstream);
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,508 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+#include "protocol.hpp"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace boost::asio;
+
+/**
+ * @file compress.hpp
+ * @brief proxy_server 與 expose 之間資料連線的串流壓縮。
+ *
+ * 只壓縮 proxy <-> expose 這一段 (通常是 expose 所在的窄頻上行)，client 與 target 端不受影響。
+ * 使用的 Codec 在註冊時協商 (見 protocol.hpp)，兩端以 compressed_stream 包裝 tunnel 端的 stream。
+ */
+
+inline const char *codec_name(Codec codec) {
+    switch (codec) {
+    case Codec::DEFLATE_FAST:
+        return "deflate-fast";
+
+    case Codec::DEFLATE:
+        return "deflate";
+
+    default:
+        return "none";
+    }
+}
+
+// 解析 COMPRESSION 環境變數；無法辨識時回傳 false
+inline bool parse_codec(const std::string &name, Codec &codec) {
+    for (Codec candidate : {Codec::NONE, Codec::DEFLATE_FAST, Codec::DEFLATE}) {
+        if (name == codec_name(candidate)) {
+            codec = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// 這個 build 是否能使用該 Codec (需以 zlib 建置)
+inline bool codec_supported(Codec codec) {
+#ifdef HAVE_ZLIB
+    return codec == Codec::NONE || codec == Codec::DEFLATE_FAST || codec == Codec::DEFLATE;
+#else
+    return codec == Codec::NONE;
+#endif
+}
+
+#ifdef HAVE_ZLIB
+
+/**
+ * @struct codec_metrics
+ * @brief 每種 Codec 壓縮前的 bytes、實際寫到 tunnel 上的 bytes (含 frame header)，
+ * 以及切換為 passthrough 的次數。
+ */
+struct codec_metrics {
+    explicit codec_metrics(Codec codec)
+        : input("tunnel_codec_input_bytes_total", "Bytes handed to the tunnel compressor.",
+                std::string("codec=\"") + codec_name(codec) + "\""),
+          wire("tunnel_codec_wire_bytes_total",
+               "Bytes written to compressed tunnels, including framing.",
+               std::string("codec=\"") + codec_name(codec) + "\""),
+          passthrough("tunnel_codec_passthrough_total",
+                      "Times a compressed tunnel direction switched to passthrough.",
+                      std::string("codec=\"") + codec_name(codec) + "\"") {}
+
+    counter input;
+    counter wire;
+    counter passthrough;
+};
+
+inline codec_metrics &compression_metrics(Codec codec) {
+    static codec_metrics fast(Codec::DEFLATE_FAST);
+    static codec_metrics best(Codec::DEFLATE);
+    return codec == Codec::DEFLATE_FAST ? fast : best;
+}
+
+/**
+ * @class compressed_stream
+ * @brief 以 deflate 壓縮寫入、解壓讀取的 stream 包裝，提供與 ssocket 相同的介面供 depipe 使用。
+ *
+ * 每次 async_write 成為一個 frame：[type: 1 byte][length: 4 bytes, network byte order][payload]
+ * - RAW：payload 原樣傳送 (passthrough)
+ * - DEFLATE：接續同一個 raw deflate 串流，以 Z_SYNC_FLUSH 結尾，接收端不必等下一個 frame
+ * - DEFLATE_RESET：送出端先重設了 deflate 串流，接收端也要重設 inflate
+ *
+ * 送出端每壓縮 PROBE_BYTES 檢查一次，省不到 1/8 就改送 RAW (TLS、影像等已壓縮的資料)；
+ * 之後每隔一段資料只壓縮一小段樣本重新評估，連續失敗時間隔加倍，
+ * 因此不可壓縮的串流幾乎不花壓縮的 CPU。RAW frame 的讀寫都不經過額外的複製。
+ * 讀寫兩個方向的狀態各自獨立，與 depipe 相同，一個方向同時只有一個讀或寫在進行。
+ */
+template <typename Stream>
+class compressed_stream {
+  public:
+    compressed_stream(Stream stream, Codec codec)
+        : stream_(std::move(stream)), state_(std::make_unique<state>(codec)) {}
+
+    // 底層 stream 的 executor，completion handler 都在這裡執行
+    auto get_executor() const {
+        return stream_.get_executor();
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler) {
+        // 只解壓到第一個非空的 buffer，depipe 每次只給一個
+        state_->target = mutable_buffer();
+
+        for (auto it = buffer_sequence_begin(buffers); it != buffer_sequence_end(buffers); ++it) {
+            if (it->size() > 0) {
+                state_->target = *it;
+                break;
+            }
+        }
+
+        continue_read(std::forward<ReadHandler>(handler), true);
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    void async_write(const ConstBufferSequence &buffers, WriteHandler &&handler) {
+        using handler_type = typename std::decay<WriteHandler>::type;
+        state &s = *state_;
+        size_t total = buffer_size(buffers);
+        // passthrough 期間只在到期時壓縮開頭的一小段作為樣本，其餘原樣送出
+        size_t sample = s.probe_due() ? std::min(total, PROBE_SAMPLE) : 0;
+        size_t compressed = s.passthrough ? sample : total;
+        auto &metrics = compression_metrics(s.codec);
+        metrics.input.add(total);
+        s.frames.clear();
+
+        if (compressed > 0) {
+            uint8_t type = DEFLATE;
+
+            // 樣本從新的 deflate 串流開始，接收端對應地重設 inflate
+            if (s.passthrough) {
+                deflateReset(&s.deflater);
+                type = DEFLATE_RESET;
+            }
+
+            size_t produced = s.compress(buffers, compressed);
+            put_header(s.out.data(), type, produced);
+            s.frames.push_back(buffer(s.out.data(), FRAME_HEADER + produced));
+
+            if (s.judge(compressed, produced)) {
+                metrics.passthrough.add();
+            }
+        }
+
+        if (compressed < total) {
+            // RAW frame 不複製資料：header 與剩下的 buffers 一起 gathered write
+            put_header(s.header, RAW, total - compressed);
+            s.frames.push_back(buffer(s.header));
+            size_t skip = compressed;
+
+            for (auto it = buffer_sequence_begin(buffers); it != buffer_sequence_end(buffers);
+                    ++it) {
+                const_buffer piece = *it;
+
+                if (skip >= piece.size()) {
+                    skip -= piece.size();
+                    continue;
+                }
+
+                s.frames.push_back(piece + skip);
+                skip = 0;
+            }
+
+            s.skipped += total - compressed;
+        }
+
+        metrics.wire.add(buffer_size(s.frames));
+        stream_.async_write(s.frames,
+                            write_op<handler_type>(std::forward<WriteHandler>(handler), total));
+    }
+
+    void close() {
+        stream_.close();
+    }
+
+  private:
+    enum : uint8_t {
+        RAW = 0,
+        DEFLATE = 1,
+        DEFLATE_RESET = 2,
+    };
+
+    static constexpr size_t FRAME_HEADER = 5;
+    static constexpr size_t IN_BUF_SIZE = 64 * 1024;
+    static constexpr size_t PROBE_BYTES = 64 * 1024;   // 壓縮時評估壓縮率的區間
+    static constexpr size_t PROBE_SAMPLE = 16 * 1024;  // passthrough 時重新評估的樣本大小
+    static constexpr size_t REPROBE_MIN = 1024 * 1024; // passthrough 後第一次重新評估的間隔
+    static constexpr size_t REPROBE_MAX = 4 * 1024 * 1024;  // 樣本只佔 16 KiB，間隔不必拉得太長
+
+    static void put_header(char *header, uint8_t type, size_t length) {
+        header[0] = static_cast<char>(type);
+        put_be(header + 1, static_cast<uint32_t>(length));
+    }
+
+    // zlib 的狀態內含指回 z_stream 的指標，不能搬移，因此整組放在 heap 上
+    struct state {
+        explicit state(Codec _codec) : codec(_codec), in(IN_BUF_SIZE) {
+            int level = codec == Codec::DEFLATE_FAST ? 1 : Z_DEFAULT_COMPRESSION;
+            // raw deflate (負的 windowBits)：不需要 zlib header 與 checksum，TCP 已保證完整
+            deflateInit2(&deflater, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            inflateInit2(&inflater, -15);
+        }
+
+        ~state() {
+            deflateEnd(&deflater);
+            inflateEnd(&inflater);
+        }
+
+        // 把 buffer sequence 的前 limit bytes 壓縮進 out (保留 frame header 的位置)，回傳 payload 長度
+        template <typename ConstBufferSequence>
+        size_t compress(const ConstBufferSequence &buffers, size_t limit) {
+            out.resize(std::max(out.size(), FRAME_HEADER + deflateBound(&deflater, limit) + 16));
+            deflater.next_out = reinterpret_cast<Bytef *>(out.data() + FRAME_HEADER);
+            deflater.avail_out = static_cast<uInt>(out.size() - FRAME_HEADER);
+
+            for (auto it = buffer_sequence_begin(buffers);
+                    it != buffer_sequence_end(buffers) && limit > 0; ++it) {
+                size_t n = std::min(it->size(), limit);
+                deflater.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(it->data()));
+                deflater.avail_in = static_cast<uInt>(n);
+                deflate_all(Z_NO_FLUSH);
+                limit -= n;
+            }
+
+            deflate_all(Z_SYNC_FLUSH);
+            return out.size() - FRAME_HEADER - deflater.avail_out;
+        }
+
+        // 輸出空間不足時放大 out 後繼續，直到輸入用完 (flush 時直到輸出完整)
+        void deflate_all(int flush) {
+            for (;;) {
+                deflate(&deflater, flush);
+
+                if (deflater.avail_out > 0 && deflater.avail_in == 0) {
+                    return;
+                }
+
+                size_t used = out.size() - deflater.avail_out;
+                out.resize(out.size() * 2);
+                deflater.next_out = reinterpret_cast<Bytef *>(out.data() + used);
+                deflater.avail_out = static_cast<uInt>(out.size() - used);
+            }
+        }
+
+        // 壓縮時累計壓縮率，passthrough 時只看這次的樣本；省不到 1/8 就 (繼續) passthrough。
+        // 回傳是否剛從壓縮切換為 passthrough
+        bool judge(size_t input, size_t produced) {
+            if (passthrough) {
+                if (produced * 8 > input * 7) {
+                    reprobe = std::min(reprobe * 2, REPROBE_MAX);
+                } else {
+                    passthrough = false;
+                    reprobe = REPROBE_MIN;
+                }
+
+                skipped = 0;
+                return false;
+            }
+
+            window_in += input;
+            window_out += produced;
+
+            if (window_in < PROBE_BYTES) {
+                return false;
+            }
+
+            bool poor = window_out * 8 > window_in * 7;
+            window_in = window_out = 0;
+            skipped = 0;
+            passthrough = poor;
+            return poor;
+        }
+
+        bool probe_due() const {
+            return skipped >= reprobe;
+        }
+
+        // 從 in 解出資料到 target；有輸出或發生錯誤時回傳 true，需要更多輸入時回傳 false
+        bool decode(size_t &n, boost::system::error_code &ec) {
+            n = 0;
+
+            for (;;) {
+                if (frame_left == 0 && !inflate_pending) {
+                    if (end - begin < FRAME_HEADER) {
+                        return false;
+                    }
+
+                    frame_type = static_cast<uint8_t>(in[begin]);
+                    frame_left = get_be<uint32_t>(&in[begin + 1]);
+                    begin += FRAME_HEADER;
+
+                    if (frame_type > DEFLATE_RESET) {
+                        ec = error::invalid_argument;
+                        return true;
+                    }
+
+                    if (frame_type == DEFLATE_RESET) {
+                        inflateReset(&inflater);
+                    }
+
+                    continue;
+                }
+
+                size_t avail = std::min(end - begin, frame_left);
+
+                if (frame_type == RAW) {
+                    if (avail == 0) {
+                        return false;
+                    }
+
+                    n = std::min(avail, target.size());
+                    std::memcpy(target.data(), &in[begin], n);
+                    begin += n;
+                    frame_left -= n;
+                    return true;
+                }
+
+                inflater.next_in = reinterpret_cast<Bytef *>(&in[begin]);
+                inflater.avail_in = static_cast<uInt>(avail);
+                inflater.next_out = static_cast<Bytef *>(target.data());
+                inflater.avail_out = static_cast<uInt>(target.size());
+                int rc = inflate(&inflater, Z_SYNC_FLUSH);
+                size_t used = avail - inflater.avail_in;
+                begin += used;
+                frame_left -= used;
+                n = target.size() - inflater.avail_out;
+                // 輸出空間用完時 inflate 內可能還有資料，讀完才能解析下一個 frame
+                inflate_pending = inflater.avail_out == 0;
+
+                if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                    ec = error::invalid_argument;
+                    return true;
+                }
+
+                if (n > 0) {
+                    return true;
+                }
+
+                if (frame_left > 0) {
+                    return false;
+                }
+            }
+        }
+
+        // 把尚未處理的輸入移到 buffer 開頭，回傳可填入的空間
+        mutable_buffer space() {
+            std::memmove(in.data(), in.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            return buffer(in.data() + end, in.size() - end);
+        }
+
+        Codec codec;
+
+        // 寫入方向
+        z_stream deflater{};
+        std::vector<char> out;
+        char header[FRAME_HEADER];
+        std::vector<const_buffer> frames;
+        size_t window_in = 0;
+        size_t window_out = 0;
+        bool passthrough = false;
+        size_t skipped = 0;
+        size_t reprobe = REPROBE_MIN;
+
+        // 讀取方向
+        z_stream inflater{};
+        std::vector<char> in;
+        size_t begin = 0;
+        size_t end = 0;
+        uint8_t frame_type = RAW;
+        size_t frame_left = 0;
+        bool inflate_pending = false;
+        mutable_buffer target;
+    };
+
+    // 以下 handler 都沿用呼叫端 handler 的 allocator，depipe 的 pooled_handler 因此仍然有效
+    template <typename Handler>
+    class read_op {
+      public:
+        using allocator_type = associated_allocator_t<Handler>;
+
+        // direct：直接讀進呼叫端 buffer 的 RAW frame 資料，而不是讀進內部 buffer 等待解析
+        read_op(compressed_stream *self, Handler handler, bool direct)
+            : self_(self), handler_(std::move(handler)), direct_(direct) {}
+
+        allocator_type get_allocator() const noexcept {
+            return get_associated_allocator(handler_);
+        }
+
+        void operator()(const boost::system::error_code &ec, size_t n) {
+            if (ec) {
+                handler_(ec, size_t(0));
+                return;
+            }
+
+            if (direct_) {
+                self_->state_->frame_left -= n;
+                handler_(ec, n);
+                return;
+            }
+
+            self_->state_->end += n;
+            self_->continue_read(std::move(handler_), false);
+        }
+
+      private:
+        compressed_stream *self_;
+        Handler handler_;
+        bool direct_;
+    };
+
+    template <typename Handler>
+    class write_op {
+      public:
+        using allocator_type = associated_allocator_t<Handler>;
+
+        write_op(Handler handler, size_t total) : handler_(std::move(handler)), total_(total) {}
+
+        allocator_type get_allocator() const noexcept {
+            return get_associated_allocator(handler_);
+        }
+
+        // 回報的是壓縮前的 bytes，與未包裝的 stream 相同
+        void operator()(const boost::system::error_code &ec, size_t) {
+            handler_(ec, ec ? size_t(0) : total_);
+        }
+
+      private:
+        Handler handler_;
+        size_t total_;
+    };
+
+    template <typename Handler>
+    class completion {
+      public:
+        using allocator_type = associated_allocator_t<Handler>;
+
+        completion(Handler handler, const boost::system::error_code &ec, size_t n)
+            : handler_(std::move(handler)), ec_(ec), n_(n) {}
+
+        allocator_type get_allocator() const noexcept {
+            return get_associated_allocator(handler_);
+        }
+
+        void operator()() {
+            handler_(ec_, n_);
+        }
+
+      private:
+        Handler handler_;
+        boost::system::error_code ec_;
+        size_t n_;
+    };
+
+    template <typename ReadHandler>
+    void continue_read(ReadHandler &&handler, bool initiating) {
+        using handler_type = typename std::decay<ReadHandler>::type;
+        size_t n;
+        boost::system::error_code ec;
+
+        if (state_->decode(n, ec)) {
+            // 資料已在 buffer 中：發起函式內不直接呼叫 handler，維持 asio 的非同步語意
+            if (initiating) {
+                post(stream_.get_executor(),
+                     completion<handler_type>(std::forward<ReadHandler>(handler), ec, n));
+            } else {
+                handler(ec, n);
+            }
+
+            return;
+        }
+
+        state &s = *state_;
+
+        // RAW frame 剩下的資料直接讀進呼叫端的 buffer，省去一次複製
+        if (s.frame_type == RAW && s.frame_left > 0 && s.begin == s.end) {
+            size_t limit = std::min(s.target.size(), s.frame_left);
+            stream_.async_read_some(buffer(s.target.data(), limit),
+                                    read_op<handler_type>(this, std::forward<ReadHandler>(handler),
+                                                          true));
+            return;
+        }
+
+        stream_.async_read_some(s.space(), read_op<handler_type>(this,
+                                std::forward<ReadHandler>(handler), false));
+    }
+
+    Stream stream_;
+    std::unique_ptr<state> state_;
+};
+
+#endif
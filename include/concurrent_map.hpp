@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @class concurrent_map
+ * @brief 以 key 的 hash 分成多個 shard、各自持有 mutex 的 hash map。
+ *
+ * 不同 key 的操作大多落在不同 shard，各 io 線程之間幾乎不會互相等待；
+ * 每個 shard 對齊 cache line，避免相鄰 shard 的鎖互相干擾。
+ */
+template <typename Key, typename Value, size_t Shards = 64>
+class concurrent_map {
+  public:
+    // key 已存在時不覆寫並回傳 false
+    bool insert(const Key &key, Value value) {
+        auto &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.map.emplace(key, std::move(value)).second;
+    }
+
+    // 取出並移除；不存在時回傳 false
+    bool take(const Key &key, Value &value) {
+        auto &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+
+        if (it == shard.map.end()) {
+            return false;
+        }
+
+        value = std::move(it->second);
+        shard.map.erase(it);
+        return true;
+    }
+
+    // 複製一份而不移除；不存在時回傳 false
+    bool find(const Key &key, Value &value) {
+        auto &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+
+        if (it == shard.map.end()) {
+            return false;
+        }
+
+        value = it->second;
+        return true;
+    }
+
+    void erase(const Key &key) {
+        auto &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.map.erase(key);
+    }
+
+    // 移除所有符合條件的項目並回傳，呼叫端在鎖外處理它們
+    template <typename Predicate>
+    std::vector<Value> take_if(Predicate predicate) {
+        std::vector<Value> taken;
+
+        for (auto &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            for (auto it = shard.map.begin(); it != shard.map.end();) {
+                if (predicate(it->second)) {
+                    taken.push_back(std::move(it->second));
+                    it = shard.map.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        return taken;
+    }
+
+  private:
+    struct alignas(64) shard {
+        std::mutex mutex;
+        std::unordered_map<Key, Value> map;
+    };
+
+    shard &shard_for(const Key &key) {
+        return shards_[std::hash<Key>()(key) % Shards];
+    }
+
+    std::array<shard, Shards> shards_;
+};
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+/**
+ * @file control.hpp
+ * @brief DIAL_BACK / POOL / GROUP 控制連線上的 control frame (格式見 protocol.hpp)。
+ *
+ * 以前每個 session token 各自對控制連線發起一次 async_write，而且是從 client 所在的
+ * shard 發起、彼此之間沒有排隊：同時到達的 client 會讓多個寫入在同一條 socket 上交錯。
+ * control_channel 把 frame 附加到待寫 buffer，由控制連線所在的線程一次寫出；
+ * 寫入進行中或同一輪事件中送出的 frame 會合併成同一次寫入。
+ */
+
+inline counter &control_frames_sent() {
+    static counter frames("control_frames_sent_total", "Control frames queued for sending.");
+    return frames;
+}
+
+inline counter &control_writes() {
+    static counter writes("control_writes_total", "Writes issued on control connections.");
+    return writes;
+}
+
+inline counter &control_heartbeat_timeouts() {
+    static counter timeouts("control_heartbeat_timeouts_total",
+                            "Control connections closed after missing heartbeats.");
+    return timeouts;
+}
+
+// 環境變數 CONTROL_HEARTBEAT：心跳間隔 (秒)，0 表示不送心跳，預設 10 秒
+inline uint16_t control_heartbeat() {
+    static const uint16_t interval = []() {
+        const char *value = std::getenv("CONTROL_HEARTBEAT");
+        return static_cast<uint16_t>(value ? std::strtoul(value, nullptr, 10) : 10);
+    }();
+    return interval;
+}
+
+// 雙方 HELLO 協商出的心跳間隔：任一方不支援或關閉時為 0
+inline uint16_t negotiate_heartbeat(const control_hello &local, const control_hello &peer) {
+    if (!(local.capabilities & peer.capabilities & CAP_HEARTBEAT) || local.heartbeat == 0
+            || peer.heartbeat == 0) {
+        return 0;
+    }
+
+    return std::min(local.heartbeat, peer.heartbeat);
+}
+
+// 本端的 HELLO
+inline control_hello local_hello() {
+    control_hello hello;
+    hello.capabilities = CAP_HEARTBEAT;
+    hello.heartbeat = control_heartbeat();
+    return hello;
+}
+
+// detach 交出的控制連線：釋放的 fd (由呼叫者關閉，連線已關閉時為 -1)、已讀到但還沒解析的輸入、
+// 還沒寫出的輸出與協商的心跳間隔
+struct control_state {
+    int fd = -1;
+    std::vector<char> unread;
+    std::vector<char> unsent;
+    uint16_t heartbeat = 0;
+};
+
+/**
+ * @class control_channel
+ * @brief 一條控制連線：讀取並解析 control frame，合併寫出待送的 frame。
+ *
+ * send 可在任何線程呼叫；其餘操作與 frame handler 都在控制連線所在的線程上執行。
+ * 每次讀到的完整 frame 依序交給 frame handler，payload 指標在 handler 返回前有效。
+ */
+class control_channel : public std::enable_shared_from_this<control_channel> {
+  public:
+    using frame_handler = std::function<void(ControlFrame, const char *, size_t)>;
+    using close_handler = std::function<void()>;
+
+    explicit control_channel(tcp::socket socket)
+        : socket_(std::move(socket)),
+          executor_(static_cast<io_context &>(socket_.get_executor().context()).get_executor()),
+          heartbeat_([this]() {
+        do_heartbeat();
+    }) {
+        in_.resize(IN_BUF_SIZE);
+    }
+
+    io_context::executor_type get_executor() const {
+        return executor_;
+    }
+
+    void start(frame_handler on_frame, close_handler on_close) {
+        on_frame_ = std::move(on_frame);
+        on_close_ = std::move(on_close);
+        received_ = std::chrono::steady_clock::now();
+
+        if (!pending_.empty()) {
+            // resume 帶來的輸出
+            writing_ = true;
+            auto self(shared_from_this());
+            post(executor_, [this, self]() {
+                do_write();
+            });
+        }
+
+        if (consume()) {
+            do_read();
+        }
+    }
+
+    // 接手其他程式 detach 的連線：在 start 之前以交出時的輸入與輸出繼續 (心跳另以 start_heartbeat 開始)
+    void resume(const std::vector<char> &unread, std::vector<char> unsent) {
+        in_.resize(std::max(in_.size(), unread.size()));
+        std::copy(unread.begin(), unread.end(), in_.begin());
+        end_ = unread.size();
+        pending_ = std::move(unsent);
+    }
+
+    // 停止讀寫並把連線交給其他程式 (可在任何線程呼叫)。進行中的讀取與寫入取消之後，
+    // 在控制連線的線程上以連線的狀態呼叫 done，之後如同連線關閉 (close handler 照常執行)；
+    // 之後 send 回傳 false
+    void detach(std::function<void(control_state)> done) {
+        auto self(shared_from_this());
+        dispatch(executor_, [this, self, done = std::move(done)]() mutable {
+            if (socket_closed_ || detach_) {
+                done(control_state());
+                return;
+            }
+
+            detach_ = std::move(done);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+
+            heartbeat_.cancel();
+            armed_.reset();
+            // 已完成但 handler 尚未執行的讀取仍會以讀到的資料回呼，不會遺失
+            boost::system::error_code ec;
+            socket_.cancel(ec);
+            finish_detach();
+        });
+    }
+
+    // 附加一個 frame，必要時安排一次寫入；連線已關閉時回傳 false
+    bool send(ControlFrame type, const char *payload = nullptr, size_t size = 0) {
+        bool flush;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (closed_) {
+                return false;
+            }
+
+            size_t offset = pending_.size();
+            pending_.resize(offset + FRAME_HEADER_SIZE + size);
+            put_be(&pending_[offset], static_cast<uint16_t>(size));
+            pending_[offset + 2] = static_cast<char>(type);
+
+            if (size > 0) {
+                std::memcpy(&pending_[offset + FRAME_HEADER_SIZE], payload, size);
+            }
+
+            flush = !writing_;
+            writing_ = true;
+        }
+
+        control_frames_sent().add();
+
+        if (flush) {
+            // 延到控制連線的線程上寫出，這段時間內其他 send 附加的 frame 一起送出
+            auto self(shared_from_this());
+            post(executor_, [this, self]() {
+                do_write();
+            });
+        }
+
+        return true;
+    }
+
+    // 可在任何線程呼叫
+    void close() {
+        auto self(shared_from_this());
+        dispatch(executor_, [this, self]() {
+            do_close();
+        });
+    }
+
+    // 每 interval 秒送出 HEARTBEAT；連續 HEARTBEAT_MISSES 個間隔沒有收到任何 frame 就關閉
+    void start_heartbeat(uint16_t interval) {
+        if (interval == 0 || socket_closed_) {
+            return;
+        }
+
+        interval_ = std::chrono::seconds(interval);
+        armed_ = shared_from_this();
+        heartbeat_.arm(use_service<timer_wheel>(static_cast<io_context &>(executor_.context())),
+                       interval_);
+    }
+
+  private:
+    static constexpr size_t IN_BUF_SIZE = 4096;
+
+    void do_read() {
+        auto self(shared_from_this());
+        reading_ = true;
+        socket_.async_read_some(buffer(in_.data() + end_, in_.size() - end_),
+        [this, self](const boost::system::error_code & ec, size_t n) {
+            reading_ = false;
+            end_ += n;
+
+            if (detach_) {
+                // 讀到的資料留給接手的程式解析
+                finish_detach();
+                return;
+            }
+
+            if (ec) {
+                do_close();
+                on_frame_ = nullptr;
+                return;
+            }
+
+            received_ = std::chrono::steady_clock::now();
+
+            if (consume()) {
+                do_read();
+            }
+        });
+    }
+
+    // 依序處理 buffer 中完整的 frame；連線已關閉時回傳 false
+    bool consume() {
+        size_t begin = 0;
+
+        while (!socket_closed_ && end_ - begin >= FRAME_HEADER_SIZE) {
+            size_t length = get_be<uint16_t>(&in_[begin]);
+
+            if (end_ - begin < FRAME_HEADER_SIZE + length) {
+                // 比 buffer 大的 frame：放大 buffer 等待補齊
+                in_.resize(std::max(in_.size(), FRAME_HEADER_SIZE + length));
+                break;
+            }
+
+            auto type = static_cast<ControlFrame>(in_[begin + 2]);
+            begin += FRAME_HEADER_SIZE + length;
+
+            if (type != ControlFrame::HEARTBEAT) {
+                on_frame_(type, &in_[begin - length], length);
+            }
+        }
+
+        // 不完整的 frame 移到開頭，等下一次讀取補齊
+        std::memmove(in_.data(), in_.data() + begin, end_ - begin);
+        end_ -= begin;
+
+        if (socket_closed_) {
+            // frame handler 可能持有擁有者，關閉後才釋放 (不能在 handler 執行中釋放)
+            on_frame_ = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    void do_write() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (pending_.empty() || closed_) {
+                writing_ = false;
+                return;
+            }
+
+            std::swap(pending_, out_);
+        }
+
+        auto self(shared_from_this());
+        control_writes().add();
+        trace_event("control_write");
+        writing_out_ = true;
+        async_write(socket_, buffer(out_),
+        [this, self](const boost::system::error_code & ec, size_t n) {
+            writing_out_ = false;
+
+            if (detach_) {
+                // 取消前已寫出 n bytes，其餘交給接手的程式
+                out_.erase(out_.begin(), out_.begin() + n);
+                finish_detach();
+                return;
+            }
+
+            out_.clear();
+
+            if (ec) {
+                do_close();
+                return;
+            }
+
+            do_write();
+        });
+    }
+
+    void do_heartbeat() {
+        auto self = std::move(armed_);
+
+        if (std::chrono::steady_clock::now() - received_ > interval_ * HEARTBEAT_MISSES) {
+            control_heartbeat_timeouts().add();
+            do_close();
+            return;
+        }
+
+        send(ControlFrame::HEARTBEAT);
+        armed_ = std::move(self);
+        heartbeat_.arm(use_service<timer_wheel>(static_cast<io_context &>(executor_.context())),
+                       interval_);
+    }
+
+    // 讀取與寫入都已停止時交出連線
+    void finish_detach() {
+        if (reading_ || writing_out_) {
+            return;
+        }
+
+        control_state state;
+
+        if (!socket_closed_) {
+            // 交出 fd 的所有權，do_close 不再關閉它 (不支援 release 的平台上視為已關閉)
+            boost::system::error_code ec;
+            auto fd = socket_.release(ec);
+            state.fd = ec ? -1 : static_cast<int>(fd);
+        }
+
+        state.unread.assign(in_.begin(), in_.begin() + end_);
+        state.unsent = std::move(out_);
+        out_.clear();
+        state.heartbeat = static_cast<uint16_t>(interval_.count());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            state.unsent.insert(state.unsent.end(), pending_.begin(), pending_.end());
+            pending_.clear();
+        }
+
+        auto done = std::move(detach_);
+        do_close();
+        on_frame_ = nullptr;
+        done(std::move(state));
+    }
+
+    void do_close() {
+        if (socket_closed_) {
+            return;
+        }
+
+        socket_closed_ = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+
+        boost::system::error_code ec;
+        socket_.close(ec);
+        heartbeat_.cancel();
+        armed_.reset();
+
+        if (on_close_) {
+            std::exchange(on_close_, nullptr)();
+        }
+    }
+
+    tcp::socket socket_;
+    io_context::executor_type executor_;
+    std::vector<char> in_;
+    size_t end_ = 0;
+    std::vector<char> out_;
+    frame_handler on_frame_;
+    close_handler on_close_;
+    bool reading_ = false;
+    bool writing_out_ = false;
+    bool socket_closed_ = false; // 只在控制連線的線程上存取
+    std::function<void(control_state)> detach_;
+
+    // send 與寫入之間共用
+    std::mutex mutex_;
+    std::vector<char> pending_;
+    bool writing_ = false;
+    bool closed_ = false;
+
+    // 心跳：掛在 wheel 上時以 armed_ 保持 channel 存活
+    std::chrono::steady_clock::time_point received_;
+    std::chrono::seconds interval_{0};
+    wheel_timer heartbeat_;
+    std::shared_ptr<control_channel> armed_;
+};
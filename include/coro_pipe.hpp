@@ -0,0 +1,412 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "depipe.hpp"
+#include "dns_cache.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+/**
+ * @file coro_pipe.hpp
+ * @brief 以 C++20 coroutine (co_await) 實作的連線建立與轉送，需以 -DENABLE_COROUTINES=ON 建置。
+ *
+ * 一條 tunnel 的兩個 socket 都在同一個 shard (單線程 io_context) 上，
+ * 因此不需要 strand，也不必在每一步捕獲 shared_from_this() 或包一層 std::function。
+ *
+ * asio 1.74 的 awaitable 每種用途只快取一塊記憶體，巢狀的 coroutine 與同時進行的操作
+ * 幾乎每次都要進 heap；這裡改用自己的 task，coroutine frame、asio op 與轉送 buffer
+ * 都從每條線程依大小分級的 frame_pool (handler_memory.hpp) 配置，釋放後直接給下一條連線重複使用。
+ */
+
+/**
+ * @class task
+ * @brief 延遲啟動的 coroutine；可被另一個 coroutine co_await，或以 detach() 獨立執行。
+ *
+ * 被 co_await 時在結束後直接切回等待者 (symmetric transfer)；detach 後結束時自行釋放 frame。
+ * 例外留在 promise 中：被 co_await 時在等待者中重新拋出，detach 的 coroutine 則記錄後結束，
+ * 不會從恢復它的 handler 傳出而結束 shard 的線程 (轉送的 coroutine 先關閉 tunnel 再拋出)。
+ */
+class task {
+  public:
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        auto final_suspend() noexcept {
+            struct final_awaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<promise_type> self) noexcept {
+                    auto next = self.promise().continuation;
+
+                    if (!next) {
+                        report(self.promise().error);
+                        self.destroy();
+                        return std::noop_coroutine();
+                    }
+
+                    return next;
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            return final_awaiter{};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            error = std::current_exception();
+        }
+
+        static void *operator new(size_t size) {
+            return frame_pool::allocate(size);
+        }
+
+        static void operator delete(void *pointer, size_t size) {
+            frame_pool::deallocate(pointer, size);
+        }
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    // 開始執行，不再由任何人等待
+    void detach() {
+        std::exchange(handle_, nullptr).resume();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept {
+        handle_.promise().continuation = waiter;
+        return handle_;
+    }
+
+    void await_resume() const {
+        if (handle_.promise().error) {
+            std::rethrow_exception(handle_.promise().error);
+        }
+    }
+
+  private:
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    static void report(const std::exception_ptr &error) noexcept {
+        if (!error) {
+            return;
+        }
+
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception &e) {
+            std::cerr << "Coroutine failed: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "Coroutine failed" << std::endl;
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+ * 等待一個 asio 異步操作：completion handler 只帶著指向 awaiter 的指標，
+ * 並以 pool_allocator 作為 associated allocator，op 記憶體同樣來自 frame_pool。
+ */
+template <typename Value>
+class io_awaiter_base {
+  public:
+    class completion {
+      public:
+        using allocator_type = pool_allocator<void>;
+
+        explicit completion(io_awaiter_base *awaiter) : awaiter_(awaiter) {}
+
+        allocator_type get_allocator() const noexcept {
+            return {};
+        }
+
+        void operator()(const boost::system::error_code &ec) {
+            awaiter_->ec_ = ec;
+            awaiter_->waiter_.resume();
+        }
+
+        template <typename V>
+        void operator()(const boost::system::error_code &ec, V &&value) {
+            awaiter_->ec_ = ec;
+            awaiter_->value_ = std::forward<V>(value);
+            awaiter_->waiter_.resume();
+        }
+
+      private:
+        io_awaiter_base *awaiter_;
+    };
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::pair<boost::system::error_code, Value> await_resume() {
+        return {ec_, std::move(value_)};
+    }
+
+  protected:
+    std::coroutine_handle<> waiter_;
+    boost::system::error_code ec_;
+    Value value_{};
+};
+
+template <typename Value, typename Initiate>
+class io_awaiter : public io_awaiter_base<Value> {
+  public:
+    explicit io_awaiter(Initiate initiate) : initiate_(std::move(initiate)) {}
+
+    void await_suspend(std::coroutine_handle<> waiter) {
+        this->waiter_ = waiter;
+        initiate_(typename io_awaiter_base<Value>::completion(this));
+    }
+
+  private:
+    Initiate initiate_;
+};
+
+// co_await async_io<Value>([&](auto handler) { socket.async_xxx(..., std::move(handler)); })
+// 回傳 {error_code, Value}
+template <typename Value = size_t, typename Initiate>
+io_awaiter<Value, Initiate> async_io(Initiate initiate) {
+    return io_awaiter<Value, Initiate>(std::move(initiate));
+}
+
+// 在 executor 的線程上建立並啟動 coroutine，frame 由該線程的 frame_pool 配置
+template <typename Executor, typename Function>
+void co_spawn_task(const Executor &executor, Function function) {
+    dispatch(executor, [function = std::move(function)]() mutable {
+        function().detach();
+    });
+}
+
+// 以快取的解析結果連線 (見 dns_cache.hpp)，結果寫入 ec
+inline task co_connect(tcp::socket &socket, const std::string &host, const std::string &service,
+                       boost::system::error_code &ec, SocketSetup setup = nullptr) {
+    auto [connect_ec, endpoint] = co_await async_io<tcp::endpoint>([&](auto handler) {
+        async_resolve_and_connect(socket, host, service, std::move(handler), std::move(setup));
+    });
+    ec = connect_ec;
+}
+
+/**
+ * depipe 的 coroutine 版本 (copy 引擎)：每個方向一個讀取 coroutine 與一個寫入 coroutine，
+ * 以 depipe 的 pipe_flow 交接 chunk，讀取不等待寫入完成 (與 depipe 相同的多重緩衝、gathered write
+ * 與閒置時歸還 buffer)。兩個 socket 必須屬於同一個 io_context，四個 coroutine 在同一條線程上交替執行，
+ * 因此不需要 pipe_flow 的 mutex。
+ *
+ * 任一方向出錯，或讀到 EOF 且已讀入的資料寫完，就關閉兩端 (與 depipe 相同)，
+ * 進行中的操作隨之取消、停下等待的 coroutine 隨之恢復，最後一個 coroutine 結束時釋放 socket。
+ * token 與 basic_depipe::track 相同，隨 tunnel 存活。
+ */
+class co_tunnel {
+  public:
+    struct direction {
+        explicit direction(direction_metrics &metrics) : flow(metrics) {}
+
+        pipe_flow flow;
+        std::coroutine_handle<> reader; // 佇列已滿，等待寫入端送出
+        std::coroutine_handle<> writer; // 佇列已空，等待讀取端讀入
+    };
+
+    co_tunnel(tcp::socket _src, tcp::socket _dest, std::shared_ptr<void> _token)
+        : src(std::move(_src)),
+          dest(std::move(_dest)),
+          token(std::move(_token)),
+          forward(upstream_metrics()),
+          backward(downstream_metrics()) {}
+
+    // 停下來，等待同一個方向的另一個 coroutine (或 close) 以 wake 恢復
+    struct park {
+        std::coroutine_handle<> &slot;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> waiter) noexcept {
+            slot = waiter;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    static void wake(std::coroutine_handle<> &slot) {
+        if (slot) {
+            std::exchange(slot, nullptr).resume();
+        }
+    }
+
+    void close() {
+        if (closed) {
+            return;
+        }
+
+        closed = true;
+        boost::system::error_code ec;
+        src.close(ec);
+        dest.close(ec);
+
+        for (auto *dir : {&forward, &backward}) {
+            wake(dir->reader);
+            wake(dir->writer);
+        }
+    }
+
+    tcp::socket src;
+    tcp::socket dest;
+    std::shared_ptr<void> token;
+    direction forward;
+    direction backward;
+    bool closed = false;
+};
+
+// 單一方向的讀取端：佇列未滿就繼續讀。buffer 維持最小大小且來源暫時讀空時先等待可讀再取 buffer，
+// buffer 已成長時先以非阻塞讀取探測一次 (見 pipe_flow)
+inline task co_pump_read(std::shared_ptr<co_tunnel> tunnel, bool forward) {
+    tcp::socket &from = forward ? tunnel->src : tunnel->dest;
+    co_tunnel::direction &dir = forward ? tunnel->forward : tunnel->backward;
+    pipe_flow &flow = dir.flow;
+
+    try {
+        boost::system::error_code ec;
+        from.non_blocking(true, ec);
+
+        while (!tunnel->closed) {
+            mutable_buffer target;
+
+            if (!flow.begin_read(target, true)) {
+                co_await co_tunnel::park{dir.reader};
+                continue;
+            }
+
+            size_t n = 0;
+
+            if (target.size() == 0) {
+                bool probe = flow.streaming();
+
+                for (;;) {
+                    if (!probe) {
+                        auto [wait_ec, unused] = co_await async_io([&](auto handler) {
+                            from.async_wait(tcp::socket::wait_read, std::move(handler));
+                        });
+
+                        if (wait_ec) {
+                            ec = wait_ec;
+                            break;
+                        }
+                    }
+
+                    probe = false;
+                    n = from.read_some(flow.fill(), ec);
+
+                    if (ec != error::would_block) {
+                        break;
+                    }
+
+                    flow.unfill();
+                }
+            } else {
+                auto [read_ec, bytes_read] = co_await async_io([&](auto handler) {
+                    from.async_read_some(target, std::move(handler));
+                });
+                ec = read_ec;
+                n = bytes_read;
+            }
+
+            // 讀到 EOF 或錯誤：已讀入的資料由寫入端寫完後關閉
+            if (ec) {
+                if (flow.end_read_failed()) {
+                    tunnel->close();
+                }
+
+                break;
+            }
+
+            flow.end_read(n);
+            co_tunnel::wake(dir.writer);
+        }
+    } catch (...) {
+        tunnel->close();
+        throw;
+    }
+}
+
+// 單一方向的寫入端：一次把佇列中所有 chunk 寫出 (gathered write)，寫完後恢復因佇列滿而停下的讀取端
+inline task co_pump_write(std::shared_ptr<co_tunnel> tunnel, bool forward) {
+    tcp::socket &to = forward ? tunnel->dest : tunnel->src;
+    co_tunnel::direction &dir = forward ? tunnel->forward : tunnel->backward;
+    pipe_flow &flow = dir.flow;
+
+    try {
+        while (!tunnel->closed) {
+            if (!flow.begin_write()) {
+                co_await co_tunnel::park{dir.writer};
+                continue;
+            }
+
+            auto [write_ec, written] = co_await async_io([&](auto handler) {
+                async_write(to, flow.gather(), std::move(handler));
+            });
+
+            if (write_ec || flow.end_write()) {
+                tunnel->close();
+                break;
+            }
+
+            co_tunnel::wake(dir.reader);
+        }
+    } catch (...) {
+        tunnel->close();
+        throw;
+    }
+}
+
+inline void co_depipe(tcp::socket src, tcp::socket dest, std::shared_ptr<void> token = nullptr) {
+    auto executor = src.get_executor();
+    co_spawn_task(executor, [src = std::move(src), dest = std::move(dest),
+    token = std::move(token)]() mutable {
+        auto tunnel = std::allocate_shared<co_tunnel>(pool_allocator<co_tunnel>(), std::move(src),
+                      std::move(dest), std::move(token));
+        co_pump_write(tunnel, true).detach();
+        co_pump_write(tunnel, false).detach();
+        co_pump_read(tunnel, false).detach();
+        return co_pump_read(std::move(tunnel), true);
+    });
+}
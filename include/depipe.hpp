@@ -1,113 +1,766 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
+#include <cerrno>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <array>
-#include "ssocket.hpp" // 引入 Strand-Safe Socket
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <type_traits>
+#include <vector>
+#include "handler_memory.hpp"
+#include "metrics.hpp"
+#include "shaping.hpp"
+#include "splice.hpp"
+#include "ssocket.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+#include "uring.hpp"
 
 using namespace boost::asio;
 using ip::tcp;
 
-extern io_context io;
-
 // Define a reasonable buffer size for efficiency
 constexpr size_t BUF_SIZE = 4096;
+// buffer 依觀察到的讀取量成長的上限
+constexpr size_t MAX_BUF_SIZE = 256 * 1024;
+// 每個方向的 buffer 數：一個在讀，其餘排隊或寫出中
+constexpr size_t PIPE_SLOTS = 4;
+// 已讀入但尚未寫出的 bytes 上限，超過就暫停讀取
+constexpr size_t MAX_QUEUED = 512 * 1024;
+
+/**
+ * @struct direction_metrics
+ * @brief 單一方向的轉送量。upstream 為 src -> dest (連入端往服務端)，downstream 相反。
+ */
+struct direction_metrics {
+    explicit direction_metrics(const std::string &direction)
+        : bytes("tunnel_bytes_total", "Bytes forwarded through tunnels.",
+                "direction=\"" + direction + "\""),
+          chunks("tunnel_chunks_total", "Reads (copy) or splices forwarded through tunnels.",
+                 "direction=\"" + direction + "\"") {}
+
+    counter bytes;
+    counter chunks;
+};
+
+inline direction_metrics &upstream_metrics() {
+    static direction_metrics metrics("upstream");
+    return metrics;
+}
+
+inline direction_metrics &downstream_metrics() {
+    static direction_metrics metrics("downstream");
+    return metrics;
+}
+
+inline counter &idle_closes() {
+    static counter closes("tunnel_idle_closes_total",
+                          "Tunnels closed after TUNNEL_IDLE_TIMEOUT without traffic.");
+    return closes;
+}
+
+// 環境變數 TUNNEL_IDLE_TIMEOUT：tunnel 兩個方向都沒有資料多少秒後關閉 (預設 0，不關閉)
+inline std::chrono::seconds tunnel_idle_timeout() {
+    static const std::chrono::seconds timeout = []() {
+        const char *value = std::getenv("TUNNEL_IDLE_TIMEOUT");
+        return std::chrono::seconds(value ? std::strtoul(value, nullptr, 10) : 0);
+    }();
+    return timeout;
+}
+
+/**
+ * @class pipe_flow
+ * @brief 單一方向的多重緩衝狀態。
+ *
+ * 讀取不必等前一次寫入完成：讀到的 chunk 放進環狀佇列，寫入端一次把
+ * 佇列中所有 chunk 以 gathered write 送出，排隊量以 MAX_QUEUED 為上限。
+ * 讀取填滿 buffer 時下一個 buffer 加倍，連續小讀取時減半，
+ * 大小介於 BUF_SIZE 與 MAX_BUF_SIZE 之間；slot 被重用時才調整大小。
+ *
+ * buffer 從所在線程的 frame_pool 取得，只在有資料時持有：buffer 維持最小大小時，
+ * 讀取沒有填滿 buffer (來源暫時讀空) 就進入等待模式，呼叫端先等待可讀再取 buffer 讀取，
+ * 佇列寫完後未使用的 buffer 立即歸還，閒置的方向不佔用任何 buffer。
+ * buffer 已成長的大量傳輸在讀空之後先以非阻塞讀取探測一次，仍有資料就直接讀入，
+ * 沒有資料 (來源閒置) 才歸還 buffer 進入等待，因此大量傳輸後閒置的方向同樣不佔用 buffer。
+ *
+ * 讀取 handler 與寫入 handler 分別在兩端 socket 的線程上執行，
+ * 因此狀態以 mutex 保護 (只在更新索引時短暫持有)。
+ */
+class pipe_flow {
+  public:
+    explicit pipe_flow(direction_metrics &metrics) : metrics_(metrics) {
+        gather_.fill(const_buffer());
+    }
+
+    pipe_flow(const pipe_flow &) = delete;
+    pipe_flow &operator=(const pipe_flow &) = delete;
+
+    ~pipe_flow() {
+        for (auto &slot : slots_) {
+            release(slot);
+        }
+    }
+
+    // 開始下一個讀取；正在讀、佇列已滿或已結束時回傳 false。
+    // can_wait 且處於等待模式時 target 為空 buffer，呼叫端須先等待可讀 (streaming() 時先探測一次)
+    // 再以 fill() 取得 buffer，沒有讀到資料時以 unfill() 歸還。
+    bool begin_read(mutable_buffer &target, bool can_wait) {
+        if (reading_ || eof_ || queued_ == PIPE_SLOTS || queued_bytes_ >= MAX_QUEUED) {
+            return false;
+        }
+
+        reading_ = true;
+
+        if (can_wait && waiting_) {
+            trim();
+            target = mutable_buffer();
+        } else {
+            target = fill();
+        }
+
+        return true;
+    }
+
+    // 為進行中的讀取取得 buffer
+    mutable_buffer fill() {
+        auto &slot = slots_[(head_ + queued_) % PIPE_SLOTS];
+
+        if (slot.capacity != size_) {
+            release(slot);
+            slot.data = static_cast<char *>(frame_pool::allocate(size_));
+            slot.capacity = size_;
+        }
+
+        filling_ = true;
+        return buffer(slot.data, slot.capacity);
+    }
+
+    void unfill() {
+        filling_ = false;
+        trim();
+    }
+
+    void end_read(size_t n) {
+        auto &slot = slots_[(head_ + queued_) % PIPE_SLOTS];
+        reading_ = false;
+        filling_ = false;
+        waiting_ = n < slot.capacity;
+        slot.length = n;
+        ++queued_;
+        queued_bytes_ += n;
+        adapt(n, slot.capacity);
+        count(n);
+    }
+
+    void count(size_t n) {
+        metrics_.bytes.add(n);
+        metrics_.chunks.add();
+        active_.store(true, std::memory_order_relaxed);
+    }
+
+    // 上次呼叫之後是否轉送過資料
+    bool take_active() {
+        return active_.exchange(false, std::memory_order_relaxed);
+    }
+
+    // 讀到 EOF 或錯誤；回傳 true 表示已無待寫資料，可以直接關閉
+    bool end_read_failed() {
+        reading_ = false;
+        filling_ = false;
+        eof_ = true;
+        return !writing_ && queued_ == 0;
+    }
+
+    // 把佇列中的 chunk 收集成 gathered write；正在寫或沒有資料時回傳 false
+    bool begin_write() {
+        if (writing_ || queued_ == 0) {
+            return false;
+        }
+
+        writing_ = true;
+        writing_count_ = queued_;
+
+        for (size_t i = 0; i < PIPE_SLOTS; ++i) {
+            auto &slot = slots_[(head_ + i) % PIPE_SLOTS];
+            gather_[i] = i < writing_count_ ? buffer(slot.data, slot.length) : const_buffer();
+        }
+
+        return true;
+    }
+
+    // 寫入完成；回傳 true 表示讀端已結束且資料已全部送出
+    bool end_write() {
+        for (size_t i = 0; i < writing_count_; ++i) {
+            queued_bytes_ -= slots_[(head_ + i) % PIPE_SLOTS].length;
+        }
+
+        head_ = (head_ + writing_count_) % PIPE_SLOTS;
+        queued_ -= writing_count_;
+        writing_count_ = 0;
+        writing_ = false;
+
+        if (waiting_) {
+            trim();
+        }
+
+        return eof_ && queued_ == 0;
+    }
+
+    // 固定長度的 buffer sequence (未使用的為空 buffer)，複製時不需配置記憶體
+    const std::array<const_buffer, PIPE_SLOTS> &gather() const {
+        return gather_;
+    }
+
+    // buffer 已成長：可能仍在大量傳輸中，等待之前先探測一次，不必多等一次可讀通知
+    bool streaming() const {
+        return size_ > BUF_SIZE;
+    }
+
+    std::mutex mutex;
+
+  private:
+    struct slot {
+        char *data = nullptr;
+        size_t capacity = 0;
+        size_t length = 0;
+    };
+
+    void adapt(size_t n, size_t capacity) {
+        if (n == capacity) {
+            size_ = std::min(size_ * 2, MAX_BUF_SIZE);
+            small_reads_ = 0;
+        } else if (n <= capacity / 4 && ++small_reads_ >= 4) {
+            size_ = std::max(size_ / 2, BUF_SIZE);
+            small_reads_ = 0;
+        }
+    }
+
+    // 歸還不在佇列中、也沒有在讀取的 buffer
+    void trim() {
+        for (size_t i = queued_; i < PIPE_SLOTS; ++i) {
+            if (i > queued_ || !filling_) {
+                release(slots_[(head_ + i) % PIPE_SLOTS]);
+            }
+        }
+    }
+
+    static void release(slot &slot) {
+        if (slot.data) {
+            frame_pool::deallocate(slot.data, slot.capacity);
+            slot.data = nullptr;
+            slot.capacity = 0;
+        }
+    }
+
+    direction_metrics &metrics_;
+    std::array<slot, PIPE_SLOTS> slots_;
+    std::array<const_buffer, PIPE_SLOTS> gather_;
+    size_t size_ = BUF_SIZE;
+    size_t head_ = 0;          // 最舊的一個已讀入 chunk
+    size_t queued_ = 0;        // 已讀入 (含寫出中) 的 chunk 數
+    size_t writing_count_ = 0; // 目前 gathered write 中的 chunk 數
+    size_t queued_bytes_ = 0;
+    size_t small_reads_ = 0;
+    bool reading_ = false;
+    bool filling_ = false;     // 讀取中的 slot 持有 buffer
+    bool waiting_ = true;      // 上次讀取沒有填滿 buffer (或還沒讀過)，下次先等待可讀
+    bool writing_ = false;
+    bool eof_ = false;
+    std::atomic<bool> active_{false};
+};
 
 /**
- * @class depipe
- * @brief 使用 Strand-Safe Sockets (ssocket) 在兩個端點之間異步傳輸數據。
+ * @class basic_depipe
+ * @brief 使用 ssocket 在兩個端點之間異步傳輸數據。
+ *
+ * forward 和 backward 兩個管道各自推進，handler 在兩端 socket 所屬 shard 的線程上執行，
+ * 兩端在不同 shard 時可以完全並行；每個讀取與寫入都在它的 stream 所屬的線程上開始
+ * (另一端的 handler 以 dispatch 轉過去)。
  *
- * 每個 ssocket 內部都有自己的 Strand，因此 forward 和 backward 兩個管道
- * 可以完全並行執行，解決了原始設計中的單一 Strand 瓶頸。
+ * Source / Sink 只需提供 async_read_some、async_write、close 與 get_executor
+ * (例如 ssocket 或 mux.hpp 中的 mux_channel)。
+ *
+ * 設定 tunnel_shaper 後每次讀取量受 token 與 weight 限制 (forward 方向計入 upload)，
+ * 並且不使用 splice 與 uring 引擎。
+ *
+ * 設定 TUNNEL_IDLE_TIMEOUT 時以 src 所屬 io_context 的 timer_wheel 每隔一個 timeout 檢查一次，
+ * 這段期間兩個方向都沒有資料就關閉，因此閒置的 tunnel 在 1 到 2 個 timeout 之間被關閉。
+ *
+ * 壽命以嵌入的引用計數管理 (以 make_depipe 建立)，每個進行中的操作持有一個 intrusive_ptr；
+ * 沒有 shared_ptr 的 control block 與 weak_ptr，閒置時只剩物件本身與兩個等待中的 op。
  */
-class depipe : public std::enable_shared_from_this<depipe> {
+template <typename Source, typename Sink>
+class basic_depipe
+    : public boost::intrusive_ref_counter<basic_depipe<Source, Sink>, boost::thread_safe_counter> {
   public:
-    // 構造函數：接受兩個已建立的 tcp::socket，並將它們移動到 ssocket 成員中。
-    // ssocket 的 Move 構造函數會自動為每個 socket 創建一個專屬的 Strand。
-    depipe(tcp::socket _src, tcp::socket _dest)
-        : src(std::move(_src)), dest(std::move(_dest)) {
+    // 構造函數：接受兩個已建立的端點 (例如 tcp::socket)，並將它們移動到成員中。
+    template <typename S, typename D>
+    basic_depipe(S &&_src, D &&_dest)
+        : src(std::forward<S>(_src)), dest(std::forward<D>(_dest)),
+          cross_shard(&src.get_executor().context() != &dest.get_executor().context()),
+          forward_flow(upstream_metrics()), backward_flow(downstream_metrics()),
+          idle_timer([this]() {
+        check_idle();
+    }) {
     }
 
     void start() {
-        // 啟動兩個獨立的管道。它們在 ssocket 內部 Strand 的保護下並行運行。
+        if (tunnel_idle_timeout().count() > 0) {
+            watch_idle();
+        }
+
+        // 兩端都是真正的 socket 時才能使用 splice 零拷貝路徑
+        if constexpr (std::is_same<Source, ssocket>::value && std::is_same<Sink, ssocket>::value) {
+            if (!shaper && pipe_engine() == PipeEngine::SPLICE && forward_pipe.open()
+                    && backward_pipe.open()) {
+                splice_forward();
+                splice_backward();
+                return;
+            }
+
+#ifdef HAVE_IO_URING
+
+            if (!shaper && pipe_engine() == PipeEngine::URING) {
+                start_uring();
+                return;
+            }
+
+#endif
+        }
+
+        // 啟動兩個獨立的管道
         pipe_forward();
         pipe_backward();
     }
 
+    // token 隨 depipe 存活 (例如 proxy_server 中 port 的 active session 計數)
+    void track(std::shared_ptr<void> token) {
+        tracked = std::move(token);
+    }
+
+    // 須在 start 之前設定；nullptr 表示不整形
+    void shape(std::shared_ptr<tunnel_shaper> _shaper) {
+        shaper = std::move(_shaper);
+    }
+
+    // 須在 start 之前設定：以這個 session ID 記錄兩個方向的第一個 chunk 與關閉 (見 trace.hpp)
+    void trace(uint64_t id) {
+        trace_id = id;
+    }
+
   private:
-    // *** 核心變動：使用 ssocket 替代 tcp::socket。Strand 管理已內建於 ssocket 中。 ***
-    ssocket src;
-    ssocket dest;
-    // io_context::strand strand; // <-- 不再需要！
+    Source src;
+    Sink dest;
+    // 兩端在不同的 shard 上 (例如 mux tunnel 的 client 與 mux_channel)
+    bool cross_shard;
+
+    boost::intrusive_ptr<basic_depipe> ref() {
+        return this;
+    }
+
+    // 在 stream 所屬的線程上執行：ssocket 沒有 strand，對它的操作只能在它的 shard 上開始。
+    // 兩端在同一個 shard 時直接執行
+    template <typename Stream, typename Function>
+    void run_on(Stream &stream, Function function) {
+        if (cross_shard) {
+            dispatch(stream.get_executor(), make_pooled_handler(std::move(function)));
+        } else {
+            function();
+        }
+    }
+
+    // 每個方向的佇列狀態；buffer 與 handler 記憶體來自線程的 frame_pool，
+    // 大小穩定後轉送每個 chunk 都不需要 heap 配置。
+    pipe_flow forward_flow;
+    pipe_flow backward_flow;
+
+    // splice 引擎使用的 kernel pipe，copy 引擎下不會開啟
+    splice_pipe forward_pipe;
+    splice_pipe backward_pipe;
+
+    std::shared_ptr<void> tracked;
+    std::shared_ptr<tunnel_shaper> shaper;
+
+    // 追蹤中的 session；兩個 first_* 各自只在該方向讀取端的線程上存取
+    uint64_t trace_id = 0;
+    bool first_forward = true;
+    bool first_backward = true;
+
+    // 閒置檢查：timer 掛在 wheel 上時以 idle_self 保持 depipe 存活，只在 wheel 的線程上存取
+    wheel_timer idle_timer;
+    boost::intrusive_ptr<basic_depipe> idle_self;
+    std::atomic<bool> closed{false};
 
     // A shared helper for closing both sockets
     void close_sockets() {
         // 呼叫 ssocket 內的安全關閉方法
         src.close();
         dest.close();
+
+        bool first = !closed.exchange(true);
+
+        if (first && trace_id != 0) {
+            trace_event("tunnel_close", trace_id);
+        }
+
+        // 可能在另一端的線程上被呼叫，取消交給 wheel 的線程
+        if (first && tunnel_idle_timeout().count() > 0) {
+            post(wheel_context(), [this, self = ref()]() {
+                idle_timer.cancel();
+                idle_self.reset();
+            });
+        }
     }
 
-    // Data flow from src to dest
-    void pipe_forward() {
-        auto self(shared_from_this());
-        auto buffer_ptr = std::make_shared<std::array<char, BUF_SIZE>>();
-
-        // 讀取操作：調用 ssocket::async_read_some。
-        // 其 Completion Handler 會自動在 src.ssocket 內部的 Strand 上執行。
-        src.async_read_some(buffer(*buffer_ptr),
-        [this, self, buffer_ptr](const boost::system::error_code & ec_read, size_t bytes_read) {
-            // 檢查讀取錯誤或 EOF
-            if (ec_read == boost::asio::error::eof || ec_read) {
+    io_context &wheel_context() {
+        return static_cast<io_context &>(src.get_executor().context());
+    }
+
+    void watch_idle() {
+        dispatch(wheel_context(), [this, self = ref()]() {
+            if (!closed) {
+                idle_self = self;
+                idle_timer.arm(use_service<timer_wheel>(wheel_context()), tunnel_idle_timeout());
+            }
+        });
+    }
+
+    void check_idle() {
+        // 兩個方向都要清除，不能短路
+        bool forward = forward_flow.take_active();
+        bool backward = backward_flow.take_active();
+
+        if (closed) {
+            idle_self.reset();
+        } else if (forward || backward) {
+            idle_timer.arm(use_service<timer_wheel>(wheel_context()), tunnel_idle_timeout());
+        } else {
+            idle_closes().add();
+            // close_sockets 排入的取消會釋放 idle_self
+            close_sockets();
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    // ring 只能在所屬 io_context 的線程上使用，start 可能在其他 shard 上被呼叫。
+    // 進行中的 uring_tunnel 持有一個引用，在 uring_closed 中歸還
+    void start_uring() {
+        auto self = ref();
+        auto &context = static_cast<io_context &>(src.get_executor().context());
+        dispatch(context, [this, self, &context]() {
+            intrusive_ptr_add_ref(this);
+
+            if (uring_tunnel<basic_depipe>::start(use_service<uring_service>(context),
+                                                  src.native_handle(), dest.native_handle(),
+                                                  *this)) {
+                return;
+            }
+
+            // kernel 不支援或 fixed file 用完
+            intrusive_ptr_release(this);
+            pipe_forward();
+            pipe_backward();
+        });
+    }
+
+    friend class uring_tunnel<basic_depipe>;
+
+    void uring_transferred(bool forward, size_t n) {
+        (forward ? forward_flow : backward_flow).count(n);
+    }
+
+    void uring_closed() {
+        boost::intrusive_ptr<basic_depipe> self(this, false);
+        close_sockets();
+    }
+#endif
+
+    void splice_forward() {
+        splice_pump(src, dest, forward_pipe, forward_flow, true);
+    }
+
+    void splice_backward() {
+        splice_pump(dest, src, backward_pipe, backward_flow, false);
+    }
+
+    // Zero-copy data flow: from -> pipe -> to，以 async_wait 等待 reactor 的就緒通知
+    template <typename From, typename To>
+    void splice_pump(From &from, To &to, splice_pipe &pipe, pipe_flow &flow, bool forward) {
+#ifdef __linux__
+        auto self(ref());
+        auto resume = make_pooled_handler(
+        [this, self, forward](const boost::system::error_code & ec) {
+            if (ec) {
                 close_sockets();
                 return;
             }
 
-            // 寫入操作：調用 dest.ssocket::async_write。
-            // 由於此 Handler (read_handler) 在 src.strand 上執行，
-            // 而 Write Handler (write_handler) 將在 dest.strand 上執行，
-            // 這是兩個獨立的 Strand，不會互相等待。
-            dest.async_write(buffer(*buffer_ptr, bytes_read),
-            [this, self, buffer_ptr](const boost::system::error_code & ec_write, size_t) {
-                // 檢查寫入錯誤
-                if (ec_write) {
+            forward ? splice_forward() : splice_backward();
+        });
+
+        for (int round = 0; round < SPLICE_ROUNDS; ++round) {
+            if (pipe.pending == 0) {
+                ssize_t n = ::splice(from.native_handle(), nullptr, pipe.write_end(), nullptr,
+                                     SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+                if (n == 0) {
                     close_sockets();
                     return;
                 }
 
-                // 繼續管道傳輸 (下一輪 Read 將重新回到 src.strand 上)
-                pipe_forward();
-            });
-        });
+                if (n < 0) {
+                    if (errno == EAGAIN) {
+                        from.async_wait(tcp::socket::wait_read, resume);
+                    } else if (errno == EINVAL && !pipe.used) {
+                        // 此 fd 不支援 splice，這個方向改走 copy
+                        forward ? pipe_forward() : pipe_backward();
+                    } else {
+                        close_sockets();
+                    }
+
+                    return;
+                }
+
+                pipe.pending = static_cast<size_t>(n);
+                pipe.used = true;
+                flow.count(pipe.pending);
+            }
+
+            ssize_t n = ::splice(pipe.read_end(), nullptr, to.native_handle(), nullptr,
+                                 pipe.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    to.async_wait(tcp::socket::wait_write, resume);
+                } else {
+                    close_sockets();
+                }
+
+                return;
+            }
+
+            pipe.pending -= static_cast<size_t>(n);
+        }
+
+        // 讓出線程，下一輪重新經過 reactor
+        if (pipe.pending == 0) {
+            from.async_wait(tcp::socket::wait_read, resume);
+        } else {
+            to.async_wait(tcp::socket::wait_write, resume);
+        }
+
+#endif
+    }
+
+    // Data flow from src to dest
+    void pipe_forward() {
+        copy_read(src, dest, forward_flow);
     }
 
     // Data flow from dest to src
     void pipe_backward() {
-        auto self(shared_from_this());
-        auto buffer_ptr = std::make_shared<std::array<char, BUF_SIZE>>();
-
-        // 讀取操作：Completion Handler 將在 dest.ssocket 內部的 Strand 上執行。
-        dest.async_read_some(buffer(*buffer_ptr),
-        [this, self, buffer_ptr](const boost::system::error_code & ec_read, size_t bytes_read) {
-            // 檢查讀取錯誤或 EOF
-            if (ec_read == boost::asio::error::eof || ec_read) {
-                close_sockets();
+        copy_read(dest, src, backward_flow);
+    }
+
+    // 讀取不等待寫入完成：只要佇列未滿就繼續讀，與寫入重疊進行
+    template <typename From, typename To>
+    void copy_read(From &from, To &to, pipe_flow &flow) {
+        mutable_buffer target;
+        bool probe;
+        {
+            std::lock_guard<std::mutex> lock(flow.mutex);
+
+            // 來源是 socket 時閒置期間不持有 buffer，整形時每次讀取量另有限制，不進入等待模式
+            if (!flow.begin_read(target, std::is_same<From, ssocket>::value && !shaper)) {
                 return;
             }
 
-            // 寫入操作：Completion Handler 將在 src.ssocket 內部的 Strand 上執行。
-            // 這同樣允許與 pipe_forward 並行。
-            src.async_write(buffer(*buffer_ptr, bytes_read),
-            [this, self, buffer_ptr](const boost::system::error_code & ec_write, size_t) {
-                // 檢查寫入錯誤
-                if (ec_write) {
-                    close_sockets();
-                    return;
+            probe = flow.streaming();
+        }
+
+        if constexpr (std::is_same<From, ssocket>::value) {
+            if (target.size() == 0) {
+                // 大量傳輸中資料通常已經到達，先讀一次；讀不到才等待
+                if (probe) {
+                    read_ready(from, to, flow, boost::system::error_code());
+                } else {
+                    wait_readable(from, to, flow);
                 }
 
-                // 繼續管道傳輸 (下一輪 Read 將重新回到 dest.strand 上)
-                pipe_backward();
-            });
+                return;
+            }
+        }
+
+        copy_read_into(from, to, flow, target);
+    }
+
+    // 等待模式：可讀之後才取得 buffer，以非阻塞讀取取出已到達的資料。
+    // 閒置時只剩這個 op，handler 只捕獲 self 與方向，讓 op 落在 frame_pool 較小的一級。
+    template <typename To>
+    void wait_readable(ssocket &from, To &, pipe_flow &flow) {
+        from.async_wait(tcp::socket::wait_read, make_pooled_handler(
+        [self = ref(), forward = &flow == &forward_flow](const boost::system::error_code & ec) {
+            if (forward) {
+                if constexpr (std::is_same<Source, ssocket>::value) {
+                    self->read_ready(self->src, self->dest, self->forward_flow, ec);
+                }
+            } else if constexpr (std::is_same<Sink, ssocket>::value) {
+                self->read_ready(self->dest, self->src, self->backward_flow, ec);
+            }
+        }));
+    }
+
+    template <typename To>
+    void read_ready(ssocket &from, To &to, pipe_flow &flow, const boost::system::error_code &ec) {
+        if (ec) {
+            end_copy_read(from, to, flow, ec, 0);
+            return;
+        }
+
+        mutable_buffer target;
+        {
+            std::lock_guard<std::mutex> lock(flow.mutex);
+            target = flow.fill();
+        }
+
+        boost::system::error_code ec_read;
+        size_t bytes_read = from.read_some(target, ec_read);
+
+        if (ec_read == error::would_block) {
+            {
+                std::lock_guard<std::mutex> lock(flow.mutex);
+                flow.unfill();
+            }
+
+            wait_readable(from, to, flow);
+            return;
+        }
+
+        end_copy_read(from, to, flow, ec_read, bytes_read);
+    }
+
+    template <typename From, typename To>
+    void copy_read_into(From &from, To &to, pipe_flow &flow, mutable_buffer target) {
+        auto self(ref());
+        bool forward = &flow == &forward_flow;
+
+        if (shaper) {
+            size_t allowance = shaper->allowance(forward);
+
+            if (allowance == 0) {
+                // token 用完：保持讀取中的狀態 (不會有第二個讀取開始)，補充後以同一個 buffer 重試
+                shaper->wait(forward, [this, self, &from, &to, &flow, target]() {
+                    post(from.get_executor(), [this, self, &from, &to, &flow, target]() {
+                        copy_read_into(from, to, flow, target);
+                    });
+                });
+                return;
+            }
+
+            target = buffer(target.data(), std::min(target.size(), allowance));
+        }
+
+        // 讀取操作：Completion Handler 在 from 所屬的線程上執行。
+        from.async_read_some(target, make_pooled_handler(
+        [this, self, &from, &to, &flow](const boost::system::error_code & ec_read,
+        size_t bytes_read) {
+            end_copy_read(from, to, flow, ec_read, bytes_read);
+        }));
+    }
+
+    template <typename From, typename To>
+    void end_copy_read(From &from, To &to, pipe_flow &flow,
+                       const boost::system::error_code &ec_read, size_t bytes_read) {
+        // 檢查讀取錯誤或 EOF：已讀入的資料仍要先寫完
+        if (ec_read) {
+            std::unique_lock<std::mutex> lock(flow.mutex);
+
+            if (flow.end_read_failed()) {
+                lock.unlock();
+                close_sockets();
+            }
+
+            return;
+        }
+
+        if (shaper) {
+            shaper->consume(&flow == &forward_flow, bytes_read);
+        }
+
+        if (trace_id != 0) {
+            trace_first_chunk(&flow == &forward_flow);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(flow.mutex);
+            flow.end_read(bytes_read);
+        }
+
+        run_on(to, [this, self = ref(), &from, &to, &flow]() {
+            copy_write(from, to, flow);
         });
+        copy_read(from, to, flow);
+    }
+
+    void trace_first_chunk(bool forward) {
+        bool &first = forward ? first_forward : first_backward;
+
+        if (first) {
+            first = false;
+            trace_event(forward ? "first_chunk_upstream" : "first_chunk_downstream", trace_id);
+        }
+    }
+
+    // 一次把佇列中所有 chunk 寫出 (gathered write)
+    template <typename From, typename To>
+    void copy_write(From &from, To &to, pipe_flow &flow) {
+        auto self(ref());
+        {
+            std::lock_guard<std::mutex> lock(flow.mutex);
+
+            if (!flow.begin_write()) {
+                return;
+            }
+        }
+
+        // 寫入操作：Completion Handler 在 to 所屬的線程上執行，與讀取端互不等待。
+        to.async_write(flow.gather(), make_pooled_handler(
+        [this, self, &from, &to, &flow](const boost::system::error_code & ec_write, size_t) {
+            // 檢查寫入錯誤
+            if (ec_write) {
+                close_sockets();
+                return;
+            }
+
+            bool drained;
+            {
+                std::lock_guard<std::mutex> lock(flow.mutex);
+                drained = flow.end_write();
+            }
+
+            if (drained) {
+                close_sockets();
+                return;
+            }
+
+            // 繼續管道傳輸：寫出佇列中剩下的 chunk，並在讀取端的線程上恢復因佇列滿而暫停的讀取
+            copy_write(from, to, flow);
+            run_on(from, [this, self, &from, &to, &flow]() {
+                copy_read(from, to, flow);
+            });
+        }));
     }
 };
+
+using depipe = basic_depipe<ssocket, ssocket>;
+
+template <typename Source = ssocket, typename Sink = ssocket, typename S, typename D>
+inline boost::intrusive_ptr<basic_depipe<Source, Sink>> make_depipe(S &&src, D &&dest) {
+    return new basic_depipe<Source, Sink>(std::forward<S>(src), std::forward<D>(dest));
+}
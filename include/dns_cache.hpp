@@ -0,0 +1,307 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+/**
+ * @file dns_cache.hpp
+ * @brief expose 連線路徑上的名稱解析快取，以及 Happy Eyeballs (RFC 8305) 風格的連線。
+ *
+ * getaddrinfo 不提供紀錄的 TTL，快取時間由環境變數決定：
+ *   - DNS_TTL (秒，預設 30)：解析結果視為新鮮的時間；剩下 1/4 時在背景重新解析，
+ *     過期後最多再沿用一個 TTL (重新解析失敗時也是)，連線路徑不會等待 resolver。
+ *   - DNS_NEGATIVE_TTL (秒，預設 5)：解析失敗的結果快取多久，避免對不存在的名稱反覆查詢。
+ * 同一個名稱同時只有一個解析在進行，其餘請求等待同一個結果。
+ */
+
+inline std::chrono::seconds dns_ttl_from(const char *name, long fallback) {
+    const char *value = std::getenv(name);
+    long seconds = value ? std::strtol(value, nullptr, 10) : fallback;
+    return std::chrono::seconds(std::max(seconds, 0L));
+}
+
+/**
+ * @class dns_cache
+ * @brief 以 host:service 為 key、所有線程共用的解析結果快取。
+ */
+class dns_cache {
+  public:
+    using results = std::shared_ptr<const std::vector<tcp::endpoint>>;
+    using handler = std::function<void(const boost::system::error_code &, results)>;
+
+    static dns_cache &instance() {
+        static dns_cache cache;
+        return cache;
+    }
+
+    // 結果一律經 post 在 executor 上交給 handler
+    void async_resolve(const any_io_executor &executor, const std::string &host,
+                       const std::string &service, handler callback) {
+        std::string key = host + ":" + service;
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        entry &cached = entries_[key];
+
+        if (cached.usable(now)) {
+            if (!cached.refreshing && now > cached.refresh_at) {
+                cached.refreshing = true;
+                refresh(executor, key, host, service);
+            }
+
+            auto error = cached.error;
+            auto endpoints = cached.endpoints;
+            lock.unlock();
+            (error ? negative_hits_ : hits_).add();
+            post(executor, [callback = std::move(callback), error, endpoints]() {
+                callback(error, endpoints);
+            });
+            return;
+        }
+
+        misses_.add();
+        cached.waiters.emplace_back(executor, std::move(callback));
+
+        if (!cached.refreshing) {
+            cached.refreshing = true;
+            refresh(executor, key, host, service);
+        }
+    }
+
+  private:
+    struct entry {
+        results endpoints;
+        boost::system::error_code error;
+        std::chrono::steady_clock::time_point refresh_at;
+        std::chrono::steady_clock::time_point expires;
+        bool refreshing = false;
+        std::vector<std::pair<any_io_executor, handler>> waiters;
+
+        bool usable(std::chrono::steady_clock::time_point now) const {
+            return (endpoints || error) && now < expires;
+        }
+    };
+
+    dns_cache()
+        : ttl_(dns_ttl_from("DNS_TTL", 30)),
+          negative_ttl_(dns_ttl_from("DNS_NEGATIVE_TTL", 5)),
+          hits_("expose_dns_lookups_total", "Name lookups on the connect path.", "result=\"hit\""),
+          negative_hits_("expose_dns_lookups_total", "Name lookups on the connect path.",
+                         "result=\"negative\""),
+          misses_("expose_dns_lookups_total", "Name lookups on the connect path.",
+                  "result=\"miss\"") {}
+
+    // 呼叫時持有 mutex_；resolver 綁在觸發這次解析的 executor 上
+    void refresh(const any_io_executor &executor, const std::string &key, const std::string &host,
+                 const std::string &service) {
+        auto resolver = std::make_shared<tcp::resolver>(executor);
+        resolver->async_resolve(host, service,
+        [this, resolver, key](const boost::system::error_code & ec,
+        tcp::resolver::results_type found) {
+            complete(key, ec, found);
+        });
+    }
+
+    void complete(const std::string &key, const boost::system::error_code &ec,
+                  const tcp::resolver::results_type &found) {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::pair<any_io_executor, handler>> waiters;
+        boost::system::error_code error;
+        results endpoints;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entry &cached = entries_[key];
+            cached.refreshing = false;
+
+            if (!ec && !found.empty()) {
+                cached.endpoints = interleave(found);
+                cached.error = {};
+                cached.refresh_at = now + ttl_ * 3 / 4;
+                cached.expires = now + ttl_ * 2;
+            } else if (!cached.endpoints || now >= cached.expires) {
+                // 沒有可沿用的舊結果：負快取
+                cached.endpoints = nullptr;
+                cached.error = ec ? ec : error::host_not_found;
+                cached.refresh_at = cached.expires = now + negative_ttl_;
+            } else {
+                // 重新解析失敗，沿用舊結果到過期為止，稍後再試
+                cached.refresh_at = now + negative_ttl_;
+            }
+
+            error = cached.error;
+            endpoints = cached.endpoints;
+            waiters.swap(cached.waiters);
+        }
+
+        for (auto &waiter : waiters) {
+            post(waiter.first, [callback = std::move(waiter.second), error, endpoints]() {
+                callback(error, endpoints);
+            });
+        }
+    }
+
+    // 依 RFC 8305 交錯排列兩種 address family，以第一個結果的 family 開頭
+    static results interleave(const tcp::resolver::results_type &found) {
+        std::vector<tcp::endpoint> first, second;
+        bool v6_first = found.begin()->endpoint().address().is_v6();
+
+        for (auto &result : found) {
+            auto &family = result.endpoint().address().is_v6() == v6_first ? first : second;
+            family.push_back(result.endpoint());
+        }
+
+        auto ordered = std::make_shared<std::vector<tcp::endpoint>>();
+
+        for (size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+            if (i < first.size()) {
+                ordered->push_back(first[i]);
+            }
+
+            if (i < second.size()) {
+                ordered->push_back(second[i]);
+            }
+        }
+
+        return ordered;
+    }
+
+    std::chrono::seconds ttl_;
+    std::chrono::seconds negative_ttl_;
+    counter hits_;
+    counter negative_hits_;
+    counter misses_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, entry> entries_;
+};
+
+using ConnectHandler =
+    std::function<void(const boost::system::error_code &, const tcp::endpoint)>;
+// 每個嘗試的 socket 開啟後、connect 之前呼叫 (例如套用 socket_profile)
+using SocketSetup = std::function<void(tcp::socket &)>;
+
+/**
+ * @class happy_eyeballs
+ * @brief 依序嘗試解析出的位址：前一個在 CONNECTION_ATTEMPT_DELAY 內沒有結果就同時開始下一個，
+ * 失敗則立即開始下一個；第一個成功的連線移入呼叫端的 socket，其餘關閉。
+ */
+class happy_eyeballs : public std::enable_shared_from_this<happy_eyeballs> {
+  public:
+    static constexpr std::chrono::milliseconds CONNECTION_ATTEMPT_DELAY{250};
+
+    happy_eyeballs(tcp::socket &socket, dns_cache::results endpoints, ConnectHandler handler,
+                   SocketSetup setup = nullptr)
+        : socket_(socket), endpoints_(std::move(endpoints)), handler_(std::move(handler)),
+          setup_(std::move(setup)), timer_(socket.get_executor()) {}
+
+    void start() {
+        do_attempt();
+    }
+
+  private:
+    void do_attempt() {
+        auto self(shared_from_this());
+        size_t index = next_++;
+        auto attempt = std::make_shared<tcp::socket>(socket_.get_executor());
+        attempts_.push_back(attempt);
+        ++pending_;
+
+        if (setup_) {
+            boost::system::error_code ignored;
+            attempt->open((*endpoints_)[index].protocol(), ignored);
+            setup_(*attempt);
+        }
+
+        attempt->async_connect((*endpoints_)[index],
+        [this, self, attempt, index](const boost::system::error_code & ec) {
+            --pending_;
+
+            if (done_) {
+                return;
+            }
+
+            if (!ec) {
+                finish({}, index, attempt);
+                return;
+            }
+
+            last_error_ = ec;
+
+            if (next_ < endpoints_->size()) {
+                timer_.cancel();
+                do_attempt();
+            } else if (pending_ == 0) {
+                finish(last_error_, 0, nullptr);
+            }
+        });
+
+        if (next_ < endpoints_->size()) {
+            timer_.expires_after(CONNECTION_ATTEMPT_DELAY);
+            timer_.async_wait([this, self](const boost::system::error_code & ec) {
+                if (!ec && !done_) {
+                    do_attempt();
+                }
+            });
+        }
+    }
+
+    void finish(const boost::system::error_code &ec, size_t index,
+                const std::shared_ptr<tcp::socket> &winner) {
+        done_ = true;
+        timer_.cancel();
+
+        for (auto &attempt : attempts_) {
+            if (attempt != winner) {
+                boost::system::error_code ignored;
+                attempt->close(ignored);
+            }
+        }
+
+        if (winner) {
+            socket_ = std::move(*winner);
+            handler_(ec, (*endpoints_)[index]);
+        } else {
+            handler_(ec, tcp::endpoint{});
+        }
+    }
+
+    tcp::socket &socket_;
+    dns_cache::results endpoints_;
+    ConnectHandler handler_;
+    SocketSetup setup_;
+    boost::asio::steady_timer timer_;
+    std::vector<std::shared_ptr<tcp::socket>> attempts_;
+    size_t next_ = 0;
+    size_t pending_ = 0;
+    bool done_ = false;
+    boost::system::error_code last_error_;
+};
+
+// 以快取的解析結果連線；socket 須在呼叫端存活到 handler 執行
+inline void async_resolve_and_connect(tcp::socket &socket, const std::string &host,
+                                      const std::string &service, ConnectHandler handler,
+                                      SocketSetup setup = nullptr) {
+    dns_cache::instance().async_resolve(socket.get_executor(), host, service,
+    [&socket, handler = std::move(handler), setup = std::move(setup)](
+    const boost::system::error_code & ec, dns_cache::results endpoints) mutable {
+        if (ec) {
+            handler(ec, tcp::endpoint{});
+            return;
+        }
+
+        std::make_shared<happy_eyeballs>(socket, std::move(endpoints), std::move(handler),
+                                         std::move(setup))->start();
+    });
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @class frame_pool
+ * @brief 每條線程一組、以 2 的冪次分級的 free list。
+ *
+ * depipe 的 asio op 與轉送 buffer、coroutine frame 都從這裡配置：記憶體屬於線程而不是
+ * 連線，閒置的 tunnel 不必各自保留一份，釋放後直接給下一個操作重複使用。
+ *
+ * 區塊在哪條線程釋放就回到哪條線程的 list；每級快取的總量有上限，超過就還給 heap。
+ * thread_local 狀態刻意保持 trivially destructible：shutdown 時其他物件的解構
+ * 仍可能在這條線程上釋放區塊，不能讓 list 先被解構。
+ */
+class frame_pool {
+  public:
+    static void *allocate(size_t size) {
+        size_t index = class_of(size);
+
+        if (index >= CLASSES) {
+            return ::operator new(size);
+        }
+
+        auto &list = lists()[index];
+
+        if (list.head) {
+            node *block = list.head;
+            list.head = block->next;
+            --list.count;
+            return block;
+        }
+
+        return ::operator new(MIN_BLOCK << index);
+    }
+
+    static void deallocate(void *pointer, size_t size) {
+        size_t index = class_of(size);
+
+        if (index >= CLASSES || list_full(index)) {
+            ::operator delete(pointer);
+            return;
+        }
+
+        auto &list = lists()[index];
+        auto *block = static_cast<node *>(pointer);
+        block->next = list.head;
+        list.head = block;
+        ++list.count;
+    }
+
+  private:
+    static constexpr size_t MIN_BLOCK = 64;
+    static constexpr size_t CLASSES = 13;               // 64 B ... 256 KiB (MAX_BUF_SIZE)
+    static constexpr size_t MAX_CACHED = 1024 * 1024;   // 每級最多快取的 bytes
+
+    struct node {
+        node *next;
+    };
+
+    struct free_list {
+        node *head;
+        size_t count;
+    };
+
+    static free_list *lists() {
+        thread_local free_list local[CLASSES] = {};
+        return local;
+    }
+
+    static size_t class_of(size_t size) {
+        size_t index = 0;
+
+        while ((MIN_BLOCK << index) < size) {
+            ++index;
+        }
+
+        return index;
+    }
+
+    static bool list_full(size_t index) {
+        size_t block = MIN_BLOCK << index;
+        return lists()[index].count >= std::max<size_t>(4, MAX_CACHED / block);
+    }
+};
+
+// 將 frame_pool 包裝成 Allocator，供 asio 配置 op 與容器使用
+template <typename T>
+class pool_allocator {
+  public:
+    using value_type = T;
+
+    pool_allocator() noexcept = default;
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U> &) noexcept {}
+
+    T *allocate(size_t n) const {
+        return static_cast<T *>(frame_pool::allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T *pointer, size_t n) const {
+        frame_pool::deallocate(pointer, sizeof(T) * n);
+    }
+
+    bool operator==(const pool_allocator &) const noexcept {
+        return true;
+    }
+
+    bool operator!=(const pool_allocator &) const noexcept {
+        return false;
+    }
+};
+
+/**
+ * @class pooled_handler
+ * @brief 為 completion handler 附上 pool_allocator，讓 asio 從目前線程的 frame_pool 配置 op。
+ *
+ * asio 會在呼叫 handler 之前釋放 op 的記憶體，因此 steady state 下每個操作都是
+ * 從 free list 取出再放回，不經過 heap。
+ */
+template <typename Handler>
+class pooled_handler {
+  public:
+    using allocator_type = pool_allocator<void>;
+
+    explicit pooled_handler(Handler handler) : handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type();
+    }
+
+    template <typename... Args>
+    void operator()(Args &&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+  private:
+    Handler handler_;
+};
+
+template <typename Handler>
+inline pooled_handler<typename std::decay<Handler>::type> make_pooled_handler(Handler &&handler) {
+    return pooled_handler<typename std::decay<Handler>::type>(std::forward<Handler>(handler));
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace boost::asio;
+using ip::tcp;
+
+#ifdef SO_REUSEPORT
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+/**
+ * @class shard_context
+ * @brief 可由 io_pool 先行 shutdown 的 io_context。
+ *
+ * 跨 shard 的物件 (例如 Agent 持有位於各 shard 的 acceptor) 可能由任一 shard 上的
+ * handler 持有；必須先讓所有 shard 都 shutdown (銷毀待執行的 handler)，
+ * 再逐一解構，否則解構中的 handler 會碰到已解構的 shard。
+ */
+class shard_context : public io_context {
+  public:
+    using io_context::io_context;
+
+    void shutdown_services() {
+        shutdown();
+    }
+};
+
+/**
+ * @class io_pool
+ * @brief 每個 CPU 一個 io_context (shard)，各自在一條綁定 CPU 的線程上執行。
+ *
+ * 連線在哪個 shard 上被 accept，之後的 socket、timer 與 handler 都留在同一個 shard，
+ * 不再共用單一 scheduler 的鎖，也避免跨核心的 cache 往返。
+ * 線程數預設為程式可用的 CPU 數 (affinity mask，例如 cpuset 或 taskset 限制後的)，
+ * 可用環境變數 IO_THREADS 覆寫；shard 依序綁定到可用的 CPU。
+ */
+class io_pool {
+  public:
+    explicit io_pool(size_t n = default_size()) {
+        for (size_t i = 0; i < n; ++i) {
+            // concurrency hint 1：每個 io_context 只有一條線程，scheduler 可省去鎖
+            contexts_.push_back(std::make_unique<shard_context>(1));
+        }
+    }
+
+    ~io_pool() {
+        for (auto &context : contexts_) {
+            context->shutdown_services();
+        }
+    }
+
+    io_pool(const io_pool &) = delete;
+    io_pool &operator=(const io_pool &) = delete;
+
+    size_t size() const {
+        return contexts_.size();
+    }
+
+    io_context &get(size_t index) {
+        return *contexts_[index % contexts_.size()];
+    }
+
+    // 不屬於任何已 accept 連線的物件 (例如主動連出的 socket) 以輪詢方式分配 shard
+    io_context &next() {
+        return get(next_++);
+    }
+
+    // 每個 shard 一條線程並綁定到對應 CPU，阻塞到 stop() 為止
+    void run() {
+        std::vector<std::thread> threads;
+
+        for (size_t i = 0; i < contexts_.size(); ++i) {
+            threads.emplace_back([this, i]() {
+                pin(i);
+                auto work = make_work_guard(*contexts_[i]);
+                contexts_[i]->run();
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    void stop() {
+        for (auto &context : contexts_) {
+            context->stop();
+        }
+    }
+
+    static size_t default_size() {
+        if (const char *threads = std::getenv("IO_THREADS")) {
+            try {
+                size_t n = std::stoul(threads);
+
+                if (n > 0) {
+                    return n;
+                }
+            } catch (...) {
+            }
+        }
+
+        return allowed_cpus().size();
+    }
+
+  private:
+    // 程式的 affinity mask 中的 CPU；取不到時為 0 到 hardware_concurrency - 1
+    static const std::vector<int> &allowed_cpus() {
+        static const std::vector<int> cpus = []() {
+            std::vector<int> allowed;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (CPU_ISSET(cpu, &set)) {
+                        allowed.push_back(cpu);
+                    }
+                }
+            }
+
+#endif
+
+            if (allowed.empty()) {
+                unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+
+                for (unsigned cpu = 0; cpu < cpus; ++cpu) {
+                    allowed.push_back(int(cpu));
+                }
+            }
+
+            return allowed;
+        }();
+        return cpus;
+    }
+
+    static void pin(size_t index) {
+#ifdef __linux__
+        const auto &cpus = allowed_cpus();
+        int cpu = cpus[index % cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+        if (error != 0) {
+            std::cerr << "Failed to pin shard " << index << " to CPU " << cpu << ": "
+                      << std::strerror(error) << std::endl;
+        }
+
+#endif
+    }
+
+    std::vector<std::unique_ptr<shard_context>> contexts_;
+    std::atomic<size_t> next_{0};
+};
+
+/**
+ * 在每個 shard 上各開一個綁定同一個 endpoint 的 acceptor (SO_REUSEPORT)，
+ * 由 kernel 把新連線分散到各 shard。不支援 SO_REUSEPORT 的平台只開一個。
+ * bind 失敗時拋出例外。
+ */
+inline std::vector<tcp::acceptor> listen_sharded(io_pool &pool, const tcp::endpoint &endpoint) {
+    std::vector<tcp::acceptor> acceptors;
+#ifdef SO_REUSEPORT
+    size_t count = pool.size();
+#else
+    size_t count = 1;
+#endif
+
+    for (size_t i = 0; i < count; ++i) {
+        tcp::acceptor acceptor(pool.get(i));
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        acceptor.set_option(reuse_port(true));
+#endif
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        acceptors.push_back(std::move(acceptor));
+    }
+
+    return acceptors;
+}
+
+// 把一個沒有進行中操作的 socket 移到另一個 shard，讓連線留在對端所在的核心上
+inline tcp::socket rehome(tcp::socket socket, io_context &context) {
+    if (&socket.get_executor().context() == &context) {
+        return socket;
+    }
+
+    auto protocol = socket.local_endpoint().protocol();
+    tcp::socket moved(context);
+    moved.assign(protocol, socket.release());
+    return moved;
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 每條線程可使用的 metric slot 數 (counter 一個、histogram 為 bucket 數 + 2)
+constexpr size_t MAX_METRIC_SLOTS = 4096;
+
+/**
+ * @class metric_registry
+ * @brief 低開銷的 metric 儲存：每條線程有自己的一組 slot，scrape 時才加總。
+ *
+ * 熱路徑只對本線程的 slot 做 relaxed load/store，不取鎖也不做跨核心的 RMW；
+ * 只有 metric 註冊、線程第一次使用與 scrape 時才會取 mutex。
+ */
+class metric_registry {
+  public:
+    struct block {
+        std::array<std::atomic<uint64_t>, MAX_METRIC_SLOTS> values{};
+    };
+
+    static metric_registry &instance() {
+        static metric_registry registry;
+        return registry;
+    }
+
+    // 本線程的 slot，第一次使用時登記到 registry
+    static block &local() {
+        thread_local block *local_block = instance().attach();
+        return *local_block;
+    }
+
+    static void add(size_t slot, uint64_t n) {
+        auto &value = local().values[slot];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // 同名同 label 的 metric 共用 slot (例如 exposer 重新連線後再次註冊同一個 port)
+    size_t allocate(const std::string &name, const std::string &type, const std::string &help,
+                    const std::string &labels, std::vector<double> bounds = {}) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string key = name + "{" + labels + "}";
+        auto found = slots_.find(key);
+
+        if (found != slots_.end()) {
+            return found->second;
+        }
+
+        size_t count = type == "histogram" ? bounds.size() + 3 : 1;
+
+        // slot 用完時拋出例外 (建立 metric 的註冊隨之失敗)，不讓新 metric 共用 slot 而回報錯誤的數值
+        if (next_ + count > MAX_METRIC_SLOTS) {
+            throw std::length_error("out of metric slots for " + key);
+        }
+
+        size_t base = next_;
+        next_ += count;
+        slots_[key] = base;
+        families_[name].type = type;
+        families_[name].help = help;
+        families_[name].series.push_back({labels, base, std::move(bounds)});
+        return base;
+    }
+
+    // Prometheus text exposition format (version 0.0.4)
+    std::string scrape() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+
+        for (auto &entry : families_) {
+            auto &name = entry.first;
+            auto &family = entry.second;
+            out << "# HELP " << name << " " << family.help << "\n"
+                << "# TYPE " << name << " " << family.type << "\n";
+
+            for (auto &series : family.series) {
+                if (family.type == "histogram") {
+                    write_histogram(out, name, series);
+                } else if (family.type == "gauge") {
+                    out << name << braces(series.labels) << " " << int64_t(sum(series.base))
+                        << "\n";
+                } else {
+                    out << name << braces(series.labels) << " " << sum(series.base) << "\n";
+                }
+            }
+        }
+
+        return out.str();
+    }
+
+  private:
+    struct series_info {
+        std::string labels;
+        size_t base;
+        std::vector<double> bounds;
+    };
+
+    struct family_info {
+        std::string type;
+        std::string help;
+        std::vector<series_info> series;
+    };
+
+    block *attach() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        blocks_.push_back(std::make_unique<block>());
+        return blocks_.back().get();
+    }
+
+    // 呼叫端須持有 mutex_；線程結束後其 block 仍保留，數值不會遺失
+    uint64_t sum(size_t slot) const {
+        uint64_t total = 0;
+
+        for (auto &b : blocks_) {
+            total += b->values[slot].load(std::memory_order_relaxed);
+        }
+
+        return total;
+    }
+
+    static std::string braces(const std::string &labels) {
+        return labels.empty() ? "" : "{" + labels + "}";
+    }
+
+    void write_histogram(std::ostringstream &out, const std::string &name,
+                         const series_info &series) const {
+        std::string prefix = series.labels.empty() ? "" : series.labels + ",";
+        uint64_t cumulative = 0;
+
+        for (size_t i = 0; i <= series.bounds.size(); ++i) {
+            cumulative += sum(series.base + i);
+            std::ostringstream le;
+
+            if (i < series.bounds.size()) {
+                le << series.bounds[i];
+            } else {
+                le << "+Inf";
+            }
+
+            out << name << "_bucket{" << prefix << "le=\"" << le.str() << "\"} " << cumulative
+                << "\n";
+        }
+
+        // sum 以 1e-9 為單位的整數累加，各線程可直接相加
+        size_t extra = series.base + series.bounds.size() + 1;
+        out << name << "_sum" << braces(series.labels) << " " << sum(extra) / 1e9 << "\n"
+            << name << "_count" << braces(series.labels) << " " << sum(extra + 1) << "\n";
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<block>> blocks_;
+    std::map<std::string, size_t> slots_;
+    std::map<std::string, family_info> families_;
+    size_t next_ = 0;
+};
+
+class counter {
+  public:
+    counter(const std::string &name, const std::string &help, const std::string &labels = "")
+        : slot_(metric_registry::instance().allocate(name, "counter", help, labels)) {}
+
+    void add(uint64_t n = 1) {
+        metric_registry::add(slot_, n);
+    }
+
+  private:
+    size_t slot_;
+};
+
+class gauge {
+  public:
+    gauge(const std::string &name, const std::string &help, const std::string &labels = "")
+        : slot_(metric_registry::instance().allocate(name, "gauge", help, labels)) {}
+
+    // 各線程的增減可能為負，以 2 的補數累加後於 scrape 時轉回 int64
+    void add(int64_t n) {
+        metric_registry::add(slot_, uint64_t(n));
+    }
+
+  private:
+    size_t slot_;
+};
+
+class histogram {
+  public:
+    histogram(const std::string &name, const std::string &help, std::vector<double> bounds,
+              const std::string &labels = "")
+        : bounds_(bounds),
+          slot_(metric_registry::instance().allocate(name, "histogram", help, labels,
+                std::move(bounds))) {}
+
+    void observe(double value) {
+        size_t bucket = 0;
+
+        while (bucket < bounds_.size() && value > bounds_[bucket]) {
+            ++bucket;
+        }
+
+        metric_registry::add(slot_ + bucket, 1);
+        metric_registry::add(slot_ + bounds_.size() + 1, uint64_t(value * 1e9));
+        metric_registry::add(slot_ + bounds_.size() + 2, 1);
+    }
+
+  private:
+    std::vector<double> bounds_;
+    size_t slot_;
+};
+
+/**
+ * @class metrics_server
+ * @brief 極簡 HTTP 端點，任何請求都回傳目前的 Prometheus 文字格式 metric。
+ */
+class metrics_server : public std::enable_shared_from_this<metrics_server> {
+  public:
+    metrics_server(io_context &context, u_short port)
+        : acceptor(context, tcp::endpoint(ip::address_v4::loopback(), port)) {}
+
+    void do_accept() {
+        auto self(shared_from_this());
+        acceptor.async_accept([this, self](boost::system::error_code ec, tcp::socket socket) {
+            if (ec) {
+                return;
+            }
+
+            auto peer = std::make_shared<tcp::socket>(std::move(socket));
+            auto request = std::make_shared<streambuf>(8192);
+            async_read_until(*peer, *request, "\r\n\r\n",
+            [peer, request](boost::system::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+
+                auto body = metric_registry::instance().scrape();
+                auto response = std::make_shared<std::string>(
+                                    "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                    "Connection: close\r\n\r\n" + body);
+                async_write(*peer, buffer(*response),
+                [peer, response](boost::system::error_code, size_t) {
+                    boost::system::error_code ignored;
+                    peer->shutdown(tcp::socket::shutdown_both, ignored);
+                });
+            });
+            do_accept();
+        });
+    }
+
+    // 可在任何線程呼叫；關閉 listener (例如把 port 讓給接手的程式)
+    void close() {
+        auto self(shared_from_this());
+        post(acceptor.get_executor(), [this, self]() {
+            boost::system::error_code ec;
+            acceptor.close(ec);
+        });
+    }
+
+  private:
+    tcp::acceptor acceptor;
+};
+
+// 環境變數 METRICS_PORT 有設定時，在 127.0.0.1:<port> 提供 metric；未設定時回傳 nullptr
+inline std::shared_ptr<metrics_server> serve_metrics(io_context &context) {
+    const char *port = std::getenv("METRICS_PORT");
+
+    if (port == nullptr) {
+        return nullptr;
+    }
+
+    auto server = std::make_shared<metrics_server>(context, std::stoi(port));
+    server->do_accept();
+    return server;
+}
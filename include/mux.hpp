@@ -0,0 +1,640 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "handler_memory.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+// Frame header: [type: 1][stream_id: 4, big-endian][length: 4, big-endian]
+constexpr size_t MUX_HEADER_SIZE = 9;
+// 單一 DATA frame 的最大 payload，避免大 stream 長時間佔用通道
+constexpr size_t MUX_MAX_FRAME = 16 * 1024;
+// 每個 stream 的初始流量控制窗口 (bytes)
+constexpr uint32_t MUX_INITIAL_WINDOW = 256 * 1024;
+
+enum class MuxFrame : uint8_t {
+    OPEN = 0,   // 開啟新 stream (僅由 proxy_server 發起)
+    DATA = 1,   // stream 資料
+    WINDOW = 2, // 接收端已消化 length 個 bytes，發送端可增加窗口
+    CLOSE = 3,  // stream 關閉
+};
+
+class mux_session;
+
+/**
+ * @class mux_payload
+ * @brief 收到的一個 frame payload，記憶體來自所在線程的 frame_pool。
+ *
+ * DATA 的 payload 整塊交給 stream 的 inbox，讀完即歸還，下一個 frame 再從 pool 取出，
+ * steady state 下不經過 heap。內容不做初始化，resize 後隨即由 async_read 填滿。
+ */
+class mux_payload {
+  public:
+    mux_payload() = default;
+
+    mux_payload(mux_payload &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)),
+          capacity_(std::exchange(other.capacity_, 0)) {}
+
+    mux_payload &operator=(mux_payload &&other) noexcept {
+        mux_payload(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~mux_payload() {
+        if (data_) {
+            frame_pool::deallocate(data_, capacity_);
+        }
+    }
+
+    void resize(size_t size) {
+        if (size > capacity_) {
+            mux_payload().swap(*this);
+            data_ = static_cast<char *>(frame_pool::allocate(size));
+            capacity_ = size;
+        }
+
+        size_ = size;
+    }
+
+    char *data() {
+        return data_;
+    }
+
+    const char *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+  private:
+    void swap(mux_payload &other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+
+    char *data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+};
+
+/**
+ * @class mux_stream
+ * @brief 多工通道上的一條邏輯 stream。
+ *
+ * 所有狀態只在所屬 mux_session 的 Strand 上修改；
+ * 讀寫的 Completion Handler 也在該 Strand 上執行。
+ */
+class mux_stream : public std::enable_shared_from_this<mux_stream> {
+  public:
+    using handler_type = std::function<void(const boost::system::error_code &, size_t)>;
+
+    mux_stream(std::shared_ptr<mux_session> session, uint32_t id)
+        : session_(std::move(session)), id_(id) {}
+
+    mux_stream(const mux_stream &) = delete;
+    mux_stream &operator=(const mux_stream &) = delete;
+
+    uint32_t id() const {
+        return id_;
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler);
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    void async_write(const ConstBufferSequence &buffers, WriteHandler &&handler);
+
+    void close();
+
+    // session 的 Strand，所有 completion handler 都在其上執行
+    io_context::strand get_executor() const;
+
+  private:
+    friend class mux_session;
+
+    // 以下函式皆在 session Strand 上呼叫
+    void on_data(mux_payload payload);
+    void on_window(uint32_t credit);
+    void on_remote_close();
+    void shutdown(const boost::system::error_code &ec);
+    void try_read();
+    void try_write();
+    void complete(handler_type handler, const boost::system::error_code &ec, size_t n);
+
+    std::shared_ptr<mux_session> session_;
+    uint32_t id_;
+
+    // 接收方向：對方送來但尚未被讀走的資料
+    std::deque<mux_payload> inbox_;
+    size_t inbox_offset_ = 0;
+    uint32_t consumed_ = 0; // 已讀走但尚未回報 WINDOW 的 bytes
+    uint32_t recv_window_ = MUX_INITIAL_WINDOW; // 對方還能送出的 bytes
+    std::vector<mutable_buffer> read_buffers_;
+    handler_type read_handler_;
+
+    // 發送方向：等待窗口的資料
+    uint32_t send_window_ = MUX_INITIAL_WINDOW;
+    std::vector<char> outbox_;
+    size_t outbox_offset_ = 0;
+    handler_type write_handler_;
+
+    bool local_closed_ = false;
+    bool remote_closed_ = false;
+};
+
+/**
+ * @class mux_session
+ * @brief 在一條長連線上以 frame 多工多條 stream (類似 yamux / HTTP/2)。
+ *
+ * 每條 stream 有獨立的流量控制窗口，因此一條慢的 stream 不會把
+ * 共用連線塞滿；所有待送 frame 會合併成一次 gathered write。
+ */
+class mux_session : public std::enable_shared_from_this<mux_session> {
+  public:
+    using open_handler = std::function<void(std::shared_ptr<mux_stream>)>;
+    using close_handler = std::function<void()>;
+
+    explicit mux_session(tcp::socket socket)
+        : socket_(std::move(socket)),
+          strand_(static_cast<io_context &>(socket_.get_executor().context())) {
+        // frame 已在 do_write 中合併，Nagle 只會讓小 frame 多等一個 delayed ACK
+        boost::system::error_code ec;
+        socket_.set_option(tcp::no_delay(true), ec);
+    }
+
+    mux_session(const mux_session &) = delete;
+    mux_session &operator=(const mux_session &) = delete;
+
+    // on_open: 對方開啟新 stream 時呼叫，傳入 nullptr 表示這一端只發起 stream (收到 OPEN 即為
+    // 協定錯誤)；on_close: 底層連線中斷時呼叫一次
+    void start(open_handler on_open, close_handler on_close) {
+        on_open_ = std::move(on_open);
+        on_close_ = std::move(on_close);
+        dispatch(strand_, [self = shared_from_this()]() {
+            self->do_read_header();
+        });
+    }
+
+    // 開啟一條新的 stream 並通知對方；可在任何線程呼叫
+    std::shared_ptr<mux_stream> open() {
+        auto stream = std::make_shared<mux_stream>(shared_from_this(), next_id_++);
+        dispatch(strand_, [this, self = shared_from_this(), stream]() {
+            if (closed_) {
+                stream->shutdown(error::connection_aborted);
+                return;
+            }
+
+            streams_[stream->id()] = stream;
+            send_frame(MuxFrame::OPEN, stream->id(), nullptr, 0);
+        });
+        return stream;
+    }
+
+    void close() {
+        dispatch(strand_, [this, self = shared_from_this()]() {
+            do_close();
+        });
+    }
+
+  private:
+    friend class mux_stream;
+
+    void send_frame(MuxFrame type, uint32_t id, const void *data, uint32_t length) {
+        std::vector<char> frame(MUX_HEADER_SIZE + length);
+        frame[0] = static_cast<char>(type);
+        put_u32(&frame[1], id);
+        put_u32(&frame[5], length);
+
+        if (length) {
+            std::memcpy(&frame[MUX_HEADER_SIZE], data, length);
+        }
+
+        write_queue_.push_back(std::move(frame));
+        do_write();
+    }
+
+    void do_write() {
+        if (writing_ || closed_ || write_queue_.empty()) {
+            return;
+        }
+
+        // 把目前所有待送 frame 合併成一次 gathered write
+        writing_ = true;
+        in_flight_.swap(write_queue_);
+        std::vector<const_buffer> buffers;
+        buffers.reserve(in_flight_.size());
+
+        for (auto &frame : in_flight_) {
+            buffers.push_back(buffer(frame));
+        }
+
+        boost::asio::async_write(socket_, buffers,
+                                 bind_executor(strand_, [this, self = shared_from_this()](
+                                         const boost::system::error_code & ec, size_t) {
+            writing_ = false;
+            in_flight_.clear();
+
+            if (ec) {
+                do_close();
+                return;
+            }
+
+            do_write();
+        }));
+    }
+
+    void do_read_header() {
+        boost::asio::async_read(socket_, buffer(header_),
+                                bind_executor(strand_, [this, self = shared_from_this()](
+                                        const boost::system::error_code & ec, size_t) {
+            if (ec) {
+                do_close();
+                return;
+            }
+
+            // 未知的 frame 類型或超過 MUX_MAX_FRAME 的長度 (對方不會送出) 視為協定錯誤
+            uint32_t length = get_u32(&header_[5]);
+
+            if (header_[0] > static_cast<uint8_t>(MuxFrame::CLOSE) || length > MUX_MAX_FRAME) {
+                do_close();
+                return;
+            }
+
+            payload_.resize(length);
+
+            if (payload_.empty()) {
+                on_frame();
+                do_read_header();
+                return;
+            }
+
+            do_read_payload();
+        }));
+    }
+
+    void do_read_payload() {
+        boost::asio::async_read(socket_, buffer(payload_.data(), payload_.size()),
+                                bind_executor(strand_, [this, self = shared_from_this()](
+                                        const boost::system::error_code & ec, size_t) {
+            if (ec) {
+                do_close();
+                return;
+            }
+
+            on_frame();
+            do_read_header();
+        }));
+    }
+
+    void on_frame() {
+        auto type = static_cast<MuxFrame>(header_[0]);
+        uint32_t id = get_u32(&header_[1]);
+
+        if (type == MuxFrame::OPEN) {
+            // 發起端收到 OPEN，或重複開啟仍在使用的 id，都是協定錯誤
+            if (!on_open_ || streams_.count(id)) {
+                do_close();
+                return;
+            }
+
+            auto stream = std::make_shared<mux_stream>(shared_from_this(), id);
+            streams_[id] = stream;
+            on_open_(stream);
+            return;
+        }
+
+        auto it = streams_.find(id);
+
+        // 已在本地關閉的 stream，對方可能還有在途的 frame，直接忽略
+        if (it == streams_.end()) {
+            return;
+        }
+
+        auto stream = it->second;
+
+        switch (type) {
+        case MuxFrame::DATA:
+            stream->on_data(std::move(payload_));
+            break;
+
+        case MuxFrame::WINDOW:
+            if (payload_.size() < 4) {
+                do_close();
+                break;
+            }
+
+            stream->on_window(get_u32(payload_.data()));
+            break;
+
+        case MuxFrame::CLOSE:
+            streams_.erase(it);
+            stream->on_remote_close();
+            break;
+
+        default:
+            do_close();
+            break;
+        }
+    }
+
+    void do_close() {
+        if (closed_) {
+            return;
+        }
+
+        closed_ = true;
+        boost::system::error_code ec;
+        socket_.close(ec);
+        auto streams = std::move(streams_);
+        streams_.clear();
+
+        for (auto &entry : streams) {
+            entry.second->shutdown(error::connection_aborted);
+        }
+
+        if (on_close_) {
+            on_close_();
+            on_close_ = nullptr;
+        }
+
+        on_open_ = nullptr;
+    }
+
+    void forget(uint32_t id) {
+        streams_.erase(id);
+    }
+
+    static void put_u32(char *p, uint32_t v) {
+        p[0] = static_cast<char>(v >> 24);
+        p[1] = static_cast<char>(v >> 16);
+        p[2] = static_cast<char>(v >> 8);
+        p[3] = static_cast<char>(v);
+    }
+
+    static uint32_t get_u32(const void *data) {
+        auto p = static_cast<const uint8_t *>(data);
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) |
+               uint32_t(p[3]);
+    }
+
+    tcp::socket socket_;
+    io_context::strand strand_;
+    open_handler on_open_;
+    close_handler on_close_;
+
+    std::array<uint8_t, MUX_HEADER_SIZE> header_;
+    mux_payload payload_;
+    std::unordered_map<uint32_t, std::shared_ptr<mux_stream>> streams_;
+    std::deque<std::vector<char>> write_queue_;
+    std::deque<std::vector<char>> in_flight_;
+    std::atomic<uint32_t> next_id_{1};
+    bool writing_ = false;
+    bool closed_ = false;
+};
+
+template <typename MutableBufferSequence, typename ReadHandler>
+void mux_stream::async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler) {
+    std::vector<mutable_buffer> target(buffer_sequence_begin(buffers),
+                                       buffer_sequence_end(buffers));
+    dispatch(session_->strand_, [this, self = shared_from_this(), target = std::move(target),
+          handler = handler_type(std::forward<ReadHandler>(handler))]() mutable {
+        read_buffers_ = std::move(target);
+        read_handler_ = std::move(handler);
+        try_read();
+    });
+}
+
+template <typename ConstBufferSequence, typename WriteHandler>
+void mux_stream::async_write(const ConstBufferSequence &buffers, WriteHandler &&handler) {
+    // 先複製到 outbox，發送時再依窗口切成多個 DATA frame
+    std::vector<char> data(buffer_size(buffers));
+    buffer_copy(buffer(data), buffers);
+    dispatch(session_->strand_, [this, self = shared_from_this(), data = std::move(data),
+          handler = handler_type(std::forward<WriteHandler>(handler))]() mutable {
+        outbox_ = std::move(data);
+        outbox_offset_ = 0;
+        write_handler_ = std::move(handler);
+        try_write();
+    });
+}
+
+inline void mux_stream::close() {
+    dispatch(session_->strand_, [this, self = shared_from_this()]() {
+        if (local_closed_) {
+            return;
+        }
+
+        if (!remote_closed_) {
+            session_->send_frame(MuxFrame::CLOSE, id_, nullptr, 0);
+        }
+
+        session_->forget(id_);
+        shutdown(error::operation_aborted);
+    });
+}
+
+inline void mux_stream::on_data(mux_payload payload) {
+    if (local_closed_ || payload.empty()) {
+        return;
+    }
+
+    // 對方無視 WINDOW 送出超過窗口的資料時視為協定錯誤，避免 inbox 無限增長
+    if (payload.size() > recv_window_) {
+        session_->do_close();
+        return;
+    }
+
+    recv_window_ -= static_cast<uint32_t>(payload.size());
+    inbox_.push_back(std::move(payload));
+    try_read();
+}
+
+inline void mux_stream::on_window(uint32_t credit) {
+    send_window_ += credit;
+    try_write();
+}
+
+inline void mux_stream::on_remote_close() {
+    remote_closed_ = true;
+    // 讓讀端先把 inbox 讀完再收到 EOF
+    try_read();
+
+    if (write_handler_) {
+        complete(std::move(write_handler_), error::broken_pipe, 0);
+        write_handler_ = nullptr;
+    }
+}
+
+inline void mux_stream::shutdown(const boost::system::error_code &ec) {
+    local_closed_ = true;
+    remote_closed_ = true;
+    inbox_.clear();
+
+    if (read_handler_) {
+        complete(std::move(read_handler_), ec, 0);
+        read_handler_ = nullptr;
+    }
+
+    if (write_handler_) {
+        complete(std::move(write_handler_), ec, 0);
+        write_handler_ = nullptr;
+    }
+}
+
+inline void mux_stream::try_read() {
+    if (!read_handler_) {
+        return;
+    }
+
+    if (inbox_.empty()) {
+        if (remote_closed_) {
+            complete(std::move(read_handler_), error::eof, 0);
+            read_handler_ = nullptr;
+        }
+
+        return;
+    }
+
+    size_t total = 0;
+
+    while (!inbox_.empty()) {
+        auto &front = inbox_.front();
+        size_t n = buffer_copy(read_buffers_,
+                               buffer(front.data() + inbox_offset_, front.size() - inbox_offset_));
+
+        if (n == 0) {
+            break;
+        }
+
+        total += n;
+        inbox_offset_ += n;
+
+        if (inbox_offset_ == front.size()) {
+            inbox_.pop_front();
+            inbox_offset_ = 0;
+        }
+
+        // 消耗已填滿的部分
+        auto it = read_buffers_.begin();
+        size_t skip = n;
+
+        while (it != read_buffers_.end() && skip >= it->size()) {
+            skip -= it->size();
+            ++it;
+        }
+
+        read_buffers_.erase(read_buffers_.begin(), it);
+
+        if (read_buffers_.empty()) {
+            break;
+        }
+
+        read_buffers_.front() += skip;
+    }
+
+    consumed_ += total;
+
+    // 累積到窗口的 1/4 才回報，減少 WINDOW frame 數量
+    if (!remote_closed_ && consumed_ >= MUX_INITIAL_WINDOW / 4) {
+        std::array<char, 4> credit;
+        mux_session::put_u32(credit.data(), consumed_);
+        session_->send_frame(MuxFrame::WINDOW, id_, credit.data(), 4);
+        recv_window_ += consumed_;
+        consumed_ = 0;
+    }
+
+    read_buffers_.clear();
+    complete(std::move(read_handler_), boost::system::error_code(), total);
+    read_handler_ = nullptr;
+}
+
+inline void mux_stream::try_write() {
+    if (!write_handler_) {
+        return;
+    }
+
+    if (local_closed_ || remote_closed_) {
+        complete(std::move(write_handler_), error::broken_pipe, 0);
+        write_handler_ = nullptr;
+        return;
+    }
+
+    while (outbox_offset_ < outbox_.size() && send_window_ > 0) {
+        size_t chunk = std::min<size_t>({outbox_.size() - outbox_offset_, send_window_,
+                                         MUX_MAX_FRAME
+                                        });
+        session_->send_frame(MuxFrame::DATA, id_, outbox_.data() + outbox_offset_,
+                             static_cast<uint32_t>(chunk));
+        outbox_offset_ += chunk;
+        send_window_ -= static_cast<uint32_t>(chunk);
+    }
+
+    if (outbox_offset_ == outbox_.size()) {
+        size_t total = outbox_.size();
+        outbox_.clear();
+        outbox_offset_ = 0;
+        complete(std::move(write_handler_), boost::system::error_code(), total);
+        write_handler_ = nullptr;
+    }
+}
+
+inline io_context::strand mux_stream::get_executor() const {
+    return session_->strand_;
+}
+
+inline void mux_stream::complete(handler_type handler, const boost::system::error_code &ec,
+                                 size_t n) {
+    // 不在發起函式內直接呼叫 handler，維持 asio 的非同步語意
+    post(session_->strand_, [handler = std::move(handler), ec, n]() {
+        handler(ec, n);
+    });
+}
+
+/**
+ * @class mux_channel
+ * @brief mux_stream 的值語意包裝，提供與 ssocket 相同的介面，供 depipe 使用。
+ */
+class mux_channel {
+  public:
+    explicit mux_channel(std::shared_ptr<mux_stream> stream) : stream_(std::move(stream)) {}
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler) {
+        stream_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    void async_write(const ConstBufferSequence &buffers, WriteHandler &&handler) {
+        stream_->async_write(buffers, std::forward<WriteHandler>(handler));
+    }
+
+    void close() {
+        stream_->close();
+    }
+
+    io_context::strand get_executor() const {
+        return stream_->get_executor();
+    }
+
+  private:
+    std::shared_ptr<mux_stream> stream_;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @file protocol.hpp
+ * @brief proxy_server 與 expose 之間控制連線 (control connection) 的共用定義。
+ *
+ * 註冊訊息 (expose -> proxy_server)：
+ *   [proxy_port: 2 bytes, host-endian][mode: 1 byte][codec: 1 byte]
+ *
+ * proxy_server 先回覆 [codec: 1 byte]：它接受的資料連線壓縮方式 (不支援時為 Codec::NONE)，
+ * 之後才是各模式自己的回覆：
+ * - TunnelMode::DIAL_BACK：之後雙方都以 control frame 通訊 (見下方)。
+ *   每個 client 送出一個 SESSION frame，expose 連到 HELLO 中的 data_port
+ *   並送出 data hello 建立資料連線，proxy 以 token 配對等待中的 client。
+ * - TunnelMode::MUX：控制連線本身成為多工通道 (見 mux.hpp)，
+ *   所有 client stream 共用這一條長連線，不再回撥。
+ * - TunnelMode::POOL：與 DIAL_BACK 相同，proxy 的 HELLO 另外帶有停放用的 token，
+ *   expose 預先以這個 token 對 data_port 送出 data hello 後停放；
+ *   proxy 收到 client 時對停放的連線送出 1 byte 啟動訊號，pool 為空時才退回 SESSION frame 回撥。
+ * - TunnelMode::UDP：沒有其他回覆，控制連線直接承載 datagram frame (見 udp_tunnel.hpp)；
+ *   proxy_port 是 UDP port，不支援壓縮。
+ * - TunnelMode::GROUP：一條控制連線註冊多個 dial-back port。proxy_port 為 0，codec 之後接著
+ *   [count: 2 bytes][proxy_port: 2 bytes] * count，清單中的順序即 mapping ID。
+ *   之後與 DIAL_BACK 相同，SESSION frame 中的 mapping ID 決定 expose 要連的 target。
+ *   無法 bind 的 port 只在 proxy_server 記錄，其餘 port 照常運作。
+ *
+ * control frame (DIAL_BACK、POOL、GROUP 註冊之後，欄位皆為 network byte order)：
+ *   [length: 2 bytes][type: 1 byte][payload: length bytes]
+ * expose 在註冊訊息之後緊接著送出 HELLO，proxy 回覆 codec 後以自己的 HELLO 回應；
+ * 版本不同時 proxy 關閉連線。收到不認得的 type 或比預期長的 payload 時略過多出的部分，
+ * 之後的版本可以在不改變版本號的情況下增加 frame 與欄位。
+ * - HELLO：[version: 1][capabilities: 4][heartbeat: 2 (秒)]，
+ *   proxy 的 HELLO 另外接著 [data_port: 2][token: 8 (POOL 以外為 0)]。
+ *   雙方都帶有 CAP_HEARTBEAT 時以兩者 heartbeat 中較短的間隔互送 HEARTBEAT。
+ * - SESSION (proxy -> expose)：[mapping: 2 (GROUP 以外為 0)][token: 8][session: 8]。
+ *   session 是追蹤用的 session ID (見 trace.hpp)，proxy 未啟用追蹤時為 0；
+ *   舊版 proxy 送出的 SESSION 沒有這個欄位，expose 視為 0。
+ * - HEARTBEAT：沒有 payload；連續 HEARTBEAT_MISSES 個間隔沒有收到任何 frame 就關閉連線。
+ *
+ * 虛擬主機 (見 vhost.hpp)：mode 加上 VHOST_FLAG 時，註冊的是 proxy_port 上的一個名稱，
+ * 同一個 port 可由多個名稱共用，proxy 依 client 的 HTTP Host / TLS SNI 分配。
+ * 單一註冊在 codec 之後接 [name_length: 1][name]；GROUP 在 port 清單之後依序接 count 個
+ * [name_length: 1][name]，長度 0 的項目獨佔該 port。名稱 "*" 接收沒有符合名稱的 client。
+ *
+ * data hello (資料連線的開頭，與註冊訊息共用前 3 bytes 的格式)：
+ *   [0: 2 bytes][TunnelMode::DATA: 1 byte][token: 8 bytes]
+ * data_port 預設就是控制 port，因此 expose 只需要能連到 proxy_server 的一個 port。
+ */
+enum class TunnelMode : uint8_t {
+    DIAL_BACK = 0,
+    MUX = 1,
+    POOL = 2,
+    DATA = 3, // 不是註冊，而是帶 token 的資料連線
+    UDP = 4,
+    GROUP = 5,
+};
+
+// 註冊訊息的 mode 帶有這個位元時，之後附有虛擬主機名稱
+constexpr uint8_t VHOST_FLAG = 0x80;
+
+// TunnelMode::GROUP 一次最多註冊的 port 數
+constexpr size_t MAX_GROUP_MAPPINGS = 1024;
+
+// proxy <-> expose 資料連線 (或 mux stream) 的壓縮方式，見 compress.hpp
+enum class Codec : uint8_t {
+    NONE = 0,
+    DEFLATE_FAST = 1, // zlib level 1
+    DEFLATE = 2,      // zlib 預設 level，壓縮率較高
+};
+
+// 控制連線 frame 的版本，HELLO 中交換
+constexpr uint8_t CONTROL_VERSION = 1;
+
+enum class ControlFrame : uint8_t {
+    HELLO = 0,
+    SESSION = 1,
+    HEARTBEAT = 2,
+};
+
+// HELLO 中的 capability 位元
+constexpr uint32_t CAP_HEARTBEAT = 1u << 0;
+
+constexpr size_t FRAME_HEADER_SIZE = 3;
+constexpr size_t HELLO_SIZE = 7;       // expose 的 HELLO
+constexpr size_t HELLO_REPLY_SIZE = 17; // proxy 的 HELLO
+constexpr size_t SESSION_SIZE = 18;
+// 舊版 proxy 的 SESSION 沒有 trace ID (mapping ID + token)，協定版本相同，視為 trace ID 0
+constexpr size_t SESSION_MIN_SIZE = 10;
+// 這麼多個心跳間隔沒有收到任何 frame 視為斷線
+constexpr unsigned HEARTBEAT_MISSES = 3;
+
+// network byte order 的整數欄位
+template <typename T>
+inline void put_be(char *out, T value) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<char>(value >> (8 * (sizeof(T) - 1 - i)));
+    }
+}
+
+template <typename T>
+inline T get_be(const char *in) {
+    T value = 0;
+
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        value = static_cast<T>((value << 8) | static_cast<uint8_t>(in[i]));
+    }
+
+    return value;
+}
+
+/**
+ * @struct control_hello
+ * @brief HELLO frame 的內容；data_port 與 token 只在 proxy 的回覆中。
+ */
+struct control_hello {
+    uint8_t version = CONTROL_VERSION;
+    uint32_t capabilities = 0;
+    uint16_t heartbeat = 0;
+    uint16_t data_port = 0;
+    uint64_t token = 0;
+
+    // 回傳 payload 長度 (HELLO_SIZE 或 HELLO_REPLY_SIZE)
+    size_t encode(std::array<char, HELLO_REPLY_SIZE> &out, bool reply) const {
+        out[0] = static_cast<char>(version);
+        put_be(&out[1], capabilities);
+        put_be(&out[5], heartbeat);
+
+        if (!reply) {
+            return HELLO_SIZE;
+        }
+
+        put_be(&out[7], data_port);
+        std::memcpy(&out[9], &token, sizeof(token)); // token 原樣帶回 data hello，不轉換
+        return HELLO_REPLY_SIZE;
+    }
+
+    // payload 太短時回傳 false；多出的欄位略過
+    bool decode(const char *payload, size_t size, bool reply) {
+        if (size < (reply ? HELLO_REPLY_SIZE : HELLO_SIZE)) {
+            return false;
+        }
+
+        version = static_cast<uint8_t>(payload[0]);
+        capabilities = get_be<uint32_t>(&payload[1]);
+        heartbeat = get_be<uint16_t>(&payload[5]);
+
+        if (reply) {
+            data_port = get_be<uint16_t>(&payload[7]);
+            std::memcpy(&token, &payload[9], sizeof(token));
+        }
+
+        return true;
+    }
+};
+
+constexpr size_t DATA_HELLO_SIZE = 11;
+
+inline std::array<char, DATA_HELLO_SIZE> data_hello(uint64_t token) {
+    std::array<char, DATA_HELLO_SIZE> hello{};
+    hello[2] = static_cast<char>(TunnelMode::DATA);
+    std::memcpy(&hello[3], &token, sizeof(token));
+    return hello;
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace boost::asio;
+
+/**
+ * @file shaping.hpp
+ * @brief proxy_server 的頻寬整形：每個對外 port 與每個 client IP 的 token bucket，
+ * 以及依權重限制每次讀取量的公平排程。
+ *
+ * 設定檔 (環境變數 SHAPING_FILE) 每行一條規則，# 之後為註解：
+ *   port <port> [rate=<bytes/s>] [burst=<bytes>] [weight=<1-16>]
+ *   client <ip>|* [rate=<bytes/s>] [burst=<bytes>]
+ * 數值可加 K/M/G 後綴 (以 1024 為單位)。rate 分別套用在上傳與下載兩個方向，
+ * client * 是每個 IP 各自的預設限制。收到 SIGHUP 時重新讀取，
+ * 已存在的 bucket 直接更新，進行中的 tunnel 立即套用新的限制。
+ *
+ * token 由每 SHAPING_TICK 一次的 timer 統一補充；轉送時每次讀取只做 atomic 的加減，
+ * token 用完的方向暫停讀取，登記在 bucket 上等待下一次補充。
+ *
+ * 同一個 shard 上的 tunnel 輪流執行讀取的 handler；weight 決定每一輪最多讀取
+ * weight * SHAPING_QUANTUM bytes (預設 16，即 MAX_BUF_SIZE)。把大量傳輸的 port 設成較低的 weight，
+ * 它每一輪佔用線程的時間就較短，同一個 shard 上互動式 tunnel 的延遲隨之降低。
+ */
+
+constexpr auto SHAPING_TICK = std::chrono::milliseconds(10);
+constexpr size_t SHAPING_QUANTUM = 16 * 1024;
+constexpr size_t SHAPING_MAX_WEIGHT = 16;
+
+/**
+ * @class token_bucket
+ * @brief 單一方向的 token bucket；rate 為 0 時不限制。
+ *
+ * 讀取後才扣除實際的 bytes，因此 token 可能暫時為負 (最多一次讀取量)，以後續的補充抵銷。
+ */
+class token_bucket {
+  public:
+    int64_t available() const {
+        return rate_.load(std::memory_order_relaxed) == 0 ? std::numeric_limits<int64_t>::max()
+               : tokens_.load(std::memory_order_relaxed);
+    }
+
+    void consume(size_t n) {
+        if (rate_.load(std::memory_order_relaxed) != 0) {
+            tokens_.fetch_sub(int64_t(n), std::memory_order_relaxed);
+        }
+    }
+
+    void configure(int64_t rate, int64_t burst) {
+        rate_ = rate;
+        burst_ = burst;
+        // 放寬限制時不必等 token 慢慢累積
+        tokens_ = std::min(tokens_.load(), burst);
+    }
+
+    // 下一次補充後 token 為正時呼叫 resume (在 timer 的線程上)
+    void wait(std::function<void()> resume) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiters_.push_back(std::move(resume));
+    }
+
+    void refill(double seconds) {
+        int64_t rate = rate_.load(std::memory_order_relaxed);
+        int64_t burst = burst_.load(std::memory_order_relaxed);
+        int64_t tokens = tokens_.load(std::memory_order_relaxed);
+
+        if (rate != 0 && tokens < burst) {
+            int64_t added = std::min(burst - tokens, int64_t(rate * seconds));
+            tokens = tokens_.fetch_add(added, std::memory_order_relaxed) + added;
+        }
+
+        if (rate != 0 && tokens <= 0) {
+            return;
+        }
+
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ready.swap(waiters_);
+        }
+
+        for (auto &resume : ready) {
+            resume();
+        }
+    }
+
+  private:
+    std::atomic<int64_t> rate_{0};
+    std::atomic<int64_t> burst_{0};
+    std::atomic<int64_t> tokens_{0};
+    std::mutex mutex_;
+    std::vector<std::function<void()>> waiters_;
+};
+
+// 一個 port 或一個 client IP 的兩個方向，以及 (port 才有的) 每輪讀取量
+struct shaping_group {
+    token_bucket upload;
+    token_bucket download;
+    std::atomic<size_t> quantum{SHAPING_MAX_WEIGHT * SHAPING_QUANTUM};
+};
+
+/**
+ * @class tunnel_shaper
+ * @brief 一條 tunnel 受到的限制：它的 port 與 client IP 兩組 bucket。
+ *
+ * upload 為 client -> expose (depipe 的 forward 方向)，download 相反。
+ */
+class tunnel_shaper {
+  public:
+    tunnel_shaper(std::shared_ptr<shaping_group> port, std::shared_ptr<shaping_group> client)
+        : port_(std::move(port)), client_(std::move(client)) {}
+
+    // 這次最多可讀取的 bytes；0 表示必須等待補充
+    size_t allowance(bool upload) const {
+        int64_t tokens = std::min(bucket(*port_, upload).available(),
+                                  bucket(*client_, upload).available());
+
+        if (tokens <= 0) {
+            return 0;
+        }
+
+        int64_t quantum = int64_t(port_->quantum.load(std::memory_order_relaxed));
+        return size_t(std::min<int64_t>(tokens, quantum));
+    }
+
+    void consume(bool upload, size_t n) {
+        bucket(*port_, upload).consume(n);
+        bucket(*client_, upload).consume(n);
+    }
+
+    // 在 token 用完的 bucket 上等待；補充後呼叫 resume，由呼叫端重新檢查 allowance
+    void wait(bool upload, std::function<void()> resume) {
+        auto &port = bucket(*port_, upload);
+        (port.available() <= 0 ? port : bucket(*client_, upload)).wait(std::move(resume));
+    }
+
+  private:
+    static token_bucket &bucket(shaping_group &group, bool upload) {
+        return upload ? group.upload : group.download;
+    }
+
+    std::shared_ptr<shaping_group> port_;
+    std::shared_ptr<shaping_group> client_;
+};
+
+/**
+ * @class traffic_shaping
+ * @brief 規則與所有仍在使用中的 shaping_group；負責讀取設定檔與定期補充 token。
+ */
+class traffic_shaping {
+  public:
+    static traffic_shaping &instance() {
+        static traffic_shaping shaping;
+        return shaping;
+    }
+
+    bool enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // 讀取 (或重新讀取) 設定檔並套用到現有的 group；格式錯誤時拋出例外，原本的規則不變
+    void load(const std::string &path) {
+        std::ifstream file(path);
+
+        if (!file) {
+            throw std::runtime_error("cannot open " + path);
+        }
+
+        std::map<std::string, rule> rules;
+        std::string line;
+        size_t number = 0;
+
+        while (std::getline(file, line)) {
+            ++number;
+            line = line.substr(0, line.find('#'));
+            std::istringstream words(line);
+            std::string kind, key, option;
+
+            if (!(words >> kind)) {
+                continue;
+            }
+
+            if ((kind != "port" && kind != "client") || !(words >> key)) {
+                throw std::runtime_error(path + ":" + std::to_string(number)
+                                         + ": expected port or client");
+            }
+
+            rule parsed;
+
+            while (words >> option) {
+                size_t equals = option.find('=');
+                std::string name = option.substr(0, equals);
+                int64_t value = equals == std::string::npos ? -1
+                                : parse_size(option.substr(equals + 1));
+
+                bool known = name == "rate" || name == "burst"
+                             || (name == "weight" && kind == "port");
+                bool weight_range = value >= 1 && value <= int64_t(SHAPING_MAX_WEIGHT);
+
+                if (value < 0 || !known || (name == "weight" && !weight_range)) {
+                    throw std::runtime_error(path + ":" + std::to_string(number) + ": bad option "
+                                             + option);
+                }
+
+                auto &field = name == "rate" ? parsed.rate : name == "burst" ? parsed.burst
+                              : parsed.weight;
+                field = value;
+            }
+
+            rules[kind + " " + key] = parsed;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        path_ = path;
+        rules_ = std::move(rules);
+        enabled_ = true;
+
+        for (auto &group : groups_) {
+            if (auto live = group.second.lock()) {
+                apply(group.first, *live);
+            }
+        }
+    }
+
+    void reload() {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            path = path_;
+        }
+        load(path);
+    }
+
+    // 每 SHAPING_TICK 補充一次所有仍在使用中的 bucket
+    void start(io_context &context) {
+        timer_ = std::make_unique<steady_timer>(context);
+        last_ = std::chrono::steady_clock::now();
+        do_refill();
+    }
+
+    // 新 tunnel 的 shaper；未啟用整形時回傳 nullptr
+    std::shared_ptr<tunnel_shaper> shaper_for(unsigned short port, const ip::address &client) {
+        if (!enabled()) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::make_shared<tunnel_shaper>(group("port " + std::to_string(port)),
+                                               group("client " + client.to_string()));
+    }
+
+  private:
+    struct rule {
+        int64_t rate = 0;
+        int64_t burst = 0;
+        int64_t weight = SHAPING_MAX_WEIGHT;
+    };
+
+    // 123、64K、10M、1G
+    static int64_t parse_size(const std::string &text) {
+        size_t used = 0;
+        int64_t value;
+
+        try {
+            value = std::stoll(text, &used);
+        } catch (...) {
+            return -1;
+        }
+
+        std::string suffix = text.substr(used);
+        int shift = suffix.empty() ? 0 : suffix == "K" ? 10 : suffix == "M" ? 20
+                    : suffix == "G" ? 30 : -1;
+        return shift < 0 ? -1 : value << shift;
+    }
+
+    // 呼叫時持有 mutex_
+    std::shared_ptr<shaping_group> group(const std::string &key) {
+        auto &slot = groups_[key];
+        auto live = slot.lock();
+
+        if (!live) {
+            live = std::make_shared<shaping_group>();
+            apply(key, *live);
+            slot = live;
+        }
+
+        return live;
+    }
+
+    // 呼叫時持有 mutex_；client 沒有自己的規則時套用 client *
+    void apply(const std::string &key, shaping_group &target) {
+        auto found = rules_.find(key);
+
+        if (found == rules_.end() && key.compare(0, 7, "client ") == 0) {
+            found = rules_.find("client *");
+        }
+
+        rule chosen = found == rules_.end() ? rule{} : found->second;
+        // 未指定 burst 時允許 100 ms 的量，至少 64 KiB
+        int64_t burst = chosen.burst > 0 ? chosen.burst
+                        : std::max<int64_t>(chosen.rate / 10, 64 * 1024);
+        target.upload.configure(chosen.rate, burst);
+        target.download.configure(chosen.rate, burst);
+        target.quantum = size_t(chosen.weight) * SHAPING_QUANTUM;
+    }
+
+    void do_refill() {
+        timer_->expires_after(SHAPING_TICK);
+        timer_->async_wait([this](const boost::system::error_code & ec) {
+            if (ec) {
+                return;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - last_).count();
+            last_ = now;
+            std::vector<std::shared_ptr<shaping_group>> live;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                for (auto it = groups_.begin(); it != groups_.end();) {
+                    if (auto group = it->second.lock()) {
+                        live.push_back(std::move(group));
+                        ++it;
+                    } else {
+                        it = groups_.erase(it);
+                    }
+                }
+            }
+
+            for (auto &group : live) {
+                group->upload.refill(seconds);
+                group->download.refill(seconds);
+            }
+
+            do_refill();
+        });
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::mutex mutex_;
+    std::string path_;
+    std::map<std::string, rule> rules_;
+    std::map<std::string, std::weak_ptr<shaping_group>> groups_;
+    std::unique_ptr<steady_timer> timer_;
+    std::chrono::steady_clock::time_point last_;
+};
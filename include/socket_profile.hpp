@@ -0,0 +1,205 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+using namespace boost::asio;
+using ip::tcp;
+
+/**
+ * @file socket_profile.hpp
+ * @brief 依用途命名的 TCP socket 設定，兩端以環境變數 SOCKET_PROFILE 選擇。
+ *
+ *   - default：不設定任何選項 (kernel 預設，buffer 自動調整)。
+ *   - interactive：TCP_NODELAY、TCP_QUICKACK、TCP_NOTSENT_LOWAT 16 KiB、SO_BUSY_POLL 50 µs、
+ *     控制與資料連線使用 TCP Fast Open。適合 SSH、資料庫查詢等小封包一來一往的流量。
+ *   - bulk：4 MiB 的 SO_SNDBUF / SO_RCVBUF (關閉 kernel 的自動調整)、TCP Fast Open，保留 Nagle。
+ *
+ * TCP_NODELAY 與 buffer 大小以 asio 的 socket option 設定，各平台皆可用；TCP_QUICKACK、
+ * TCP_NOTSENT_LOWAT、SO_BUSY_POLL 與 TCP Fast Open 只在 Linux 上設定。
+ * 所有選項都是盡力而為：kernel 不支援或權限不足 (例如超過 net.core.busy_poll 的 SO_BUSY_POLL
+ * 需要 CAP_NET_ADMIN) 時略過，不影響連線。TCP_QUICKACK 只在設定時生效一次，
+ * kernel 之後仍可能回到 delayed ACK。
+ */
+struct socket_profile {
+    const char *name;
+    bool no_delay;
+    bool quick_ack;
+    bool fast_open;
+    int send_buffer;    // 0 表示不設定
+    int receive_buffer; // 0 表示不設定
+    int not_sent_lowat; // 0 表示不設定
+    int busy_poll;      // µs，0 表示不設定
+};
+
+constexpr socket_profile DEFAULT_PROFILE{"default", false, false, false, 0, 0, 0, 0};
+constexpr socket_profile INTERACTIVE_PROFILE{"interactive", true, true, true, 0, 0, 16 * 1024, 50};
+constexpr socket_profile BULK_PROFILE{"bulk", false, false, true, 4 << 20, 4 << 20, 0, 0};
+
+// 未知的名稱回傳 nullptr
+inline const socket_profile *find_socket_profile(const std::string &name) {
+    for (const socket_profile *profile : {&DEFAULT_PROFILE, &INTERACTIVE_PROFILE, &BULK_PROFILE}) {
+        if (name == profile->name) {
+            return profile;
+        }
+    }
+
+    return nullptr;
+}
+
+// 盡力而為，錯誤略過
+template <typename Socket, typename Option>
+inline void set_socket_option(Socket &socket, const Option &option) {
+    boost::system::error_code ignored;
+    socket.set_option(option, ignored);
+}
+
+#ifdef __linux__
+// asio 沒有對應型別的 Linux 專用選項
+inline void set_int_option(int fd, int level, int name, int value) {
+    (void)::setsockopt(fd, level, name, &value, sizeof(value));
+}
+#endif
+
+/**
+ * 套用到已開啟的 socket。buffer 大小須在 connect 之前 (或在 listener 上) 設定，
+ * 才會反映在 SYN 的 window scale；其餘選項在連線建立後設定亦可。
+ */
+inline void apply_profile(tcp::socket &socket, const socket_profile &profile) {
+    if (profile.no_delay) {
+        set_socket_option(socket, tcp::no_delay(true));
+    }
+
+    if (profile.send_buffer) {
+        set_socket_option(socket, socket_base::send_buffer_size(profile.send_buffer));
+    }
+
+    if (profile.receive_buffer) {
+        set_socket_option(socket, socket_base::receive_buffer_size(profile.receive_buffer));
+    }
+
+#ifdef __linux__
+    int fd = socket.native_handle();
+
+    if (profile.quick_ack) {
+        set_int_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+    }
+
+    if (profile.not_sent_lowat) {
+        set_int_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.not_sent_lowat);
+    }
+
+    if (profile.busy_poll) {
+        set_int_option(fd, SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll);
+    }
+#endif
+}
+
+/**
+ * connect 之前呼叫：除了 apply_profile 的選項外，fast_open 時啟用 TCP_FASTOPEN_CONNECT，
+ * 連線之後的第一次寫入隨 SYN 送出 (已有對方的 cookie 時)。connect 因此會立即完成，
+ * 連不上的錯誤要到第一次讀寫才出現，所以只用在連往 proxy_server 的連線。
+ */
+inline void apply_profile_before_connect(tcp::socket &socket, const socket_profile &profile) {
+    apply_profile(socket, profile);
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+    if (profile.fast_open) {
+        set_int_option(socket.native_handle(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+    }
+#endif
+}
+
+// 允許 client 以 TFO 的 SYN 帶資料 (server 端另需 net.ipv4.tcp_fastopen 含 0x2)
+inline void enable_fast_open(tcp::acceptor &acceptor) {
+#if defined(__linux__) && defined(TCP_FASTOPEN)
+    set_int_option(acceptor.native_handle(), IPPROTO_TCP, TCP_FASTOPEN, 256);
+#else
+    (void)acceptor;
+#endif
+}
+
+// listen 之後呼叫：accept 的 socket 繼承 buffer 大小
+inline void apply_profile(tcp::acceptor &acceptor, const socket_profile &profile) {
+    if (profile.send_buffer) {
+        set_socket_option(acceptor, socket_base::send_buffer_size(profile.send_buffer));
+    }
+
+    if (profile.receive_buffer) {
+        set_socket_option(acceptor, socket_base::receive_buffer_size(profile.receive_buffer));
+    }
+
+    if (profile.fast_open) {
+        enable_fast_open(acceptor);
+    }
+}
+
+/**
+ * proxy_server 的 SOCKET_PROFILE：以逗號分隔，<port>:<profile> 指定單一對外 port，
+ * 不帶 port 的項目是其餘 port 的預設，例如 "bulk,22:interactive,5432:interactive"。
+ */
+class socket_profiles {
+  public:
+    // 格式錯誤或未知的 profile 時拋出例外
+    void parse(const std::string &spec) {
+        size_t begin = 0;
+
+        while (begin <= spec.size()) {
+            size_t end = spec.find(',', begin);
+            std::string item = spec.substr(begin, end == std::string::npos ? std::string::npos
+                                           : end - begin);
+            size_t colon = item.find(':');
+            std::string name = item.substr(colon == std::string::npos ? 0 : colon + 1);
+            const socket_profile *profile = find_socket_profile(name);
+
+            if (!profile) {
+                throw std::invalid_argument("unknown socket profile in \"" + item + "\"");
+            }
+
+            if (colon == std::string::npos) {
+                default_ = profile;
+            } else {
+                ports_[static_cast<unsigned short>(std::stoi(item.substr(0, colon)))] = profile;
+            }
+
+            if (end == std::string::npos) {
+                break;
+            }
+
+            begin = end + 1;
+        }
+    }
+
+    // 全部都是 default 時不必為每條連線查詢 port
+    bool configured() const {
+        return default_ != &DEFAULT_PROFILE || !ports_.empty();
+    }
+
+    const socket_profile &for_port(unsigned short port) const {
+        auto found = ports_.find(port);
+        return found == ports_.end() ? *default_ : *found->second;
+    }
+
+    // 任一 profile 使用 TCP Fast Open 時，控制 / data port 也須接受 TFO
+    bool fast_open() const {
+        bool used = default_->fast_open;
+
+        for (auto &entry : ports_) {
+            used = used || entry.second->fast_open;
+        }
+
+        return used;
+    }
+
+  private:
+    const socket_profile *default_ = &DEFAULT_PROFILE;
+    std::map<unsigned short, const socket_profile *> ports_;
+};
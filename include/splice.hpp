@@ -0,0 +1,109 @@
+#pragma once
+
+#include <csignal>
+#include <cstdlib>
+#include <string>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @file splice.hpp
+ * @brief depipe 的轉送引擎選擇與 splice(2) 所需的 kernel pipe。
+ *
+ * 環境變數 DEPIPE_ENGINE：
+ *   - copy   (預設) 經由 user-space buffer 複製。
+ *   - splice 在 Linux 上以 socket -> pipe -> socket 的 splice(2) 轉送，資料不進入 user-space；
+ *            平台不支援或 fd 無法 splice 時自動退回 copy。
+ *   - uring  以 io_uring 的 multishot recv 與 sendmsg 轉送 (見 uring.hpp)，批次送出、不經 epoll；
+ *            kernel 不支援時自動退回 copy。
+ */
+enum class PipeEngine {
+    COPY,
+    SPLICE,
+    URING,
+};
+
+inline PipeEngine pipe_engine() {
+    static const PipeEngine engine = []() {
+        const char *name = std::getenv("DEPIPE_ENGINE");
+
+        if (name != nullptr && std::string(name) == "uring") {
+            return PipeEngine::URING;
+        }
+
+        if (name == nullptr || std::string(name) != "splice") {
+            return PipeEngine::COPY;
+        }
+
+#ifdef __linux__
+        // splice 寫入已關閉的 socket 會觸發 SIGPIPE (不像 send 可帶 MSG_NOSIGNAL)
+        std::signal(SIGPIPE, SIG_IGN);
+        return PipeEngine::SPLICE;
+#else
+        return PipeEngine::COPY;
+#endif
+    }();
+    return engine;
+}
+
+// 一次 splice 最多搬移的 bytes，同時也是 pipe 的容量
+constexpr size_t SPLICE_CHUNK = 256 * 1024;
+// 每次被喚醒後最多連續 splice 的輪數，避免單一 tunnel 長時間佔用線程
+constexpr int SPLICE_ROUNDS = 16;
+
+/**
+ * @class splice_pipe
+ * @brief 單一方向使用的 kernel pipe，記錄已讀入但尚未寫出的 bytes。
+ */
+class splice_pipe {
+  public:
+    splice_pipe() = default;
+    splice_pipe(const splice_pipe &) = delete;
+    splice_pipe &operator=(const splice_pipe &) = delete;
+
+    ~splice_pipe() {
+#ifdef __linux__
+
+        if (fds[0] >= 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+        }
+
+#endif
+    }
+
+    bool open() {
+#ifdef __linux__
+
+        if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+            fds[0] = fds[1] = -1;
+            return false;
+        }
+
+        // 盡量放大 pipe，失敗 (超過 pipe-max-size) 時沿用預設大小
+        ::fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(SPLICE_CHUNK));
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int read_end() const {
+        return fds[0];
+    }
+
+    int write_end() const {
+        return fds[1];
+    }
+
+    // 已 splice 進 pipe、尚未送出的 bytes
+    size_t pending = 0;
+    // 是否已成功 splice 過；之後遇到錯誤就不能再退回 copy
+    bool used = false;
+
+  private:
+    int fds[2] = {-1, -1};
+};
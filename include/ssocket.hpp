@@ -5,84 +5,109 @@
 using namespace boost::asio;
 using ip::tcp;
 
-// Assuming 'io' is defined in the application's main file
-extern io_context io;
-
 /**
  * @class ssocket
- * @brief 使用組合 (Composition) 模式封裝 tcp::socket，並為其分配一個專屬 Strand，
- * 確保所有異步操作的 Completion Handlers 都是線程安全的。
+ * @brief 使用組合 (Composition) 模式封裝 tcp::socket，提供 depipe 所需的 stream 介面。
+ *
+ * 每個 shard 是只有一條線程的 io_context，同一個 socket 的 completion handler
+ * 本來就依序在那條線程上執行；因此不再為每個 socket 配一個 strand，
+ * handler 直接交給 socket 所屬的 io_context，省下每次完成時經過 strand 的排程。
+ * 需要跨線程存取的狀態 (例如 depipe 兩端在不同 shard 時的 pipe_flow) 由擁有者自行保護。
  */
 class ssocket {
   private:
-    // 1. 核心變動：使用組合模式，將 tcp::socket 作為私有成員
     tcp::socket socket_;
-
-    // 2. 專門為這個 socket 服務的執行序列 (Strand)
-    io_context::strand strand_;
+    io_context::executor_type executor_;
 
   public:
     // 構造函數: 接受一個已配置的 tcp::socket (例如從 acceptor 或 resolver 得到)，
     // 並將其狀態移動到內部成員中。
     explicit ssocket(tcp::socket &&other_socket)
-    // 構造 socket_ 成員，使用移動語義接管 other_socket 的狀態
         : socket_(std::move(other_socket)),
-          // 修復: strand 必須使用 socket 所在的執行器 (executor) 來構造，確保在同一 io_context 上運行
-          strand_(io) {
-    }
+          executor_(static_cast<io_context &>(socket_.get_executor().context()).get_executor()) {}
 
-    // 禁用複製，確保只有一個 ssocket 實例管理該 Strand
+    // 禁用複製；搬移只能在發起任何操作之前
     ssocket(const ssocket &) = delete;
     ssocket &operator=(const ssocket &) = delete;
+    ssocket(ssocket &&) = default;
+
+    // socket 所屬 shard 的 executor，供包裝它的 stream 投遞 completion handler
+    io_context::executor_type get_executor() const {
+        return executor_;
+    }
 
     /**
-     * @brief 線程安全地啟動異步讀取操作 (async_read_some)。
+     * @brief 啟動異步讀取操作 (async_read_some)。
      */
     template <typename MutableBufferSequence, typename ReadHandler>
     void async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler) {
-        // 核心邏輯：將處理程序綁定到 strand_，確保該 socket 的所有操作序列化。
-        socket_.async_read_some(buffers,
-                                boost::asio::bind_executor(strand_, std::forward<ReadHandler>(handler)));
+        socket_.async_read_some(buffers, std::forward<ReadHandler>(handler));
     }
 
     /**
-     * @brief 線程安全地啟動異步讀取操作（使用 async_read free function），保證讀取完所有要求的數據。 (新增)
+     * @brief 啟動異步讀取操作（使用 async_read free function），保證讀取完所有要求的數據。
      */
     template <typename MutableBufferSequence, typename ReadHandler>
     void async_read(const MutableBufferSequence &buffers, ReadHandler &&handler) {
-        // 使用 async_read 自由函數，將處理程序綁定到 strand_。
-        boost::asio::async_read(socket_, buffers,
-                                boost::asio::bind_executor(strand_, std::forward<ReadHandler>(handler)));
+        boost::asio::async_read(socket_, buffers, std::forward<ReadHandler>(handler));
     }
 
     /**
-     * @brief 線程安全地啟動異步寫入部分數據操作 (async_write_some)。
+     * @brief 啟動異步寫入部分數據操作 (async_write_some)。
      */
     template <typename ConstBufferSequence, typename WriteHandler>
     void async_write_some(const ConstBufferSequence &buffers, WriteHandler &&handler) {
-        // 核心邏輯：將處理程序綁定到 strand_，確保該 socket 的所有操作序列化。
-        socket_.async_write_some(buffers,
-                                 boost::asio::bind_executor(strand_, std::forward<WriteHandler>(handler)));
+        socket_.async_write_some(buffers, std::forward<WriteHandler>(handler));
     }
 
     /**
-     * @brief 線程安全地啟動異步寫入操作（使用 async_write free function），保證寫完所有數據。
+     * @brief 啟動異步寫入操作（使用 async_write free function），保證寫完所有數據。
      */
     template <typename ConstBufferSequence, typename WriteHandler>
     void async_write(const ConstBufferSequence &buffers, WriteHandler &&handler) {
-        // 使用 async_write 自由函數，將處理程序綁定到 strand_。
-        boost::asio::async_write(socket_, buffers,
-                                 boost::asio::bind_executor(strand_, std::forward<WriteHandler>(handler)));
+        boost::asio::async_write(socket_, buffers, std::forward<WriteHandler>(handler));
+    }
+
+    /**
+     * @brief 等待 socket 可讀/可寫 (供 splice 等零拷貝路徑與 depipe 的閒置讀取使用)。
+     */
+    template <typename WaitHandler>
+    void async_wait(tcp::socket::wait_type type, WaitHandler &&handler) {
+        socket_.async_wait(type, std::forward<WaitHandler>(handler));
+    }
+
+    // 非阻塞讀取目前已到達的資料，沒有資料時 ec 為 would_block；搭配 async_wait 使用
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers, boost::system::error_code &ec) {
+        // 每次設定都是一次 ioctl，只在第一次設定
+        if (!socket_.non_blocking()) {
+            socket_.non_blocking(true, ec);
+
+            if (ec) {
+                return 0;
+            }
+        }
+
+        return socket_.read_some(buffers, ec);
     }
 
     // --- 實用功能：暴露底層 socket 的必要方法 ---
 
+    // 暴露原生 fd，並確保其處於非阻塞模式
+    tcp::socket::native_handle_type native_handle() {
+        boost::system::error_code ec;
+        socket_.native_non_blocking(true, ec);
+        return socket_.native_handle();
+    }
+
     // 暴露 close 方法
+    // 只做 shutdown，fd 留到解構時才釋放：close 可能與其他線程上正在發起的操作並行，
+    // 若此時釋放 fd，該編號可能立刻被新連線重用，導致不相干的連線被讀寫或重設。
     void close() {
         boost::system::error_code ec;
 
         if (socket_.is_open()) {
-            socket_.close(ec);
+            socket_.shutdown(tcp::socket::shutdown_both, ec);
         }
     }
 
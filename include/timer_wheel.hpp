@@ -0,0 +1,246 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+using namespace boost::asio;
+
+/**
+ * @file timer_wheel.hpp
+ * @brief 每個 io_context 一個的階層式 timing wheel，給數量大、精度要求低的逾時使用
+ *        (dial-back 時限、tunnel 閒置)。
+ *
+ * 每個 steady_timer 都是 reactor 中 heap 的一個項目，設定與取消是 O(log n) 並經過鎖。
+ * wheel_timer 嵌入在擁有者中，以雙向串列掛在 slot 上，設定與取消都是 O(1) 且不配置記憶體；
+ * 整個 wheel 只用一個 steady_timer，每 WHEEL_TICK 前進一格，沒有 timer 時停止。
+ *
+ * 共 WHEEL_LEVELS 層、每層 WHEEL_SLOTS 格，第 n 層的一格為 WHEEL_SLOTS^n 個 tick。
+ * timer 依距到期的 tick 數放在對應的層；較高層的格子輪到時，其中的 timer 依剩餘時間
+ * 重新放到較低層 (cascade)。timer 在設定的時間之後的第一個 tick 觸發。
+ *
+ * wheel 與掛在上面的 timer 只能在執行該 io_context 的線程上使用。
+ */
+
+constexpr auto WHEEL_TICK = std::chrono::milliseconds(100);
+constexpr unsigned WHEEL_BITS = 6;
+constexpr unsigned WHEEL_SLOTS = 1u << WHEEL_BITS;
+// 4 層可表示 64^4 個 tick (約 19 天)，更遠的到期時間提早到這個上限
+constexpr unsigned WHEEL_LEVELS = 4;
+
+class timer_wheel;
+
+/**
+ * @class wheel_timer
+ * @brief 掛在 timer_wheel 上的一次性 timer；handler 在構造時指定，每次 arm 重複使用。
+ *
+ * 解構時自動取消，因此擁有者須在 wheel 所屬的線程上解構 (或先在該線程上 cancel)。
+ */
+class wheel_timer {
+  public:
+    explicit wheel_timer(std::function<void()> handler) : handler_(std::move(handler)) {}
+    wheel_timer(const wheel_timer &) = delete;
+    wheel_timer &operator=(const wheel_timer &) = delete;
+
+    ~wheel_timer() {
+        cancel();
+    }
+
+    // delay 之後呼叫 handler；已設定時改為新的時間
+    void arm(timer_wheel &wheel, std::chrono::steady_clock::duration delay);
+
+    void cancel();
+
+    bool armed() const {
+        return wheel_ != nullptr;
+    }
+
+  private:
+    friend class timer_wheel;
+
+    std::function<void()> handler_;
+    timer_wheel *wheel_ = nullptr;
+    wheel_timer *prev_ = nullptr;
+    wheel_timer *next_ = nullptr;
+    uint64_t expiry_ = 0; // tick
+};
+
+/**
+ * @class timer_wheel
+ * @brief asio service：以 use_service<timer_wheel>(io_context) 取得該 io_context 的 wheel。
+ */
+class timer_wheel : public execution_context::service {
+  public:
+    static inline execution_context::id id;
+
+    explicit timer_wheel(io_context &context)
+        : execution_context::service(context), timer_(context) {}
+
+    // io_context 解構時先 shutdown 所有 service 再銷毀 handler：此後解構的 wheel_timer 不再碰 wheel
+    void shutdown() override {
+        for (auto &level : slots_) {
+            for (auto &head : level) {
+                while (head) {
+                    wheel_timer *timer = head;
+                    head = timer->next_;
+                    timer->wheel_ = nullptr;
+                }
+            }
+        }
+
+        boost::system::error_code ec;
+        timer_.cancel(ec);
+    }
+
+    // 目前掛在 wheel 上的 timer 數
+    size_t size() const {
+        return size_;
+    }
+
+  private:
+    friend class wheel_timer;
+
+    using clock = std::chrono::steady_clock;
+
+    void insert(wheel_timer &timer, clock::duration delay) {
+        if (!running_) {
+            // 停止期間 now_ 沒有前進，把它對齊到現在
+            epoch_ = clock::now() - int64_t(now_) * WHEEL_TICK;
+        }
+
+        // 時間到達 deadline 之後的第一個 tick
+        auto deadline = clock::now() + delay - epoch_;
+        uint64_t expiry = uint64_t((deadline + WHEEL_TICK - clock::duration(1)) / WHEEL_TICK);
+        timer.expiry_ = std::max(expiry, now_ + 1);
+        timer.wheel_ = this;
+        link(timer);
+        ++size_;
+
+        if (!running_) {
+            running_ = true;
+            do_tick();
+        }
+    }
+
+    void remove(wheel_timer &timer) {
+        unlink(timer);
+        timer.wheel_ = nullptr;
+        --size_;
+    }
+
+    wheel_timer *&slot(uint64_t expiry) {
+        uint64_t delta = expiry - now_;
+
+        for (unsigned level = 0; level + 1 < WHEEL_LEVELS; ++level) {
+            if (delta < uint64_t(1) << (WHEEL_BITS * (level + 1))) {
+                return slots_[level][(expiry >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            }
+        }
+
+        uint64_t top = (expiry >> (WHEEL_BITS * (WHEEL_LEVELS - 1))) & (WHEEL_SLOTS - 1);
+        return slots_[WHEEL_LEVELS - 1][top];
+    }
+
+    void link(wheel_timer &timer) {
+        uint64_t limit = (uint64_t(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        timer.expiry_ = std::min(timer.expiry_, now_ + limit);
+        wheel_timer *&head = slot(timer.expiry_);
+        timer.prev_ = nullptr;
+        timer.next_ = head;
+
+        if (head) {
+            head->prev_ = &timer;
+        }
+
+        head = &timer;
+    }
+
+    void unlink(wheel_timer &timer) {
+        if (timer.prev_) {
+            timer.prev_->next_ = timer.next_;
+        } else {
+            slot(timer.expiry_) = timer.next_;
+        }
+
+        if (timer.next_) {
+            timer.next_->prev_ = timer.prev_;
+        }
+
+        timer.prev_ = timer.next_ = nullptr;
+    }
+
+    // now_ 前進一格：進入較高層的新一格時先把其中的 timer 往下層放，再觸發第 0 層這一格
+    void advance() {
+        ++now_;
+        unsigned levels = 1;
+
+        while (levels < WHEEL_LEVELS
+                && ((now_ >> (WHEEL_BITS * (levels - 1))) & (WHEEL_SLOTS - 1)) == 0) {
+            ++levels;
+        }
+
+        for (unsigned level = levels - 1; level >= 1; --level) {
+            wheel_timer *&head = slots_[level][(now_ >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            wheel_timer *timer = head;
+            head = nullptr;
+
+            while (timer) {
+                wheel_timer *next = timer->next_;
+                link(*timer);
+                timer = next;
+            }
+        }
+
+        // handler 可能設定或取消其他 timer；新設定的 timer 最早在下一個 tick，不會落在這一格
+        wheel_timer *&head = slots_[0][now_ & (WHEEL_SLOTS - 1)];
+
+        while (head) {
+            wheel_timer &timer = *head;
+            remove(timer);
+            timer.handler_();
+        }
+    }
+
+    void do_tick() {
+        timer_.expires_at(epoch_ + int64_t(now_ + 1) * WHEEL_TICK);
+        timer_.async_wait([this](const boost::system::error_code & ec) {
+            if (ec) {
+                return;
+            }
+
+            // 線程忙碌時可能晚了好幾個 tick，一次補上
+            auto elapsed = clock::now() - epoch_;
+
+            while (now_ < uint64_t(elapsed / WHEEL_TICK)) {
+                advance();
+            }
+
+            if (size_ == 0) {
+                running_ = false;
+                return;
+            }
+
+            do_tick();
+        });
+    }
+
+    steady_timer timer_;
+    std::array<std::array<wheel_timer *, WHEEL_SLOTS>, WHEEL_LEVELS> slots_{};
+    clock::time_point epoch_; // tick 0 的時間
+    uint64_t now_ = 0;
+    size_t size_ = 0;
+    bool running_ = false;
+};
+
+inline void wheel_timer::arm(timer_wheel &wheel, std::chrono::steady_clock::duration delay) {
+    cancel();
+    wheel.insert(*this, delay);
+}
+
+inline void wheel_timer::cancel() {
+    if (wheel_) {
+        wheel_->remove(*this);
+    }
+}
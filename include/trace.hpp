@@ -0,0 +1,243 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace boost::asio;
+
+/**
+ * @file trace.hpp
+ * @brief 每條線程一個 ring buffer 的事件追蹤，輸出 Chrome trace JSON (chrome://tracing、Perfetto)。
+ *
+ * 設定環境變數 TRACE_FILE=<path> 時啟用，收到 SIGUSR1 時把所有線程目前保留的事件寫到該檔案
+ * (覆寫)；未設定時每個追蹤點只多一次判斷。每條線程保留最近 TRACE_EVENTS 個事件 (預設 65536)，
+ * 較舊的事件被覆蓋。
+ *
+ * 同一個 session 的事件以 session ID 串起來：proxy_server 在 SESSION frame 中把 ID 帶給
+ * expose，兩邊都以 id2.global 輸出，時間戳記為 system_clock，合併兩個檔案的 traceEvents
+ * 之後同一個 session 在兩個程式中的事件會顯示在同一條 async track 上。
+ */
+
+enum class TracePhase : char {
+    BEGIN = 'b',
+    END = 'e',
+    INSTANT = 'n',
+};
+
+/**
+ * @class trace_ring
+ * @brief 單一線程寫入的環狀事件佇列。
+ *
+ * 寫入端只做 relaxed store 並以 release 推進 head，不取鎖；讀取端 (dump) 在複製前後各讀一次
+ * head，丟棄複製期間可能被覆蓋的 slot。
+ */
+class trace_ring {
+  public:
+    struct event {
+        std::atomic<int64_t> ns{0}; // system_clock，自 epoch 起的 ns
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> id{0};
+        std::atomic<char> phase{0};
+    };
+
+    struct snapshot {
+        int64_t ns;
+        const char *name;
+        uint64_t id;
+        char phase;
+    };
+
+    explicit trace_ring(size_t capacity)
+        : events_(new event[capacity]), mask_(capacity - 1), tid_(int(::syscall(SYS_gettid))) {}
+
+    void record(const char *name, uint64_t id, TracePhase phase) {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::system_clock::now().time_since_epoch()).count();
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        event &slot = events_[head & mask_];
+        slot.ns.store(ns, std::memory_order_relaxed);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.id.store(id, std::memory_order_relaxed);
+        slot.phase.store(static_cast<char>(phase), std::memory_order_relaxed);
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // 可在任何線程呼叫；回傳時間順序的事件
+    std::vector<snapshot> read() const {
+        uint64_t end = head_.load(std::memory_order_acquire);
+        uint64_t begin = end > mask_ + 1 ? end - (mask_ + 1) : 0;
+        std::vector<snapshot> copied;
+        copied.reserve(end - begin);
+
+        for (uint64_t i = begin; i < end; ++i) {
+            const event &slot = events_[i & mask_];
+            copied.push_back({slot.ns.load(std::memory_order_relaxed),
+                              slot.name.load(std::memory_order_relaxed),
+                              slot.id.load(std::memory_order_relaxed),
+                              slot.phase.load(std::memory_order_relaxed)});
+        }
+
+        // 複製期間寫入端可能已經繞回並覆寫了最舊的 slot；head 所指的 slot 可能正在寫入，同樣不可信
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = head_.load(std::memory_order_relaxed);
+        uint64_t valid = after + 1 > mask_ + 1 ? after + 1 - (mask_ + 1) : 0;
+
+        if (valid > begin) {
+            copied.erase(copied.begin(),
+                         copied.begin() + std::min<uint64_t>(valid - begin, copied.size()));
+        }
+
+        return copied;
+    }
+
+    int tid() const {
+        return tid_;
+    }
+
+  private:
+    std::unique_ptr<event[]> events_;
+    uint64_t mask_;
+    int tid_;
+    std::atomic<uint64_t> head_{0};
+};
+
+/**
+ * @class trace_registry
+ * @brief 所有線程的 trace_ring；線程第一次記錄事件時登記，結束後保留到 dump。
+ */
+class trace_registry {
+  public:
+    static trace_registry &instance() {
+        static trace_registry registry;
+        return registry;
+    }
+
+    // TRACE_FILE 有設定時啟用
+    bool enabled() const {
+        return !path_.empty();
+    }
+
+    static trace_ring &local() {
+        thread_local trace_ring *ring = instance().attach();
+        return *ring;
+    }
+
+    // 以 Chrome trace JSON 寫出所有線程的事件；process 為顯示的程式名稱
+    bool dump(const char *process) {
+        std::vector<std::shared_ptr<trace_ring>> rings;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings = rings_;
+        }
+
+        std::FILE *file = std::fopen(path_.c_str(), "w");
+
+        if (file == nullptr) {
+            return false;
+        }
+
+        int pid = int(::getpid());
+        std::fprintf(file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}}", pid, process);
+
+        for (auto &ring : rings) {
+            for (auto &event : ring->read()) {
+                std::fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"session\",\"ph\":\"%c\","
+                             "\"ts\":%lld.%03d,\"pid\":%d,\"tid\":%d", event.name, event.phase,
+                             (long long)(event.ns / 1000), int(event.ns % 1000), pid, ring->tid());
+
+                if (event.id != 0) {
+                    std::fprintf(file, ",\"id2\":{\"global\":\"0x%llx\"}}",
+                                 (unsigned long long)event.id);
+                } else {
+                    std::fprintf(file, ",\"s\":\"t\"}");
+                }
+            }
+        }
+
+        std::fprintf(file, "\n]}\n");
+        return std::fclose(file) == 0;
+    }
+
+  private:
+    trace_registry() {
+        const char *path = std::getenv("TRACE_FILE");
+        const char *events = std::getenv("TRACE_EVENTS");
+        path_ = path ? path : "";
+        size_t requested = events ? std::strtoul(events, nullptr, 10) : 65536;
+
+        // 取整到 2 的冪次，以遮罩取 slot
+        while (capacity_ < requested) {
+            capacity_ <<= 1;
+        }
+    }
+
+    trace_ring *attach() {
+        auto ring = std::make_shared<trace_ring>(capacity_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(ring);
+        return ring.get();
+    }
+
+    std::string path_;
+    size_t capacity_ = 1;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<trace_ring>> rings_;
+};
+
+// TRACE_FILE 有設定時為 true；追蹤點以此判斷，未啟用時不做其他事
+inline bool tracing() {
+    static const bool enabled = trace_registry::instance().enabled();
+    return enabled;
+}
+
+/**
+ * 記錄一個事件；name 須為字串常值 (dump 時才讀取)。
+ * id 為 session ID，0 表示不屬於任何 session (輸出為線程上的 instant event)。
+ */
+inline void trace_event(const char *name, uint64_t id = 0, TracePhase phase = TracePhase::INSTANT) {
+    if (tracing()) {
+        trace_registry::local().record(name, id, phase);
+    }
+}
+
+// 新的 session ID；未啟用時為 0。高位元放 pid，重新啟動後的 ID 不與之前的 trace 重複
+inline uint64_t new_trace_id() {
+    static std::atomic<uint64_t> next{(uint64_t(::getpid()) << 32) | 1};
+    return tracing() ? next.fetch_add(1, std::memory_order_relaxed) : 0;
+}
+
+inline void do_dump_trace(std::shared_ptr<signal_set> signals, const char *process) {
+    signals->async_wait([signals, process](const boost::system::error_code & ec, int) {
+        if (ec) {
+            return;
+        }
+
+        if (trace_registry::instance().dump(process)) {
+            std::cout << "Trace written" << std::endl;
+        } else {
+            std::cerr << "Trace not written" << std::endl;
+        }
+
+        do_dump_trace(signals, process);
+    });
+}
+
+// TRACE_FILE 有設定時，收到 SIGUSR1 就把事件寫到該檔案 (在 context 的線程上寫出)
+inline void dump_trace_on_signal(io_context &context, const char *process) {
+    if (tracing()) {
+        do_dump_trace(std::make_shared<signal_set>(context, SIGUSR1), process);
+    }
+}
@@ -0,0 +1,461 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+#include "metrics.hpp"
+#include "protocol.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+using ip::udp;
+
+/**
+ * @file udp_tunnel.hpp
+ * @brief TunnelMode::UDP：datagram 以 frame 的形式經控制連線在 proxy_server 與 expose 之間轉送。
+ *
+ * frame：[flow: 4 bytes][length: 2 bytes][payload]，皆為 network byte order
+ *
+ * flow 由 proxy_server 依 client 的 (位址, port) 分配；expose 為每個 flow 開一個連到 target 的
+ * UDP socket，target 的回應以同一個 flow 送回。兩端各自在 flow 閒置 udp_idle_timeout() 後釋放狀態，
+ * 之後同一個 client 再送資料時重新建立，不需要額外的控制訊息。flow 數達到 udp_max_flows() 時
+ * 新的 flow 取代最久沒有流量的 flow，偽造來源位址的 datagram 不能讓兩端無限制地配置狀態與 socket。
+ *
+ * UDP socket 以 recvmmsg/sendmmsg 一次處理最多 udp_batch() 個 datagram；一批收到的 datagram
+ * 併成一次 TCP 寫入，一次 TCP 讀到的 frame 也併成 sendmmsg。tunnel 或 socket buffer 滿了就丟棄，
+ * 與 UDP 本身的語意相同。一條 UDP tunnel 的所有 socket 都在控制連線所在的 shard 上，不需要 strand。
+ * Linux 以外沒有 recvmmsg/sendmmsg，改為每個 datagram 各一次 receive_from/send_to。
+ */
+
+constexpr size_t UDP_FRAME_HEADER = 6;
+constexpr size_t UDP_MAX_DATAGRAM = 65535;
+// 每次 socket 可讀時最多連續收幾批，避免單一 tunnel 長時間佔用線程
+constexpr int UDP_ROUNDS = 8;
+// 尚未寫進控制連線的 bytes 上限，超過就丟棄新的 datagram
+constexpr size_t UDP_LINK_BACKLOG = 4 * 1024 * 1024;
+
+// 環境變數 UDP_BATCH：每次 recvmmsg/sendmmsg 最多處理的 datagram 數 (1 ~ 64，預設 32)
+inline size_t udp_batch() {
+    static const size_t batch = []() -> size_t {
+        const char *value = std::getenv("UDP_BATCH");
+        size_t n = value ? std::strtoul(value, nullptr, 10) : 32;
+        return std::min<size_t>(std::max<size_t>(n, 1), 64);
+    }();
+    return batch;
+}
+
+// 環境變數 UDP_IDLE_TIMEOUT：flow 閒置多少秒後釋放 (預設 60)
+inline std::chrono::seconds udp_idle_timeout() {
+    static const std::chrono::seconds timeout = []() {
+        const char *value = std::getenv("UDP_IDLE_TIMEOUT");
+        long seconds = value ? std::strtol(value, nullptr, 10) : 60;
+        return std::chrono::seconds(std::max(seconds, 1L));
+    }();
+    return timeout;
+}
+
+// 環境變數 UDP_MAX_FLOWS：每個 UDP tunnel 最多同時追蹤的 flow 數 (預設 1024)
+inline size_t udp_max_flows() {
+    static const size_t max_flows = []() -> size_t {
+        const char *value = std::getenv("UDP_MAX_FLOWS");
+        size_t n = value ? std::strtoul(value, nullptr, 10) : 1024;
+        return std::max<size_t>(n, 1);
+    }();
+    return max_flows;
+}
+
+/**
+ * @struct udp_metrics
+ * @brief UDP tunnel 收到的 datagram (upstream 為 client -> target)、丟棄的 datagram、
+ * 批次 syscall 的次數與目前的 flow 數。datagrams / syscalls 即平均批次大小。
+ */
+struct udp_metrics {
+    counter upstream{"tunnel_udp_datagrams_total", "Datagrams received from UDP sockets.",
+                     "direction=\"upstream\""};
+    counter downstream{"tunnel_udp_datagrams_total", "Datagrams received from UDP sockets.",
+                       "direction=\"downstream\""};
+    counter dropped{"tunnel_udp_dropped_total",
+                    "Datagrams dropped because a tunnel or socket buffer was full."};
+    counter syscalls{"tunnel_udp_syscalls_total",
+                     "recvmmsg and sendmmsg calls made by UDP tunnels."};
+    gauge flows{"tunnel_udp_flows", "UDP flows currently tracked."};
+    counter evicted{"tunnel_udp_evicted_total",
+                    "UDP flows dropped early because a tunnel reached UDP_MAX_FLOWS."};
+};
+
+inline udp_metrics &udp_stats() {
+    static udp_metrics metrics;
+    return metrics;
+}
+
+/**
+ * @class flow_order
+ * @brief 依最後一次流量排序的 flow ID，最久沒有流量的在最前面。
+ *
+ * 閒置釋放與達到上限時的取代都只需要從前面取，不必掃過所有 flow。
+ */
+class flow_order {
+  public:
+    struct entry {
+        uint32_t flow;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    using iterator = std::list<entry>::iterator;
+
+    iterator add(uint32_t flow, std::chrono::steady_clock::time_point now) {
+        return order_.insert(order_.end(), entry{flow, now});
+    }
+
+    void touch(iterator it, std::chrono::steady_clock::time_point now) {
+        it->last = now;
+        order_.splice(order_.end(), order_, it);
+    }
+
+    void erase(iterator it) {
+        order_.erase(it);
+    }
+
+    bool empty() const {
+        return order_.empty();
+    }
+
+    const entry &oldest() const {
+        return order_.front();
+    }
+
+  private:
+    std::list<entry> order_;
+};
+
+/**
+ * 以 recvmmsg 從 non-blocking 的 socket 收一批 datagram，對每個呼叫 visit(data, size, peer)，
+ * 回傳收到的數量 (沒有資料時為 0)。收件的 buffer 是每條線程共用的，visit 必須在返回前用完資料。
+ */
+template <typename Visitor>
+size_t receive_datagrams(udp::socket &socket, Visitor &&visit) {
+#ifdef __linux__
+    struct storage {
+        std::vector<mmsghdr> headers;
+        std::vector<iovec> vectors;
+        std::vector<udp::endpoint> peers;
+        std::vector<char> data;
+    };
+
+    thread_local storage local;
+    size_t batch = udp_batch();
+
+    if (local.headers.size() != batch) {
+        local.headers.resize(batch);
+        local.vectors.resize(batch);
+        local.peers.resize(batch);
+        local.data.resize(batch * UDP_MAX_DATAGRAM);
+    }
+
+    for (size_t i = 0; i < batch; ++i) {
+        local.vectors[i] = {&local.data[i * UDP_MAX_DATAGRAM], UDP_MAX_DATAGRAM};
+        local.headers[i].msg_hdr = {};
+        local.headers[i].msg_hdr.msg_name = local.peers[i].data();
+        local.headers[i].msg_hdr.msg_namelen = static_cast<socklen_t>(local.peers[i].capacity());
+        local.headers[i].msg_hdr.msg_iov = &local.vectors[i];
+        local.headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(socket.native_handle(), local.headers.data(), static_cast<unsigned>(batch),
+                     MSG_DONTWAIT, nullptr);
+    udp_stats().syscalls.add();
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        local.peers[i].resize(local.headers[i].msg_hdr.msg_namelen);
+        visit(static_cast<const char *>(local.vectors[i].iov_base),
+              size_t(local.headers[i].msg_len), local.peers[i]);
+    }
+
+    return size_t(n);
+#else
+    thread_local std::vector<char> data(UDP_MAX_DATAGRAM);
+    udp::endpoint peer;
+    size_t count = 0;
+
+    while (count < udp_batch()) {
+        boost::system::error_code ec;
+        size_t n = socket.receive_from(buffer(data), peer, 0, ec);
+        udp_stats().syscalls.add();
+
+        if (ec) {
+            break;
+        }
+
+        visit(static_cast<const char *>(data.data()), n, peer);
+        ++count;
+    }
+
+    return count;
+#endif
+}
+
+/**
+ * @class datagram_sender
+ * @brief 收集要送出的 datagram，同一個 socket 的連續 datagram 以一次 sendmmsg 送出。
+ *
+ * 只保存指標，資料須在 flush 之前保持有效；socket buffer 滿時丟棄剩下的 datagram。
+ */
+class datagram_sender {
+  public:
+#ifdef __linux__
+    datagram_sender() : headers_(udp_batch()), vectors_(udp_batch()), peers_(udp_batch()) {}
+#else
+    datagram_sender() : items_(udp_batch()), peers_(udp_batch()) {}
+#endif
+
+    // peer 為 nullptr 時送往 connected socket 的對端
+    void add(udp::socket &socket, const udp::endpoint *peer, const char *data, size_t size) {
+        if (&socket != socket_ || count_ == peers_.size()) {
+            flush();
+            socket_ = &socket;
+        }
+
+#ifdef __linux__
+        vectors_[count_] = {const_cast<char *>(data), size};
+        mmsghdr &header = headers_[count_];
+        header.msg_hdr = {};
+        header.msg_hdr.msg_iov = &vectors_[count_];
+        header.msg_hdr.msg_iovlen = 1;
+
+        if (peer) {
+            peers_[count_] = *peer;
+            header.msg_hdr.msg_name = peers_[count_].data();
+            header.msg_hdr.msg_namelen = static_cast<socklen_t>(peers_[count_].size());
+        }
+#else
+        items_[count_] = {data, size, peer != nullptr};
+
+        if (peer) {
+            peers_[count_] = *peer;
+        }
+#endif
+
+        ++count_;
+    }
+
+    void flush() {
+        size_t sent = 0;
+
+#ifdef __linux__
+        while (sent < count_) {
+            int n = sendmmsg(socket_->native_handle(), &headers_[sent],
+                             static_cast<unsigned>(count_ - sent), MSG_DONTWAIT);
+            udp_stats().syscalls.add();
+
+            if (n > 0) {
+                sent += size_t(n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                // EAGAIN 或對端 ICMP 錯誤：跳過目前這個，其餘再試一次
+                udp_stats().dropped.add();
+                ++sent;
+            }
+        }
+#else
+        for (; sent < count_; ++sent) {
+            boost::system::error_code ec;
+            auto data = buffer(items_[sent].data, items_[sent].size);
+
+            if (items_[sent].addressed) {
+                socket_->send_to(data, peers_[sent], 0, ec);
+            } else {
+                socket_->send(data, 0, ec);
+            }
+
+            udp_stats().syscalls.add();
+
+            if (ec) {
+                udp_stats().dropped.add();
+            }
+        }
+#endif
+
+        count_ = 0;
+    }
+
+  private:
+#ifdef __linux__
+    std::vector<mmsghdr> headers_;
+    std::vector<iovec> vectors_;
+#else
+    struct item {
+        const char *data;
+        size_t size;
+        bool addressed;
+    };
+
+    std::vector<item> items_;
+#endif
+    std::vector<udp::endpoint> peers_;
+    size_t count_ = 0;
+    udp::socket *socket_ = nullptr;
+};
+
+struct datagram {
+    uint32_t flow;
+    const char *data;
+    size_t size;
+};
+
+/**
+ * @class datagram_link
+ * @brief 以控制連線 (TCP) 承載 datagram frame 的一端。
+ *
+ * send 只把 frame 附加到待寫 buffer，flush 時才開始寫入；寫入進行中附加的 frame 在完成後一起寫出。
+ * 每次讀到的完整 frame 一起交給 frame handler，指標在 handler 返回前有效。
+ * close 之後兩個 handler 都被釋放，它們捕獲的擁有者 (持有這個 link) 不會因循環參照而留下。
+ */
+class datagram_link : public std::enable_shared_from_this<datagram_link> {
+  public:
+    using frame_handler = std::function<void(const std::vector<datagram> &)>;
+    using close_handler = std::function<void()>;
+
+    explicit datagram_link(tcp::socket socket) : socket_(std::move(socket)), in_(IN_BUF_SIZE) {}
+
+    void start(frame_handler on_frames, close_handler on_close) {
+        on_frames_ = std::move(on_frames);
+        on_close_ = std::move(on_close);
+        do_read();
+    }
+
+    // 附加一個 frame；待寫的資料已達上限時丟棄並回傳 false
+    bool send(uint32_t flow, const char *data, size_t size) {
+        if (closed_ || pending_.size() + UDP_FRAME_HEADER + size > UDP_LINK_BACKLOG) {
+            udp_stats().dropped.add();
+            return false;
+        }
+
+        size_t offset = pending_.size();
+        pending_.resize(offset + UDP_FRAME_HEADER + size);
+        put_be(&pending_[offset], flow);
+        put_be(&pending_[offset + 4], static_cast<uint16_t>(size));
+        std::memcpy(&pending_[offset + UDP_FRAME_HEADER], data, size);
+        return true;
+    }
+
+    void flush() {
+        if (writing_ || pending_.empty() || closed_) {
+            return;
+        }
+
+        auto self(shared_from_this());
+        writing_ = true;
+        std::swap(pending_, out_);
+        async_write(socket_, buffer(out_),
+        [this, self](const boost::system::error_code & ec, size_t) {
+            writing_ = false;
+            out_.clear();
+
+            if (ec) {
+                close();
+                return;
+            }
+
+            flush();
+        });
+    }
+
+    void close() {
+        if (closed_) {
+            return;
+        }
+
+        closed_ = true;
+        boost::system::error_code ec;
+        socket_.close(ec);
+
+        // frame handler 執行中 (由它呼叫 close) 時在它返回後才釋放
+        if (!dispatching_) {
+            on_frames_ = nullptr;
+        }
+
+        if (on_close_) {
+            std::exchange(on_close_, nullptr)();
+        }
+    }
+
+  private:
+    static constexpr size_t IN_BUF_SIZE = 256 * 1024;
+
+    void do_read() {
+        auto self(shared_from_this());
+        socket_.async_read_some(buffer(in_.data() + end_, in_.size() - end_),
+        [this, self](const boost::system::error_code & ec, size_t n) {
+            if (ec) {
+                close();
+                return;
+            }
+
+            end_ += n;
+            size_t begin = 0;
+            frames_.clear();
+
+            while (end_ - begin >= UDP_FRAME_HEADER) {
+                datagram frame;
+                frame.flow = get_be<uint32_t>(&in_[begin]);
+                uint16_t length = get_be<uint16_t>(&in_[begin + 4]);
+
+                if (end_ - begin < UDP_FRAME_HEADER + length) {
+                    break;
+                }
+
+                frame.data = &in_[begin + UDP_FRAME_HEADER];
+                frame.size = length;
+                frames_.push_back(frame);
+                begin += UDP_FRAME_HEADER + length;
+            }
+
+            if (!frames_.empty()) {
+                dispatching_ = true;
+                on_frames_(frames_);
+                dispatching_ = false;
+            }
+
+            if (closed_) {
+                on_frames_ = nullptr;
+                return;
+            }
+
+            // 不完整的 frame 移到開頭，等下一次讀取補齊
+            std::memmove(in_.data(), in_.data() + begin, end_ - begin);
+            end_ -= begin;
+            do_read();
+        });
+    }
+
+    tcp::socket socket_;
+    std::vector<char> in_;
+    size_t end_ = 0;
+    std::vector<datagram> frames_;
+    std::vector<char> pending_;
+    std::vector<char> out_;
+    bool writing_ = false;
+    bool closed_ = false;
+    bool dispatching_ = false;
+    frame_handler on_frames_;
+    close_handler on_close_;
+};
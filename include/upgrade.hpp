@@ -0,0 +1,320 @@
+#pragma once
+
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.hpp"
+
+/**
+ * @file upgrade.hpp
+ * @brief 不中斷服務的程式更新：舊的 proxy_server 把 listener 與連線的 fd 經 Unix socket
+ * (SCM_RIGHTS) 交給新程式。
+ *
+ * 設定 UPGRADE_SOCKET=<path> 時，proxy_server 在該路徑等待下一版。以同樣設定啟動的新程式
+ * 先連到這個路徑：連得上就接手舊程式的 listener、控制連線與等待 dial-back 的 client，
+ * 之後才開始服務並在同一個路徑等待再下一版；連不上 (沒有舊程式) 才自己 bind。
+ * listener 的 fd 在交接期間一直開著，這段時間到達的連線留在 kernel 的 backlog 中由新程式 accept，
+ * 不會被拒絕。已開始轉送的 tunnel 留在舊程式中直到結束 (最多 UPGRADE_DRAIN 秒)。
+ * 只在 Unix 上編譯 (proxy_server 以 `#if defined(__unix__)` 引入)，其他平台不支援交接。
+ *
+ * 使用 SOCK_SEQPACKET：每筆 record 一次 sendmsg，邊界與附帶的 fd 不會和其他 record 混在一起。
+ * 新程式先送出 HELLO：[version: 1]，版本相同時舊程式依序回覆以下 record
+ * (欄位皆為 network byte order)，以 END 結束；版本不同時舊程式關閉連線並繼續服務：
+ * - LISTENER：[port: 2]，附帶該 port 的所有 acceptor (每個 shard 一個)。
+ * - CONTROL：[mode: 1][codec: 1][heartbeat: 2][token: 8][count: 2]
+ *   [mapping: 2][port: 2][name_length: 1][name] * count [unread_length: 4][unread]
+ *   [unsent_length: 4][unsent]，附帶控制連線。mode 為 GROUP 時 count 個 mapping 共用這條連線，
+ *   否則 count 為 1；token 為 POOL 的停放 token。unread 是已讀到但還沒解析的輸入，
+ *   unsent 是還沒寫出的 frame (可能從某個 frame 的中間開始)，新程式先寫出它們。
+ * - PARKED：[control: 4]，附帶第 control 個 CONTROL 的停放連線 (最多 UPGRADE_MAX_FDS 條)。
+ * - SESSION：[control: 4][mapping: 2][token: 8][session: 8]，附帶 client；SESSION frame 已經送出，
+ *   新程式以同一個 token 等待資料連線。
+ * - END：沒有欄位。
+ * 新程式收到 END 並接手全部 record 之後回覆 READY (沒有欄位)，在這之前失敗時直接結束，
+ * 不以部分的 listener 與連線開始服務。舊程式收到 READY 才關閉交出的 fd 並結束；
+ * 連線中斷或 UPGRADE_READY_TIMEOUT 內沒有收到時收回交出的 listener 與連線，繼續服務。
+ */
+
+enum class UpgradeRecord : uint8_t {
+    LISTENER = 0,
+    CONTROL = 1,
+    PARKED = 2,
+    SESSION = 3,
+    END = 4,
+    HELLO = 5,
+    READY = 6,
+};
+
+constexpr uint8_t UPGRADE_VERSION = 2;
+
+// 舊程式送出 END 之後等待 READY 的上限
+constexpr auto UPGRADE_READY_TIMEOUT = std::chrono::seconds(10);
+
+// 一筆 record 最多的 bytes 與附帶的 fd 數
+constexpr size_t UPGRADE_MAX_RECORD = 256 * 1024;
+constexpr size_t UPGRADE_MAX_FDS = 64;
+
+// 環境變數 UPGRADE_SOCKET：交接用的 Unix socket 路徑，未設定時不支援交接
+inline const std::string &upgrade_path() {
+    static const std::string path = []() {
+        const char *value = std::getenv("UPGRADE_SOCKET");
+        return std::string(value ? value : "");
+    }();
+    return path;
+}
+
+// 環境變數 UPGRADE_DRAIN：交出之後等待既有 tunnel 結束的最長時間 (秒)，預設 300 秒
+inline std::chrono::seconds upgrade_drain() {
+    static const std::chrono::seconds drain = []() {
+        const char *value = std::getenv("UPGRADE_DRAIN");
+        return std::chrono::seconds(value ? std::strtoul(value, nullptr, 10) : 300);
+    }();
+    return drain;
+}
+
+// 複製一個 fd 交給其他程式；原本的 fd 照常關閉，連線由複製的 fd 保持
+inline int duplicate_fd(int fd) {
+    return fd < 0 ? -1 : ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/**
+ * @class record_writer
+ * @brief 組出一筆交接 record。
+ */
+class record_writer {
+  public:
+    explicit record_writer(UpgradeRecord type) {
+        data_.push_back(static_cast<char>(type));
+    }
+
+    template <typename T>
+    record_writer &put(T value) {
+        size_t offset = data_.size();
+        data_.resize(offset + sizeof(T));
+        put_be(&data_[offset], value);
+        return *this;
+    }
+
+    // [length: 1][bytes]
+    record_writer &put_name(const std::string &name) {
+        put(static_cast<uint8_t>(name.size()));
+        data_.insert(data_.end(), name.begin(), name.end());
+        return *this;
+    }
+
+    // [length: 4][bytes]
+    record_writer &put_bytes(const std::vector<char> &bytes) {
+        put(static_cast<uint32_t>(bytes.size()));
+        data_.insert(data_.end(), bytes.begin(), bytes.end());
+        return *this;
+    }
+
+    const std::vector<char> &data() const {
+        return data_;
+    }
+
+  private:
+    std::vector<char> data_;
+};
+
+/**
+ * @class record_reader
+ * @brief 依序讀出一筆 record 的欄位；長度不足時拋出例外。
+ */
+class record_reader {
+  public:
+    explicit record_reader(const std::vector<char> &data) : data_(data) {}
+
+    UpgradeRecord type() {
+        return static_cast<UpgradeRecord>(get<uint8_t>());
+    }
+
+    template <typename T>
+    T get() {
+        return get_be<T>(take(sizeof(T)));
+    }
+
+    std::string get_name() {
+        size_t length = get<uint8_t>();
+        const char *name = take(length);
+        return std::string(name, length);
+    }
+
+    std::vector<char> get_bytes() {
+        size_t length = get<uint32_t>();
+        const char *bytes = take(length);
+        return std::vector<char>(bytes, bytes + length);
+    }
+
+  private:
+    const char *take(size_t size) {
+        if (data_.size() - offset_ < size) {
+            throw std::runtime_error("truncated upgrade record");
+        }
+
+        offset_ += size;
+        return data_.data() + offset_ - size;
+    }
+
+    const std::vector<char> &data_;
+    size_t offset_ = 0;
+};
+
+/**
+ * @class upgrade_link
+ * @brief 交接用的 SOCK_SEQPACKET 連線 (阻塞式)，每筆 record 可附帶 fd。
+ */
+class upgrade_link {
+  public:
+    explicit upgrade_link(int fd) : fd_(fd) {}
+
+    ~upgrade_link() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    upgrade_link(const upgrade_link &) = delete;
+    upgrade_link &operator=(const upgrade_link &) = delete;
+
+    // 連到舊程式；沒有程式在該路徑等待時回傳 -1
+    static int connect(const std::string &path) {
+        int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        sockaddr_un address = unix_address(path);
+
+        if (fd >= 0
+                && ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        return -1;
+    }
+
+    // 在 path 等待下一版 (移除先前留下的路徑)；失敗時拋出例外
+    static int listen(const std::string &path) {
+        int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        sockaddr_un address = unix_address(path);
+        ::unlink(path.c_str());
+
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+                || ::listen(fd, 1) != 0) {
+            int error = errno;
+
+            if (fd >= 0) {
+                ::close(fd);
+            }
+
+            throw std::system_error(error, std::generic_category(), "upgrade socket " + path);
+        }
+
+        return fd;
+    }
+
+    // 送出一筆 record；fds 在送出後仍由呼叫端關閉
+    void send(const record_writer &record, const std::vector<int> &fds = {}) {
+        const auto &data = record.data();
+        iovec iov{const_cast<char *>(data.data()), data.size()};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        std::vector<char> control;
+
+        if (!fds.empty()) {
+            control.resize(CMSG_SPACE(sizeof(int) * fds.size()));
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+            cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+        }
+
+        while (::sendmsg(fd_, &message, MSG_NOSIGNAL) < 0) {
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "upgrade send");
+            }
+        }
+    }
+
+    // 之後的 receive 最多等待 timeout，逾時拋出例外
+    void set_receive_timeout(std::chrono::milliseconds timeout) {
+        timeval value{};
+        value.tv_sec = timeout.count() / 1000;
+        value.tv_usec = (timeout.count() % 1000) * 1000;
+        ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &value, sizeof(value));
+    }
+
+    // 收到一筆 record 與附帶的 fd (由呼叫端接手)；對方關閉時回傳 false
+    bool receive(std::vector<char> &data, std::vector<int> &fds) {
+        data.resize(UPGRADE_MAX_RECORD);
+        fds.clear();
+        iovec iov{data.data(), data.size()};
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS));
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        ssize_t n;
+
+        while ((n = ::recvmsg(fd_, &message, MSG_CMSG_CLOEXEC)) < 0) {
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "upgrade receive");
+            }
+        }
+
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header;
+                header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+                size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                size_t offset = fds.size();
+                fds.resize(offset + count);
+                std::memcpy(&fds[offset], CMSG_DATA(header), sizeof(int) * count);
+            }
+        }
+
+        if (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            for (int fd : fds) {
+                ::close(fd);
+            }
+
+            throw std::runtime_error("upgrade record truncated");
+        }
+
+        data.resize(size_t(n));
+        return n > 0;
+    }
+
+  private:
+    static sockaddr_un unix_address(const std::string &path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("upgrade socket path too long: " + path);
+        }
+
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    int fd_;
+};
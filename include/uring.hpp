@@ -0,0 +1,848 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "handler_memory.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// multishot recv 與 provided buffer ring 需要 6.0 以後的 kernel header
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+using namespace boost::asio;
+
+/**
+ * @file uring.hpp
+ * @brief depipe 的 io_uring 引擎 (DEPIPE_ENGINE=uring)，不依賴 liburing，直接使用 syscall。
+ *
+ * 每個 io_context (shard) 一個 ring，以 asio service 的形式存在：ring 的 fd 交給 asio 的 reactor 等待，
+ * 有 completion 時在 shard 的線程上處理，新的 SQE 累積到這一輪 handler 結束後以一次 io_uring_enter 送出。
+ *
+ * 每條 tunnel 的兩個 socket 登記為 fixed file，每個方向一個 provided buffer ring (向 kernel 註冊的
+ * buffer，kernel 收到資料時自行挑選)，以一個 multishot recv 持續接收；轉送時把已收到的 chunk
+ * 以一個 sendmsg 一起送出，送完才把 buffer 還給 kernel。buffer 全部在排隊時 recv 以 ENOBUFS 結束，
+ * 即為背壓，送出後再重新發起。
+ *
+ * kernel 不支援 (io_uring 被停用、沒有 multishot recv 或 buffer ring) 或 fixed file 用完時，
+ * depipe 退回 epoll 的 copy 引擎。
+ */
+
+#ifdef HAVE_IO_URING
+
+// SQ 的大小；CQ 為 4 倍
+constexpr unsigned URING_ENTRIES = 256;
+// 每個 ring 的 fixed file 數，每條 tunnel 使用 2 個
+constexpr unsigned URING_FILES = 4096;
+// 每個方向的 buffer 數 (2 的次方) 與大小，合計即排隊量上限
+constexpr unsigned URING_BUFFERS = 8;
+constexpr size_t URING_CHUNK = 64 * 1024;
+// tunnel 結束後保留重用的 buffer ring 數，超過的向 kernel 註銷
+constexpr size_t URING_SPARE_BUFFERS = 64;
+
+// ring 上一個進行中的操作；SQE 的 user_data 指向它
+class uring_operation {
+  public:
+    virtual void complete(int result, unsigned flags) = 0;
+
+  protected:
+    ~uring_operation() = default;
+};
+
+/**
+ * @class uring_buffers
+ * @brief 一組向 kernel 註冊的 provided buffer (buffer group)。
+ *
+ * kernel 從 ring 中取用 buffer，用完後以 give 歸還；publish 之後 kernel 才看得到。
+ */
+class uring_buffers {
+  public:
+    uring_buffers(uint16_t _group, io_uring_buf_ring *_ring, char *_data)
+        : group(_group), ring(_ring), data(_data) {}
+
+    char *chunk(uint16_t id) const {
+        return data + size_t(id) * URING_CHUNK;
+    }
+
+    void give(uint16_t id) {
+        // tail 與第一個 buffer 的保留欄位共用記憶體，只寫入 addr、len 與 bid。
+        // 不使用 ring->bufs：header 的 flexible array 在 C++ 中多出 1 byte 的空 struct，位移會錯
+        auto &buf = reinterpret_cast<io_uring_buf *>(ring)[tail & (URING_BUFFERS - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(chunk(id));
+        buf.len = URING_CHUNK;
+        buf.bid = id;
+        ++tail;
+    }
+
+    void publish() {
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    const uint16_t group;
+    io_uring_buf_ring *const ring;
+    char *const data;
+
+  private:
+    uint16_t tail = 0;
+};
+
+/**
+ * @class uring_service
+ * @brief 一個 io_context 的 io_uring：SQ/CQ、fixed file table 與 buffer group 的配置。
+ *
+ * 只能在執行該 io_context 的線程上使用。
+ */
+class uring_service : public execution_context::service {
+  public:
+    static inline execution_context::id id;
+
+    explicit uring_service(io_context &context)
+        : execution_context::service(context), context_(context), notifier_(context) {
+        ok_ = setup() && probe();
+
+        if (ok_) {
+            notifier_.assign(ring_fd_);
+            do_wait();
+        } else if (ring_fd_ >= 0) {
+            ::close(ring_fd_);
+        }
+    }
+
+    ~uring_service() override {
+        boost::system::error_code ec;
+        notifier_.close(ec);
+
+        for (auto &buffers : owned_) {
+            ::munmap(buffers->ring, ring_bytes());
+            ::munmap(buffers->data, URING_BUFFERS * URING_CHUNK);
+        }
+
+        if (sq_ptr_) {
+            ::munmap(sqes_, sqes_bytes_);
+            ::munmap(sq_ptr_, sq_bytes_);
+
+            if (cq_ptr_ != sq_ptr_) {
+                ::munmap(cq_ptr_, cq_bytes_);
+            }
+        }
+    }
+
+    void shutdown() override {
+        boost::system::error_code ec;
+        notifier_.cancel(ec);
+    }
+
+    bool available() const {
+        return ok_;
+    }
+
+    // SQ 至少有 n 個空位；不足時先送出累積的 SQE 讓 kernel 取走
+    bool has_room(unsigned n) {
+        if (sq_entries_ - (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) >= n) {
+            return true;
+        }
+
+        submit();
+        return sq_entries_ - (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) >= n;
+    }
+
+    // 取得下一個 SQE (已清空)；送出延到這一輪 handler 結束。
+    // SQ 已滿且 kernel 暫時不收 (CQ 積壓) 時回傳 nullptr，不覆寫 kernel 還沒取走的 SQE
+    io_uring_sqe *next_sqe() {
+        if (!has_room(1)) {
+            return nullptr;
+        }
+
+        io_uring_sqe *sqe = &sqes_[sq_tail_ & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++sq_tail_;
+        ++unsubmitted_;
+
+        if (!submit_posted_) {
+            submit_posted_ = true;
+            post(context_, make_pooled_handler([this]() {
+                submit_posted_ = false;
+                submit();
+            }));
+        }
+
+        return sqe;
+    }
+
+    // 登記為 fixed file，回傳 index；table 已滿時回傳 -1
+    int add_file(int fd) {
+        if (free_files_.empty()) {
+            return -1;
+        }
+
+        int index = free_files_.back();
+
+        if (!update_file(index, fd)) {
+            return -1;
+        }
+
+        free_files_.pop_back();
+        return index;
+    }
+
+    // 須在這個 file 上沒有進行中的操作之後呼叫
+    void remove_file(int index) {
+        update_file(index, -1);
+        free_files_.push_back(index);
+    }
+
+    // 取得一組 buffer (全部在 kernel 手上)；失敗時回傳 nullptr
+    uring_buffers *acquire_buffers() {
+        if (!spare_.empty()) {
+            uring_buffers *buffers = spare_.back();
+            spare_.pop_back();
+            return buffers;
+        }
+
+        if (free_groups_.empty()) {
+            return nullptr;
+        }
+
+        size_t data_bytes = URING_BUFFERS * URING_CHUNK;
+        void *ring = ::mmap(nullptr, ring_bytes(), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *data = ::mmap(nullptr, data_bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (ring == MAP_FAILED || data == MAP_FAILED) {
+            if (ring != MAP_FAILED) {
+                ::munmap(ring, ring_bytes());
+            }
+
+            if (data != MAP_FAILED) {
+                ::munmap(data, data_bytes);
+            }
+
+            return nullptr;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = free_groups_.back();
+
+        if (enroll(IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            ::munmap(ring, ring_bytes());
+            ::munmap(data, data_bytes);
+            return nullptr;
+        }
+
+        free_groups_.pop_back();
+        owned_.push_back(std::make_unique<uring_buffers>(reg.bgid,
+                         static_cast<io_uring_buf_ring *>(ring), static_cast<char *>(data)));
+        uring_buffers *buffers = owned_.back().get();
+
+        for (uint16_t i = 0; i < URING_BUFFERS; ++i) {
+            buffers->give(i);
+        }
+
+        buffers->publish();
+        return buffers;
+    }
+
+    // 所有 buffer 都已歸還給 kernel 之後呼叫
+    void release_buffers(uring_buffers *buffers) {
+        if (spare_.size() < URING_SPARE_BUFFERS) {
+            spare_.push_back(buffers);
+            return;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.bgid = buffers->group;
+        enroll(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        free_groups_.push_back(buffers->group);
+        ::munmap(buffers->ring, ring_bytes());
+        ::munmap(buffers->data, URING_BUFFERS * URING_CHUNK);
+
+        for (auto it = owned_.begin(); it != owned_.end(); ++it) {
+            if (it->get() == buffers) {
+                owned_.erase(it);
+                break;
+            }
+        }
+    }
+
+  private:
+    static size_t ring_bytes() {
+        return (URING_BUFFERS * sizeof(io_uring_buf) + 4095) & ~size_t(4095);
+    }
+
+    int enroll(unsigned opcode, void *arg, unsigned count) {
+        return int(::syscall(__NR_io_uring_register, ring_fd_, opcode, arg, count));
+    }
+
+    bool update_file(int index, int fd) {
+        io_uring_files_update update{};
+        update.offset = unsigned(index);
+        update.fds = reinterpret_cast<uint64_t>(&fd);
+        return enroll(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+    bool setup() {
+        io_uring_params params{};
+        // COOP_TASKRUN (5.19)：completion 的 task work 等線程下一次進入 kernel 時才執行，
+        // 不以 IPI 打斷正在 user-space 執行的 handler；舊 kernel 不認得時不帶這個 flag 再試一次
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring_fd_ = int(::syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+
+        if (ring_fd_ < 0 && errno == EINVAL) {
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = URING_ENTRIES * 4;
+            ring_fd_ = int(::syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        }
+
+        // socket 的 recv/send 以內部 poll 等待 (FAST_POLL) 而不是 worker 線程；CQ 滿時不丟棄 (NODROP)
+        if (ring_fd_ < 0 || !(params.features & IORING_FEAT_FAST_POLL)
+                || !(params.features & IORING_FEAT_NODROP)) {
+            return false;
+        }
+
+        sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (single) {
+            sq_bytes_ = cq_bytes_ = std::max(sq_bytes_, cq_bytes_);
+        }
+
+        void *sq = ::mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQ_RING);
+
+        if (sq == MAP_FAILED) {
+            return false;
+        }
+
+        sq_ptr_ = static_cast<char *>(sq);
+        cq_ptr_ = sq_ptr_;
+
+        if (!single) {
+            void *cq = ::mmap(nullptr, cq_bytes_, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+
+            if (cq == MAP_FAILED) {
+                ::munmap(sq_ptr_, sq_bytes_);
+                sq_ptr_ = nullptr;
+                return false;
+            }
+
+            cq_ptr_ = static_cast<char *>(cq);
+        }
+
+        sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = ::mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+        sq_head_ = reinterpret_cast<unsigned *>(sq_ptr_ + params.sq_off.head);
+        sq_tail_ptr_ = reinterpret_cast<unsigned *>(sq_ptr_ + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq_ptr_ + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_tail_ = *sq_tail_ptr_;
+        cq_head_ = reinterpret_cast<unsigned *>(cq_ptr_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq_ptr_ + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq_ptr_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq_ptr_ + params.cq_off.cqes);
+
+        // SQ 的 index array 固定為 identity，之後只需推進 tail
+        auto array = reinterpret_cast<unsigned *>(sq_ptr_ + params.sq_off.array);
+
+        for (unsigned i = 0; i < params.sq_entries; ++i) {
+            array[i] = i;
+        }
+
+        // 空的 fixed file table，tunnel 建立時才填入
+        std::vector<int> files(URING_FILES, -1);
+
+        if (enroll(IORING_REGISTER_FILES, files.data(), URING_FILES) != 0) {
+            return false;
+        }
+
+        for (int i = URING_FILES - 1; i >= 0; --i) {
+            free_files_.push_back(i);
+        }
+
+        for (int group = 0xfffe; group >= 0xff00; --group) {
+            free_groups_.push_back(uint16_t(group));
+        }
+
+        return true;
+    }
+
+    // 在 socketpair 上試一次 multishot recv：舊 kernel 回傳 -EINVAL，或沒有 F_MORE
+    bool probe() {
+        int pair[2];
+
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+            return false;
+        }
+
+        uring_buffers *buffers = acquire_buffers();
+        bool supported = false;
+
+        io_uring_sqe *sqe = buffers ? next_sqe() : nullptr;
+
+        if (sqe) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = pair[0];
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->buf_group = buffers->group;
+            (void)::write(pair[1], "x", 1);
+            submit();
+            bool more = true;
+
+            while (more) {
+                io_uring_cqe cqe = wait_cqe();
+
+                if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                    supported = cqe.flags & IORING_CQE_F_MORE;
+                    buffers->give(uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                    buffers->publish();
+                    // 結束 multishot：對方關閉後收到 0
+                    ::close(pair[1]);
+                    pair[1] = -1;
+                }
+
+                more = cqe.flags & IORING_CQE_F_MORE;
+            }
+        }
+
+        if (buffers) {
+            release_buffers(buffers);
+        }
+
+        ::close(pair[0]);
+
+        if (pair[1] >= 0) {
+            ::close(pair[1]);
+        }
+
+        return supported;
+    }
+
+    // 只在 probe 中使用：阻塞等待一個 CQE
+    io_uring_cqe wait_cqe() {
+        while (__atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) == *cq_head_) {
+            ::syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+
+        io_uring_cqe cqe = cqes_[*cq_head_ & cq_mask_];
+        __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+        return cqe;
+    }
+
+    void submit() {
+        if (unsubmitted_ == 0) {
+            return;
+        }
+
+        __atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+        int n = int(::syscall(__NR_io_uring_enter, ring_fd_, unsubmitted_, 0, 0, nullptr, 0));
+
+        // EBUSY / EAGAIN：CQ 積壓，留到下一次 (處理完 completion 之後) 再送
+        if (n > 0) {
+            unsubmitted_ -= unsigned(n);
+        }
+    }
+
+    bool cq_pending() const {
+        return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) != *cq_head_;
+    }
+
+    // 一次只處理進入時已在 CQ 中的 completion；之後才到達的排到 asio 佇列的後面，
+    // 讓同一個線程上的其他 handler (例如 accept) 不會被持續轉送的 tunnel 餓死
+    void reap() {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head) {
+            const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+            auto operation = reinterpret_cast<uring_operation *>(cqe.user_data);
+            int result = cqe.res;
+            unsigned flags = cqe.flags;
+            // 先釋出 CQ 的位置，handler 可能 (經由 submit) 讓 kernel 寫入新的 CQE
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+            if (operation) {
+                operation->complete(result, flags);
+            }
+        }
+
+        submit();
+        schedule_reap();
+    }
+
+    void schedule_reap() {
+        if (cq_pending() && !reap_posted_) {
+            reap_posted_ = true;
+            post(context_, make_pooled_handler([this]() {
+                reap_posted_ = false;
+                reap();
+            }));
+        }
+    }
+
+    // asio 的 reactor 以 edge-triggered 等待 ring fd：在等待登記之前到達的 CQE 不會再產生通知，
+    // 因此登記之後再檢查一次
+    void do_wait() {
+        notifier_.async_wait(posix::stream_descriptor::wait_read,
+        [this](const boost::system::error_code & ec) {
+            if (ec) {
+                return;
+            }
+
+            reap();
+            do_wait();
+        });
+
+        schedule_reap();
+    }
+
+    io_context &context_;
+    posix::stream_descriptor notifier_;
+    bool ok_ = false;
+    int ring_fd_ = -1;
+
+    char *sq_ptr_ = nullptr;
+    char *cq_ptr_ = nullptr;
+    size_t sq_bytes_ = 0;
+    size_t cq_bytes_ = 0;
+    size_t sqes_bytes_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ptr_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sq_tail_ = 0;
+    unsigned unsubmitted_ = 0;
+    bool submit_posted_ = false;
+    bool reap_posted_ = false;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+
+    std::vector<int> free_files_;
+    std::vector<uint16_t> free_groups_;
+    std::vector<uring_buffers *> spare_;
+    std::vector<std::unique_ptr<uring_buffers>> owned_;
+};
+
+/**
+ * @class uring_tunnel
+ * @brief 以 io_uring 在兩個 socket 之間雙向轉送。
+ *
+ * 任一方向讀到 EOF 且資料送完、或發生錯誤時 shutdown 兩個 socket，
+ * 等所有進行中的操作結束後歸還 buffer 與 fixed file，再呼叫 owner 的 uring_closed()。
+ * 開始之後 SQ 持續滿載 (取不到 SQE) 時與錯誤相同，結束 tunnel。
+ * 物件在這之前持有自己，不需要呼叫端保留；owner 須存活到 uring_closed 為止。
+ *
+ * 每個收到的 chunk 以 owner 的 uring_transferred(forward, bytes) 計量 (forward 為 a -> b)，
+ * 直接呼叫 Owner 的成員函式，轉送路徑上沒有 std::function。
+ */
+template <typename Owner>
+class uring_tunnel {
+  public:
+    uring_tunnel(uring_service &ring, int a, int b, Owner &owner)
+        : ring_(ring), fds_{a, b}, owner_(owner) {
+        for (int i = 0; i < 2; ++i) {
+            lanes_[i].tunnel = this;
+            lanes_[i].forward = i == 0;
+            lanes_[i].receiver.owner = &lanes_[i];
+            lanes_[i].sender.owner = &lanes_[i];
+        }
+    }
+
+    // 須在 ring 所屬的線程上呼叫；資源不足時回傳 false (什麼都不會發生)，由呼叫端改用 epoll
+    static bool start(uring_service &ring, int a, int b, Owner &owner) {
+        if (!ring.available() || !ring.has_room(2)) {
+            return false;
+        }
+
+        auto tunnel = std::make_shared<uring_tunnel>(ring, a, b, owner);
+
+        if (!tunnel->open()) {
+            return false;
+        }
+
+        tunnel->self_ = tunnel;
+
+        for (auto &lane : tunnel->lanes_) {
+            tunnel->receive(lane);
+        }
+
+        return true;
+    }
+
+  private:
+    struct lane;
+
+    struct receive_operation : uring_operation {
+        void complete(int result, unsigned flags) override {
+            owner->tunnel->received(*owner, result, flags);
+        }
+
+        lane *owner = nullptr;
+    };
+
+    struct send_operation : uring_operation {
+        void complete(int result, unsigned) override {
+            owner->tunnel->sent(*owner, result);
+        }
+
+        lane *owner = nullptr;
+    };
+
+    struct chunk {
+        uint16_t id;
+        uint32_t length;
+    };
+
+    // 一個方向：from 的 multishot recv 與 to 的 sendmsg
+    struct lane {
+        uring_tunnel *tunnel = nullptr;
+        bool forward = true;
+        int from = -1; // fixed file index
+        int to = -1;
+        uring_buffers *buffers = nullptr;
+        receive_operation receiver;
+        send_operation sender;
+        // 已收到、尚未送完的 chunk，依到達順序；head 的前 offset bytes 已送出
+        std::array<chunk, URING_BUFFERS> queue{};
+        size_t head = 0;
+        size_t count = 0;
+        size_t offset = 0;
+        bool receiving = false;
+        bool sending = false;
+        bool starved = false; // buffer 全部在排隊，recv 已以 ENOBUFS 結束
+        bool eof = false;
+        std::array<iovec, URING_BUFFERS> iov{};
+        msghdr message{};
+    };
+
+    bool open() {
+        for (int i = 0; i < 2; ++i) {
+            files_[i] = ring_.add_file(fds_[i]);
+            lanes_[i].buffers = files_[i] < 0 ? nullptr : ring_.acquire_buffers();
+
+            if (!lanes_[i].buffers) {
+                release();
+                return false;
+            }
+        }
+
+        lanes_[0].from = lanes_[1].to = files_[0];
+        lanes_[0].to = lanes_[1].from = files_[1];
+        return true;
+    }
+
+    // 歸還已取得的 fixed file 與 buffer (此時沒有進行中的操作)
+    void release() {
+        for (int i = 0; i < 2; ++i) {
+            auto &lane = lanes_[i];
+
+            if (lane.buffers) {
+                for (size_t k = 0; k < lane.count; ++k) {
+                    lane.buffers->give(lane.queue[(lane.head + k) % URING_BUFFERS].id);
+                }
+
+                lane.buffers->publish();
+                ring_.release_buffers(lane.buffers);
+                lane.buffers = nullptr;
+            }
+
+            if (files_[i] >= 0) {
+                ring_.remove_file(files_[i]);
+                files_[i] = -1;
+            }
+        }
+    }
+
+    void receive(lane &lane) {
+        io_uring_sqe *sqe = ring_.next_sqe();
+
+        if (!sqe) {
+            close();
+            return;
+        }
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = lane.from;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->buf_group = lane.buffers->group;
+        sqe->user_data = reinterpret_cast<uint64_t>(static_cast<uring_operation *>(&lane.receiver));
+        lane.receiving = true;
+        ++inflight_;
+    }
+
+    // 一次送出佇列中所有 chunk
+    void send(lane &lane) {
+        if (lane.sending || lane.count == 0 || closing_) {
+            return;
+        }
+
+        for (size_t k = 0; k < lane.count; ++k) {
+            const chunk &c = lane.queue[(lane.head + k) % URING_BUFFERS];
+            size_t skip = k == 0 ? lane.offset : 0;
+            lane.iov[k].iov_base = lane.buffers->chunk(c.id) + skip;
+            lane.iov[k].iov_len = c.length - skip;
+        }
+
+        lane.message.msg_iov = lane.iov.data();
+        lane.message.msg_iovlen = lane.count;
+        io_uring_sqe *sqe = ring_.next_sqe();
+
+        if (!sqe) {
+            close();
+            return;
+        }
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = lane.to;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = reinterpret_cast<uint64_t>(&lane.message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = reinterpret_cast<uint64_t>(static_cast<uring_operation *>(&lane.sender));
+        lane.sending = true;
+        ++inflight_;
+    }
+
+    void received(lane &lane, int result, unsigned flags) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            lane.receiving = false;
+            --inflight_;
+        }
+
+        if (result > 0) {
+            lane.queue[(lane.head + lane.count) % URING_BUFFERS] = {
+                uint16_t(flags >> IORING_CQE_BUFFER_SHIFT), uint32_t(result)
+            };
+            ++lane.count;
+            owner_.uring_transferred(lane.forward, size_t(result));
+
+            if (!closing_) {
+                send(lane);
+
+                // multishot 因其他原因 (例如 CQ 積壓) 結束時重新發起
+                if (!lane.receiving) {
+                    receive(lane);
+                }
+            }
+        } else if (result == -ENOBUFS && !closing_) {
+            lane.starved = true;
+        } else if (result == 0 && !closing_) {
+            lane.eof = true;
+
+            if (lane.count == 0 && !lane.sending) {
+                close();
+            }
+        } else {
+            close();
+        }
+
+        finish();
+    }
+
+    void sent(lane &lane, int result) {
+        lane.sending = false;
+        --inflight_;
+
+        if (result < 0 || closing_) {
+            close();
+            finish();
+            return;
+        }
+
+        // 完整送出的 chunk 歸還給 kernel
+        size_t left = size_t(result);
+
+        while (left > 0 && lane.count > 0) {
+            const chunk &c = lane.queue[lane.head];
+            size_t remaining = c.length - lane.offset;
+
+            if (left < remaining) {
+                lane.offset += left;
+                break;
+            }
+
+            left -= remaining;
+            lane.buffers->give(c.id);
+            lane.head = (lane.head + 1) % URING_BUFFERS;
+            --lane.count;
+            lane.offset = 0;
+        }
+
+        lane.buffers->publish();
+
+        if (lane.starved && !lane.receiving) {
+            lane.starved = false;
+            receive(lane);
+        }
+
+        if (lane.count > 0) {
+            send(lane);
+        } else if (lane.eof) {
+            close();
+        }
+
+        finish();
+    }
+
+    // shutdown 讓兩個 socket 上進行中的 recv 與 send 以 0 或錯誤結束
+    void close() {
+        if (closing_) {
+            return;
+        }
+
+        closing_ = true;
+        ::shutdown(fds_[0], SHUT_RDWR);
+        ::shutdown(fds_[1], SHUT_RDWR);
+    }
+
+    void finish() {
+        if (!closing_ || inflight_ > 0) {
+            return;
+        }
+
+        release();
+        auto keep = std::move(self_);
+        owner_.uring_closed();
+    }
+
+    uring_service &ring_;
+    int fds_[2];
+    int files_[2] = {-1, -1};
+    std::array<lane, 2> lanes_;
+    Owner &owner_;
+    std::shared_ptr<uring_tunnel> self_;
+    int inflight_ = 0;
+    bool closing_ = false;
+};
+
+#endif
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+/**
+ * @file vhost.hpp
+ * @brief 共用對外 port 的虛擬主機路由：從 client 的第一批資料取出 HTTP Host 或 TLS SNI。
+ *
+ * proxy_server 以 MSG_PEEK 讀取 client 已送達的前綴交給 route_parser，資料留在 kernel 的
+ * socket buffer 中，路由後由 depipe (或 splice) 照常讀取，不需要重送也不多一次複製。
+ * 前綴不完整時 parse 回傳 NEED_MORE，下一次以更長的前綴 (開頭相同) 再呼叫，
+ * parser 從上次停下的位置繼續，已解析的部分不重新掃描。parser 不配置記憶體，
+ * 找到的 host 指向呼叫端的 buffer。
+ */
+
+// 路由前最多讀取的 bytes (一個 TLS record 的上限)
+constexpr size_t VHOST_PEEK_LIMIT = 16 * 1024 + 5;
+// 正規化後 host 的長度上限 (DNS 名稱上限 253)
+constexpr size_t VHOST_MAX_NAME = 255;
+
+enum class route_status {
+    NEED_MORE, // 前綴還不足以判斷
+    FOUND,     // host() 為 client 要求的名稱
+    NO_HOST,   // 不是 HTTP/TLS、沒有 Host/SNI 或格式錯誤
+};
+
+/**
+ * @class sni_parser
+ * @brief 逐欄位解析 TLS ClientHello，取出 server_name extension 中的 host_name。
+ *
+ * 只看第一個 record；ClientHello 跨 record 時若 SNI 不在第一個 record 中視為 NO_HOST。
+ */
+class sni_parser {
+  public:
+    route_status parse(const char *data, size_t size) {
+        auto bytes = reinterpret_cast<const uint8_t *>(data);
+
+        while (true) {
+            // 這一步需要 pos_ 之後的 need bytes
+            size_t need = step_need();
+
+            if (need == 0) {
+                return route_status::NO_HOST;
+            }
+
+            if (pos_ + need > limit()) {
+                return route_status::NO_HOST;
+            }
+
+            if (pos_ + need > size) {
+                wanted_ = pos_ + need;
+                return route_status::NEED_MORE;
+            }
+
+            route_status status = step(bytes);
+
+            if (status != route_status::NEED_MORE) {
+                return status;
+            }
+        }
+    }
+
+    std::string_view host() const {
+        return host_;
+    }
+
+    // 下一步至少需要的前綴長度
+    size_t wanted() const {
+        return wanted_;
+    }
+
+  private:
+    enum class state {
+        RECORD, HANDSHAKE, HELLO, CIPHERS, COMPRESSION, EXTENSIONS, EXTENSION, SERVER_NAME
+    };
+
+    static size_t u16(const uint8_t *p) {
+        return size_t(p[0]) << 8 | p[1];
+    }
+
+    size_t limit() const {
+        return state_ == state::RECORD ? 5 : record_end_;
+    }
+
+    // 各狀態所需的 bytes；0 表示格式錯誤
+    size_t step_need() const {
+        switch (state_) {
+        case state::RECORD:
+            return 5;
+
+        case state::HANDSHAKE:
+            return 4;
+
+        case state::HELLO:
+            return 2 + 32 + 1;
+
+        case state::CIPHERS:
+        case state::EXTENSIONS:
+            return 2;
+
+        case state::COMPRESSION:
+            return 1;
+
+        case state::EXTENSION:
+            return pos_ >= extensions_end_ ? 0 : 4;
+
+        case state::SERVER_NAME:
+            return 4 + extension_length_;
+        }
+
+        return 0;
+    }
+
+    // 處理一個欄位；回傳 NEED_MORE 表示繼續下一個欄位
+    route_status step(const uint8_t *bytes) {
+        const uint8_t *p = bytes + pos_;
+
+        switch (state_) {
+        case state::RECORD:
+            // handshake record，TLS 1.0 以後的版本
+            if (p[0] != 0x16 || p[1] != 0x03) {
+                return route_status::NO_HOST;
+            }
+
+            record_end_ = 5 + u16(p + 3);
+            pos_ = 5;
+            state_ = state::HANDSHAKE;
+            break;
+
+        case state::HANDSHAKE:
+            if (p[0] != 0x01) { // client_hello
+                return route_status::NO_HOST;
+            }
+
+            pos_ += 4;
+            state_ = state::HELLO;
+            break;
+
+        case state::HELLO:
+            // legacy_version + random，接著是 session id 的長度
+            pos_ += 2 + 32 + 1 + p[34];
+            state_ = state::CIPHERS;
+            break;
+
+        case state::CIPHERS:
+            pos_ += 2 + u16(p);
+            state_ = state::COMPRESSION;
+            break;
+
+        case state::COMPRESSION:
+            pos_ += 1 + p[0];
+            state_ = state::EXTENSIONS;
+            break;
+
+        case state::EXTENSIONS:
+            extensions_end_ = pos_ + 2 + u16(p);
+            pos_ += 2;
+            state_ = state::EXTENSION;
+            break;
+
+        case state::EXTENSION:
+            extension_length_ = u16(p + 2);
+
+            if (u16(p) == 0x0000) { // server_name
+                state_ = state::SERVER_NAME;
+            } else {
+                pos_ += 4 + extension_length_;
+            }
+
+            break;
+
+        case state::SERVER_NAME:
+            return server_name(p + 4, extension_length_);
+        }
+
+        return route_status::NEED_MORE;
+    }
+
+    // ServerNameList：[length: 2]，每項 [type: 1][length: 2][name]
+    route_status server_name(const uint8_t *p, size_t length) {
+        if (length < 2) {
+            return route_status::NO_HOST;
+        }
+
+        size_t end = 2 + u16(p);
+
+        for (size_t i = 2; i + 3 <= end && end <= length;) {
+            size_t name_length = u16(p + i + 1);
+
+            if (i + 3 + name_length > end) {
+                break;
+            }
+
+            if (p[i] == 0) { // host_name
+                host_ = std::string_view(reinterpret_cast<const char *>(p + i + 3), name_length);
+                return route_status::FOUND;
+            }
+
+            i += 3 + name_length;
+        }
+
+        return route_status::NO_HOST;
+    }
+
+    state state_ = state::RECORD;
+    size_t pos_ = 0;
+    size_t record_end_ = 0;
+    size_t extensions_end_ = 0;
+    size_t extension_length_ = 0;
+    size_t wanted_ = 0;
+    std::string_view host_;
+};
+
+/**
+ * @class http_host_parser
+ * @brief 逐行掃描 HTTP/1.x request 的 header，取出 Host 的值。
+ *
+ * 以 memchr (glibc 以 SIMD 實作) 找行尾；只處理完整的行，下一次從未完成的行開頭繼續。
+ */
+class http_host_parser {
+  public:
+    route_status parse(const char *data, size_t size) {
+        while (true) {
+            auto newline = static_cast<const char *>(std::memchr(data + line_, '\n', size - line_));
+
+            if (!newline) {
+                return size >= VHOST_PEEK_LIMIT ? route_status::NO_HOST : route_status::NEED_MORE;
+            }
+
+            std::string_view line(data + line_, size_t(newline - data) - line_);
+            line_ = size_t(newline - data) + 1;
+
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+
+            // header 結束仍沒有 Host
+            if (line.empty()) {
+                return route_status::NO_HOST;
+            }
+
+            if (line.size() > 5 && equal_lower(line.substr(0, 5), "host:")) {
+                line.remove_prefix(5);
+
+                while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+                    line.remove_prefix(1);
+                }
+
+                while (!line.empty() && (line.back() == ' ' || line.back() == '\t')) {
+                    line.remove_suffix(1);
+                }
+
+                host_ = line;
+                return host_.empty() ? route_status::NO_HOST : route_status::FOUND;
+            }
+        }
+    }
+
+    std::string_view host() const {
+        return host_;
+    }
+
+  private:
+    static bool equal_lower(std::string_view text, std::string_view lower) {
+        for (size_t i = 0; i < text.size(); ++i) {
+            if ((text[i] | 0x20) != lower[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    size_t line_ = 0; // 尚未處理的行的開頭
+    std::string_view host_;
+};
+
+/**
+ * @class route_parser
+ * @brief 依第一個 byte 判斷 TLS (0x16) 或 HTTP (method 為大寫字母)，交給對應的 parser。
+ */
+class route_parser {
+  public:
+    route_status parse(const char *data, size_t size) {
+        if (size == 0) {
+            return route_status::NEED_MORE;
+        }
+
+        if (kind_ == kind::UNKNOWN) {
+            kind_ = data[0] == 0x16 ? kind::TLS
+                    : data[0] >= 'A' && data[0] <= 'Z' ? kind::HTTP : kind::OTHER;
+        }
+
+        switch (kind_) {
+        case kind::TLS:
+            return tls_.parse(data, size);
+
+        case kind::HTTP:
+            return http_.parse(data, size);
+
+        default:
+            return route_status::NO_HOST;
+        }
+    }
+
+    std::string_view host() const {
+        return kind_ == kind::TLS ? tls_.host() : http_.host();
+    }
+
+    // NEED_MORE 時下一次值得重試的前綴長度：TLS 已知欄位長度，HTTP 只能等下一個 byte
+    size_t wanted(size_t size) const {
+        return kind_ == kind::TLS ? tls_.wanted() : size + 1;
+    }
+
+  private:
+    enum class kind { UNKNOWN, TLS, HTTP, OTHER };
+
+    kind kind_ = kind::UNKNOWN;
+    sni_parser tls_;
+    http_host_parser http_;
+};
+
+/**
+ * 把 host 正規化到 out：轉成小寫、去掉 port (HTTP Host 可能帶有) 與結尾的 '.'。
+ * 結果為空或超過 VHOST_MAX_NAME 時回傳空的 string_view。
+ */
+inline std::string_view normalize_host(std::string_view host, char (&out)[VHOST_MAX_NAME + 1]) {
+    if (!host.empty() && host.front() == '[') {
+        // IPv6 literal：[addr]:port 只保留 [addr]
+        size_t close = host.find(']');
+        host = close == std::string_view::npos ? std::string_view() : host.substr(0, close + 1);
+    } else {
+        host = host.substr(0, host.find(':'));
+    }
+
+    if (!host.empty() && host.back() == '.') {
+        host.remove_suffix(1);
+    }
+
+    if (host.empty() || host.size() > VHOST_MAX_NAME) {
+        return {};
+    }
+
+    for (size_t i = 0; i < host.size(); ++i) {
+        char c = host[i];
+        out[i] = c >= 'A' && c <= 'Z' ? char(c | 0x20) : c;
+    }
+
+    return std::string_view(out, host.size());
+}
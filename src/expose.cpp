@@ -1,85 +1,836 @@
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "compress.hpp"
+#include "control.hpp"
 #include "depipe.hpp"
+#include "dns_cache.hpp"
+#include "io_pool.hpp"
+#include "metrics.hpp"
+#include "mux.hpp"
+#include "protocol.hpp"
+#include "socket_profile.hpp"
+#include "trace.hpp"
+#include "udp_tunnel.hpp"
+#include "vhost.hpp"
+
+#ifdef USE_COROUTINES
+#include "coro_pipe.hpp"
+#endif
 
 using namespace boost::asio;
 using ip::tcp;
-io_context io;
+using ip::udp;
+
+counter proxy_connect_failures("expose_connect_failures_total",
+                               "Data connections that could not be established.",
+                               "leg=\"proxy\"");
+counter target_connect_failures("expose_connect_failures_total",
+                                "Data connections that could not be established.",
+                                "leg=\"target\"");
+counter sessions_total("expose_sessions_total", "Tunnels connected to the target service.");
+counter registrations("expose_registrations_total", "Registrations accepted by the proxy server.");
+
+io_pool shards;
+
+class TargetPool;
+
+/**
+ * 一組對外 port 與 target 的對應 (命令列參數或 EXPOSE_CONFIG 的一行)。
+ * 在 main 中建立後不再改變，存活到程式結束，其他物件以參考持有。
+ */
+struct Mapping {
+    u_short proxy_port;
+    // 虛擬主機名稱 (<host>@<proxy_port>:...)，空字串表示獨佔 proxy_port
+    std::string host;
+    std::string target_host = "127.0.0.1";
+    std::string target_port;
+    // TARGET_POOL：每個 shard 一組
+    std::vector<std::shared_ptr<TargetPool>> target_pools;
+};
 
 // Arguments
 std::string proxy_host;
 std::string ctrl_port;
-u_short proxy_port;
-std::string target_host = "127.0.0.1";
-std::string target_port;
-
-using ConnectHandler =
-    std::function<void(const boost::system::error_code &, const tcp::endpoint)>;
-
-void async_resolve_and_connect(tcp::socket &socket, const std::string &host,
-                               const std::string &svc, ConnectHandler handler) {
-    auto resolver = std::make_shared<tcp::resolver>(io);
-    resolver->async_resolve(
-        tcp::v4(), host, svc,
-        [handler, &socket, resolver](const boost::system::error_code & ec_resolve,
-    tcp::resolver::results_type results) {
-        if (ec_resolve) {
-            return handler(ec_resolve, tcp::endpoint{});
-        }
-
-        // 解析成功，繼續非同步連線
-        boost::asio::async_connect(socket, results, handler);
+std::vector<std::unique_ptr<Mapping>> mappings;
+TunnelMode tunnel_mode = TunnelMode::DIAL_BACK;
+Codec requested_codec = Codec::NONE;
+size_t pool_low = 0;
+size_t pool_high = 0;
+size_t target_pool_size = 0;
+std::chrono::seconds target_pool_idle(30);
+const socket_profile *profile = &DEFAULT_PROFILE;
+
+// 連往 target 與控制連線在 connect 之前套用 SOCKET_PROFILE；default 時不提前開啟 socket
+SocketSetup profile_setup() {
+    if (profile == &DEFAULT_PROFILE) {
+        return nullptr;
+    }
+
+    return [](tcp::socket & socket) {
+        apply_profile(socket, *profile);
+    };
+}
+
+// 資料連線另外可用 TCP Fast Open：token 隨 SYN 送出，連不上的錯誤由寫入 token 時處理
+SocketSetup data_profile_setup() {
+    if (profile == &DEFAULT_PROFILE) {
+        return nullptr;
+    }
+
+    return [](tcp::socket & socket) {
+        apply_profile_before_connect(socket, *profile);
+    };
+}
+
+counter target_pool_hits("expose_target_pool_total",
+                         "Target connections requested from the warm pool.", "result=\"hit\"");
+counter target_pool_misses("expose_target_pool_total",
+                           "Target connections requested from the warm pool.", "result=\"miss\"");
+counter target_pool_stale("expose_target_pool_stale_total",
+                          "Pooled target connections found closed or too old and discarded.");
+
+/**
+ * @class TargetPool
+ * @brief 每個 shard 一組預先連到 target 的閒置連線 (TARGET_POOL)。
+ *
+ * 交出前以 MSG_PEEK 確認對方沒有關閉；每秒檢查一次閒置的連線，已被關閉或閒置超過
+ * target_pool_idle 的連線 (server 端的 idle timeout 隨時可能關閉它們) 丟棄後補回。
+ * 被取走的連線立即在背景補回。只在所屬 shard 的線程上使用，不需要鎖。
+ */
+class TargetPool : public std::enable_shared_from_this<TargetPool> {
+  public:
+    TargetPool(io_context &_context, const Mapping &_mapping)
+        : context(_context), mapping(_mapping), timer(_context) {}
+
+    void start() {
+        auto self(shared_from_this());
+        post(context, [this, self]() {
+            refill();
+            do_sweep();
+        });
+    }
+
+    bool serves(const execution_context &other) const {
+        return &context == &other;
+    }
+
+    // 取出一條健康的連線放進 socket；沒有時回傳 false
+    bool take(tcp::socket &socket) {
+        while (!idle.empty()) {
+            auto entry = std::move(idle.front());
+            idle.pop_front();
+
+            if (alive(entry.socket)) {
+                socket = std::move(entry.socket);
+                target_pool_hits.add();
+                refill();
+                return true;
+            }
+
+            target_pool_stale.add();
+        }
+
+        target_pool_misses.add();
+        refill();
+        return false;
+    }
+
+  private:
+    struct entry {
+        tcp::socket socket;
+        std::chrono::steady_clock::time_point created;
+    };
+
+    // 對方已關閉 (讀到 EOF) 或連線出錯就不能再用；有資料可讀 (例如 server 的歡迎訊息) 仍是健康的
+    static bool alive(tcp::socket &socket) {
+        boost::system::error_code ec;
+
+        // 每次設定都是一次 ioctl，只在第一次檢查時設定
+        if (!socket.non_blocking()) {
+            socket.non_blocking(true, ec);
+
+            if (ec) {
+                return false;
+            }
+        }
+
+        char byte;
+        socket.receive(buffer(&byte, 1), socket_base::message_peek, ec);
+        return !ec || ec == error::would_block;
+    }
+
+    // 連線失敗時不立即重試，由下一次 sweep 再補
+    void refill() {
+        auto self(shared_from_this());
+
+        while (idle.size() + connecting < target_pool_size) {
+            ++connecting;
+            auto socket = std::make_shared<tcp::socket>(context);
+            async_resolve_and_connect(*socket, mapping.target_host, mapping.target_port,
+            [this, self, socket](const boost::system::error_code & ec, const tcp::endpoint) {
+                --connecting;
+
+                if (ec) {
+                    target_connect_failures.add();
+                    return;
+                }
+
+                idle.push_back({std::move(*socket), std::chrono::steady_clock::now()});
+            }, profile_setup());
+        }
+    }
+
+    void do_sweep() {
+        auto self(shared_from_this());
+        timer.expires_after(std::chrono::seconds(1));
+        timer.async_wait([this, self](const boost::system::error_code & ec) {
+            if (ec) {
+                return;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() - target_pool_idle;
+            auto stale = std::remove_if(idle.begin(), idle.end(), [deadline](entry & candidate) {
+                return candidate.created < deadline || !alive(candidate.socket);
+            });
+            target_pool_stale.add(std::distance(stale, idle.end()));
+            idle.erase(stale, idle.end());
+            refill();
+            do_sweep();
+        });
+    }
+
+    io_context &context;
+    const Mapping &mapping;
+    boost::asio::steady_timer timer;
+    std::deque<entry> idle;
+    size_t connecting = 0;
+};
+
+/**
+ * @class TargetLeg
+ * @brief 一個 tunnel 的 target 端連線：優先從所在 shard 的 TargetPool 取得，否則新建。
+ *
+ * start 之後就開始，與 proxy 端的連線同時進行；async_wait 的 handler 在連線完成 (或失敗) 後執行。
+ */
+class TargetLeg : public std::enable_shared_from_this<TargetLeg> {
+  public:
+    TargetLeg(const any_io_executor &executor, const Mapping &_mapping)
+        : socket(executor), mapping(_mapping) {}
+
+    void start() {
+        auto self(shared_from_this());
+        dispatch(socket.get_executor(), [this, self]() {
+            for (auto &pool : mapping.target_pools) {
+                if (pool->serves(socket.get_executor().context()) && pool->take(socket)) {
+                    complete({});
+                    return;
+                }
+            }
+
+            async_resolve_and_connect(
+                socket, mapping.target_host, mapping.target_port,
+            [this, self](const boost::system::error_code & ec, const tcp::endpoint) {
+                if (ec) {
+                    target_connect_failures.add();
+                    std::cout << "Target connection failed" << std::endl;
+                }
+
+                complete(ec);
+            }, profile_setup());
+        });
+    }
+
+    // handler 一律經 post 執行，不會在呼叫 async_wait 的過程中被呼叫
+    void async_wait(std::function<void(const boost::system::error_code &)> handler) {
+        auto self(shared_from_this());
+        dispatch(socket.get_executor(), [this, self, handler = std::move(handler)]() mutable {
+            if (done) {
+                post(socket.get_executor(), [handler = std::move(handler), ec = error]() {
+                    handler(ec);
+                });
+            } else {
+                waiter = std::move(handler);
+            }
+        });
+    }
+
+    // proxy 端失敗時放棄 target 端
+    void close() {
+        auto self(shared_from_this());
+        dispatch(socket.get_executor(), [this, self]() {
+            boost::system::error_code ec;
+            socket.close(ec);
+        });
+    }
+
+    tcp::socket socket;
+
+  private:
+    void complete(const boost::system::error_code &ec) {
+        done = true;
+        error = ec;
+
+        if (waiter) {
+            std::exchange(waiter, nullptr)(ec);
+        }
+    }
+
+    const Mapping &mapping;
+    bool done = false;
+    boost::system::error_code error;
+    std::function<void(const boost::system::error_code &)> waiter;
+};
+
+// proxy 與 target 兩條連線已在同一個 shard 上，開始轉送；proxy 端依協商結果壓縮。
+// trace_id 為 proxy 在 SESSION frame 中帶來的 session ID (0 表示不追蹤)
+void start_pipe(tcp::socket proxy, tcp::socket target, Codec codec, uint64_t trace_id = 0) {
+    trace_event("expose_setup", trace_id, TracePhase::END);
+    trace_event("pipe_start", trace_id);
+#ifdef HAVE_ZLIB
+    if (codec != Codec::NONE) {
+        auto piper = make_depipe<compressed_stream<ssocket>, ssocket>(
+                         compressed_stream<ssocket>(ssocket(std::move(proxy)), codec),
+                         std::move(target));
+        piper->trace(trace_id);
+        piper->start();
+        return;
+    }
+#endif
+#ifdef USE_COROUTINES
+    // 設定閒置逾時的 tunnel 使用 depipe
+    if (pipe_engine() == PipeEngine::COPY && tunnel_idle_timeout().count() == 0) {
+        co_depipe(std::move(proxy), std::move(target));
+        return;
+    }
+#endif
+    auto piper = make_depipe(std::move(proxy), std::move(target));
+    piper->trace(trace_id);
+    piper->start();
+}
+
+#ifdef USE_COROUTINES
+// Session::do_accept 的 coroutine 版本：target 端與連到 data port、送出 token 同時進行，兩端完成後轉送
+task co_session(io_context &context, const Mapping &mapping, u_short data_port, uint64_t token,
+                Codec codec, uint64_t trace_id) {
+    tcp::socket proxy(context);
+    auto target = std::make_shared<TargetLeg>(context.get_executor(), mapping);
+    target->start();
+    boost::system::error_code ec;
+    co_await co_connect(proxy, proxy_host, std::to_string(data_port), ec, data_profile_setup());
+
+    if (ec) {
+        proxy_connect_failures.add();
+        std::cout << "Proxy connection failed" << std::endl;
+        trace_event("expose_setup", trace_id, TracePhase::END);
+        target->close();
+        co_return;
+    }
+
+    auto hello = data_hello(token);
+    auto [write_ec, n] = co_await async_io([&](auto handler) {
+        async_write(proxy, buffer(hello), std::move(handler));
+    });
+
+    if (write_ec) {
+        proxy_connect_failures.add();
+        trace_event("expose_setup", trace_id, TracePhase::END);
+        target->close();
+        co_return;
+    }
+
+    trace_event("data_connected", trace_id);
+    auto [target_ec, unused] = co_await async_io([&](auto handler) {
+        target->async_wait(std::move(handler));
     });
+
+    if (target_ec) {
+        trace_event("expose_setup", trace_id, TracePhase::END);
+        co_return;
+    }
+
+    trace_event("target_connected", trace_id);
+    sessions_total.add();
+    start_pipe(std::move(proxy), std::move(target->socket), codec, trace_id);
 }
+#endif
+
+class DataPool;
 
 class Session : public std::enable_shared_from_this<Session> {
   public:
-    explicit Session(u_short _agent_port)
-        : agent_port(std::to_string(_agent_port)),
-          proxy(io),
-          target(io) {}
+    // 兩條連線放在同一個 shard，整個 tunnel 留在同一個核心上
+    explicit Session(const Mapping &mapping, io_context &context = shards.next())
+        : proxy(context),
+          target(std::make_shared<TargetLeg>(context.get_executor(), mapping)) {}
 
-    void do_accept() {
+    // 連到 proxy 的 data port 並送出 session token，proxy 以此配對等待中的 client；
+    // target 端同時開始連線
+    void do_accept(u_short data_port, uint64_t token, Codec _codec, uint64_t _trace_id = 0) {
         auto self(shared_from_this());
-        std::cout << "Connection creating" << std::endl;
+        hello = data_hello(token);
+        codec = _codec;
+        trace_id = _trace_id;
+        target->start();
         async_resolve_and_connect(
-            proxy, proxy_host, agent_port,
+            proxy, proxy_host, std::to_string(data_port),
         [this, self](const boost::system::error_code & ec, const tcp::endpoint) {
             if (ec) {
+                proxy_connect_failures.add();
                 std::cout << "Proxy connection failed" << std::endl;
+                trace_event("expose_setup", trace_id, TracePhase::END);
+                target->close();
                 return;
             }
 
-            async_resolve_and_connect(
-                target, target_host, target_port,
-                [this, self](const boost::system::error_code & ec,
-            const tcp::endpoint) {
+            async_write(proxy, buffer(hello), [this, self](const boost::system::error_code & ec,
+            size_t) {
                 if (ec) {
-                    std::cout << "Target connection failed" << std::endl;
+                    proxy_connect_failures.add();
+                    trace_event("expose_setup", trace_id, TracePhase::END);
+                    target->close();
                     return;
                 }
 
-                std::cout << "Connection created" << std::endl;
-                auto piper = std::make_shared<depipe>(std::move(proxy),
-                                                      std::move(target));
-                piper->start();
+                trace_event("data_connected", trace_id);
+                do_connect_target();
             });
-        });
+        }, data_profile_setup());
     }
 
+    // 預先以 pool token 連到 proxy 的 data port 並停放，收到啟動訊號後才連 target
+    void do_park(std::shared_ptr<DataPool> _pool);
+
   private:
-    std::string agent_port;
+    void do_connect_target() {
+        auto self(shared_from_this());
+        target->async_wait([this, self](const boost::system::error_code & ec) {
+            if (ec) {
+                trace_event("expose_setup", trace_id, TracePhase::END);
+                return;
+            }
+
+            trace_event("target_connected", trace_id);
+            sessions_total.add();
+            start_pipe(std::move(proxy), std::move(target->socket), codec, trace_id);
+        });
+    }
+
     tcp::socket proxy;
-    tcp::socket target;
+    std::shared_ptr<TargetLeg> target;
+    std::array<char, DATA_HELLO_SIZE> hello;
+    uint64_t trace_id = 0;
+    std::shared_ptr<DataPool> pool;
+    Codec codec = Codec::NONE;
+    char signal = 0;
+};
+
+/**
+ * 停放在 proxy 的閒置資料連線池。
+ *
+ * 目標數量依觀察到的連線到達率 (快升慢降的 EWMA) 乘上補充一條連線所需的時間，
+ * 並夾在 [pool_low, pool_high] 之間；被使用的連線會立即在背景補回。
+ */
+class DataPool : public std::enable_shared_from_this<DataPool> {
+  public:
+    DataPool(const Mapping &_mapping, u_short _data_port, uint64_t _token, Codec _codec)
+        : mapping(_mapping), data_port(std::to_string(_data_port)), token(_token), codec(_codec),
+          timer(shards.next()), target(pool_low) {}
+
+    void start() {
+        do_tick();
+        refill();
+    }
+
+    void stop() {
+        stopped = true;
+        timer.cancel();
+    }
+
+    const std::string &port() const {
+        return data_port;
+    }
+
+    uint64_t get_token() const {
+        return token;
+    }
+
+    Codec get_codec() const {
+        return codec;
+    }
+
+    // 一條連線完成停放，記錄補充所需時間
+    void on_parked(std::chrono::steady_clock::duration setup) {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        latency = 0.8 * latency + 0.2 * std::chrono::duration<double>(setup).count();
+    }
+
+    void on_claimed() {
+        --parked;
+        ++claims;
+        refill();
+    }
+
+    // 停放失敗或被對方關閉，留給下一次 tick 補充，避免 proxy 斷線時密集重連
+    void on_lost() {
+        --parked;
+    }
+
+  private:
+    void refill() {
+        size_t n = parked.load();
+
+        while (!stopped && n < target.load()) {
+            if (parked.compare_exchange_weak(n, n + 1)) {
+                std::make_shared<Session>(mapping)->do_park(shared_from_this());
+                n = parked.load();
+            }
+        }
+    }
+
+    void do_tick() {
+        auto self(shared_from_this());
+        timer.expires_after(TICK);
+        timer.async_wait([this, self](const boost::system::error_code & ec) {
+            if (ec || stopped) {
+                return;
+            }
+
+            double sample = claims.exchange(0) / std::chrono::duration<double>(TICK).count();
+            size_t wanted;
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                rate = std::max(sample, 0.7 * rate + 0.3 * sample);
+                // 預留兩倍補充時間內預期到達的連線數
+                wanted = static_cast<size_t>(std::ceil(rate * latency * 2));
+            }
+            target = std::min(std::max(wanted, pool_low), pool_high);
+            refill();
+            do_tick();
+        });
+    }
+
+    static constexpr std::chrono::milliseconds TICK{250};
+
+    const Mapping &mapping;
+    std::string data_port;
+    uint64_t token;
+    Codec codec;
+    boost::asio::steady_timer timer;
+    std::atomic<bool> stopped{false};
+    std::atomic<size_t> parked{0};
+    std::atomic<size_t> claims{0};
+    std::atomic<size_t> target;
+    std::mutex stats_mutex;
+    double rate = 0;
+    double latency = 0.001;
+};
+
+void Session::do_park(std::shared_ptr<DataPool> _pool) {
+    auto self(shared_from_this());
+    pool = std::move(_pool);
+    hello = data_hello(pool->get_token());
+    codec = pool->get_codec();
+    auto start = std::chrono::steady_clock::now();
+    async_resolve_and_connect(
+        proxy, proxy_host, pool->port(),
+    [this, self, start](const boost::system::error_code & ec, const tcp::endpoint) {
+        if (ec) {
+            pool->on_lost();
+            return;
+        }
+
+        async_write(proxy, buffer(hello),
+        [this, self, start](const boost::system::error_code & ec, size_t) {
+            if (ec) {
+                pool->on_lost();
+                return;
+            }
+
+            pool->on_parked(std::chrono::steady_clock::now() - start);
+            async_read(proxy, buffer(&signal, 1),
+            [this, self](const boost::system::error_code & ec, size_t) {
+                if (ec) {
+                    pool->on_lost();
+                    return;
+                }
+
+                pool->on_claimed();
+                target->start();
+                do_connect_target();
+            });
+        });
+    }, data_profile_setup());
+}
+
+class StreamSession : public std::enable_shared_from_this<StreamSession> {
+  public:
+    StreamSession(std::shared_ptr<mux_stream> _stream, Codec _codec, const Mapping &mapping)
+        : stream(std::move(_stream)),
+          target(std::make_shared<TargetLeg>(shards.next().get_executor(), mapping)),
+          codec(_codec) {}
+
+    void do_connect() {
+        auto self(shared_from_this());
+        target->start();
+        target->async_wait([this, self](const boost::system::error_code & ec) {
+            if (ec) {
+                stream->close();
+                return;
+            }
+
+            sessions_total.add();
+#ifdef HAVE_ZLIB
+
+            if (codec != Codec::NONE) {
+                make_depipe<compressed_stream<mux_channel>, ssocket>(
+                    compressed_stream<mux_channel>(mux_channel(stream), codec),
+                    std::move(target->socket))->start();
+                return;
+            }
+
+#endif
+            make_depipe<mux_channel, ssocket>(mux_channel(stream),
+                                              std::move(target->socket))->start();
+        });
+    }
+
+  private:
+    std::shared_ptr<mux_stream> stream;
+    std::shared_ptr<TargetLeg> target;
+    Codec codec;
+};
+
+/**
+ * @class UdpSession
+ * @brief TunnelMode::UDP 的 expose 端：控制連線上的每個 flow 對應一個連到 target 的 UDP socket。
+ *
+ * 每個 flow 用自己的 source port，target 看到的是不同的 client；
+ * flow 閒置超過 udp_idle_timeout() 時關閉 socket，proxy 再送來時重新建立。
+ * 同時開啟的 socket 以 udp_max_flows() 為上限，已滿時關閉最久沒有流量的 flow。
+ */
+class UdpSession : public std::enable_shared_from_this<UdpSession> {
+  public:
+    UdpSession(tcp::socket control, udp::endpoint _target)
+        : executor(control.get_executor()),
+          link(std::make_shared<datagram_link>(std::move(control))),
+          target(_target),
+          sweeper(executor) {}
+
+    void start(std::function<void()> on_close) {
+        auto self(shared_from_this());
+        link->start([this, self](const std::vector<datagram> &frames) {
+            do_send(frames);
+        }, [this, self, on_close]() {
+            sweeper.cancel();
+            on_close();
+        });
+        do_sweep();
+    }
+
+  private:
+    struct flow {
+        explicit flow(const any_io_executor &executor, uint32_t _id) : socket(executor), id(_id) {}
+
+        udp::socket socket;
+        uint32_t id;
+        flow_order::iterator order;
+    };
+
+    // proxy -> target：同一個 flow 的 datagram 排在一起，以 sendmmsg 分批送出
+    void do_send(const std::vector<datagram> &frames) {
+        auto now = std::chrono::steady_clock::now();
+        batch.clear();
+
+        for (auto &frame : frames) {
+            auto it = flows.find(frame.flow);
+
+            if (it == flows.end()) {
+                if (flows.size() >= udp_max_flows()) {
+                    // 同一批中較早的 datagram 若屬於被關閉的 flow，送出時失敗並計入 dropped
+                    close_flow(flows.find(order.oldest().flow));
+                    udp_stats().evicted.add();
+                }
+
+                auto entry = do_open(frame.flow, now);
+
+                if (!entry) {
+                    udp_stats().dropped.add();
+                    continue;
+                }
+
+                it = flows.emplace(frame.flow, std::move(entry)).first;
+            } else {
+                order.touch(it->second->order, now);
+            }
+
+            batch.push_back({it->second.get(), frame});
+        }
+
+        std::stable_sort(batch.begin(), batch.end(), [](const pending & a, const pending & b) {
+            return a.owner < b.owner;
+        });
+
+        for (auto &item : batch) {
+            sender.add(item.owner->socket, nullptr, item.frame.data, item.frame.size);
+        }
+
+        sender.flush();
+    }
+
+    std::shared_ptr<flow> do_open(uint32_t id, std::chrono::steady_clock::time_point now) {
+        auto entry = std::make_shared<flow>(executor, id);
+        boost::system::error_code ec;
+        entry->socket.open(udp::v4(), ec);
+
+        if (!ec) {
+            entry->socket.connect(target, ec);
+        }
+
+        if (!ec) {
+            entry->socket.non_blocking(true, ec);
+        }
+
+        if (ec) {
+            target_connect_failures.add();
+            return nullptr;
+        }
+
+        entry->order = order.add(id, now);
+        udp_stats().flows.add(1);
+        sessions_total.add();
+        do_receive(entry);
+        return entry;
+    }
+
+    void close_flow(std::unordered_map<uint32_t, std::shared_ptr<flow>>::iterator it) {
+        boost::system::error_code ignored;
+        it->second->socket.close(ignored);
+        order.erase(it->second->order);
+        flows.erase(it);
+        udp_stats().flows.add(-1);
+    }
+
+    // target -> proxy：每次可讀時以 recvmmsg 收最多 UDP_ROUNDS 批，整批併成一次控制連線寫入
+    void do_receive(std::shared_ptr<flow> entry) {
+        auto self(shared_from_this());
+        entry->socket.async_wait(udp::socket::wait_read,
+        [this, self, entry](const boost::system::error_code & ec) {
+            // 完成之後、handler 執行之前 flow 可能已被關閉
+            if (ec || !entry->socket.is_open()) {
+                return;
+            }
+
+            for (int round = 0; round < UDP_ROUNDS; ++round) {
+                size_t n = receive_datagrams(entry->socket,
+                [&](const char *data, size_t size, const udp::endpoint &) {
+                    link->send(entry->id, data, size);
+                });
+                udp_stats().downstream.add(n);
+
+                if (n < udp_batch()) {
+                    break;
+                }
+            }
+
+            order.touch(entry->order, std::chrono::steady_clock::now());
+            link->flush();
+            do_receive(entry);
+        });
+    }
+
+    void do_sweep() {
+        auto self(shared_from_this());
+        sweeper.expires_after(std::chrono::seconds(1));
+        sweeper.async_wait([this, self](const boost::system::error_code & ec) {
+            auto deadline = std::chrono::steady_clock::now() - udp_idle_timeout();
+
+            // 控制連線斷開時全部關閉
+            while (!order.empty() && (ec || order.oldest().last < deadline)) {
+                close_flow(flows.find(order.oldest().flow));
+            }
+
+            if (!ec) {
+                do_sweep();
+            }
+        });
+    }
+
+    struct pending {
+        flow *owner;
+        datagram frame;
+    };
+
+    any_io_executor executor;
+    std::shared_ptr<datagram_link> link;
+    udp::endpoint target;
+    boost::asio::steady_timer sweeper;
+    datagram_sender sender;
+    std::unordered_map<uint32_t, std::shared_ptr<flow>> flows;
+    flow_order order;
+    std::vector<pending> batch;
 };
 
+/**
+ * @class Agent
+ * @brief 一條控制連線與它註冊的 mapping。
+ *
+ * 只有一個 mapping 時以 tunnel_mode 註冊；dial-back 模式的多個 mapping 以 TunnelMode::GROUP
+ * 共用這一條控制連線，proxy 送來的 SESSION frame 帶有 mapping ID (members 中的順序)。
+ */
 class Agent : public std::enable_shared_from_this<Agent> {
   public:
-    Agent() : control(io), retry_timer(io) {}
+    explicit Agent(std::vector<const Mapping *> _members)
+        : control(shards.next()), retry_timer(control.get_executor()), members(std::move(_members)),
+          grouped(members.size() > 1) {
+        if (grouped) {
+            group_count = static_cast<uint16_t>(members.size());
+
+            for (auto member : members) {
+                group_ports.push_back(member->proxy_port);
+            }
+        }
+
+        // 任一 mapping 帶有名稱時，註冊訊息之後依序附上每個 mapping 的 [name_length: 1][name]
+        bool named = false;
+
+        for (auto member : members) {
+            named = named || !member->host.empty();
+        }
+
+        auto base = static_cast<uint8_t>(grouped ? TunnelMode::GROUP : tunnel_mode);
+        mode = static_cast<TunnelMode>(base | (named ? VHOST_FLAG : 0));
+
+        for (auto member : members) {
+            if (!named) {
+                break;
+            }
+
+            hosts.push_back(static_cast<char>(member->host.size()));
+            hosts.insert(hosts.end(), member->host.begin(), member->host.end());
+        }
+
+        // dial-back 類的模式在註冊訊息之後緊接著送出 HELLO frame
+        if (tunnel_mode != TunnelMode::MUX && tunnel_mode != TunnelMode::UDP) {
+            std::array<char, HELLO_REPLY_SIZE> payload;
+            size_t size = local_hello().encode(payload, false);
+            hello.resize(FRAME_HEADER_SIZE + size);
+            put_be(&hello[0], static_cast<uint16_t>(size));
+            hello[2] = static_cast<char>(ControlFrame::HELLO);
+            std::memcpy(&hello[FRAME_HEADER_SIZE], payload.data(), size);
+        }
+    }
 
     void do_request() {
         auto self(shared_from_this());
@@ -87,46 +838,186 @@ class Agent : public std::enable_shared_from_this<Agent> {
             control, proxy_host, ctrl_port,
         [this, self](const boost::system::error_code & ec, const tcp::endpoint) {
             if (ec) {
-                std::cout << ec.what() << std::endl;
+                std::cout << ec.message() << std::endl;
                 std::cout << "Proxy server not found" << std::endl;
                 do_retry();
                 return;
             }
 
+            std::vector<const_buffer> request = {buffer(&members[0]->proxy_port, 2),
+                                                 buffer(&mode, 1), buffer(&requested_codec, 1),
+                                                 buffer(hosts), buffer(hello)
+                                                };
+
+            if (grouped) {
+                static const u_short no_port = 0;
+                request = {buffer(&no_port, 2), buffer(&mode, 1), buffer(&requested_codec, 1),
+                           buffer(&group_count, 2), buffer(group_ports), buffer(hosts),
+                           buffer(hello)
+                          };
+            }
+
             async_write(
-                control, buffer(&proxy_port, 2),
-            [this, self](const boost::system::error_code & ec, size_t size) {
-                if (ec || size != 2) {
+                control, request,
+            [this, self, expected = buffer_size(request)](const boost::system::error_code & ec,
+            size_t size) {
+                if (ec || size != expected) {
                     std::cout << "Proxy failed" << std::endl;
                     return;
                 }
 
-                std::cout << "Proxy at " << proxy_host << ":" << proxy_port
-                          << std::endl;
-                do_handle_connection();
+                do_read_codec();
             });
-        });
+        }, profile_setup());
     }
 
   private:
-    void do_handle_connection() {
+    // proxy 回覆它接受的壓縮方式：要求的 Codec 或 NONE
+    void do_read_codec() {
         auto self(shared_from_this());
-        // looply wait for new connection from proxy server
-        async_read(control, buffer(&random_port, 2),
-        [this, self](const boost::system::error_code & ec, size_t size) {
-            if (ec || size != 2) {
+        async_read(control, buffer(&codec, 1),
+        [this, self](const boost::system::error_code & ec, size_t) {
+            if (ec || (codec != requested_codec && codec != Codec::NONE)) {
                 std::cout << "Lose connection\n";
                 do_retry();
                 return;
             }
 
-            std::make_shared<Session>(random_port)->do_accept();
-            do_handle_connection();
+            registrations.add();
+
+            for (auto member : members) {
+                std::cout << "Proxy at " << proxy_host << ":" << member->proxy_port
+                          << (member->host.empty() ? "" : " for " + member->host)
+                          << " (compression " << codec_name(codec) << ")" << std::endl;
+            }
+
+            if (codec != requested_codec) {
+                std::cout << "Proxy does not support compression " << codec_name(requested_codec)
+                          << std::endl;
+            }
+
+            if (tunnel_mode == TunnelMode::MUX) {
+                do_multiplex();
+            } else if (tunnel_mode == TunnelMode::UDP) {
+                do_relay_udp();
+            } else {
+                do_control();
+            }
+        });
+    }
+
+    // 之後的控制訊息都是 control frame：proxy 的 HELLO 帶有 data port (POOL 另有停放用的 token)，
+    // 之後每個 client 一個 SESSION frame
+    void do_control() {
+        auto self(shared_from_this());
+        channel = std::make_shared<control_channel>(std::move(control));
+        channel->start([this, self](ControlFrame type, const char *payload, size_t size) {
+            if (type == ControlFrame::HELLO) {
+                do_greet(payload, size);
+            } else if (type == ControlFrame::SESSION && size >= SESSION_MIN_SIZE && greeted) {
+                uint16_t id = get_be<uint16_t>(payload);
+                uint64_t token;
+                std::memcpy(&token, payload + 2, 8);
+                uint64_t trace_id = size >= SESSION_SIZE ? get_be<uint64_t>(payload + 10) : 0;
+
+                // proxy 未啟用追蹤時為 0，本地啟用追蹤時另外編號
+                if (trace_id == 0) {
+                    trace_id = new_trace_id();
+                }
+
+                trace_event("expose_setup", trace_id, TracePhase::BEGIN);
+
+                if (id >= members.size()) {
+                    channel->close();
+                    return;
+                }
+
+                do_session(*members[id], token, trace_id);
+            }
+        }, [this, self]() {
+            std::cout << "Lose connection\n";
+            do_retry();
+        });
+    }
+
+    void do_greet(const char *payload, size_t size) {
+        control_hello peer;
+
+        if (greeted || !peer.decode(payload, size, true)) {
+            return;
+        }
+
+        greeted = true;
+        data_port = peer.data_port;
+
+        if (tunnel_mode == TunnelMode::POOL) {
+            pool = std::make_shared<DataPool>(*members[0], data_port, peer.token, codec);
+            pool->start();
+        }
+
+        channel->start_heartbeat(negotiate_heartbeat(local_hello(), peer));
+    }
+
+    void do_session(const Mapping &mapping, uint64_t token, uint64_t trace_id) {
+#ifdef USE_COROUTINES
+
+        if (pipe_engine() == PipeEngine::COPY) {
+            auto &context = shards.next();
+            co_spawn_task(context.get_executor(),
+            [&context, &mapping, port = data_port, token, codec = codec, trace_id]() {
+                return co_session(context, mapping, port, token, codec, trace_id);
+            });
+            return;
+        }
+
+#endif
+        std::make_shared<Session>(mapping)->do_accept(data_port, token, codec, trace_id);
+    }
+
+    void do_multiplex() {
+        auto self(shared_from_this());
+        // control 連線交給 mux_session，之後每個 client 都是其上的一條 stream
+        auto tunnel = std::make_shared<mux_session>(std::move(control));
+        tunnel->start([codec = codec, &mapping = *members[0]](std::shared_ptr<mux_stream> stream) {
+            std::make_shared<StreamSession>(std::move(stream), codec, mapping)->do_connect();
+        }, [this, self]() {
+            std::cout << "Lose connection\n";
+            do_retry();
+        });
+    }
+
+    // 控制連線交給 UdpSession 承載 datagram；target 只在建立時解析一次
+    void do_relay_udp() {
+        auto self(shared_from_this());
+        auto resolver = std::make_shared<udp::resolver>(control.get_executor());
+        resolver->async_resolve(udp::v4(), members[0]->target_host, members[0]->target_port,
+        [this, self, resolver](const boost::system::error_code & ec,
+        udp::resolver::results_type results) {
+            if (ec || results.empty()) {
+                std::cout << "Target not found\n";
+                do_retry();
+                return;
+            }
+
+            auto session = std::make_shared<UdpSession>(std::move(control),
+                           results.begin()->endpoint());
+            session->start([this, self]() {
+                std::cout << "Lose connection\n";
+                do_retry();
+            });
         });
     }
 
     void do_retry() {
         auto self(shared_from_this());
+
+        if (pool) {
+            pool->stop();
+            pool.reset();
+        }
+
+        channel.reset();
+        greeted = false;
         control.close();
         retry_timer.expires_after(std::chrono::seconds(3));
         std::cout << "Retry after 3 seconds\n";
@@ -140,9 +1031,20 @@ class Agent : public std::enable_shared_from_this<Agent> {
     }
 
   private:
-    u_short random_port;
     tcp::socket control;
+    std::shared_ptr<control_channel> channel;
+    bool greeted = false;
     boost::asio::steady_timer retry_timer;
+    Codec codec = Codec::NONE;
+    u_short data_port;
+    std::shared_ptr<DataPool> pool;
+    std::vector<const Mapping *> members;
+    bool grouped;
+    TunnelMode mode;
+    uint16_t group_count = 0;
+    std::vector<u_short> group_ports;
+    std::vector<char> hosts;
+    std::vector<char> hello;
 };
 
 int main(int argc, const char *argv[]) {
@@ -168,50 +1070,201 @@ int main(int argc, const char *argv[]) {
         return 1;
     }
 
+    if (const char *mode = std::getenv("TUNNEL_MODE")) {
+        if (std::string(mode) == "mux") {
+            tunnel_mode = TunnelMode::MUX;
+        } else if (std::string(mode) == "udp") {
+            tunnel_mode = TunnelMode::UDP;
+        } else if (std::string(mode) != "dial") {
+            std::cerr << "Environment variable TUNNEL_MODE should be \"dial\", \"mux\" "
+                      "or \"udp\"\n";
+            return 1;
+        }
+    }
+
+    if (const char *compression = std::getenv("COMPRESSION")) {
+        if (!parse_codec(compression, requested_codec)) {
+            std::cerr << "Environment variable COMPRESSION should be \"none\", \"deflate-fast\" or "
+                      "\"deflate\"\n";
+            return 1;
+        }
+
+        if (!codec_supported(requested_codec)) {
+            std::cerr << "Compression " << compression << " is not supported by this build\n";
+            return 1;
+        }
+
+        if (requested_codec != Codec::NONE && tunnel_mode == TunnelMode::UDP) {
+            std::cerr << "Compression is not supported with TUNNEL_MODE=udp\n";
+            return 1;
+        }
+    }
+
+    if (const char *pool = std::getenv("EXPOSE_POOL")) {
+        try {
+            std::vector<std::string> watermarks;
+            boost::split(watermarks, pool, boost::is_any_of(":"));
+
+            if (watermarks.size() != 2 || tunnel_mode != TunnelMode::DIAL_BACK) {
+                throw std::invalid_argument("");
+            }
+
+            pool_low = std::stoul(watermarks[0]);
+            pool_high = std::stoul(watermarks[1]);
+
+            if (pool_high == 0 || pool_low > pool_high) {
+                throw std::invalid_argument("");
+            }
+
+            tunnel_mode = TunnelMode::POOL;
+        } catch (...) {
+            std::cerr << "Environment variable EXPOSE_POOL should follow the format "
+                      "<low>:<high> and requires TUNNEL_MODE=dial\n";
+            return 1;
+        }
+    }
+
+    if (const char *pool = std::getenv("TARGET_POOL")) {
+        try {
+            std::vector<std::string> settings;
+            boost::split(settings, pool, boost::is_any_of(":"));
+
+            if (settings.size() > 2 || tunnel_mode == TunnelMode::UDP) {
+                throw std::invalid_argument("");
+            }
+
+            target_pool_size = std::stoul(settings[0]);
+
+            if (settings.size() == 2) {
+                target_pool_idle = std::chrono::seconds(std::stoul(settings[1]));
+            }
+        } catch (...) {
+            std::cerr << "Environment variable TARGET_POOL should follow the format "
+                      "<size>[:<max_idle_seconds>] and cannot be used with TUNNEL_MODE=udp\n";
+            return 1;
+        }
+    }
+
+    if (const char *name = std::getenv("SOCKET_PROFILE")) {
+        profile = find_socket_profile(name);
+
+        if (!profile) {
+            std::cerr << "Environment variable SOCKET_PROFILE should be \"default\", "
+                      "\"interactive\" or \"bulk\"\n";
+            return 1;
+        }
+    }
+
+    // 命令列上的 mapping 與 EXPOSE_CONFIG 檔案中每行一個的 mapping (# 之後為註解)
+    std::vector<std::string> specs(argv + 1, argv + argc);
+
+    if (const char *path = std::getenv("EXPOSE_CONFIG")) {
+        std::ifstream file(path);
+        std::string line;
+
+        if (!file) {
+            std::cerr << "Cannot read EXPOSE_CONFIG file " << path << "\n";
+            return 1;
+        }
+
+        while (std::getline(file, line)) {
+            line = line.substr(0, line.find('#'));
+            boost::trim(line);
+
+            if (!line.empty()) {
+                specs.push_back(line);
+            }
+        }
+    }
+
     try {
-        if (argc != 2) {
+        if (specs.empty() || specs.size() > MAX_GROUP_MAPPINGS) {
             throw std::invalid_argument("");
         }
-        std::vector<std::string> temp;
-        boost::split(temp, argv[1], boost::is_any_of(":"));
-        proxy_port = std::stoi(temp[0]);
 
-        switch (temp.size()) {
-        case 2:
-            target_port = temp[1];
-            break;
+        std::set<std::pair<std::string, u_short>> ports;
 
-        case 3:
-            target_host = temp[1];
-            target_port = temp[2];
-            break;
+        for (auto &spec : specs) {
+            std::vector<std::string> temp;
+            auto mapping = std::make_unique<Mapping>();
+            size_t at = spec.find('@');
 
-        default:
-            throw std::invalid_argument("");
+            if (at != std::string::npos) {
+                mapping->host = spec.substr(0, at);
+
+                // 名稱長度以 1 byte 傳送；UDP 沒有 Host / SNI 可供路由
+                if (mapping->host.empty() || mapping->host.size() > VHOST_MAX_NAME
+                        || tunnel_mode == TunnelMode::UDP) {
+                    throw std::invalid_argument("");
+                }
+            }
+
+            boost::split(temp, spec.substr(at == std::string::npos ? 0 : at + 1),
+                         boost::is_any_of(":"));
+            mapping->proxy_port = std::stoi(temp[0]);
+
+            switch (temp.size()) {
+            case 2:
+                mapping->target_port = temp[1];
+                break;
+
+            case 3:
+                mapping->target_host = temp[1];
+                mapping->target_port = temp[2];
+                break;
+
+            default:
+                throw std::invalid_argument("");
+            }
+
+            if (!ports.insert({mapping->host, mapping->proxy_port}).second) {
+                throw std::invalid_argument("");
+            }
+
+            mappings.push_back(std::move(mapping));
         }
     } catch (...) {
-        std::cerr << "Usage: expose <proxy_port>:[<target_host>:]<target_port>";
+        std::cerr << "Usage: expose [<host>@]<proxy_port>:[<target_host>:]<target_port> ...\n"
+                  "Mappings may also be listed one per line in the file named by EXPOSE_CONFIG; "
+                  "each proxy port (or host on a shared port) may appear only once\n";
         return 1;
     }
 
     try {
-        signal_set signals(io, SIGINT, SIGTERM);
+        signal_set signals(shards.get(0), SIGINT, SIGTERM);
         signals.async_wait(
         [](const boost::system::error_code & ec, int signal_number) {
             if (!ec) {
-                io.stop();
+                shards.stop();
             }
         });
-        std::make_shared<Agent>()->do_request();
-        std::vector<std::thread> threads;
+        // target 的 host 已知後才建立每個 shard 的 warm pool
+        for (auto &mapping : mappings) {
+            for (size_t i = 0; target_pool_size > 0 && i < shards.size(); ++i) {
+                auto pool = std::make_shared<TargetPool>(shards.get(i), *mapping);
+                mapping->target_pools.push_back(pool);
+                mapping->target_pools.back()->start();
+            }
+        }
 
-        for (int i = 0; i < 4; ++i)
-            threads.emplace_back([]() {
-            io.run();
-        });
+        // dial-back 的所有 mapping 共用一條控制連線；mux、udp 與 pool 的控制連線本身承載
+        // 該 port 的資料或停放狀態，每個 mapping 各一條
+        if (tunnel_mode == TunnelMode::DIAL_BACK) {
+            std::vector<const Mapping *> members;
+
+            for (auto &mapping : mappings) {
+                members.push_back(mapping.get());
+            }
 
-        for (auto &t : threads)
-            t.join();
+            std::make_shared<Agent>(std::move(members))->do_request();
+        } else {
+            for (auto &mapping : mappings) {
+                std::make_shared<Agent>(std::vector<const Mapping *> {mapping.get()})->do_request();
+            }
+        }
+        serve_metrics(shards.get(0));
+        dump_trace_on_signal(shards.get(0), "expose");
+        shards.run();
     } catch (std::exception &e) {
         std::cerr << "error: " << e.what() << std::endl;
     }
@@ -1,201 +1,2737 @@
+#include <algorithm>
 #include <boost/asio.hpp>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <unordered_map>
 #include <thread>
 #include <vector>
 
+#include "compress.hpp"
+#include "concurrent_map.hpp"
+#include "control.hpp"
 #include "depipe.hpp"
+#include "io_pool.hpp"
+#include "metrics.hpp"
+#include "mux.hpp"
+#include "protocol.hpp"
+#include "shaping.hpp"
+#include "socket_profile.hpp"
 #include "ssocket.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+#include "udp_tunnel.hpp"
+#include "vhost.hpp"
+
+#if defined(__unix__)
+#include "upgrade.hpp"
+#endif
+
+#ifdef USE_COROUTINES
+#include "coro_pipe.hpp"
+#endif
 
 using namespace boost::asio;
 using ip::tcp;
-io_context io;
+using ip::udp;
+
+class PortGroup;
+class VhostPort;
+
+// 每個對外 port (虛擬主機則為 port 與名稱) 一個 backend group，同一個 port 可由多個 expose 註冊。
+// 須宣告在 shards 之前：shards 解構時殘留的物件仍可能存取它們。
+std::mutex ports_mutex;
+std::map<std::pair<u_short, std::string>, std::weak_ptr<PortGroup>> port_groups;
+// 由多個虛擬主機名稱共用的對外 port
+std::map<u_short, std::weak_ptr<VhostPort>> vhost_ports;
+
+// 新 client 在同一個 port 的多個 expose 之間的分配方式，由環境變數 BALANCE_POLICY 選擇
+enum class BalancePolicy {
+    ROUND_ROBIN,
+    LEAST_CONN,
+    LOWEST_LATENCY,
+};
+
+BalancePolicy balance_policy = BalancePolicy::ROUND_ROBIN;
+
+// 單一 expose 的負載；由 session 持有，可能比 Agent 活得久
+struct BackendLoad {
+    std::atomic<size_t> active{0};
+    std::atomic<double> latency{-1}; // dial-back 延遲的 EWMA (秒)，尚未量測過為負值
+
+    bool measured() const {
+        return latency.load(std::memory_order_relaxed) >= 0;
+    }
+
+    // 第一個量測值直接作為初始值；同時完成的 session 以 CAS 更新，不會互相覆蓋
+    void observe(double seconds) {
+        double current = latency.load(std::memory_order_relaxed);
+
+        while (!latency.compare_exchange_weak(current,
+                                              current < 0 ? seconds : 0.8 * current + 0.2 * seconds,
+                                              std::memory_order_relaxed)) {
+        }
+    }
+};
+
+// 從送出 session token 到 agent 連回的時間
+histogram dial_back_seconds("proxy_dial_back_seconds",
+                            "Time from dial-back request to agent connect.",
+{0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5});
+counter dial_back_timeouts("proxy_dial_back_timeouts_total",
+                           "Dial-back requests the agent did not answer in time.");
+counter bind_failures("proxy_bind_failures_total", "Proxy ports that could not be bound.");
+counter vhost_matched("proxy_vhost_routes_total",
+                      "Clients routed on shared ports, by how the name matched.",
+                      "result=\"host\"");
+counter vhost_defaulted("proxy_vhost_routes_total",
+                        "Clients routed on shared ports, by how the name matched.",
+                        "result=\"default\"");
+counter vhost_unmatched("proxy_vhost_routes_total",
+                        "Clients routed on shared ports, by how the name matched.",
+                        "result=\"none\"");
+
+io_pool shards;
+
+// 環境變數 SOCKET_PROFILE：每個對外 port 的 client 與資料連線使用的 socket 設定
+socket_profiles profiles;
+
+// 舊程式交出的 listener (見 upgrade.hpp)，由第一個用到該 port 的 Server 或 group 取用
+std::map<u_short, std::vector<int>> inherited_listeners;
+// 已開始交給新程式：不再建立 listener，之後才完成的註冊關閉控制連線，讓 expose 重新註冊到新程式
+std::atomic<bool> handing_over{false};
+// 目前的 session 數 (含等待 dial-back 的 client)；交出之後舊程式等它歸零才結束
+std::atomic<size_t> open_sessions{0};
+// 已 accept 但還沒讀完開頭的連線數；交出 session 之前等它們找到 token
+std::atomic<size_t> handshakes{0};
+// 最後一個 handshake_guard 結束時通知等待中的交接 (只在歸零時取得 mutex)
+std::mutex handshakes_mutex;
+std::condition_variable handshakes_done;
+
+struct handshake_guard {
+    handshake_guard() {
+        ++handshakes;
+    }
+
+    ~handshake_guard() {
+        if (--handshakes == 0) {
+            std::lock_guard<std::mutex> lock(handshakes_mutex);
+            handshakes_done.notify_all();
+        }
+    }
+
+    handshake_guard(const handshake_guard &) = delete;
+    handshake_guard &operator=(const handshake_guard &) = delete;
+};
+
+// port 的 listener：有舊程式交出的就沿用 (shard 數不同時沿用舊程式的 acceptor 數)，否則 bind。
+// 呼叫時持有 ports_mutex 或尚未開始服務；bind 失敗時拋出例外
+std::vector<tcp::acceptor> listen_port(u_short port) {
+    auto inherited = inherited_listeners.find(port);
+
+    if (inherited == inherited_listeners.end()) {
+        return listen_sharded(shards, tcp::endpoint(tcp::v4(), port));
+    }
+
+    std::vector<tcp::acceptor> acceptors;
+
+    for (size_t i = 0; i < inherited->second.size(); ++i) {
+        acceptors.emplace_back(shards.get(i), tcp::v4(), inherited->second[i]);
+    }
+
+    inherited_listeners.erase(inherited);
+    return acceptors;
+}
 
+// client 與 agent 已在同一個 shard 上，開始轉送；agent 端依協商結果壓縮，
+// 受整形或設定閒置逾時的 tunnel 一律使用 depipe (不使用 coroutine 版本)。
+// trace_id 為追蹤中的 session ID (0 表示不追蹤)，coroutine 版本只記錄開始轉送
+void start_pipe(tcp::socket client, tcp::socket agent, std::shared_ptr<void> active, Codec codec,
+                std::shared_ptr<tunnel_shaper> shaper, uint64_t trace_id = 0) {
+    trace_event("pipe_start", trace_id);
+
+    if (profiles.configured()) {
+        boost::system::error_code ec;
+        auto local = client.local_endpoint(ec);
+
+        if (!ec) {
+            apply_profile(agent, profiles.for_port(local.port()));
+        }
+    }
+
+#ifdef HAVE_ZLIB
+    if (codec != Codec::NONE) {
+        auto piper = make_depipe<ssocket, compressed_stream<ssocket>>(
+                         std::move(client),
+                         compressed_stream<ssocket>(ssocket(std::move(agent)), codec));
+        piper->track(std::move(active));
+        piper->shape(std::move(shaper));
+        piper->trace(trace_id);
+        piper->start();
+        return;
+    }
+#endif
+#ifdef USE_COROUTINES
+    if (pipe_engine() == PipeEngine::COPY && !shaper && tunnel_idle_timeout().count() == 0) {
+        co_depipe(std::move(client), std::move(agent), std::move(active));
+        return;
+    }
+#endif
+    auto piper = make_depipe(std::move(client), std::move(agent));
+    piper->track(std::move(active));
+    piper->shape(std::move(shaper));
+    piper->trace(trace_id);
+    piper->start();
+}
+
+// expose 收到 session token 後須在這段時間內連到 data port
+constexpr auto DIAL_BACK_TIMEOUT = std::chrono::seconds(5);
+
+// control / data port 上的連線須在這段時間內送完開頭 (註冊訊息或 token)，否則關閉
+constexpr auto HANDSHAKE_TIMEOUT = std::chrono::seconds(10);
+
+/**
+ * @class pending_handshake
+ * @brief control / data port 上還沒讀完開頭的連線：HANDSHAKE_TIMEOUT 內沒有讀完就關閉，
+ * 存活期間計入 handshakes。
+ *
+ * 以 aliasing shared_ptr<tcp::socket> 交給各段讀取 handler，最後一個 handler 結束 (開頭讀完並交出
+ * socket，或讀取失敗) 時釋放並取消時限；都在 accept 它的 shard 上執行。
+ */
+class pending_handshake {
+  public:
+    static std::shared_ptr<tcp::socket> start(tcp::socket socket) {
+        auto pending = std::make_shared<pending_handshake>(std::move(socket));
+        auto &context = static_cast<io_context &>(pending->socket_.get_executor().context());
+        pending->deadline_.arm(use_service<timer_wheel>(context), HANDSHAKE_TIMEOUT);
+        return std::shared_ptr<tcp::socket>(pending, &pending->socket_);
+    }
+
+    explicit pending_handshake(tcp::socket socket)
+        : socket_(std::move(socket)), deadline_([this]() {
+        // 進行中的讀取以錯誤結束，handler 隨之釋放這個物件
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }) {}
+
+  private:
+    tcp::socket socket_;
+    handshake_guard guard_;
+    wheel_timer deadline_;
+};
+
+// 對外 port 每次 accept 完成後最多再取出的連線數 (含第一條)
+constexpr size_t ACCEPT_BATCH = 32;
+
+// 共用 port 的 client 須在這段時間內送出 Host / SNI，逾時交給名稱 "*"
+constexpr auto VHOST_TIMEOUT = std::chrono::seconds(5);
+
+// 不可預測的 64-bit token；每條線程一個以 random_device 播種的產生器，不必每次進 kernel
+inline uint64_t new_token() {
+    thread_local std::mt19937_64 generator([]() {
+        std::random_device rd;
+        std::seed_seq seed{rd(), rd(), rd(), rd()};
+        return std::mt19937_64(seed);
+    }());
+    return generator();
+}
+
+/**
+ * 等待 expose 回撥的 client。
+ *
+ * 不再為每個 client 開一個臨時 acceptor：session 以 token 登記在 pending_sessions，
+ * token 以 SESSION frame 經控制連線送給 expose，expose 連到共用的 data port 並送出 token 後由 attach 配對。
+ * 時限掛在 client 所在 shard 的 timer_wheel 上 (不需每個 session 一個 steady_timer)，
+ * 因此 session 的最後一段 (取消時限、開始轉送) 都在該 shard 上執行。
+ *
+ * 以 -DENABLE_COROUTINES=ON 建置時整段流程是 client 所在 shard 上的一個 coroutine (run)：
+ * 送出 SESSION frame 後 co_await 資料連線，attach、逾時、交出與控制連線斷開都只是恢復它。
+ */
 class Session : public std::enable_shared_from_this<Session> {
   public:
-    Session(tcp::socket _client, std::shared_ptr<ssocket> _control)
+    // mapping 為 TunnelMode::GROUP 中這個 port 的 mapping ID，單一註冊時為 -1
+    Session(tcp::socket _client, std::shared_ptr<control_channel> _control,
+            std::shared_ptr<void> _active, std::shared_ptr<tunnel_shaper> _shaper,
+            std::shared_ptr<BackendLoad> _load, Codec _codec, int _mapping)
         : client(std::move(_client)),
-          agent_acceptor(io),
-          timer(io),
-          control(_control) {}
+          control(_control),
+          active(std::move(_active)),
+          shaper(std::move(_shaper)),
+          load(std::move(_load)),
+          codec(_codec),
+          mapping(_mapping),
+          deadline([this]() {
+        expire();
+    }) {}
+
+    // 送出 SESSION frame 並等待資料連線；可在任何線程上呼叫，之後都在 client 所在的 shard 上進行
+    void start();
+
+    // 舊程式交出、SESSION frame 已送出的 session：以原本的 token 等待資料連線。
+    // 在開始服務之前呼叫；時限在 client 所在的 shard 上開始
+    void resume(uint64_t _token, uint64_t _trace_id);
+
+#if defined(__unix__)
+    // 交給新程式 (已從 pending_sessions 取出)：在 client 所在的 shard 上停止時限，交出 client 的 fd
+    int hand_over() {
+        deadline.cancel();
+        armed.reset();
+        boost::system::error_code ec;
+        int fd = client.release(ec);
+
+        if (ec) {
+            fd = -1;
+            client.close(ec);
+        }
+
+        finish();
+        return fd;
+    }
+#endif
+
+    io_context::executor_type get_executor() {
+        return static_cast<io_context &>(client.get_executor().context()).get_executor();
+    }
+
+    const std::shared_ptr<control_channel> &get_control() const {
+        return control;
+    }
+
+    int get_mapping() const {
+        return mapping;
+    }
+
+    uint64_t get_token() const {
+        return token;
+    }
+
+    uint64_t get_trace_id() const {
+        return trace_id;
+    }
+
+    // 帶著這個 session token 的資料連線已到達 (已從 pending_sessions 取出)
+    void attach(tcp::socket agent) {
+        double latency = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - requested).count();
+        dial_back_seconds.observe(latency);
+        load->observe(latency);
+        trace_event("agent_accept", trace_id);
+
+        // 資料連線在 data port 所在的 shard 上 accept，交給 client 所在的 shard 繼續處理
+        auto self(shared_from_this());
+        auto &context = static_cast<io_context &>(client.get_executor().context());
+        post(context, [this, self, agent = rehome(std::move(agent), context)]() mutable {
+            deadline.cancel();
+            armed.reset();
+            trace_event("proxy_setup", trace_id, TracePhase::END);
+#ifdef USE_COROUTINES
+            agent_ = std::move(agent);
+            finish();
+#else
+            start_pipe(std::move(client), std::move(agent), std::move(active), codec,
+                       std::move(shaper), trace_id);
+#endif
+        });
+    }
+
+  private:
+    tcp::socket client;
+    std::shared_ptr<control_channel> control;
+    std::shared_ptr<void> active;
+    std::shared_ptr<tunnel_shaper> shaper;
+    std::shared_ptr<BackendLoad> load;
+    Codec codec;
+    int mapping;
+    uint64_t token;
+    uint64_t trace_id;
+    bool resumed = false;
+    std::chrono::steady_clock::time_point requested;
+    // 時限掛在 wheel 上時以 armed 保持 session 存活
+    wheel_timer deadline;
+    std::shared_ptr<Session> armed;
+
+    // expose 沒有在時限內連回；token 已被 attach 取走時什麼都不做
+    void expire();
+
+    void do_connect_agent();
+
+#ifdef USE_COROUTINES
+    // 等待結束時的資料連線 (逾時、交出或控制連線已斷時未開啟)，與等待中的 run
+    tcp::socket agent_{client.get_executor()};
+    std::coroutine_handle<> waiter;
+    bool finished = false;
+
+    // 由 finish 恢復，回傳資料連線
+    struct dial_back {
+        Session &session;
+
+        bool await_ready() const noexcept {
+            return session.finished;
+        }
+
+        void await_suspend(std::coroutine_handle<> _waiter) noexcept {
+            session.waiter = _waiter;
+        }
+
+        tcp::socket await_resume() {
+            return std::move(session.agent_);
+        }
+    };
+
+    static task run(std::shared_ptr<Session> session, bool resumed);
+#endif
+
+    // token 已從 pending_sessions 取出、不會再有資料連線：恢復等待中的 run (在 client 所在的 shard 上)
+    void finish() {
+#ifdef USE_COROUTINES
+        finished = true;
+
+        if (waiter) {
+            std::exchange(waiter, nullptr).resume();
+        }
+
+#endif
+    }
+};
+
+class Agent;
+
+// 等待資料連線的 session (一次性) 與 POOL 模式 Agent 的停放 token (可重複使用)
+concurrent_map<uint64_t, std::shared_ptr<Session>> pending_sessions;
+concurrent_map<uint64_t, std::shared_ptr<Agent>> pool_tokens;
+
+// data port 預設即控制 port，由 main 設定
+u_short data_port;
+
+void Session::expire() {
+    auto self = std::move(armed);
+    std::shared_ptr<Session> pending;
+
+    if (!pending_sessions.take(token, pending)) {
+        return;
+    }
+
+    trace_event("dial_back_timeout", trace_id);
+    trace_event("proxy_setup", trace_id, TracePhase::END);
+    dial_back_timeouts.add();
+
+    // 接手的 session 的資料連線可能在交接期間到達舊程式而遺失，不代表 expose 失去回應
+    if (!resumed) {
+        control->close();
+        std::cout << "Timeout, closing control connection" << std::endl;
+    }
+
+    finish();
+}
+
+void Session::resume(uint64_t _token, uint64_t _trace_id) {
+    token = _token;
+    trace_id = _trace_id;
+    resumed = true;
+
+    // 在開始 accept 資料連線之前登記，交接期間到達的資料連線一定找得到 token
+    if (!pending_sessions.insert(token, shared_from_this())) {
+        return;
+    }
+
+    requested = std::chrono::steady_clock::now();
+    auto self(shared_from_this());
+    // attach 也排在 client 的 shard 上，一定在時限開始之後才取消它
+#ifdef USE_COROUTINES
+    co_spawn_task(client.get_executor(), [self]() {
+        return run(self, true);
+    });
+#else
+    post(client.get_executor(), [this, self]() {
+        armed = self;
+        auto &context = static_cast<io_context &>(client.get_executor().context());
+        deadline.arm(use_service<timer_wheel>(context), DIAL_BACK_TIMEOUT);
+    });
+#endif
+}
+
+void Session::start() {
+    // pool 為空時由停放中的資料連線 (在它自己的 shard 上) 退回 dial-back，先回到 client 的 shard
+#ifdef USE_COROUTINES
+    co_spawn_task(client.get_executor(), [self = shared_from_this()]() {
+        return run(self, false);
+    });
+#else
+    dispatch(client.get_executor(), [self = shared_from_this()]() {
+        self->do_connect_agent();
+    });
+#endif
+}
+
+void Session::do_connect_agent() {
+    auto self(shared_from_this());
+
+    do {
+        token = new_token();
+    } while (!pending_sessions.insert(token, self));
+
+    requested = std::chrono::steady_clock::now();
+    trace_id = new_trace_id();
+    trace_event("proxy_setup", trace_id, TracePhase::BEGIN);
+    // 在 client 所在的 shard 上 (由 start 轉到該 shard) 呼叫，時限掛在該 shard 的 wheel 上
+    armed = self;
+    auto &context = static_cast<io_context &>(client.get_executor().context());
+    deadline.arm(use_service<timer_wheel>(context), DIAL_BACK_TIMEOUT);
+    // 同時到達的 client 的 SESSION frame 在控制連線上合併成一次寫入
+    std::array<char, SESSION_SIZE> message;
+    put_be(&message[0], static_cast<uint16_t>(mapping < 0 ? 0 : mapping));
+    std::memcpy(&message[2], &token, 8);
+    put_be(&message[10], trace_id);
+    trace_event("session_sent", trace_id);
+
+    if (!control->send(ControlFrame::SESSION, message.data(), message.size())) {
+        // 控制連線已斷，不會有資料連線帶著這個 token 到達
+        std::shared_ptr<Session> dropped;
+
+        if (pending_sessions.take(token, dropped)) {
+            finish();
+        }
+    }
+}
+
+#ifdef USE_COROUTINES
+task Session::run(std::shared_ptr<Session> session, bool resumed) {
+    if (resumed) {
+        session->armed = session;
+        auto &context = static_cast<io_context &>(session->client.get_executor().context());
+        session->deadline.arm(use_service<timer_wheel>(context), DIAL_BACK_TIMEOUT);
+    } else {
+        session->do_connect_agent();
+    }
+
+    tcp::socket agent = co_await dial_back{*session};
+
+    if (!agent.is_open()) {
+        co_return;
+    }
+
+    start_pipe(std::move(session->client), std::move(agent), std::move(session->active),
+               session->codec, std::move(session->shaper), session->trace_id);
+}
+#endif
+
+/**
+ * 處理 expose 的 HELLO：版本不符時關閉控制連線，否則回覆 proxy 的 HELLO 並依協商結果開始心跳。
+ * 回覆排在之後所有 SESSION frame 之前。
+ */
+bool accept_hello(control_channel &control, const char *payload, size_t size, uint64_t token) {
+    control_hello peer;
+
+    if (!peer.decode(payload, size, false) || peer.version != CONTROL_VERSION) {
+        std::cerr << "Unsupported control protocol version " << int(peer.version) << std::endl;
+        control.close();
+        return false;
+    }
+
+    control_hello reply = local_hello();
+    reply.data_port = data_port;
+    reply.token = token;
+    std::array<char, HELLO_REPLY_SIZE> message;
+    control.send(ControlFrame::HELLO, message.data(), reply.encode(message, true));
+    control.start_heartbeat(negotiate_heartbeat(reply, peer));
+    return true;
+}
+
+/**
+ * @class PortGroup
+ * @brief 一個對外 port 的 listener 與註冊到這個 port 的所有 expose (backend)。
+ *
+ * 第一個 expose 註冊時 bind，之後註冊同一個 port 的 expose 加入同一個 group；
+ * 每個 client 依 balance_policy 交給其中一個。控制連線斷開時立即移出 group，
+ * 最後一個成員離開時關閉 listener。以虛擬主機名稱註冊的 group 沒有自己的 listener，
+ * client 由共用 port 的 VhostPort 依名稱交給它。
+ */
+class PortGroup : public std::enable_shared_from_this<PortGroup> {
+  public:
+    // host 為空時獨佔 port
+    PortGroup(u_short _port, std::string _host);
+
+    // 加入 (必要時建立) port 與名稱的 group；bind 失敗或與既有的註冊衝突時拋出例外
+    static std::shared_ptr<PortGroup> join(u_short port, const std::string &host,
+                                           const std::shared_ptr<Agent> &agent);
+
+    void leave(const std::shared_ptr<Agent> &agent);
+
+    // 把已 accept 的 client 交給其中一個 expose；沒有 backend 時關閉 client
+    void dispatch(tcp::socket client);
+
+    // 舊程式交出的等待 dial-back 的 client，交回原本的 expose
+    void resume(tcp::socket client, const std::shared_ptr<Agent> &agent, uint64_t token,
+                uint64_t trace_id);
+
+    // 獨佔 port 的 listener (虛擬主機名稱的 group 沒有)
+    std::vector<tcp::acceptor> &listeners() {
+        return proxies;
+    }
+
+    std::vector<std::shared_ptr<Agent>> current_members() {
+        std::lock_guard<std::mutex> lock(members_mutex);
+        return members;
+    }
+
+  private:
+    void do_accept(tcp::acceptor &proxy);
+
+    std::shared_ptr<Agent> pick();
+
+    std::shared_ptr<tunnel_shaper> shaper_for(tcp::socket &client);
+
+    // session 存活期間計入 port 的 active gauge、backend 的連線數與 open_sessions；
+    // token 只有一個 control block，從線程的 frame_pool 配置 (可在任何線程釋放)
+    std::shared_ptr<void> track(std::shared_ptr<BackendLoad> load) {
+        ++load->active;
+        ++open_sessions;
+        sessions_active.add(1);
+        return std::shared_ptr<void>(nullptr,
+        [load = std::move(load), active = sessions_active](void *) mutable {
+            --load->active;
+            --open_sessions;
+            active.add(-1);
+        }, pool_allocator<char>());
+    }
+
+    u_short port;
+    std::string host;
+    std::vector<tcp::acceptor> proxies;
+    std::shared_ptr<VhostPort> shared;
+    counter sessions_total;
+    gauge sessions_active;
+    gauge backends;
+    std::mutex members_mutex;
+    std::vector<std::shared_ptr<Agent>> members;
+    size_t next = 0;
+};
+
+/**
+ * @class UdpPort
+ * @brief TunnelMode::UDP 的對外 port：一個 UDP socket 加上承載 datagram 的控制連線。
+ *
+ * client 以 (位址, port) 對應到 flow，回程的 frame 依 flow 找回 client；
+ * flow 閒置超過 udp_idle_timeout() 或 flow 數達到 udp_max_flows() 時從最久沒有流量的開始釋放。
+ * 控制連線斷開時關閉 port。
+ * 與 TCP port 不同，一個 UDP port 只屬於一個 expose，不做負載平衡。
+ */
+class UdpPort : public std::enable_shared_from_this<UdpPort> {
+  public:
+    // bind 失敗時拋出例外
+    UdpPort(tcp::socket control, u_short port)
+        : socket(control.get_executor(), udp::endpoint(udp::v4(), port)),
+          link(std::make_shared<datagram_link>(std::move(control))),
+          sweeper(socket.get_executor()) {
+        socket.non_blocking(true);
+    }
+
+    void start() {
+        auto self(shared_from_this());
+        link->start([this, self](const std::vector<datagram> &frames) {
+            do_send(frames);
+        }, [this, self]() {
+            boost::system::error_code ec;
+            socket.close(ec);
+            sweeper.cancel();
+        });
+        do_receive();
+        do_sweep();
+    }
+
+  private:
+    struct flow {
+        udp::endpoint peer;
+        flow_order::iterator order;
+    };
+
+    static uint64_t key_of(const udp::endpoint &peer) {
+        return uint64_t(peer.address().to_v4().to_uint()) << 16 | peer.port();
+    }
+
+    // client -> expose：每次可讀時以 recvmmsg 收最多 UDP_ROUNDS 批，整批併成一次控制連線寫入
+    void do_receive() {
+        auto self(shared_from_this());
+        socket.async_wait(udp::socket::wait_read,
+        [this, self](const boost::system::error_code & ec) {
+            if (ec) {
+                return;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto &stats = udp_stats();
+
+            for (int round = 0; round < UDP_ROUNDS; ++round) {
+                size_t n = receive_datagrams(socket,
+                [&](const char *data, size_t size, const udp::endpoint & peer) {
+                    auto it = by_peer.find(key_of(peer));
+
+                    if (it == by_peer.end()) {
+                        if (flows.size() >= udp_max_flows()) {
+                            evict(order.oldest().flow);
+                            stats.evicted.add();
+                        }
+
+                        // ID 繞回時跳過仍在使用的 flow
+                        while (flows.count(next_flow)) {
+                            ++next_flow;
+                        }
+
+                        it = by_peer.emplace(key_of(peer), next_flow).first;
+                        flows[next_flow] = flow{peer, order.add(next_flow, now)};
+                        ++next_flow;
+                        stats.flows.add(1);
+                    } else {
+                        order.touch(flows[it->second].order, now);
+                    }
+
+                    link->send(it->second, data, size);
+                });
+                stats.upstream.add(n);
+
+                if (n < udp_batch()) {
+                    break;
+                }
+            }
+
+            link->flush();
+            do_receive();
+        });
+    }
+
+    // expose -> client：一次讀到的 frame 以 sendmmsg 分批送出，flow 已釋放的直接丟棄
+    void do_send(const std::vector<datagram> &frames) {
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto &frame : frames) {
+            auto it = flows.find(frame.flow);
+
+            if (it == flows.end()) {
+                udp_stats().dropped.add();
+                continue;
+            }
+
+            order.touch(it->second.order, now);
+            sender.add(socket, &it->second.peer, frame.data, frame.size);
+        }
+
+        sender.flush();
+    }
+
+    void do_sweep() {
+        auto self(shared_from_this());
+        sweeper.expires_after(std::chrono::seconds(1));
+        sweeper.async_wait([this, self](const boost::system::error_code & ec) {
+            if (ec) {
+                // port 關閉：釋放剩下的 flow
+                udp_stats().flows.add(-int64_t(flows.size()));
+                flows.clear();
+                by_peer.clear();
+                order = flow_order();
+                return;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() - udp_idle_timeout();
+
+            while (!order.empty() && order.oldest().last < deadline) {
+                evict(order.oldest().flow);
+            }
+
+            do_sweep();
+        });
+    }
+
+    void evict(uint32_t id) {
+        auto it = flows.find(id);
+        by_peer.erase(key_of(it->second.peer));
+        order.erase(it->second.order);
+        flows.erase(it);
+        udp_stats().flows.add(-1);
+    }
+
+    udp::socket socket;
+    std::shared_ptr<datagram_link> link;
+    boost::asio::steady_timer sweeper;
+    datagram_sender sender;
+    std::unordered_map<uint64_t, uint32_t> by_peer;
+    std::unordered_map<uint32_t, flow> flows;
+    flow_order order;
+    uint32_t next_flow = 0;
+};
+
+/**
+ * expose 預先建立並停放 (park) 在 proxy 的閒置資料連線。
+ * 停放期間持續讀取以偵測對方關閉；被 claim 時取消讀取，
+ * 在讀取的 handler 中送出 1 byte 啟動訊號後交給 depipe。
+ */
+class ParkedConnection : public std::enable_shared_from_this<ParkedConnection> {
+  public:
+    ParkedConnection(tcp::socket _agent, std::shared_ptr<Agent> _owner)
+        : agent(std::move(_agent)), owner(std::move(_owner)) {}
+
+    void do_wait();
+
+    // 由 Agent 在持有 pool_mutex 時呼叫
+    void claim(tcp::socket _client, std::shared_ptr<void> _active,
+               std::shared_ptr<tunnel_shaper> _shaper) {
+        client = std::make_unique<tcp::socket>(std::move(_client));
+        active = std::move(_active);
+        shaper = std::move(_shaper);
+        boost::system::error_code ec;
+        agent.cancel(ec);
+    }
+
+    void close() {
+        boost::system::error_code ec;
+        agent.close(ec);
+    }
+
+#if defined(__unix__)
+    // 由 Agent 在持有 pool_mutex 時呼叫 (停放中的連線尚未關閉)
+    int duplicate() {
+        return duplicate_fd(agent.native_handle());
+    }
+#endif
+
+  private:
+    void do_activate();
+
+    tcp::socket agent;
+    std::shared_ptr<Agent> owner;
+    std::unique_ptr<tcp::socket> client;
+    std::shared_ptr<void> active;
+    std::shared_ptr<tunnel_shaper> shaper;
+    std::array<char, 1> buf;
+};
+
+#if defined(__unix__)
+// 交給新程式的一條控制連線 (upgrade.hpp 的 CONTROL 與 PARKED record)
+struct handed_control {
+    struct mapping {
+        uint16_t id;
+        u_short port;
+        std::string host;
+    };
+
+    TunnelMode mode = TunnelMode::DIAL_BACK;
+    Codec codec = Codec::NONE;
+    uint64_t token = 0;
+    std::vector<mapping> mappings;
+    control_state state;
+    std::vector<int> parked;
+};
+#endif
+
+class Agent : public std::enable_shared_from_this<Agent> {
+  public:
+    // 要求的 Codec 不支援 (或是 UDP 模式) 時退回不壓縮，結果在 do_proxy 中回覆給 expose；
+    // host 為虛擬主機名稱，空字串表示獨佔 proxy_port
+    Agent(tcp::socket _control, u_short _proxy_port, TunnelMode _mode, Codec requested,
+          std::string _host)
+        : control_socket(std::move(_control)), proxy_port(_proxy_port), host(std::move(_host)),
+          mode(_mode),
+          codec(codec_supported(requested) && _mode != TunnelMode::UDP ? requested : Codec::NONE) {}
+
+    // TunnelMode::GROUP 的一個 port：共用 ControlGroup 的控制連線，codec 已協商
+    Agent(std::shared_ptr<control_channel> _control, u_short _proxy_port, std::string _host,
+          uint16_t _mapping, Codec _codec)
+        : control_socket(_control->get_executor().context()), control(std::move(_control)),
+          proxy_port(_proxy_port), host(std::move(_host)), mode(TunnelMode::DIAL_BACK),
+          codec(_codec), mapping(_mapping) {}
+
+    // MUX 的 stream 不經過 dial-back，沒有延遲可量測
+    bool measures_latency() const {
+        return mode != TunnelMode::MUX;
+    }
+
+    const std::shared_ptr<BackendLoad> &backend_load() const {
+        return load;
+    }
+
+    Codec get_codec() const {
+        return codec;
+    }
+
+    int get_mapping() const {
+        return mapping;
+    }
+
+    // 由 PortGroup 分配到這個 expose 的 client
+    void serve(tcp::socket client, std::shared_ptr<void> active,
+               std::shared_ptr<tunnel_shaper> shaper) {
+        if (tunnel) {
+#ifdef HAVE_ZLIB
+            if (codec != Codec::NONE) {
+                auto piper = make_depipe<ssocket, compressed_stream<mux_channel>>(
+                                 std::move(client),
+                                 compressed_stream<mux_channel>(mux_channel(tunnel->open()),
+                                         codec));
+                piper->track(std::move(active));
+                piper->shape(std::move(shaper));
+                piper->start();
+                return;
+            }
+#endif
+            auto piper = make_depipe<ssocket, mux_channel>(
+                             std::move(client), mux_channel(tunnel->open()));
+            piper->track(std::move(active));
+            piper->shape(std::move(shaper));
+            piper->start();
+        } else {
+            do_dispatch(std::move(client), std::move(active), std::move(shaper));
+        }
+    }
+
+    // 把 client 交給一條停放中的資料連線；pool 為空時退回 dial-back
+    void do_dispatch(tcp::socket client, std::shared_ptr<void> active,
+                     std::shared_ptr<tunnel_shaper> shaper) {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+
+            if (!idle.empty()) {
+                auto parked = idle.front();
+                idle.pop_front();
+                parked->claim(std::move(client), std::move(active), std::move(shaper));
+                return;
+            }
+        }
+
+        std::make_shared<Session>(std::move(client), control, std::move(active), std::move(shaper),
+                                  load, codec, mapping)->start();
+    }
+
+    // ParkedConnection 在 pool_mutex 下查詢自己是否已被 claim
+    std::mutex &mutex() {
+        return pool_mutex;
+    }
+
+    void forget(const std::shared_ptr<ParkedConnection> &parked) {
+        auto it = std::find(idle.begin(), idle.end(), parked);
+
+        if (it != idle.end()) {
+            idle.erase(it);
+        }
+    }
+
+    // 帶著 pool token 的資料連線到達，停放到 idle 中
+    void park(tcp::socket agent) {
+        auto parked = std::make_shared<ParkedConnection>(std::move(agent), shared_from_this());
+        std::lock_guard<std::mutex> lock(pool_mutex);
+
+        if (pool_closed) {
+            parked->close();
+            return;
+        }
+
+        idle.push_back(parked);
+        parked->do_wait();
+    }
+
+    void do_proxy() {
+        auto self(shared_from_this());
+        std::cout << "New proxy requested port " << where() << " (compression "
+                  << codec_name(codec) << ")" << std::endl;
+        apply_profile(control_socket, profiles.for_port(proxy_port));
+
+        // 第一個回覆 byte：接受的壓縮方式
+        async_write(control_socket, buffer(&codec, 1),
+        [this, self](const boost::system::error_code & ec, size_t) {
+            if (!ec) {
+                do_start();
+            }
+        });
+    }
+
+    // GROUP 的 port 由 ControlGroup 在回覆 HELLO 之後加入與移出
+    void join_group() {
+        if (do_join()) {
+            std::cout << "Proxy created at port " << where() << " (mapping " << mapping << ")"
+                      << std::endl;
+        }
+    }
+
+    void leave_group() {
+        do_leave();
+    }
+
+    // 接手舊程式交出的 DIAL_BACK / POOL 控制連線：HELLO 已交換過，直接加入 group。在開始服務之前呼叫
+    void resume(control_state state, uint64_t pool_token) {
+        greeted = true;
+        control = std::make_shared<control_channel>(std::move(control_socket));
+        control->resume(state.unread, std::move(state.unsent));
+
+        if (mode == TunnelMode::POOL) {
+            token = pool_token;
+            pool_opened = pool_tokens.insert(token, shared_from_this());
+        }
+
+        start_control();
+        control->start_heartbeat(state.heartbeat);
+        do_join();
+    }
+
+    // 舊程式交出的等待 dial-back 的 client (已由 PortGroup::resume 計入)
+    void resume_session(tcp::socket client, std::shared_ptr<void> active,
+                        std::shared_ptr<tunnel_shaper> shaper, uint64_t session_token,
+                        uint64_t trace_id) {
+        std::make_shared<Session>(std::move(client), control, std::move(active), std::move(shaper),
+                                  load, codec, mapping)->resume(session_token, trace_id);
+    }
+
+#if defined(__unix__)
+    // 交給新程式的註冊內容；GROUP 的成員各自加上自己的 mapping
+    void describe(handed_control &handed) const {
+        handed.mode = mapping < 0 ? mode : TunnelMode::GROUP;
+        handed.codec = codec;
+        handed.token = pool_opened ? token : 0;
+        auto id = static_cast<uint16_t>(mapping < 0 ? 0 : mapping);
+        handed.mappings.push_back({id, proxy_port, host});
+    }
+
+    // 停放中的連線的複製 fd；之後控制連線關閉時原本的 fd 照常關閉
+    void duplicate_parked(std::vector<int> &fds) {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+
+        for (auto &parked : idle) {
+            int fd = parked->duplicate();
+
+            if (fd >= 0) {
+                fds.push_back(fd);
+            }
+        }
+    }
+#endif
+
+    // 控制連線所在的 shard；control、tunnel 與註冊內容只在這個線程上改變
+    io_context::executor_type get_executor() {
+        return static_cast<io_context &>(control_socket.get_executor().context()).get_executor();
+    }
+
+    const std::shared_ptr<control_channel> &get_control() const {
+        return control;
+    }
+
+    const std::shared_ptr<mux_session> &get_tunnel() const {
+        return tunnel;
+    }
+
+    std::shared_ptr<PortGroup> joined_group() {
+        std::lock_guard<std::mutex> lock(group_mutex);
+        return group;
+    }
+
+  private:
+    // 日誌中的 port，虛擬主機加上名稱
+    std::string where() const {
+        std::string port = std::to_string(proxy_port);
+        return host.empty() ? port : port + " for " + host;
+    }
+
+    void do_start() {
+        auto self(shared_from_this());
+
+        if (mode == TunnelMode::MUX) {
+            // 控制連線直接成為多工通道，stream 由 proxy 這端開啟
+            // 先加入 group 再啟動，斷線的 close_handler 一定在加入之後才執行
+            tunnel = std::make_shared<mux_session>(std::move(control_socket));
+
+            if (!do_join()) {
+                return;
+            }
+
+            std::cout << "Proxy created at port " << where() << " (mux)" << std::endl;
+            tunnel->start(nullptr, [this, self]() {
+                do_leave();
+            });
+            return;
+        }
+
+        if (mode == TunnelMode::UDP) {
+            // 控制連線交給 UdpPort 承載 datagram，Agent 隨之結束
+            try {
+                std::make_shared<UdpPort>(std::move(control_socket), proxy_port)->start();
+                std::cout << "Proxy created at port " << proxy_port << " (udp)" << std::endl;
+            } catch (...) {
+                bind_failures.add();
+                std::cerr << "Failed to bind to port " << proxy_port << std::endl;
+            }
+
+            return;
+        }
+
+        control = std::make_shared<control_channel>(std::move(control_socket));
+        start_control();
+    }
+
+    // 收到 expose 的 HELLO 後回覆 data port (POOL 另外帶有停放用的 token) 並加入 group；
+    // 控制連線斷開時立即停止分配新 client
+    void start_control() {
+        auto self(shared_from_this());
+        control->start([this, self](ControlFrame type, const char *payload, size_t size) {
+            if (type == ControlFrame::HELLO && !greeted) {
+                greeted = true;
+                do_greet(payload, size);
+            }
+        }, [this, self]() {
+            do_leave();
+            do_close_pool();
+        });
+    }
+
+    bool do_join() {
+        try {
+            auto joined = PortGroup::join(proxy_port, host, shared_from_this());
+            std::lock_guard<std::mutex> lock(group_mutex);
+            group = std::move(joined);
+            return true;
+        } catch (std::exception &e) {
+            if (handing_over) {
+                // 已交給新程式：關閉控制連線，expose 重新註冊到新程式 (MUX 的通道隨 Agent 釋放而關閉)
+                if (control) {
+                    control->close();
+                }
+
+                return false;
+            }
+
+            bind_failures.add();
+            std::cerr << "Failed to bind to port " << where() << ": " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    // 控制連線斷開：立即停止分配新 client 到這個 expose
+    void do_leave() {
+        std::shared_ptr<PortGroup> left;
+        {
+            std::lock_guard<std::mutex> lock(group_mutex);
+            left = std::move(group);
+        }
+
+        if (left) {
+            left->leave(shared_from_this());
+        }
+    }
+
+    void do_greet(const char *payload, size_t size) {
+        if (mode == TunnelMode::POOL) {
+            auto self(shared_from_this());
+
+            do {
+                token = new_token();
+            } while (!pool_tokens.insert(token, self));
+
+            pool_opened = true;
+        }
+
+        uint64_t pool_token = mode == TunnelMode::POOL ? token : 0;
+
+        if (!accept_hello(*control, payload, size, pool_token) || !do_join()) {
+            return;
+        }
+
+        std::cout << "Proxy created at port " << where()
+                  << (mode == TunnelMode::POOL ? " (pool)" : "") << std::endl;
+    }
+
+    void do_close_pool() {
+        if (pool_opened) {
+            pool_tokens.erase(token);
+        }
+
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_closed = true;
+
+        for (auto &parked : idle) {
+            parked->close();
+        }
+    }
+
+    tcp::socket control_socket;
+    std::shared_ptr<control_channel> control;
+    bool greeted = false;
+    std::shared_ptr<mux_session> tunnel;
+    u_short proxy_port;
+    std::string host;
+    TunnelMode mode;
+    Codec codec;
+    int mapping = -1;
+    std::mutex group_mutex;
+    std::shared_ptr<PortGroup> group;
+    std::shared_ptr<BackendLoad> load = std::make_shared<BackendLoad>();
+
+    // TunnelMode::POOL：expose 預先停放的資料連線
+    uint64_t token;
+    bool pool_opened = false;
+    std::mutex pool_mutex;
+    std::deque<std::shared_ptr<ParkedConnection>> idle;
+    bool pool_closed = false;
+};
+
+/**
+ * @class ControlGroup
+ * @brief TunnelMode::GROUP：一條控制連線註冊的多個 dial-back port。
+ *
+ * 每個 port 一個 Agent (各自加入 PortGroup、參與負載平衡)，共用這條控制連線；
+ * SESSION frame 帶有 mapping ID。控制連線斷開時所有 port 一起移出。
+ */
+class ControlGroup : public std::enable_shared_from_this<ControlGroup> {
+  public:
+    // hosts 與 ports 一一對應，空字串表示獨佔該 port
+    ControlGroup(tcp::socket _control, const std::vector<u_short> &_ports,
+                 const std::vector<std::string> &_hosts, Codec requested)
+        : control_socket(std::move(_control)), ports(_ports), hosts(_hosts),
+          codec(codec_supported(requested) ? requested : Codec::NONE) {}
+
+    void start() {
+        auto self(shared_from_this());
+        std::cout << "New proxy group requested " << ports.size() << " ports (compression "
+                  << codec_name(codec) << ")" << std::endl;
+
+        async_write(control_socket, buffer(&codec, 1),
+        [this, self](const boost::system::error_code & ec, size_t) {
+            if (!ec) {
+                do_start();
+            }
+        });
+    }
+
+#if defined(__unix__)
+    // 接手舊程式交出的控制連線：HELLO 已交換過，直接加入 mappings 中的 port。在開始服務之前呼叫
+    void resume(control_state state, const std::vector<handed_control::mapping> &mappings) {
+        greeted = true;
+        control = std::make_shared<control_channel>(std::move(control_socket));
+        control->resume(state.unread, std::move(state.unsent));
+
+        for (auto &mapping : mappings) {
+            members.push_back(std::make_shared<Agent>(control, mapping.port, mapping.host,
+                              mapping.id, codec));
+        }
+
+        start_control();
+        control->start_heartbeat(state.heartbeat);
+
+        for (auto &member : members) {
+            member->join_group();
+        }
+    }
+#endif
+
+    // 依 mapping ID 找到接手的 port
+    std::shared_ptr<Agent> member(uint16_t mapping) const {
+        for (auto &agent : members) {
+            if (agent->get_mapping() == mapping) {
+                return agent;
+            }
+        }
+
+        return nullptr;
+    }
+
+  private:
+    void do_start() {
+        control = std::make_shared<control_channel>(std::move(control_socket));
+
+        for (size_t i = 0; i < ports.size(); ++i) {
+            members.push_back(std::make_shared<Agent>(control, ports[i], hosts[i],
+                              static_cast<uint16_t>(i), codec));
+        }
+
+        start_control();
+    }
+
+    // 收到 expose 的 HELLO 後回覆 data port 並加入所有 port；控制連線斷開時一起移出
+    void start_control() {
+        auto self(shared_from_this());
+        control->start([this, self](ControlFrame type, const char *payload, size_t size) {
+            if (type != ControlFrame::HELLO || greeted) {
+                return;
+            }
+
+            greeted = true;
+
+            if (!accept_hello(*control, payload, size, 0)) {
+                return;
+            }
+
+            for (auto &member : members) {
+                member->join_group();
+            }
+        }, [this, self]() {
+            for (auto &member : members) {
+                member->leave_group();
+            }
+        });
+    }
+
+    tcp::socket control_socket;
+    std::shared_ptr<control_channel> control;
+    std::vector<u_short> ports;
+    std::vector<std::string> hosts;
+    Codec codec;
+    bool greeted = false;
+    std::vector<std::shared_ptr<Agent>> members;
+};
+
+/**
+ * @class VhostPort
+ * @brief 以虛擬主機名稱共用的對外 port：listener 由所有名稱共用，
+ * 每個 client 依 HTTP Host / TLS SNI 交給該名稱的 PortGroup。
+ *
+ * 先找完全相同的名稱，再找 "*.<上一層網域>"，最後是 "*"；都沒有時關閉 client。
+ * 名稱由 ports_mutex 下的 join / leave 增減，accept 的線程以 routes_mutex 查詢。
+ */
+class VhostPort : public std::enable_shared_from_this<VhostPort> {
+  public:
+    // bind 失敗時拋出例外
+    explicit VhostPort(u_short _port)
+        : port(_port), proxies(listen_port(port)) {
+        for (auto &proxy : proxies) {
+            apply_profile(proxy, profiles.for_port(port));
+        }
+    }
+
+    // 呼叫時持有 ports_mutex
+    static std::shared_ptr<VhostPort> open(u_short port) {
+        auto &slot = vhost_ports[port];
+        auto shared = slot.lock();
+
+        if (!shared) {
+            shared = std::make_shared<VhostPort>(port);
+            slot = shared;
+
+            for (auto &proxy : shared->proxies) {
+                shared->do_accept(proxy);
+            }
+        }
+
+        return shared;
+    }
+
+    // 呼叫時持有 ports_mutex
+    void add(const std::string &host, const std::shared_ptr<PortGroup> &group) {
+        std::lock_guard<std::mutex> lock(routes_mutex);
+        routes[host] = group;
+    }
+
+    // 呼叫時持有 ports_mutex；最後一個名稱移除時關閉 listener
+    void remove(const std::string &host) {
+        {
+            std::lock_guard<std::mutex> lock(routes_mutex);
+            routes.erase(host);
+
+            if (!routes.empty()) {
+                return;
+            }
+        }
+
+        vhost_ports.erase(port);
+        auto self(shared_from_this());
+
+        for (auto &proxy : proxies) {
+            post(proxy.get_executor(), [self, &proxy]() {
+                boost::system::error_code ec;
+                proxy.close(ec);
+            });
+        }
+    }
+
+    std::vector<tcp::acceptor> &listeners() {
+        return proxies;
+    }
+
+    // host 已正規化；空的 host (沒有 Host / SNI) 直接找 "*"
+    std::shared_ptr<PortGroup> route(std::string_view host) {
+        std::lock_guard<std::mutex> lock(routes_mutex);
+        auto found = routes.end();
+
+        if (!host.empty()) {
+            found = routes.find(host);
+            size_t dot = host.find('.');
+
+            if (found == routes.end() && dot != std::string_view::npos) {
+                char wildcard[VHOST_MAX_NAME + 2] = "*";
+                std::memcpy(wildcard + 1, host.data() + dot, host.size() - dot);
+                found = routes.find(std::string_view(wildcard, 1 + host.size() - dot));
+            }
+        }
+
+        if (found != routes.end()) {
+            vhost_matched.add();
+            return found->second.lock();
+        }
+
+        found = routes.find("*");
+
+        if (found == routes.end()) {
+            vhost_unmatched.add();
+            return nullptr;
+        }
+
+        vhost_defaulted.add();
+        return found->second.lock();
+    }
+
+  private:
+    void do_accept(tcp::acceptor &proxy);
+
+    u_short port;
+    std::vector<tcp::acceptor> proxies;
+    std::mutex routes_mutex;
+    std::map<std::string, std::weak_ptr<PortGroup>, std::less<>> routes;
+};
+
+/**
+ * @class HostRouting
+ * @brief 共用 port 上剛 accept 的 client：等到 Host / SNI 到達後交給對應的 PortGroup。
+ *
+ * 以 MSG_PEEK 讀取，資料留在 socket 中，之後的 depipe (或 splice) 從第一個 byte 開始轉送。
+ * 前綴不完整時把 SO_RCVLOWAT 設為 parser 需要的長度，epoll 只在資料足夠時喚醒，
+ * 不會每個 segment 都重新 peek 一次；交出 client 之前改回 1。
+ * 每次 peek 使用線程共用的 buffer，等待中的 client 只保留 parser 的幾個 offset。
+ */
+class HostRouting : public std::enable_shared_from_this<HostRouting> {
+  public:
+    HostRouting(tcp::socket _client, std::shared_ptr<VhostPort> _shared)
+        : client(std::move(_client)), shared(std::move(_shared)), deadline(client.get_executor()) {}
+
+    void start() {
+        auto self(shared_from_this());
+        deadline.expires_after(VHOST_TIMEOUT);
+        deadline.async_wait([this, self](const boost::system::error_code & ec) {
+            if (!ec) {
+                timed_out = true;
+                boost::system::error_code ignored;
+                client.cancel(ignored);
+            }
+        });
+        do_peek();
+    }
+
+  private:
+    void do_peek() {
+        thread_local char prefix[VHOST_PEEK_LIMIT];
+        boost::system::error_code ec;
+
+        // 每次設定都是一次 ioctl，只在第一次 peek 時設定
+        if (!client.non_blocking()) {
+            client.non_blocking(true, ec);
+        }
+
+        size_t n = ec ? 0 : client.receive(buffer(prefix), socket_base::message_peek, ec);
+
+        if (ec == error::would_block) {
+            do_wait();
+            return;
+        }
+
+        if (ec || n == 0) {
+            // client 在送出任何資料前就斷線
+            deadline.cancel();
+            return;
+        }
+
+        route_status status = parser.parse(prefix, n);
+        size_t wanted = parser.wanted(n);
+
+        // 資料沒有增加表示 client 已送完 (例如半關閉)，以目前的結果路由
+        if (status == route_status::NEED_MORE && n != peeked && wanted <= VHOST_PEEK_LIMIT) {
+            peeked = n;
+            client.set_option(socket_base::receive_low_watermark(int(wanted)), ec);
+            lowered = true;
+            do_wait();
+            return;
+        }
+
+        char name[VHOST_MAX_NAME + 1];
+        finish(status == route_status::FOUND ? normalize_host(parser.host(), name)
+               : std::string_view());
+    }
+
+    void do_wait() {
+        auto self(shared_from_this());
+        client.async_wait(tcp::socket::wait_read,
+        [this, self](const boost::system::error_code & ec) {
+            if (!ec) {
+                do_peek();
+            } else if (timed_out) {
+                finish(std::string_view());
+            }
+        });
+    }
+
+    void finish(std::string_view host) {
+        deadline.cancel();
+
+        if (lowered) {
+            boost::system::error_code ignored;
+            client.set_option(socket_base::receive_low_watermark(1), ignored);
+        }
+
+        if (auto group = shared->route(host)) {
+            group->dispatch(std::move(client));
+        }
+    }
+
+    tcp::socket client;
+    std::shared_ptr<VhostPort> shared;
+    steady_timer deadline;
+    route_parser parser;
+    size_t peeked = 0;
+    bool lowered = false;
+    bool timed_out = false;
+};
+
+void VhostPort::do_accept(tcp::acceptor &proxy) {
+    auto self(shared_from_this());
+    proxy.async_accept([this, self, &proxy](boost::system::error_code ec, tcp::socket client) {
+        if (ec) {
+            if (ec != error::operation_aborted) {
+                std::cerr << "Proxy at " << port << " closed: " << ec.message() << std::endl;
+            }
+
+            return;
+        }
+
+        std::make_shared<HostRouting>(std::move(client), self)->start();
+        do_accept(proxy);
+    });
+}
+
+// metrics 的 label：port，虛擬主機另加上 host
+std::string group_labels(u_short port, const std::string &host) {
+    std::string labels = "port=\"" + std::to_string(port) + "\"";
+    return host.empty() ? labels : labels + ",host=\"" + host + "\"";
+}
+
+PortGroup::PortGroup(u_short _port, std::string _host)
+    : port(_port),
+      host(std::move(_host)),
+      // 每個 shard 一個 SO_REUSEPORT acceptor，client 由 kernel 分散到各核心
+      proxies(host.empty() ? listen_port(port) : std::vector<tcp::acceptor>()),
+      sessions_total("proxy_sessions_total", "Client connections accepted per proxy port.",
+                     group_labels(port, host)),
+      sessions_active("proxy_sessions_active", "Client connections currently open per proxy port.",
+                      group_labels(port, host)),
+      backends("proxy_backends", "Exposers registered per proxy port.", group_labels(port, host)) {
+    for (auto &proxy : proxies) {
+        apply_profile(proxy, profiles.for_port(port));
+        // do_accept 在完成通知之後以非阻塞 accept 取出 backlog 中的其他連線
+        proxy.non_blocking(true);
+    }
+}
+
+std::shared_ptr<PortGroup> PortGroup::join(u_short port, const std::string &host,
+        const std::shared_ptr<Agent> &agent) {
+    std::lock_guard<std::mutex> lock(ports_mutex);
+
+    if (handing_over) {
+        // 交接開始後的註冊不在交出的清單中
+        throw std::runtime_error("handing over to a new process");
+    }
+
+    auto key = std::make_pair(port, host);
+    auto group = port_groups[key].lock();
+
+    if (!group) {
+        // 同一個 port 不能同時獨佔與共用：SO_REUSEPORT 下兩者都能 bind，kernel 會任意分配 client
+        auto exclusive = port_groups.find({port, std::string()});
+        bool conflict = host.empty() ? vhost_ports.count(port) > 0
+                        : exclusive != port_groups.end() && !exclusive->second.expired();
+
+        if (conflict) {
+            throw std::runtime_error("port " + std::to_string(port) + " is already registered");
+        }
+
+        group = std::make_shared<PortGroup>(port, host);
+
+        if (host.empty()) {
+            for (auto &proxy : group->proxies) {
+                group->do_accept(proxy);
+            }
+        } else {
+            group->shared = VhostPort::open(port);
+            group->shared->add(host, group);
+        }
+
+        port_groups[key] = group;
+    }
+
+    std::lock_guard<std::mutex> members_lock(group->members_mutex);
+    group->members.push_back(agent);
+    group->backends.add(1);
+    return group;
+}
+
+void PortGroup::leave(const std::shared_ptr<Agent> &agent) {
+    std::lock_guard<std::mutex> lock(ports_mutex);
+    std::lock_guard<std::mutex> members_lock(members_mutex);
+    auto it = std::find(members.begin(), members.end(), agent);
+
+    if (it == members.end()) {
+        return;
+    }
+
+    members.erase(it);
+    backends.add(-1);
+
+    if (!members.empty()) {
+        return;
+    }
+
+    // 最後一個 expose 離開：之後同一個 port 的註冊會重新建立 group
+    port_groups.erase(std::make_pair(port, host));
+
+    if (shared) {
+        shared->remove(host);
+        return;
+    }
+
+    auto self(shared_from_this());
+
+    // 每個 acceptor 屬於不同 shard，在各自的線程上取消
+    for (auto &proxy : proxies) {
+        post(proxy.get_executor(), [self, &proxy]() {
+            boost::system::error_code ec;
+            proxy.close(ec);
+        });
+    }
+}
+
+void PortGroup::do_accept(tcp::acceptor &proxy) {
+    auto self(shared_from_this());
+    proxy.async_accept([this, self, &proxy](boost::system::error_code ec, tcp::socket client) {
+        if (ec) {
+            if (ec != error::operation_aborted) {
+                std::cerr << "Proxy at " << port << " closed: " << ec.message() << std::endl;
+            }
+
+            return;
+        }
+
+        dispatch(std::move(client));
+
+        // 同一批到達的 client 一起處理：它們的 SESSION frame 在控制連線上合併成一次寫入，
+        // 也省下每條連線各一次 epoll 往返
+        for (size_t i = 1; i < ACCEPT_BATCH; ++i) {
+            tcp::socket next = proxy.accept(ec);
+
+            if (ec) {
+                break;
+            }
+
+            dispatch(std::move(next));
+        }
+
+        do_accept(proxy);
+    });
+}
+
+void PortGroup::dispatch(tcp::socket client) {
+    // 沒有 backend 時 (最後一個 expose 剛離開) 直接關閉 client
+    if (auto agent = pick()) {
+        sessions_total.add();
+        apply_profile(client, profiles.for_port(port));
+        auto shaper = shaper_for(client);
+        agent->serve(std::move(client), track(agent->backend_load()), std::move(shaper));
+    }
+}
+
+void PortGroup::resume(tcp::socket client, const std::shared_ptr<Agent> &agent, uint64_t token,
+                       uint64_t trace_id) {
+    auto shaper = shaper_for(client);
+    agent->resume_session(std::move(client), track(agent->backend_load()), std::move(shaper), token,
+                          trace_id);
+}
+
+std::shared_ptr<tunnel_shaper> PortGroup::shaper_for(tcp::socket &client) {
+    boost::system::error_code ec;
+    auto peer = client.remote_endpoint(ec);
+    return ec ? nullptr : traffic_shaping::instance().shaper_for(port, peer.address());
+}
+
+std::shared_ptr<Agent> PortGroup::pick() {
+    std::lock_guard<std::mutex> lock(members_mutex);
+
+    if (members.empty()) {
+        return nullptr;
+    }
+
+    size_t start = next++ % members.size();
+
+    if (balance_policy == BalancePolicy::ROUND_ROBIN) {
+        return members[start];
+    }
+
+    // 從輪詢位置開始找最小值，平手時依序分散到不同 backend
+    size_t best = start;
+
+    if (balance_policy == BalancePolicy::LEAST_CONN) {
+        for (size_t k = 1; k < members.size(); ++k) {
+            size_t i = (start + k) % members.size();
+
+            if (members[i]->backend_load()->active < members[best]->backend_load()->active) {
+                best = i;
+            }
+        }
+
+        return members[best];
+    }
+
+    // 還沒有量測值的 dial-back backend (剛加入) 輪到時先選它以取得第一個量測值；
+    // 其餘只比較已量測的 backend (MUX 沒有 dial-back)，都沒有量測值時照輪詢
+    if (members[start]->measures_latency() && !members[start]->backend_load()->measured()) {
+        return members[start];
+    }
+
+    bool found = false;
+
+    for (size_t k = 0; k < members.size(); ++k) {
+        size_t i = (start + k) % members.size();
+        auto &candidate = *members[i]->backend_load();
+
+        if (candidate.measured()
+                && (!found || candidate.latency < members[best]->backend_load()->latency)) {
+            best = i;
+            found = true;
+        }
+    }
+
+    return members[best];
+}
+
+void ParkedConnection::do_wait() {
+    auto self(shared_from_this());
+    // expose 在收到啟動訊號前不會送資料，因此這個讀取只會以錯誤結束
+    agent.async_read_some(buffer(buf),
+    [this, self](boost::system::error_code ec, std::size_t) {
+        std::unique_lock<std::mutex> lock(owner->mutex());
+
+        if (!client) {
+            // 尚未被 claim 前對方就斷線了
+            owner->forget(self);
+            return;
+        }
+
+        lock.unlock();
+
+        if (ec != error::operation_aborted) {
+            // claim 與斷線同時發生，改用其他連線
+            owner->do_dispatch(std::move(*client), std::move(active), std::move(shaper));
+            return;
+        }
+
+        do_activate();
+    });
+}
+
+void ParkedConnection::do_activate() {
+    auto self(shared_from_this());
+    buf[0] = 1;
+    async_write(agent, buffer(buf),
+    [this, self](const boost::system::error_code & ec, size_t) {
+        if (ec) {
+            owner->do_dispatch(std::move(*client), std::move(active), std::move(shaper));
+            return;
+        }
+
+        // 停放的連線在 control 所在的 shard 上 accept，交給 client 所在的 shard 繼續處理
+        auto &context = static_cast<io_context &>(client->get_executor().context());
+        start_pipe(std::move(*client), rehome(std::move(agent), context), std::move(active),
+                   owner->get_codec(), std::move(shaper));
+    });
+}
+
+class Server : public std::enable_shared_from_this<Server> {
+  public:
+    // 控制 port 與 data port 相同時只 listen 一次；兩者都接受註冊與資料連線
+    Server(u_short control_port, u_short data_port)
+        : acceptors(listen_port(control_port)) {
+        if (data_port != control_port) {
+            for (auto &acceptor : listen_port(data_port)) {
+                acceptors.push_back(std::move(acceptor));
+            }
+        }
+
+        // expose 的資料連線以 TFO 連入時 token 隨 SYN 到達
+        if (profiles.fast_open()) {
+            for (auto &acceptor : acceptors) {
+                enable_fast_open(acceptor);
+            }
+        }
+    }
+
+    void do_accept() {
+        for (auto &acceptor : acceptors) {
+            do_accept(acceptor);
+        }
+    }
+
+    std::vector<tcp::acceptor> &listeners() {
+        return acceptors;
+    }
+
+#if defined(__unix__)
+    // 交接失敗時交還 listener 交出的 fd，重新開始 accept
+    void readopt(tcp::acceptor &acceptor, int fd) {
+        auto self(shared_from_this());
+        post(acceptor.get_executor(), [this, self, &acceptor, fd]() {
+            boost::system::error_code ec;
+            acceptor.assign(tcp::v4(), fd, ec);
+
+            if (ec) {
+                ::close(fd);
+                return;
+            }
+
+            do_accept(acceptor);
+        });
+    }
+#endif
 
-    void do_connect_agent() {
+  private:
+    void do_accept(tcp::acceptor &acceptor) {
         auto self(shared_from_this());
+        acceptor.async_accept(
+        [this, self, &acceptor](boost::system::error_code ec, tcp::socket agent) {
+            if (ec)
+                return;
 
-        tcp::endpoint endpoint(tcp::v4(), 0);
+            do_handshake(std::move(agent));
+            do_accept(acceptor);
+        });
+    }
 
-        agent_acceptor.open(endpoint.protocol());
-        agent_acceptor.set_option(tcp::acceptor::reuse_address(true));
-        agent_acceptor.bind(endpoint);
-        agent_acceptor.listen();
+    // 前 3 bytes 區分註冊 (新的 Agent) 與帶 token 的資料連線
+    void do_handshake(tcp::socket socket) {
+        struct hello {
+            u_short port;
+            TunnelMode mode;
+            Codec codec;
+            uint64_t token;
+        };
 
-        random_port = agent_acceptor.local_endpoint().port();
-        control->async_write(
-            buffer(&random_port, 2),
-        [this, self](const boost::system::error_code & ec, size_t size) {
-            if (ec || size != 2) {
+        auto peer = pending_handshake::start(std::move(socket));
+        auto header = std::make_shared<hello>();
+        std::array<mutable_buffer, 2> request = {buffer(&header->port, 2),
+                                                 buffer(&header->mode, 1)
+                                                };
+        async_read(*peer, request,
+        [peer, header](const boost::system::error_code & ec, size_t) {
+            if (ec) {
                 return;
             }
 
-            timer.expires_after(std::chrono::seconds(5));
-            timer.async_wait([this, self](const boost::system::error_code & ec) {
-                if (!ec) {
-                    agent_acceptor.cancel();
-                    control->close();
-                    std::cout << "Timeout, closing agent_acceptor" << std::endl;
-                }
-            });
+            // VHOST_FLAG：註冊訊息之後附有虛擬主機名稱
+            bool named = static_cast<uint8_t>(header->mode) & VHOST_FLAG;
+            auto mode = static_cast<uint8_t>(header->mode) & ~VHOST_FLAG;
+            header->mode = static_cast<TunnelMode>(mode);
+
+            // 未知的 mode：不是 expose，peer 隨 handler 釋放而關閉
+            if (header->mode > TunnelMode::GROUP) {
+                return;
+            }
 
-            agent_acceptor.async_accept([this, self](boost::system::error_code ec,
-            tcp::socket agent) {
-                timer.cancel();
+            if (header->mode == TunnelMode::GROUP) {
+                do_read_group(peer, named);
+                return;
+            }
+
+            if (header->mode != TunnelMode::DATA) {
+                async_read(*peer, buffer(&header->codec, 1),
+                [peer, header, named](const boost::system::error_code & ec, size_t) {
+                    if (ec) {
+                        return;
+                    }
+
+                    auto start = [peer, header](std::string host) {
+                        std::make_shared<Agent>(std::move(*peer), header->port, header->mode,
+                                                header->codec, std::move(host))->do_proxy();
+                    };
 
+                    if (!named) {
+                        start(std::string());
+                    } else if (header->mode != TunnelMode::UDP) {
+                        do_read_host(peer, start);
+                    }
+                });
+                return;
+            }
+
+            async_read(*peer, buffer(&header->token, 8),
+            [peer, header](const boost::system::error_code & ec, size_t) {
                 if (ec) {
                     return;
                 }
 
-                std::cout << "Connection created" << std::endl;
-                auto piper =
-                    std::make_shared<depipe>(std::move(client), std::move(agent));
-                piper->start();
+                std::shared_ptr<Session> session;
+                std::shared_ptr<Agent> pool;
+
+                if (pending_sessions.take(header->token, session)) {
+                    session->attach(std::move(*peer));
+                } else if (pool_tokens.find(header->token, pool)) {
+                    pool->park(std::move(*peer));
+                }
+
+                // 未知或已逾時的 token：peer 隨 handler 釋放而關閉
             });
         });
     }
 
-  private:
-    tcp::socket client;
-    tcp::acceptor agent_acceptor;
-    boost::asio::steady_timer timer;
-    std::shared_ptr<ssocket> control;
-    u_short random_port;
+    // 虛擬主機名稱：[name_length: 1][name]；正規化後交給 done，格式錯誤時關閉 peer
+    static void do_read_host(std::shared_ptr<tcp::socket> peer,
+                             std::function<void(std::string)> done) {
+        auto length = std::make_shared<uint8_t>();
+        async_read(*peer, buffer(length.get(), 1),
+        [peer, length, done](const boost::system::error_code & ec, size_t) {
+            if (ec) {
+                return;
+            }
+
+            auto host = std::make_shared<std::string>(*length, '\0');
+            async_read(*peer, buffer(*host),
+            [peer, host, done](const boost::system::error_code & ec, size_t) {
+                char name[VHOST_MAX_NAME + 1];
+                std::string_view normalized = normalize_host(*host, name);
+
+                if (!ec && (host->empty() || !normalized.empty())) {
+                    done(std::string(normalized));
+                }
+            });
+        });
+    }
+
+    struct group_hello {
+        Codec codec;
+        uint16_t count;
+        std::vector<u_short> ports;
+        std::vector<std::string> hosts;
+    };
+
+    // GROUP 註冊：[codec][count] 之後是 count 個 port，named 時再接 count 個名稱
+    static void do_read_group(std::shared_ptr<tcp::socket> peer, bool named) {
+        auto header = std::make_shared<group_hello>();
+        std::array<mutable_buffer, 2> request = {buffer(&header->codec, 1),
+                                                 buffer(&header->count, 2)
+                                                };
+        async_read(*peer, request,
+        [peer, header, named](const boost::system::error_code & ec, size_t) {
+            if (ec || header->count == 0 || header->count > MAX_GROUP_MAPPINGS) {
+                return;
+            }
+
+            header->ports.resize(header->count);
+            header->hosts.resize(header->count);
+            async_read(*peer, buffer(header->ports),
+            [peer, header, named](const boost::system::error_code & ec, size_t) {
+                if (!ec) {
+                    do_read_group_hosts(peer, header, named ? 0 : header->hosts.size());
+                }
+            });
+        });
+    }
+
+    // 依序讀取第 index 個之後的名稱，全部讀完後才建立 ControlGroup
+    static void do_read_group_hosts(std::shared_ptr<tcp::socket> peer,
+                                    std::shared_ptr<group_hello> header, size_t index) {
+        if (index == header->hosts.size()) {
+            std::make_shared<ControlGroup>(std::move(*peer), header->ports, header->hosts,
+                                           header->codec)->start();
+            return;
+        }
+
+        do_read_host(peer, [peer, header, index](std::string host) {
+            header->hosts[index] = std::move(host);
+            do_read_group_hosts(peer, header, index + 1);
+        });
+    }
+
+    std::vector<tcp::acceptor> acceptors;
 };
 
-class Agent : public std::enable_shared_from_this<Agent> {
+#if defined(__unix__)
+histogram upgrade_seconds("proxy_upgrade_seconds",
+                          "Time the new process took to take over from the old one.",
+{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1});
+
+// 沒有 expose 接手的 listener (例如 MUX 的 expose 重新註冊之前) 保留這段時間，backlog 中的 client 不會被拒絕
+constexpr auto INHERITED_GRACE = std::chrono::seconds(10);
+// 交出 session 之前等待已 accept 的連線讀完開頭的上限 (不送資料的連線不能拖住交接)
+constexpr auto HANDSHAKE_GRACE = std::chrono::milliseconds(500);
+
+struct released_listener {
+    u_short port;
+    int fd;
+    // 交接失敗時把 fd 交還原本的 acceptor (fd 的所有權隨之轉移)；
+    // 沒有的 (group 與虛擬主機的 listener) 交給 inherited_listeners，由收回的控制連線沿用
+    std::function<void(int)> readopt;
+};
+
+// 在 acceptor 所在的線程上交出 fd (不與該線程上的 accept 或 close 競爭)；已關閉時 fd 為 -1。
+// 以 release 交出而不是複製後關閉：關閉會把 fd 留在 epoll 中，之後收回的複本可能拿到同一個號碼
+std::future<released_listener> release_listener(tcp::acceptor &acceptor,
+        std::function<void(int)> readopt = nullptr) {
+    auto released = std::make_shared<std::promise<released_listener>>();
+    post(acceptor.get_executor(), [&acceptor, released, readopt]() {
+        boost::system::error_code ec;
+        auto local = acceptor.local_endpoint(ec);
+        int fd = ec ? -1 : acceptor.release(ec);
+
+        if (ec) {
+            fd = -1;
+            acceptor.close(ec);
+        }
+
+        released->set_value({local.port(), fd, readopt});
+    });
+    return released->get_future();
+}
+
+// 交出之後等既有的 session 結束，最多 UPGRADE_DRAIN 秒
+void do_drain(std::shared_ptr<steady_timer> timer, std::chrono::steady_clock::time_point deadline) {
+    timer->expires_after(std::chrono::milliseconds(100));
+    timer->async_wait([timer, deadline](const boost::system::error_code & ec) {
+        if (ec) {
+            return;
+        }
+
+        if (open_sessions == 0 || std::chrono::steady_clock::now() >= deadline) {
+            std::cout << "Drained " << (open_sessions == 0 ? "all" : "some") << " sessions, exiting"
+                      << std::endl;
+            shards.stop();
+            return;
+        }
+
+        do_drain(timer, deadline);
+    });
+}
+
+// 一個 Agent 交出的註冊內容；channel 為空表示沒有可交出的控制連線
+struct handed_agent {
+    std::shared_ptr<control_channel> channel;
+    handed_control handed;
+};
+
+// 在 Agent 的線程上讀取它的狀態 (不與該線程上的註冊或斷線競爭)。MUX 的通道直接關閉，
+// POOL 的停放連線在控制連線交出 (並關閉 pool) 之前複製
+std::future<handed_agent> describe_agent(const std::shared_ptr<Agent> &agent) {
+    auto described = std::make_shared<std::promise<handed_agent>>();
+    post(agent->get_executor(), [agent, described]() {
+        handed_agent state;
+
+        if (agent->get_tunnel()) {
+            agent->get_tunnel()->close();
+        } else if (agent->get_control()) {
+            state.channel = agent->get_control();
+            agent->describe(state.handed);
+
+            if (state.handed.mode == TunnelMode::POOL) {
+                agent->duplicate_parked(state.handed.parked);
+            }
+        }
+
+        described->set_value(std::move(state));
+    });
+    return described->get_future();
+}
+
+/**
+ * 接手交出的控制連線、停放的連線與 session：新程式以舊程式送來的 record 接手，交接失敗時
+ * 舊程式以自己送出的 record 收回。每條控制連線在它所在的 shard 上 resume，它的停放連線與
+ * session 依 record 的順序排在同一個 shard 上 (舊程式收回時仍在服務，不能從其他線程開始讀寫)。
+ * LISTENER 與 END 由呼叫端處理
+ */
+class upgrade_adopter {
   public:
-    explicit Agent(tcp::socket _control)
-        : buf(), control(std::make_shared<ssocket>(std::move(_control))),
-          proxy(io) {}
+    // 接手一筆 record 與附帶的 fd (所有權隨之轉移)；格式錯誤時拋出例外
+    void adopt(const std::vector<char> &data, const std::vector<int> &fds) {
+        record_reader record(data);
+        std::vector<std::shared_ptr<tcp::socket>> sockets;
 
-    void do_proxy() {
-        auto self(shared_from_this());
-        control->async_read(
-            buffer(&proxy_port, 2),
-        [this, self](const boost::system::error_code & ec, size_t size) {
-            if (ec || size != 2) {
-                return;
+        for (int received : fds) {
+            sockets.push_back(std::make_shared<tcp::socket>(shards.next(), tcp::v4(), received));
+        }
+
+        switch (record.type()) {
+        case UpgradeRecord::CONTROL:
+            adopt_control(record, sockets);
+            break;
+
+        case UpgradeRecord::PARKED: {
+            auto &control = controls.at(record.get<uint32_t>());
+
+            for (auto &socket : sockets) {
+                if (control.agent) {
+                    post(control.executor, [agent = control.agent, socket]() {
+                        agent->park(std::move(*socket));
+                    });
+                    ++parked;
+                }
             }
 
-            std::cout << "New proxy requested port " << proxy_port << std::endl;
-            tcp::endpoint endpoint(tcp::v4(), proxy_port);
-            proxy.open(endpoint.protocol());
-            proxy.set_option(tcp::acceptor::reuse_address(true));
+            break;
+        }
 
-            try {
-                proxy.bind(endpoint);
-            } catch (...) {
-                std::cerr << "Failed to bind to port " << proxy_port << std::endl;
-                return;
+        case UpgradeRecord::SESSION: {
+            auto control = controls.at(record.get<uint32_t>());
+            uint16_t mapping = record.get<uint16_t>();
+            uint64_t token = record.get<uint64_t>();
+            uint64_t trace_id = record.get<uint64_t>();
+
+            if (sockets.size() != 1) {
+                throw std::runtime_error("malformed session record");
             }
 
-            proxy.listen();
-            std::cout << "Proxy created at port " << proxy_port << std::endl;
-            do_accept();
-            do_check_control();
-        });
+            post(control.executor, [control, mapping, token, trace_id, client = sockets[0]]() {
+                auto agent = control.group ? control.group->member(mapping) : control.agent;
+                auto group = agent ? agent->joined_group() : nullptr;
+
+                // 找不到 port (例如無法 bind) 時 client 隨 socket 釋放而關閉
+                if (group) {
+                    group->resume(std::move(*client), agent, token, trace_id);
+                }
+            });
+            ++sessions;
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    size_t control_count() const {
+        return controls.size();
+    }
+
+    size_t parked_count() const {
+        return parked;
+    }
+
+    size_t session_count() const {
+        return sessions;
     }
 
   private:
-    void do_accept() {
-        auto self(shared_from_this());
-        proxy.async_accept([this, self](boost::system::error_code ec,
-        tcp::socket client) {
-            if (ec) {
-                std::cerr << "Proxy at " << proxy_port << " closed\n";
-                return;
+    // 第 i 個 CONTROL：單一註冊的 Agent 或 GROUP 的 ControlGroup，以及它們所在的 shard
+    struct adopted_control {
+        io_context::executor_type executor;
+        std::shared_ptr<Agent> agent;
+        std::shared_ptr<ControlGroup> group;
+    };
+
+    void adopt_control(record_reader &record,
+                       const std::vector<std::shared_ptr<tcp::socket>> &sockets) {
+        auto mode = static_cast<TunnelMode>(record.get<uint8_t>());
+        auto codec = static_cast<Codec>(record.get<uint8_t>());
+        control_state state;
+        state.heartbeat = record.get<uint16_t>();
+        uint64_t token = record.get<uint64_t>();
+        std::vector<handed_control::mapping> mappings(record.get<uint16_t>());
+
+        for (auto &mapping : mappings) {
+            mapping.id = record.get<uint16_t>();
+            mapping.port = record.get<uint16_t>();
+            mapping.host = record.get_name();
+        }
+
+        state.unread = record.get_bytes();
+        state.unsent = record.get_bytes();
+
+        if (sockets.size() != 1 || mappings.empty()) {
+            throw std::runtime_error("malformed control record");
+        }
+
+        auto &socket = *sockets[0];
+        adopted_control control{
+            static_cast<io_context &>(socket.get_executor().context()).get_executor(), nullptr,
+            nullptr};
+
+        if (mode == TunnelMode::GROUP) {
+            control.group = std::make_shared<ControlGroup>(std::move(socket),
+                            std::vector<u_short>(), std::vector<std::string>(), codec);
+            post(control.executor, [group = control.group, state, mappings]() mutable {
+                group->resume(std::move(state), mappings);
+            });
+        } else {
+            control.agent = std::make_shared<Agent>(std::move(socket), mappings[0].port, mode,
+                                                    codec, mappings[0].host);
+            post(control.executor, [agent = control.agent, state, token]() mutable {
+                agent->resume(std::move(state), token);
+            });
+        }
+
+        controls.push_back(std::move(control));
+    }
+
+    std::vector<adopted_control> controls;
+    size_t parked = 0;
+    size_t sessions = 0;
+};
+
+// 沒有 expose 接手的 listener 保留 INHERITED_GRACE 後關閉
+void close_inherited_later() {
+    auto grace = std::make_shared<steady_timer>(shards.get(0), INHERITED_GRACE);
+    grace->async_wait([grace](const boost::system::error_code &) {
+        std::lock_guard<std::mutex> lock(ports_mutex);
+
+        for (auto &inherited : inherited_listeners) {
+            for (int listener : inherited.second) {
+                ::close(listener);
             }
+        }
+
+        inherited_listeners.clear();
+    });
+}
+
+void wait_for_upgrade(std::shared_ptr<Server> server, std::shared_ptr<metrics_server> metrics);
 
-            std::cout << "A client try to connect the port "
-                      << proxy.local_endpoint().port() << std::endl;
-            std::make_shared<Session>(std::move(client), control)->do_connect_agent();
-            do_accept();
+/**
+ * 交接的舊程式這端 (見 upgrade.hpp)，在自己的線程上執行：各 shard 上的物件由各自的線程交出，
+ * 這條線程只等待結果並送出 record。依序交出
+ *   1. listener：複製 fd 後關閉，之後到達的連線留在 backlog 給新程式；
+ *   2. 控制連線：停止讀寫後連同未解析的輸入、未寫出的 frame 與停放的連線交出。MUX 直接關閉
+ *      (mux stream 的狀態無法交接，expose 重新註冊到新程式)，UDP 留在舊程式直到結束；
+ *   3. 等待 dial-back 的 session：它們的 SESSION frame 已經寫出或在交出的未寫出 frame 中。
+ * 已開始轉送的 tunnel 留在舊程式，全部結束 (或 UPGRADE_DRAIN 秒後) 停止所有 shard。
+ * 收到 READY 之前不關閉交出的 fd：新程式在接手完成前結束 (或逾時) 時，舊程式以送出的
+ * record 收回 listener、控制連線、停放的連線與 session，繼續服務並重新等待交接。
+ */
+void hand_over(int fd, std::shared_ptr<Server> server, std::shared_ptr<metrics_server> metrics) {
+    upgrade_link link(fd);
+    std::vector<char> data;
+    std::vector<int> fds;
+
+    // 對方在 HELLO 之前斷線或版本不符：沒有交出任何東西，重新開始等待
+    auto rearm = [server, metrics]() {
+        post(shards.get(0), [server, metrics]() {
+            wait_for_upgrade(server, metrics);
         });
+    };
+
+    try {
+        if (!link.receive(data, fds)) {
+            std::cerr << "Upgrade refused: peer closed before hello" << std::endl;
+            rearm();
+            return;
+        }
+
+        record_reader hello(data);
+
+        if (hello.type() != UpgradeRecord::HELLO || hello.get<uint8_t>() != UPGRADE_VERSION) {
+            std::cerr << "Upgrade refused: unsupported version" << std::endl;
+            rearm();
+            return;
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Upgrade refused: " << e.what() << std::endl;
+        rearm();
+        return;
     }
 
-    void do_check_control() {
-        auto self(shared_from_this());
-        control->async_read_some(
-        buffer(buf), [this, self](boost::system::error_code ec, std::size_t) {
-            // agent don't read the data from control
-            // so when this handler executed, it must be an error
-            proxy.cancel();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<PortGroup>> groups;
+    std::vector<std::shared_ptr<VhostPort>> vhosts;
+    std::vector<std::future<released_listener>> released;
+    {
+        std::lock_guard<std::mutex> lock(ports_mutex);
+        handing_over = true;
+
+        for (auto &entry : port_groups) {
+            if (auto group = entry.second.lock()) {
+                groups.push_back(group);
+            }
+        }
+
+        for (auto &entry : vhost_ports) {
+            if (auto shared = entry.second.lock()) {
+                vhosts.push_back(shared);
+            }
+        }
+    }
+
+    for (auto &acceptor : server->listeners()) {
+        released.push_back(release_listener(acceptor, [server, &acceptor](int listener) {
+            server->readopt(acceptor, listener);
+        }));
+    }
+
+    for (auto &group : groups) {
+        for (auto &acceptor : group->listeners()) {
+            released.push_back(release_listener(acceptor));
+        }
+    }
+
+    for (auto &shared : vhosts) {
+        for (auto &acceptor : shared->listeners()) {
+            released.push_back(release_listener(acceptor));
+        }
+    }
+
+    if (metrics) {
+        // 新程式在交接完成後 bind 同一個 port
+        metrics->close();
+    }
+
+    std::map<u_short, std::vector<int>> listeners;
+    std::vector<released_listener> kept;
+
+    for (auto &future : released) {
+        auto listener = future.get();
+
+        if (listener.fd >= 0) {
+            listeners[listener.port].push_back(listener.fd);
+            kept.push_back(std::move(listener));
+        }
+    }
+
+    // listener 已關閉；已 accept 的資料連線在讀到 token 之後才會找 pending_sessions，
+    // 等它們配對完成，否則它們的 session 交出之後 token 找不到、client 等到逾時
+    {
+        std::unique_lock<std::mutex> lock(handshakes_mutex);
+        handshakes_done.wait_for(lock, HANDSHAKE_GRACE, []() {
+            return handshakes == 0;
         });
     }
 
-    std::array<char, 1> buf;
-    std::shared_ptr<ssocket> control;
-    tcp::acceptor proxy;
-    u_short proxy_port;
-};
+    // 控制連線：同一條連線 (GROUP) 的成員合併成一筆
+    std::vector<std::future<handed_agent>> described;
 
-class Server : public std::enable_shared_from_this<Server> {
-  public:
-    explicit Server(u_short port) : acceptor(io) {
-        tcp::endpoint endpoint(tcp::v4(), port);
-        acceptor.open(endpoint.protocol());
-        acceptor.set_option(tcp::acceptor::reuse_address(true));
-        acceptor.bind(endpoint);
-        acceptor.listen();
+    for (auto &group : groups) {
+        for (auto &agent : group->current_members()) {
+            described.push_back(describe_agent(agent));
+        }
+    }
+
+    std::vector<handed_control> controls;
+    std::vector<std::shared_ptr<control_channel>> channels;
+    std::unordered_map<control_channel *, size_t> by_channel;
+
+    for (auto &future : described) {
+        auto agent = future.get();
+
+        if (!agent.channel) {
+            continue;
+        }
+
+        auto inserted = by_channel.emplace(agent.channel.get(), controls.size());
+
+        if (inserted.second) {
+            controls.push_back(std::move(agent.handed));
+            channels.push_back(std::move(agent.channel));
+            continue;
+        }
+
+        auto &handed = controls[inserted.first->second];
+        handed.mappings.insert(handed.mappings.end(), agent.handed.mappings.begin(),
+                               agent.handed.mappings.end());
+        handed.parked.insert(handed.parked.end(), agent.handed.parked.begin(),
+                             agent.handed.parked.end());
     }
-    void do_accept() {
-        auto self(shared_from_this());
-        acceptor.async_accept(
-        [this, self](boost::system::error_code ec, tcp::socket agent) {
-            if (ec)
-                return;
 
-            std::make_shared<Agent>(std::move(agent))->do_proxy();
-            do_accept();
+    std::vector<std::future<control_state>> detached(controls.size());
+
+    for (size_t i = 0; i < channels.size(); ++i) {
+        auto state = std::make_shared<std::promise<control_state>>();
+        detached[i] = state->get_future();
+        channels[i]->detach([state](control_state detached_state) {
+            state->set_value(std::move(detached_state));
         });
     }
 
-  private:
-    tcp::acceptor acceptor;
-};
+    for (size_t i = 0; i < controls.size(); ++i) {
+        controls[i].state = detached[i].get();
+    }
+
+    // 等待 dial-back 的 session：在 client 所在的 shard 上停止時限並交出 client
+    auto sessions = pending_sessions.take_if([](const std::shared_ptr<Session> &) {
+        return true;
+    });
+    std::vector<std::future<int>> handed_clients;
+
+    for (auto &session : sessions) {
+        auto client = std::make_shared<std::promise<int>>();
+        handed_clients.push_back(client->get_future());
+        post(session->get_executor(), [session, client]() {
+            client->set_value(session->hand_over());
+        });
+    }
+
+    // 送出的 record 與附帶的 fd：收到 READY 之前保留，交接失敗時以同樣的 record 收回
+    std::vector<std::pair<record_writer, std::vector<int>>> records;
+    size_t handed_listeners = 0;
+    size_t handed_controls = 0;
+    size_t handed_parked = 0;
+    size_t handed_sessions = 0;
+    std::vector<int> index(controls.size(), -1);
+
+    // 每個 shard 一個 listener，shard 數可能超過一筆 record 能帶的 fd 數
+    for (auto &listener : listeners) {
+        auto &listener_fds = listener.second;
+
+        for (size_t offset = 0; offset < listener_fds.size(); offset += UPGRADE_MAX_FDS) {
+            size_t end = std::min(listener_fds.size(), offset + UPGRADE_MAX_FDS);
+            records.emplace_back(record_writer(UpgradeRecord::LISTENER).put(listener.first),
+                                 std::vector<int>(listener_fds.begin() + offset,
+                                         listener_fds.begin() + end));
+            handed_listeners += end - offset;
+        }
+    }
+
+    for (size_t i = 0; i < controls.size(); ++i) {
+        auto &handed = controls[i];
+
+        if (handed.state.fd < 0) {
+            for (int parked : handed.parked) {
+                ::close(parked);
+            }
+
+            continue;
+        }
+
+        record_writer record(UpgradeRecord::CONTROL);
+        record.put(static_cast<uint8_t>(handed.mode)).put(static_cast<uint8_t>(handed.codec))
+        .put(handed.state.heartbeat).put(handed.token)
+        .put(static_cast<uint16_t>(handed.mappings.size()));
+
+        for (auto &mapping : handed.mappings) {
+            record.put(mapping.id).put(mapping.port).put_name(mapping.host);
+        }
+
+        record.put_bytes(handed.state.unread).put_bytes(handed.state.unsent);
+        records.emplace_back(std::move(record), std::vector<int> {handed.state.fd});
+        index[i] = int(handed_controls++);
+
+        for (size_t offset = 0; offset < handed.parked.size(); offset += UPGRADE_MAX_FDS) {
+            size_t end = std::min(handed.parked.size(), offset + UPGRADE_MAX_FDS);
+            records.emplace_back(
+                record_writer(UpgradeRecord::PARKED).put(static_cast<uint32_t>(index[i])),
+                std::vector<int>(handed.parked.begin() + offset, handed.parked.begin() + end));
+            handed_parked += end - offset;
+        }
+    }
+
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        int client = handed_clients[i].get();
+        auto control = by_channel.find(sessions[i]->get_control().get());
+
+        if (client < 0) {
+            continue;
+        }
+
+        if (control == by_channel.end() || index[control->second] < 0) {
+            ::close(client);
+            continue;
+        }
+
+        int mapping = sessions[i]->get_mapping();
+        record_writer record(UpgradeRecord::SESSION);
+        record.put(static_cast<uint32_t>(index[control->second]))
+        .put(static_cast<uint16_t>(mapping < 0 ? 0 : mapping))
+        .put(sessions[i]->get_token()).put(sessions[i]->get_trace_id());
+        records.emplace_back(std::move(record), std::vector<int> {client});
+        ++handed_sessions;
+    }
+
+    bool completed = false;
+
+    try {
+        for (auto &record : records) {
+            link.send(record.first, record.second);
+        }
+
+        link.send(record_writer(UpgradeRecord::END));
+
+        // 新程式接手全部 record 之後回覆 READY；在這之前結束或逾時都收回交出的東西
+        link.set_receive_timeout(UPGRADE_READY_TIMEOUT);
+        completed = link.receive(data, fds) && record_reader(data).type() == UpgradeRecord::READY;
+
+        for (int received : fds) {
+            ::close(received);
+        }
+
+        if (completed) {
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            std::cout << "Handed over " << handed_listeners << " listeners, " << handed_controls
+                      << " control connections, " << handed_parked << " parked connections and "
+                      << handed_sessions << " sessions in " << elapsed.count() << " ms"
+                      << std::endl;
+        } else {
+            std::cerr << "Upgrade failed: new process closed before ready" << std::endl;
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Upgrade failed: " << e.what() << std::endl;
+    }
+
+    if (!completed) {
+        // 新程式沒有開始服務：control port 的 listener 交還 Server，其他 listener 與連線
+        // 如同新程式接手一樣收回 (listener 由 resume 的控制連線重新加入 group 時沿用)
+        {
+            std::lock_guard<std::mutex> lock(ports_mutex);
+            handing_over = false;
+
+            for (auto &listener : kept) {
+                if (!listener.readopt) {
+                    inherited_listeners[listener.port].push_back(listener.fd);
+                }
+            }
+        }
+
+        for (auto &listener : kept) {
+            if (listener.readopt) {
+                listener.readopt(listener.fd);
+            }
+        }
+
+        upgrade_adopter adopter;
+
+        for (auto &record : records) {
+            // LISTENER 的 fd 已在上面交還
+            if (record_reader(record.first.data()).type() == UpgradeRecord::LISTENER) {
+                continue;
+            }
+
+            try {
+                adopter.adopt(record.first.data(), record.second);
+            } catch (std::exception &e) {
+                std::cerr << "Not restored: " << e.what() << std::endl;
+            }
+        }
+
+        std::cout << "Restored " << kept.size() << " listeners, " << adopter.control_count()
+                  << " control connections, " << adopter.parked_count()
+                  << " parked connections and " << adopter.session_count() << " sessions"
+                  << std::endl;
+        close_inherited_later();
+
+        post(shards.get(0), [server, metrics]() {
+            auto serving = metrics;
+
+            if (serving) {
+                try {
+                    serving = serve_metrics(shards.get(0));
+                } catch (std::exception &e) {
+                    std::cerr << "Metrics not restored: " << e.what() << std::endl;
+                    serving = nullptr;
+                }
+            }
+
+            wait_for_upgrade(server, serving);
+        });
+        return;
+    }
+
+    // 新程式已接手：關閉這裡持有的 fd，連線由新程式持有的 fd 保持
+    for (auto &record : records) {
+        for (int handed : record.second) {
+            ::close(handed);
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + upgrade_drain();
+    post(shards.get(0), [deadline]() {
+        do_drain(std::make_shared<steady_timer>(shards.get(0)), deadline);
+    });
+}
+
+// UPGRADE_SOCKET：等待下一版連入，交接在自己的線程上進行
+void wait_for_upgrade(std::shared_ptr<Server> server, std::shared_ptr<metrics_server> metrics) {
+    using unix_seqpacket = generic::seq_packet_protocol;
+    auto acceptor = std::make_shared<basic_socket_acceptor<unix_seqpacket>>(shards.get(0));
+    acceptor->assign(unix_seqpacket(AF_UNIX, 0), upgrade_link::listen(upgrade_path()));
+    acceptor->async_accept([acceptor, server, metrics](const boost::system::error_code & ec,
+    unix_seqpacket::socket peer) {
+        if (ec) {
+            return;
+        }
+
+        // 只交接一次；版本不符時由 hand_over 重新開始等待
+        boost::system::error_code ignored;
+        acceptor->close(ignored);
+        std::thread(hand_over, peer.release(), server, metrics).detach();
+    });
+}
+
+// 交接的新程式這端：在開始服務之前接手舊程式交出的 listener 與連線。收到 END 並接手全部 record
+// 之後才回覆 READY；在這之前失敗時拋出例外，不以部分的 listener 與連線開始服務
+// (舊程式沒有收到 READY，收回交出的東西繼續服務)
+void take_over(int fd) {
+    auto start = std::chrono::steady_clock::now();
+    upgrade_link link(fd);
+    std::vector<std::pair<std::vector<char>, std::vector<int>>> records;
+    std::vector<char> data;
+    std::vector<int> fds;
+    bool complete = false;
+
+    try {
+        link.send(record_writer(UpgradeRecord::HELLO).put(UPGRADE_VERSION));
+
+        while (!complete && link.receive(data, fds)) {
+            complete = record_reader(data).type() == UpgradeRecord::END;
+            records.emplace_back(data, fds);
+        }
+
+        if (!complete) {
+            throw std::runtime_error("old process closed before end");
+        }
+    } catch (...) {
+        for (auto &record : records) {
+            for (int received : record.second) {
+                ::close(received);
+            }
+        }
+
+        throw;
+    }
+
+    size_t listeners = 0;
+    upgrade_adopter adopter;
+
+    for (auto &record : records) {
+        record_reader reader(record.first);
+
+        if (reader.type() == UpgradeRecord::LISTENER) {
+            auto &inherited = inherited_listeners[reader.get<uint16_t>()];
+            inherited.insert(inherited.end(), record.second.begin(), record.second.end());
+            listeners += record.second.size();
+        } else {
+            adopter.adopt(record.first, record.second);
+        }
+    }
+
+    link.send(record_writer(UpgradeRecord::READY));
+
+    std::chrono::duration<double> elapsed_time = std::chrono::steady_clock::now() - start;
+    double elapsed = elapsed_time.count();
+    upgrade_seconds.observe(elapsed);
+    std::cout << "Took over " << listeners << " listeners, " << adopter.control_count()
+              << " control connections, " << adopter.parked_count() << " parked connections and "
+              << adopter.session_count() << " sessions in " << elapsed * 1000 << " ms" << std::endl;
+    close_inherited_later();
+}
+#endif
+
+void do_reload_shaping(signal_set &reload) {
+    reload.async_wait([&reload](const boost::system::error_code & ec, int) {
+        if (ec) {
+            return;
+        }
+
+        try {
+            traffic_shaping::instance().reload();
+            std::cout << "Shaping rules reloaded" << std::endl;
+        } catch (std::exception &e) {
+            // 保留原本的規則
+            std::cerr << "Shaping rules not reloaded: " << e.what() << std::endl;
+        }
+
+        do_reload_shaping(reload);
+    });
+}
 
 int main(int argc, const char *argv[]) {
     u_short control_port;
 
-    if (argc != 2) {
-        std::cerr << "Usage: proxy_server <control_port>\n";
+    if (argc != 2 && argc != 3) {
+        std::cerr << "Usage: proxy_server <control_port> [<data_port>]\n";
         return 1;
     }
 
     try {
         control_port = std::stoi(argv[1]);
+        data_port = argc == 3 ? std::stoi(argv[2]) : control_port;
     } catch (...) {
-        std::cerr << "Usage: proxy_server <control_port>\n";
+        std::cerr << "Usage: proxy_server <control_port> [<data_port>]\n";
         return 1;
     }
 
+    if (const char *policy = std::getenv("BALANCE_POLICY")) {
+        std::string value(policy);
+
+        if (value == "round-robin") {
+            balance_policy = BalancePolicy::ROUND_ROBIN;
+        } else if (value == "least-conn") {
+            balance_policy = BalancePolicy::LEAST_CONN;
+        } else if (value == "latency") {
+            balance_policy = BalancePolicy::LOWEST_LATENCY;
+        } else {
+            std::cerr << "Environment variable BALANCE_POLICY should be \"round-robin\", "
+                      "\"least-conn\" or \"latency\"\n";
+            return 1;
+        }
+    }
+
+    if (const char *spec = std::getenv("SOCKET_PROFILE")) {
+        try {
+            profiles.parse(spec);
+        } catch (...) {
+            std::cerr << "Environment variable SOCKET_PROFILE should be a comma-separated list of "
+                      "[<port>:]<profile>, where <profile> is \"default\", \"interactive\" "
+                      "or \"bulk\"\n";
+            return 1;
+        }
+    }
+
     try {
-        signal_set signals(io, SIGINT, SIGTERM);
+        signal_set signals(shards.get(0), SIGINT, SIGTERM);
         signals.async_wait(
         [](const boost::system::error_code & ec, int signal_number) {
             if (!ec) {
-                io.stop();
+                shards.stop();
             }
         });
-        std::make_shared<Server>(control_port)->do_accept();
-        std::cout << "Server started on port " << control_port << std::endl;
 
-        std::vector<std::thread> threads;
+        // SHAPING_FILE：頻寬整形規則，收到 SIGHUP 時重新讀取 (格式見 shaping.hpp)。
+        // 沒有設定時不攔截 SIGHUP，保留預設的行為
+        signal_set reload(shards.get(0));
 
-        for (int i = 0; i < 8; ++i)
-            threads.emplace_back([]() {
-            io.run();
-        });
+        const char *path = std::getenv("SHAPING_FILE");
+
+        if (path && *path) {
+            traffic_shaping::instance().load(path);
+            traffic_shaping::instance().start(shards.get(0));
+            reload.add(SIGHUP);
+            do_reload_shaping(reload);
+        }
+
+#if defined(__unix__)
+        // UPGRADE_SOCKET：有舊程式在等待時先接手它的 listener 與連線 (見 upgrade.hpp)
+        int upgrade = upgrade_path().empty() ? -1 : upgrade_link::connect(upgrade_path());
+
+        if (upgrade >= 0) {
+            try {
+                take_over(upgrade);
+            } catch (std::exception &e) {
+                // 舊程式收回交出的東西繼續服務
+                std::cerr << "Upgrade aborted: " << e.what() << std::endl;
+                return 1;
+            }
+        }
+#endif
+
+        auto server = std::make_shared<Server>(control_port, data_port);
+        server->do_accept();
+        auto metrics = serve_metrics(shards.get(0));
+
+#if defined(__unix__)
+        if (!upgrade_path().empty()) {
+            wait_for_upgrade(server, metrics);
+        }
+#endif
+
+        dump_trace_on_signal(shards.get(0), "proxy_server");
+        std::cout << "Server started on port " << control_port << " with " << shards.size()
+                  << " shards" << std::endl;
 
-        for (auto &t : threads)
-            t.join();
+        shards.run();
     } catch (std::exception &e) {
         std::cerr << "Agent error: " << e.what() << std::endl;
         return 1;
@@ -0,0 +1,93 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "mux.hpp"
+
+std::vector<char> frame(MuxFrame type, uint32_t length) {
+    std::vector<char> header(MUX_HEADER_SIZE + length, 'x');
+    header[0] = static_cast<char>(type);
+    header[1] = header[2] = header[3] = 0;
+    header[4] = 1;
+    header[5] = static_cast<char>(length >> 24);
+    header[6] = static_cast<char>(length >> 16);
+    header[7] = static_cast<char>(length >> 8);
+    header[8] = static_cast<char>(length);
+    return header;
+}
+
+// 對方送出 out 之後不讀任何回應；accepts_open 為 false 時這一端扮演只發起 stream 的
+// proxy_server。回傳 mux_session 是否因此關閉了連線
+bool closed_after(const std::vector<char> &out, bool accepts_open) {
+    io_context context;
+    tcp::acceptor acceptor(context, tcp::endpoint(ip::address_v4::loopback(), 0));
+    tcp::socket peer(context);
+    peer.connect(acceptor.local_endpoint());
+    auto session = std::make_shared<mux_session>(acceptor.accept());
+
+    // stream 開啟後沒有人讀取，收到的資料全部留在 inbox
+    std::vector<std::shared_ptr<mux_stream>> opened;
+    bool closed = false;
+    mux_session::open_handler on_open;
+
+    if (accepts_open) {
+        on_open = [&opened](std::shared_ptr<mux_stream> stream) {
+            opened.push_back(std::move(stream));
+        };
+    }
+
+    session->start(on_open, [&closed]() {
+        closed = true;
+    });
+
+    boost::asio::write(peer, buffer(out));
+    context.run_for(std::chrono::milliseconds(500));
+    opened.clear();
+    return closed;
+}
+
+// 一個不理會 WINDOW 的對方：開一條 stream 後連續送出 bytes 的 DATA
+bool overrun(size_t bytes) {
+    std::vector<char> out = frame(MuxFrame::OPEN, 0);
+
+    for (size_t sent = 0; sent < bytes; sent += MUX_MAX_FRAME) {
+        auto data = frame(MuxFrame::DATA, uint32_t(std::min(bytes - sent, MUX_MAX_FRAME)));
+        out.insert(out.end(), data.begin(), data.end());
+    }
+
+    return closed_after(out, true);
+}
+
+int main() {
+    if (overrun(MUX_INITIAL_WINDOW)) {
+        std::cerr << "session closed although the peer stayed within the window\n";
+        return EXIT_FAILURE;
+    }
+
+    if (!overrun(MUX_INITIAL_WINDOW + MUX_MAX_FRAME)) {
+        std::cerr << "session kept buffering after the peer overran the window\n";
+        return EXIT_FAILURE;
+    }
+
+    // 同一個 id 開啟兩次，或對只發起 stream 的一端送出 OPEN，都是協定錯誤
+    std::vector<char> twice = frame(MuxFrame::OPEN, 0);
+    auto again = frame(MuxFrame::OPEN, 0);
+    twice.insert(twice.end(), again.begin(), again.end());
+
+    if (!closed_after(twice, true)) {
+        std::cerr << "session accepted a second OPEN for a stream already in use\n";
+        return EXIT_FAILURE;
+    }
+
+    if (!closed_after(frame(MuxFrame::OPEN, 0), false)) {
+        std::cerr << "session accepted an OPEN on the side that only opens streams\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "mux_window: ok\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+#include <array>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "upgrade.hpp"
+
+using namespace boost::asio;
+using ip::tcp;
+
+// 以 env 啟動子行程 (輸出丟棄)
+pid_t spawn(const std::vector<std::string> &args, const std::vector<std::string> &env) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        for (auto &entry : env) {
+            putenv(const_cast<char *>(entry.c_str()));
+        }
+
+        freopen("/dev/null", "w", stdout);
+        std::vector<char *> argv;
+
+        for (auto &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    return pid;
+}
+
+void terminate(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+// upstream：把收到的資料原樣送回
+void do_echo(std::shared_ptr<tcp::socket> socket, std::shared_ptr<std::array<char, 1024>> buf) {
+    socket->async_read_some(buffer(*buf), [socket, buf](boost::system::error_code ec, size_t n) {
+        if (!ec) {
+            async_write(*socket, buffer(*buf, n), [socket, buf](boost::system::error_code ec,
+            size_t) {
+                if (!ec) {
+                    do_echo(socket, buf);
+                }
+            });
+        }
+    });
+}
+
+void do_echo_accept(tcp::acceptor &acceptor) {
+    acceptor.async_accept([&acceptor](boost::system::error_code ec, tcp::socket socket) {
+        if (ec) {
+            return;
+        }
+
+        do_echo(std::make_shared<tcp::socket>(std::move(socket)),
+                std::make_shared<std::array<char, 1024>>());
+        do_echo_accept(acceptor);
+    });
+}
+
+// 同時開 clients 條連線，各自 echo 一個 byte；回傳 timeout 內完成的條數
+size_t burst(const tcp::endpoint &endpoint, size_t clients, std::chrono::milliseconds timeout) {
+    io_context context;
+    size_t echoed = 0;
+
+    for (size_t i = 0; i < clients; ++i) {
+        auto socket = std::make_shared<tcp::socket>(context);
+        auto byte = std::make_shared<char>('x');
+        socket->async_connect(endpoint, [socket, byte, &echoed](boost::system::error_code ec) {
+            if (ec) {
+                return;
+            }
+
+            async_write(*socket, buffer(byte.get(), 1), [socket, byte, &echoed](
+            boost::system::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+
+                async_read(*socket, buffer(byte.get(), 1), [socket, byte, &echoed](
+                boost::system::error_code ec, size_t) {
+                    if (!ec) {
+                        ++echoed;
+                    }
+                });
+            });
+        });
+    }
+
+    context.run_for(timeout);
+    return echoed;
+}
+
+// 等 tunnel 可用 (expose 每 3 秒重試註冊)
+bool wait_ready(const tcp::endpoint &endpoint) {
+    for (int attempt = 0; attempt < 200; ++attempt) {
+        if (burst(endpoint, 1, std::chrono::milliseconds(200)) == 1) {
+            return true;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    return false;
+}
+
+// 扮演接手失敗的新程式：送出 HELLO 後不回覆 READY 就離開；read_all 時先讀完舊程式交出的
+// 全部 record (直到 END)。回傳是否連上了等待交接的舊程式
+bool abandon_upgrade(const std::string &path, bool read_all) {
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = upgrade_link::connect(path);
+
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            continue;
+        }
+
+        upgrade_link link(fd);
+        link.send(record_writer(UpgradeRecord::HELLO).put(UPGRADE_VERSION));
+        std::vector<char> data;
+        std::vector<int> fds;
+
+        while (read_all && link.receive(data, fds)) {
+            for (int received : fds) {
+                ::close(received);
+            }
+
+            if (record_reader(data).type() == UpgradeRecord::END) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: upgrade_readopt <proxy_server> <expose>\n";
+        return EXIT_FAILURE;
+    }
+
+    const u_short control_port = 17900;
+    const u_short public_port = 17901;
+    const u_short upstream_port = 17902;
+    const std::string path = "/tmp/upgrade_readopt-" + std::to_string(getpid()) + ".sock";
+
+    io_context upstream_io;
+    tcp::acceptor upstream(upstream_io, tcp::endpoint(ip::address_v4::loopback(), upstream_port));
+    do_echo_accept(upstream);
+    auto work = make_work_guard(upstream_io);
+    std::thread upstream_thread([&upstream_io]() {
+        upstream_io.run();
+    });
+
+    pid_t proxy = spawn({argv[1], std::to_string(control_port)}, {"UPGRADE_SOCKET=" + path});
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::string mapping = std::to_string(public_port) + ":" + std::to_string(upstream_port);
+    pid_t expose = spawn({argv[2], mapping},
+    {"PROXY_HOST=127.0.0.1:" + std::to_string(control_port)});
+
+    tcp::endpoint endpoint(ip::address_v4::loopback(), public_port);
+    int status = EXIT_SUCCESS;
+
+    if (!wait_ready(endpoint)) {
+        std::cerr << "tunnel did not come up\n";
+        status = EXIT_FAILURE;
+    } else {
+        // 兩次失敗的交接 (HELLO 之後與讀完 END 之後離開)：舊程式收回 listener 與控制連線
+        for (int round = 0; round < 2 && status == EXIT_SUCCESS; ++round) {
+            if (!abandon_upgrade(path, round == 1)) {
+                std::cerr << "old server did not wait for an upgrade\n";
+                status = EXIT_FAILURE;
+            } else if (!wait_ready(endpoint)) {
+                std::cerr << "tunnel did not come back after a failed hand-over\n";
+                status = EXIT_FAILURE;
+            }
+        }
+
+        // 交還的 listener 上一次到達一批 client，accept 不能在 backlog 取完之後卡住 shard
+        for (int round = 0; round < 4 && status == EXIT_SUCCESS; ++round) {
+            size_t echoed = burst(endpoint, 32, std::chrono::seconds(5));
+
+            if (echoed != 32) {
+                std::cerr << "only " << echoed << " of 32 clients echoed after a failed hand-over"
+                          << std::endl;
+                status = EXIT_FAILURE;
+            }
+        }
+
+        if (status == EXIT_SUCCESS && waitpid(proxy, nullptr, WNOHANG) != 0) {
+            std::cerr << "proxy_server exited after a failed hand-over\n";
+            status = EXIT_FAILURE;
+        }
+    }
+
+    terminate(expose);
+    terminate(proxy);
+    ::unlink(path.c_str());
+    upstream_io.stop();
+    upstream_thread.join();
+
+    if (status == EXIT_SUCCESS) {
+        std::cout << "upgrade_readopt: ok\n";
+    }
+
+    return status;
+}